@@ -0,0 +1,83 @@
+#pragma once
+
+#include <microscopes/common/random_fwd.hpp>
+#include <microscopes/lda/model.hpp>
+
+#include <stddef.h>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Writes snapshots of a running chain, with its rng and iteration count,
+* every `every_iters` iterations and/or every `every_seconds` seconds.
+*
+* The table and dish assignments are taken on the calling thread
+* (state::flat_assignments, a pass over the segments and table slots) and
+* written, with the counts recounted from them, on a background thread,
+* so sampling only waits for that pass (or for the previous write, if it
+* has not finished by the next checkpoint). Files
+* are written next to `path` and renamed over it, so `path` always holds
+* a complete checkpoint. Errors from the writer are rethrown by the next
+* call to save or wait.
+*/
+class checkpointer {
+public:
+    checkpointer(const std::string &path, size_t every_iters, double every_seconds,
+                 bool with_counts = true);
+
+    ~checkpointer();
+
+    checkpointer(const checkpointer &) = delete;
+    checkpointer &operator=(const checkpointer &) = delete;
+
+    /**
+    * To be called after iteration `iteration` (counted from 1); starts a
+    * checkpoint if one is due. Returns whether it did.
+    */
+    bool
+    maybe_save(const state &state, const common::rng_t &rng, size_t iteration);
+
+    /**
+    * Starts a checkpoint of `state` and `rng` after `iteration` iterations.
+    */
+    void
+    save(const state &state, const common::rng_t &rng, size_t iteration);
+
+    /**
+    * Waits for the write in progress, if any.
+    */
+    void
+    wait();
+
+    inline const std::string &path() const { return path_; }
+
+    // Checkpoints started so far.
+    inline size_t nsaved() const { return nsaved_; }
+
+    /**
+    * Reads the checkpoint at `path` into `state` and `rng`, and returns
+    * the number of iterations it was taken after.
+    */
+    static size_t
+    load(const std::string &path, std::shared_ptr<state> &state, common::rng_t &rng);
+
+private:
+    std::string path_;
+    size_t every_iters_;
+    double every_seconds_;
+    bool with_counts_;
+    size_t last_iteration_;
+    std::chrono::steady_clock::time_point last_time_;
+    std::thread writer_;
+    std::exception_ptr error_;
+    size_t nsaved_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+typedef std::vector<std::vector<size_t>> nested_vector;
+
+/**
+* Documents as runs of a single word id, each repeated `count` times, in
+* CSR layout. A document is a bag of words, so the tokens of one given
+* token by token are grouped by word id and every copy of a word shares
+* a run, as do the pairs of one given as (word, count) pairs; a word seen
+* many times costs no more than one seen once. Token i of document j lies
+* in the first run whose end (the number of tokens of j up to and
+* including the run) exceeds i, so the corpus's own token order within a
+* document is by word id.
+*
+* The order tokens were given in is kept for documents that were not
+* already grouped: token p as given is corpus token token(j, p). Every
+* per-token view of a state (documents(), table_assignments(), get_word,
+* ...) is in that order, so it can be passed back with the documents as
+* given.
+*/
+class corpus {
+public:
+    explicit corpus(const nested_vector &docs);
+
+    /**
+    * Takes runs already laid out: offsets[j] is the first run of document
+    * j (offsets has one entry per document plus the total), and ends
+    * must increase strictly within each document. order_offsets and
+    * order, if given, are the rows of token(j, p) in the same layout; a
+    * document in corpus order has an empty row.
+    */
+    corpus(std::vector<size_t> &&offsets, std::vector<uint32_t> &&words, std::vector<uint32_t> &&ends,
+           std::vector<size_t> &&order_offsets = std::vector<size_t>(),
+           std::vector<uint32_t> &&order = std::vector<uint32_t>());
+
+    inline size_t size() const { return offsets_.size() - 1; }
+
+    inline size_t nruns() const { return words_.size(); }
+
+    inline size_t ntokens() const { return ntokens_; }
+
+    inline size_t nruns(size_t j) const { return offsets_[j + 1] - offsets_[j]; }
+
+    inline size_t nterms(size_t j) const { return nruns(j) ? ends_[offsets_[j + 1] - 1] : 0; }
+
+    inline uint32_t word(size_t j, size_t r) const { return words_[offsets_[j] + r]; }
+
+    // First token of run r, and one past its last.
+    inline size_t begin(size_t j, size_t r) const { return r ? ends_[offsets_[j] + r - 1] : 0; }
+
+    inline size_t end(size_t j, size_t r) const { return ends_[offsets_[j] + r]; }
+
+    inline size_t count(size_t j, size_t r) const { return end(j, r) - begin(j, r); }
+
+    // Run holding token i, by binary search over the document's runs.
+    inline size_t run_of(size_t j, size_t i) const {
+        auto first = ends_.begin() + offsets_[j];
+        return std::upper_bound(first, ends_.begin() + offsets_[j + 1], i) - first;
+    }
+
+    inline uint32_t word_at(size_t j, size_t i) const { return word(j, run_of(j, i)); }
+
+    inline bool in_order(size_t j) const {
+        return order_offsets_.empty() || order_offsets_[j] == order_offsets_[j + 1];
+    }
+
+    // Corpus token of token p of document j in the order it was given.
+    inline size_t token(size_t j, size_t p) const {
+        return in_order(j) ? p : order_[order_offsets_[j] + p];
+    }
+
+    // Run holding token p of document j as given, and its position in the run.
+    inline std::pair<size_t, size_t> locate(size_t j, size_t p) const {
+        const size_t i = token(j, p), r = run_of(j, i);
+        return std::make_pair(r, i - begin(j, r));
+    }
+
+    /**
+    * Puts values given per corpus token of document j into the order the
+    * document was given in.
+    */
+    void
+    restore_order(size_t j, std::vector<size_t> &values) const;
+
+    inline const std::vector<size_t> &offsets() const { return offsets_; }
+
+    inline const std::vector<uint32_t> &words() const { return words_; }
+
+    inline const std::vector<uint32_t> &ends() const { return ends_; }
+
+    inline const std::vector<size_t> &order_offsets() const { return order_offsets_; }
+
+    inline const std::vector<uint32_t> &order() const { return order_; }
+
+    /**
+    * The documents token by token, in the order they were given; builds
+    * a new nested vector.
+    */
+    nested_vector
+    documents() const;
+
+private:
+    std::vector<size_t> offsets_;
+    std::vector<uint32_t> words_;
+    std::vector<uint32_t> ends_;
+    std::vector<size_t> order_offsets_; //!< Empty if every document is in corpus order
+    std::vector<uint32_t> order_;
+    size_t ntokens_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+enum class corpus_format {
+    ldac,   //!< "M term:count ... term:count" per line, M the number of pairs
+    tokens, //!< "term term ... term" per line, one entry per token
+};
+
+/**
+* Documents parsed from a text corpus. The term ids of the file are
+* remapped to word ids 0..V-1 in increasing order, leaving out ids that do
+* not occur, so a state built on docs has V = nwords().
+*/
+struct corpus_file {
+    std::shared_ptr<const corpus> docs;
+    std::vector<uint32_t> terms; //!< Term id in the file of each word id
+
+    inline size_t nwords() const { return terms.size(); }
+
+    /**
+    * The documents with the file's term ids.
+    */
+    nested_vector
+    documents() const;
+};
+
+/**
+* Parses a corpus held in memory, one document per line. Blank lines are
+* skipped; LDA-C term:count pairs become runs of count tokens (zero
+* counts are dropped), so repeated words are never expanded. Each
+* document's terms are grouped by id, so every copy of a term, in either
+* format, shares one run; the corpus keeps the order of the tokens of a
+* line, so documents() gives them back as they were.
+* The text is split at line boundaries into chunks parsed on nthreads
+* threads; the result does not depend on their number. Malformed
+* input is reported with `name` and the line number.
+*/
+corpus_file
+parse_corpus(const char *data, size_t size, corpus_format format,
+             size_t nthreads = 1, const std::string &name = "<corpus>");
+
+/**
+* Parses the file at `path` through a read-only mapping.
+*/
+corpus_file
+read_corpus(const std::string &path, corpus_format format, size_t nthreads = 1);
+
+/**
+* Documents given as (term id, count) pairs, e.g. the rows of a
+* document-term matrix, with the term ids remapped and grouped as above.
+*/
+corpus_file
+corpus_from_counts(const std::vector<std::vector<std::pair<size_t, size_t>>> &docs);
+
+} // namespace lda
+} // namespace microscopes
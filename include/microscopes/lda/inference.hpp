@@ -0,0 +1,95 @@
+#pragma once
+
+#include <microscopes/common/random_fwd.hpp>
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/scheduler.hpp>
+
+#include <stddef.h>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* The topics of a trained state, fixed, for scoring documents that are not
+* part of it. Column 0 is a new topic, with weight gamma in the global
+* topic distribution and a uniform distribution over words; column c > 0
+* is dishes()[c].
+*/
+class frozen_model {
+public:
+    explicit frozen_model(const state &state);
+
+    inline size_t nwords() const { return V_; }
+
+    /**
+    * Number of columns: the trained topics plus the new one.
+    */
+    inline size_t ncolumns() const { return dishes_.size(); }
+
+    /**
+    * Dish id of each column; 0 for the new topic.
+    */
+    inline const std::vector<size_t> &dishes() const { return dishes_; }
+
+    inline float alpha() const { return alpha_; }
+
+    /**
+    * alpha times the global topic distribution, the prior counts of a new
+    * document's topics.
+    */
+    inline const std::vector<float> &topic_prior() const { return prior_; }
+
+    /**
+    * p(v | topic) for every column, contiguous.
+    */
+    inline const float *word_topics(size_t v) const { return &phi_[v * ncolumns()]; }
+
+    /**
+    * Document completion estimate (Wallach et al. 2009) of log p(second
+    * half | first half) for each document: the topics of the first
+    * n / 2 words are Gibbs sampled against the frozen topics for burnin
+    * sweeps, and the likelihood of the remaining words under the topic
+    * proportions of each of the next nsamples sweeps is averaged.
+    * Documents run on the scheduler's threads with seeds drawn from rng
+    * in document order, so the result does not depend on the thread count.
+    */
+    std::vector<double>
+    heldout_log_likelihood(const nested_vector &docs, size_t nsamples, size_t burnin,
+                           common::rng_t &rng, scheduler &scheduler) const;
+
+    std::vector<double>
+    heldout_log_likelihood(const nested_vector &docs, size_t nsamples, size_t burnin,
+                           common::rng_t &rng, size_t nthreads = 1) const;
+
+    /**
+    * Topic proportions of new documents by the iterated pseudo-count
+    * fold-in of Wallach et al. (2009): each word's topic responsibilities
+    * are updated from the frozen topics and the document's other words,
+    * with alpha times the global topic distribution as prior, until they
+    * change by less than tol in total, for at most max_iter updates after
+    * the first. Returns a
+    * docs.size() x (ncolumns() - 1) row-major matrix over the trained
+    * topics, in the order of dishes()[1:].
+    */
+    std::vector<float>
+    predict(const nested_vector &docs, size_t max_iter, double tol,
+            scheduler &scheduler) const;
+
+    std::vector<float>
+    predict(const nested_vector &docs, size_t max_iter, double tol,
+            size_t nthreads = 1) const;
+
+private:
+    void
+    check_words(const nested_vector &docs) const;
+
+    size_t V_;
+    float alpha_;
+    std::vector<size_t> dishes_;
+    std::vector<float> prior_;
+    std::vector<float> phi_; //!< V x ncolumns, word-major
+};
+
+} // namespace lda
+} // namespace microscopes
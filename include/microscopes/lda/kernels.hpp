@@ -1,33 +1,419 @@
 #pragma once
 
 #include <microscopes/lda/model.hpp>
+#include <microscopes/lda/scheduler.hpp>
 #include <microscopes/common/macros.hpp>
 
 namespace microscopes {
 namespace kernels {
 namespace lda_crp {
 
+/**
+* Scratch buffers for the kernels below. Their capacity is kept between
+* calls, so a sweep that reuses one workspace stops allocating once the
+* buffers have grown to the number of dishes and tables. One per thread.
+*
+* sampling_t keeps f_k for its word in cached_f_k, with sum_k f_k m_k, as
+* of the state's stamp() when it returns. The next call on the same word
+* and an unchanged state, as for the copies of a word in one run, then
+* only recomputes the two dishes the word leaves and joins.
+*
+* The run_* buffers hold sampling_t_run's local counts.
+*/
+struct workspace {
+    std::vector<float> f_k;
+    std::vector<float> p_t;
+    std::vector<float> p_k;
+    lda_util::modification_stamp::value_type cached_stamp;
+    size_t cached_word = 0;
+    double cached_mass = 0;
+    std::vector<uint32_t> run_before;
+    std::vector<uint32_t> run_after;
+    std::vector<uint32_t> run_sizes;
+    std::vector<int32_t> run_dish_words;
+    std::vector<int32_t> run_dish_tables;
+    std::vector<std::pair<size_t, uint32_t>> run_new_tables;
+    std::vector<std::pair<uint32_t, uint32_t>> run_new_dishes;
+    std::vector<size_t> run_new_dish_ids;
+    std::vector<std::pair<size_t, uint32_t>> run_opened;
+    std::vector<size_t> run_left;
+};
+
+/**
+* Posterior over dishes for table t of document j. If seated is false the
+* table has already left its dish (leave_from_dish); if true it is still
+* seated and its own table and words are discounted, so the state is only
+* read. Like the other calc_* functions it either fills an output vector
+* (resized, so its capacity is reused) or returns a new one.
+*/
+extern void
+calc_dish_posterior_t(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng,
+                      std::vector<float> &p_k, bool seated = false);
+
 extern std::vector<float>
-calc_dish_posterior_t(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng);
+calc_dish_posterior_t(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng, bool seated = false);
+
+extern void
+calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng,
+                      std::vector<float> &p_k);
 
 extern std::vector<float>
 calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng);
 
+extern void
+calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng, std::vector<float> &f_k);
+
 extern std::vector<float>
 calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng);
 
+extern void
+calc_table_posterior(microscopes::lda::state &state, size_t j, const std::vector<float> &f_k, common::rng_t &rng,
+                     std::vector<float> &p_t);
+
 extern std::vector<float>
 calc_table_posterior(microscopes::lda::state &state, size_t j, std::vector<float> &f_k, common::rng_t &rng);
 
+/**
+* The kernels that take a workspace use it for all of their temporaries;
+* the ones that do not use a fresh one on each call. The word-level ones
+* take token i of document j (in the order it was given, see corpus), or
+* token pos of run r, which saves finding the run.
+*/
+extern void
+sampling_t(microscopes::lda::state &state, size_t j, size_t r, size_t pos, common::rng_t &rng, workspace &ws);
+
+extern void
+sampling_t(microscopes::lda::state &state, size_t j, size_t i, common::rng_t &rng, workspace &ws);
+
 extern void
 sampling_t(microscopes::lda::state &state, size_t j, size_t i, common::rng_t &rng);
 
+/**
+* Same transition as sampling_t, drawn from three buckets (document
+* tables, dishes that already contain the word, and a smoothing term) so
+* that the cost grows with the number of tables in the document and dishes
+* containing the word rather than with the number of dishes.
+*/
+extern void
+sampling_t_sparse(microscopes::lda::state &state, size_t j, size_t r, size_t pos, common::rng_t &rng, workspace &ws);
+
+extern void
+sampling_t_sparse(microscopes::lda::state &state, size_t j, size_t i, common::rng_t &rng, workspace &ws);
+
+extern void
+sampling_t_sparse(microscopes::lda::state &state, size_t j, size_t i, common::rng_t &rng);
+
+/**
+* sampling_t for the copies of run r's word, as many steps as copies,
+* each on a copy picked at random. The copies move between tables in
+* local counts, and the state is updated once per table the run leaves
+* or joins rather than once per copy. As a token_sampler it resamples
+* the run at pos 0 and does nothing at the other positions; runs of one
+* token go to sampling_t.
+*/
+extern void
+sampling_t_run(microscopes::lda::state &state, size_t j, size_t r, size_t pos, common::rng_t &rng, workspace &ws);
+
+extern void
+sampling_k(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng, workspace &ws);
+
 extern void
 sampling_k(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng);
+
+/**
+* Estimated cost of the per-document work of a sweep, from the number of
+* words and tables in each document.
+*/
+extern std::vector<double>
+document_costs(const microscopes::lda::state &state);
+
+/**
+* sampling_k for every table, in order.
+*/
+extern void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, workspace &ws);
+
+/**
+* sampling_k for every table, in order, with the dish draws made ahead on
+* nthreads threads and applied by apply_dish_draws. Each draw applied was
+* made against the counts it is applied to, so the sweep has the
+* distribution of the serial one, though not its draws. The result
+* depends only on rng; nthreads <= 1 is the serial sweep.
+*/
+extern void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, size_t nthreads);
+
+/**
+* As above, with the tables' draws scheduled (and stolen between threads)
+* by `scheduler`.
+*/
+extern void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, microscopes::lda::scheduler &scheduler);
+
+/**
+* Seats table tables[i] at dish proposed[i] (0 for a new dish), for i
+* from first on, in order, where all the draws were made against the
+* current counts. Stops after the first draw that moves a table to
+* another dish, since the draws after it were made against counts that
+* have changed. Returns one past the last draw applied.
+*/
+extern size_t
+apply_dish_draws(microscopes::lda::state &state, const std::vector<std::pair<size_t, size_t>> &tables,
+                 const std::vector<size_t> &proposed, size_t first, size_t last);
+
+/**
+* Word-level step for token pos of run r of document j.
+*/
+typedef void (*token_sampler)(microscopes::lda::state &, size_t, size_t, size_t, common::rng_t &, workspace &);
+
+/**
+* sample_token for every token of document j, run by run.
+*/
+extern void
+sampling_t_document(microscopes::lda::state &state, size_t j, token_sampler sample_token,
+                    common::rng_t &rng, workspace &ws);
+
+/**
+* Proposal distributions for sampling_t_mh, snapshotted from the state at
+* the start of a sweep. They go stale as the sweep moves words around;
+* the Metropolis-Hastings correction in sampling_t_mh accounts for that.
+*
+*  - prior: dish k in proportion to m_k, a new dish in proportion to gamma.
+*  - smoothing: dish k in proportion to beta * m_k / (n_k + V*beta), a new
+*    dish in proportion to gamma / V.
+*  - word: for each word v, dish k in proportion to
+*    m_k * n_kv / (n_k + V*beta) over the dishes containing v; built the
+*    first time v is seen.
+*/
+class mh_proposals {
+public:
+    explicit mh_proposals(const microscopes::lda::state &state);
+
+    // Draws a dish id (0 for a new dish) from the prior or from the
+    // smoothing + word mixture for word v.
+    size_t
+    sample_prior(common::rng_t &rng) const;
+
+    size_t
+    sample_word(microscopes::lda::state &state, size_t v, common::rng_t &rng);
+
+    // Probabilities of the above for dish id k (0 for a new dish).
+    double
+    prior_probability(size_t k) const;
+
+    double
+    word_probability(microscopes::lda::state &state, size_t v, size_t k);
+
+    // Number of words in document eid that are seated at a table.
+    inline size_t nassigned(size_t eid) const { return nassigned_[eid]; }
+
+    inline void assigned(size_t eid) { nassigned_[eid] += 1; }
+
+private:
+    struct word_proposal {
+        word_proposal() : built(false) {}
+        bool built;
+        std::vector<uint32_t> dishes;
+        std::vector<float> weights;
+        lda_util::alias_table alias;
+    };
+
+    const word_proposal &
+    word(microscopes::lda::state &state, size_t v);
+
+    float gamma_;
+    std::vector<uint32_t> dishes_; // dish ids in the snapshot; index 0 is a new dish
+    std::vector<float> prior_weights_; // indexed by dish id
+    std::vector<float> smoothing_weights_; // indexed by dish id
+    lda_util::alias_table prior_;
+    lda_util::alias_table smoothing_;
+    std::vector<word_proposal> words_;
+    std::vector<size_t> nassigned_;
+};
+
+/**
+* Word-level step that alternates document proposals (the table of another
+* word in the document, or a new table with a dish from the prior or drawn
+* uniformly from the current dishes) and word
+* proposals (a dish from the smoothing + word mixture, then a table at that
+* dish), nsteps of each, with a Metropolis-Hastings correction against the
+* same conditional sampling_t draws from exactly. Words not yet seated at a
+* table are drawn with sampling_t_sparse.
+*/
+extern void
+sampling_t_mh(microscopes::lda::state &state, mh_proposals &proposals, size_t j, size_t r, size_t pos,
+              size_t nsteps, common::rng_t &rng);
+
+extern void
+sampling_t_mh(microscopes::lda::state &state, mh_proposals &proposals, size_t j, size_t i,
+              size_t nsteps, common::rng_t &rng);
+
+/**
+* Counts kept by split_merge across calls.
+*/
+struct split_merge_stats {
+    size_t nsplits_proposed = 0;
+    size_t nsplits_accepted = 0;
+    size_t nmerges_proposed = 0;
+    size_t nmerges_accepted = 0;
+    std::vector<size_t> ntopics; //!< Active dishes after each call
+
+    inline double split_acceptance() const {
+        return nsplits_proposed ? double(nsplits_accepted) / nsplits_proposed : 0;
+    }
+
+    inline double merge_acceptance() const {
+        return nmerges_proposed ? double(nmerges_accepted) / nmerges_proposed : 0;
+    }
+};
+
+/**
+* nproposals split-merge Metropolis-Hastings moves on the dishes
+* (sequentially allocated, after Dahl 2003 and Wang & Blei 2012). Each
+* picks two tables at random. If they share a dish, the proposal splits
+* it: the two tables start two groups and the dish's other tables join
+* one or the other, in random order, in proportion to the group's table
+* count times the likelihood of the table's words given the group's.
+* Otherwise it merges their two dishes, and the probability of the split
+* that would undo the merge is found by replaying the allocation.
+* Words never change tables, so a move can split a topic that single
+* table moves (sampling_k) would take many sweeps to pull apart.
+* Sequential allocation stands in for the restricted Gibbs scans of
+* Jain & Neal (2004), which launch the split from a few intermediate
+* scans: one pass gives the split's proposal probability in closed form,
+* with no launch state to keep, at the cost of proposals that are less
+* well fitted and so accepted less often.
+*/
+extern void
+split_merge(microscopes::lda::state &state, common::rng_t &rng, size_t nproposals, split_merge_stats &stats);
 } // namespace lda_crp
 
+/**
+* Posterior sampling by direct assignment (Teh et al. 2006, section 5.3):
+* each word draws its dish given the others and the global dish weights
+* beta, the number of tables of each dish in a document is drawn given
+* its words, and beta is drawn given the table counts. The state keeps
+* working as a franchise: a word's dish is its table's, and the tables
+* drawn for a document are a seating of its words at each dish under a
+* CRP with concentration alpha * beta_k, so m_k is the sampler's table
+* count and every accessor (and the lda_crp kernels) can be used on the
+* result. The seating (n_jt, n_jtv and the run segments) is therefore
+* kept up to date as in lda_crp, so the state needs as much memory as
+* under the CRF kernels; only the sweep is cheaper.
+*/
+namespace lda_direct {
+
+/**
+* beta by dish id and the weight left for new dishes, drawn at the start
+* of a sweep, and the current document's counts. Scratch buffers keep
+* their capacity between calls, as in lda_crp::workspace.
+*/
+struct workspace {
+    std::vector<double> beta; //!< 0 for inactive dishes
+    double beta_new = 0;
+    double smoothing = 0; //!< alpha * (beta_new / V + sum_k beta_k * beta / (n_k + V * beta))
+    std::vector<uint32_t> n_jk; //!< Words of the current document at each dish
+    std::vector<uint32_t> table_of; //!< A table of the current document at each dish, 0 if none
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> token_tables;
+    std::vector<size_t> table_dishes;
+    std::vector<size_t> doc_dishes;
+};
+
+/**
+* Draws beta ~ Dirichlet(m_1, ..., m_K, gamma) from the state's table
+* counts.
+*/
+extern void
+sample_beta(const microscopes::lda::state &state, common::rng_t &rng, workspace &ws);
+
+/**
+* Loads the counts of document eid into ws; needed before sampling_z.
+*/
+extern void
+begin_document(const microscopes::lda::state &state, size_t eid, workspace &ws);
+
+/**
+* Draws the dish of token pos of run r of the current document eid from
+* (n_jk + alpha * beta_k) * f_k(v) over the active dishes and
+* alpha * beta_new / V for a new dish, whose weight is broken off
+* beta_new by the stick-breaking prior. The weights are split into word,
+* document and smoothing buckets as in lda_crp::sampling_t_sparse. The
+* word is seated at a table of the document at its dish.
+*/
+extern void
+sampling_z(microscopes::lda::state &state, size_t eid, size_t r, size_t pos, common::rng_t &rng,
+           workspace &ws);
+
+/**
+* Reseats the words of the current document eid, dish by dish, by a CRP
+* with concentration alpha * beta_k, which draws the number of tables of
+* each dish from its conditional (the Antoniak distribution). Clears the
+* document's counts from ws.
+*/
+extern void
+sampling_m(microscopes::lda::state &state, size_t eid, common::rng_t &rng, workspace &ws);
+
+/**
+* begin_document, sampling_z for every token and sampling_m.
+*/
+extern void
+sampling_document(microscopes::lda::state &state, size_t eid, common::rng_t &rng, workspace &ws);
+} // namespace lda_direct
+
 extern void
 lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng);
 
+/**
+* One sweep using sample_token (e.g. lda_crp::sampling_t or
+* lda_crp::sampling_t_sparse) for the word-level step.
+*/
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token);
+
+/**
+* As above with the kernels' temporaries in `ws`, so that repeated sweeps
+* do not allocate for them.
+*/
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token,
+              lda_crp::workspace &ws);
+
+/**
+* One sweep whose word-level step runs on nthreads threads, each over its
+* own share of the documents with a private copy of the dish counts
+* (AD-LDA). The copies are merged before the table-level step, which
+* then runs as lda_crp::sampling_k_sweep on the same number of threads.
+* nthreads <= 1 is the serial sweep above.
+*/
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token, size_t nthreads);
+
+/**
+* As above, on the threads of `scheduler`, whose counters then include
+* this sweep. Documents are dealt to the threads by document_costs.
+*/
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token, microscopes::lda::scheduler &scheduler);
+
+/**
+* One sweep using sampling_t_mh for the word-level step (with proposals
+* rebuilt at the start of the sweep) and sampling_k for the table-level
+* step.
+*/
+extern void
+lda_crp_mh(microscopes::lda::state &state, common::rng_t &rng, size_t nsteps);
+
+/**
+* One sweep of the direct assignment sampler: lda_direct::sample_beta,
+* then lda_direct::sampling_document for each document in order.
+*/
+extern void
+lda_direct_gibbs(microscopes::lda::state &state, common::rng_t &rng);
+
+extern void
+lda_direct_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_direct::workspace &ws);
+
 } // namespace kernels
 } // namespace microscopes
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Read-only memory mapping of a whole file, unmapped on destruction.
+*/
+class mapped_file {
+public:
+    explicit mapped_file(const std::string &path);
+
+    ~mapped_file();
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    inline const std::string &path() const { return path_; }
+
+    // Null for an empty file.
+    inline const char *data() const { return data_; }
+
+    inline size_t size() const { return size_; }
+
+private:
+    std::string path_;
+    int fd_;
+    const char *data_;
+    size_t size_;
+};
+
+} // namespace lda
+} // namespace microscopes
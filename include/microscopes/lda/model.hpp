@@ -4,9 +4,14 @@
 #include <microscopes/common/util.hpp>
 #include <microscopes/common/typedefs.hpp>
 #include <microscopes/common/assert.hpp>
+#include <microscopes/lda/corpus.hpp>
 #include <microscopes/lda/util.hpp>
+#include <microscopes/lda/scheduler.hpp>
 
 #include <math.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
 #include <vector>
 #include <set>
 #include <map>
@@ -14,7 +19,7 @@
 namespace microscopes {
 namespace lda {
 
-typedef std::vector<std::vector<size_t>> nested_vector;
+typedef lda_util::histogram<uint32_t, uint32_t> word_histogram; //!< Word counts at a single table
 
 class model_definition {
 public:
@@ -26,26 +31,128 @@ private:
     size_t v_;
 };
 
+/**
+* Dish ids for one worker of a parallel sweep. Each worker gets a disjoint
+* share of the ids that are free in the global state (every nworkers-th
+* one, smallest first) followed by every nworkers-th id past the global
+* capacity, so workers never hand out the same id and the ids they pick
+* do not depend on thread timing.
+*/
+class dish_id_pool {
+public:
+    dish_id_pool(const lda_util::id_set &dishes, size_t worker, size_t nworkers);
+
+    size_t
+    create();
+
+private:
+    std::vector<size_t> free_; // descending, so the smallest is at the back
+    size_t next_;
+    size_t stride_;
+};
+
+class state;
+
+/**
+* The per-document part of a state for a range of documents: the corpus,
+* tables, table counts and table assignments, exchanged with a state's
+* own by state::swap_shard. An out-of-core chain (see shard_stream.hpp)
+* keeps these on disk between sweeps.
+*/
+struct document_shard {
+    std::shared_ptr<const corpus> docs;
+    std::vector<lda_util::id_set> using_t;
+    nested_vector dish_assignments;
+    nested_vector n_jt;
+    std::vector<std::vector<word_histogram>> n_jtv;
+    std::vector<lda_util::run_tables> run_tables;
+
+    inline size_t size() const { return using_t.size(); }
+
+    /**
+    * Writes the shard to `path` in the snapshot layout (see
+    * src/lda/snapshot.cpp), flagged as a shard and without dish counts.
+    */
+    void
+    save(const std::string &path, size_t V) const;
+
+    /**
+    * Reads a file written by save; the table counts and per-table word
+    * histograms are rebuilt from the table assignments.
+    */
+    static document_shard
+    load(const std::string &path, size_t V);
+};
+
+/**
+* The table and dish assignments of a state as a snapshot lays them out
+* (the segments of each run and the dish of each table slot), with the
+* hyperparameters and the corpus, which is shared as it never changes.
+* Taking one is a pass over the segments and table slots, without the
+* counts and per-table word histograms a copy of the state would bring;
+* save() recounts the counts from the assignments.
+*/
+struct snapshot_assignments {
+    size_t V;
+    float alpha, beta, gamma;
+    size_t ndishes; //!< One past the largest dish id
+    std::shared_ptr<const corpus> docs;
+    std::vector<uint64_t> segment_offsets; //!< Row offsets of each document's segments
+    std::vector<uint32_t> nsegments; //!< Segments covering each run
+    std::vector<uint32_t> segments; //!< (t_ji, number of tokens) pairs in token order
+    std::vector<uint64_t> table_offsets; //!< Row offsets of each document's table slots
+    std::vector<uint32_t> dishes; //!< k_jt of each slot; 0 for a free slot
+
+    /**
+    * Writes the same file state::save_snapshot writes for the state it
+    * was taken from.
+    */
+    void
+    save(const std::string &path, bool with_counts = true,
+         const std::string &extra = std::string()) const;
+};
+
 class state {
 public:
     size_t V; //!< Total number of unique vocabulary words
     float alpha_; //!< Hyperparamter on second level Dirichlet process (\alpha_0)
     float beta_; //!< Hyperparameter of base Dirichlet distribution (over term distributions) (\beta)
     float gamma_; //!< Hyperparameter on first level Dirichlet process (\gamma)
-    nested_vector using_t; //!< Nested vector giving list of indices of
-                           //!< active tables for each document
-                           //!< table==0 means we need to create new table for word
-    std::vector<size_t> dishes_; //!< List of indices of active dishes/topics (using_k in shuyo's code)
-    const nested_vector x_ji; //!< Integer representation of documents
+    std::vector<lda_util::id_set> using_t; //!< Active table ids for each document
+                                           //!< table==0 means we need to create new table for word
+    lda_util::id_set dishes_; //!< Active dish/topic ids (using_k in shuyo's code)
+    std::shared_ptr<const corpus> x_ji; //!< Documents as runs of repeated word ids (shared with worker states)
     nested_vector dish_assignments_; //!< Nested vector mapping doc/table pair to topic (k_jt)
                                 //!< dish==0 means we need to create new dish
     nested_vector n_jt; //!< Nested vector giving counts for words assigned to doc/table pairs
-    std::vector<std::vector<std::map<size_t, size_t>>> n_jtv; //!< Nested vector giving counts for doc/table/word triples
+    std::vector<std::vector<word_histogram>> n_jtv; //!< Nested vector giving counts for doc/table/word triples
     std::vector<size_t> m_k; //!< Number of tables assigned to each dish
-    lda_util::defaultdict<size_t, float> n_k; //!< Number of words assigned to each dish plus beta * V
-    std::vector<lda_util::defaultdict<size_t, float>> n_kv; //!< Number of times a given word is assigned to
-                                                            //!< each dish plus beta
-    nested_vector table_assignments_; //!< Nested vector giving table assignment for each doc/word pair (t_ji)
+    std::vector<size_t> n_k; //!< Number of words assigned to each dish
+    lda_util::count_matrix<uint32_t> n_kv; //!< Number of times a given word is assigned to
+                                           //!< each dish (dish x word, row-major)
+    std::vector<lda_util::run_tables> run_tables_; //!< Table assignment of each token (t_ji), by run of each doc
+    size_t ntables_; //!< Total number of tables with a dish (sum of m_k)
+    std::vector<float> inv_n_k_; //!< 1 / (n_k + V * beta) for each dish
+    double smoothing_mass_; //!< Sum over dishes of m_k / (n_k + V * beta)
+    std::vector<std::vector<uint32_t>> word_dishes_; //!< Dishes with n_kv > 0 for each word (unordered)
+    std::shared_ptr<dish_id_pool> dish_ids_; //!< Source of new dish ids in a worker state, null otherwise
+
+    /**
+    * A worker state's copy of n_kv(., v) for a word it has changed.
+    */
+    struct word_column {
+        uint32_t v;
+        std::vector<uint32_t> n_kv; //!< By dish; dishes past the end have count 0
+        std::vector<uint32_t> dishes; //!< Dishes with a non-zero count (word_dishes_ for v)
+    };
+    const state *base_; //!< In a worker state, the state whose n_kv and word_dishes_ it reads through; null otherwise
+    size_t base_ndishes_; //!< Worker state: number of rows of base_->n_kv
+    std::vector<int32_t> word_column_slot_; //!< Worker state: index in word_columns_ of each word, -1 if unchanged
+    std::vector<word_column> word_columns_; //!< Worker state: the words it has changed
+    lda_util::cached_function lgamma_beta_; //!< lgamma(n + beta) for integer counts n
+    lda_util::cached_function lgamma_vbeta_; //!< lgamma(n + V * beta) for integer counts n
+    lda_util::cached_function log_n_; //!< log(n) for integer counts n
+    lda_util::modification_stamp stamp_; //!< Touched by every change to m_k, n_k, n_kv or the active dishes
 
     template <class... Args>
     static inline std::shared_ptr<state>
@@ -61,7 +168,19 @@ private:
           float gamma,
           const nested_vector &docs);
 
+    state(size_t V,
+          float alpha,
+          float beta,
+          float gamma,
+          const std::shared_ptr<const corpus> &docs);
+
 public:
+    /**
+    * State without documents: the hyperparameters and the dummy dish.
+    * Documents are brought in with swap_shard.
+    */
+    state(size_t V, float alpha, float beta, float gamma);
+
     state(const model_definition &defn,
           float alpha,
           float beta,
@@ -70,6 +189,21 @@ public:
           const nested_vector &docs,
           common::rng_t &);
 
+    /**
+    * Random initial state on a shared corpus, e.g. one from read_corpus.
+    */
+    state(const model_definition &defn,
+          float alpha,
+          float beta,
+          float gamma,
+          size_t initial_dishes,
+          const std::shared_ptr<const corpus> &docs,
+          common::rng_t &);
+
+    /**
+    * Explicit assignments: table_assignments[j][i] is the table of token
+    * i of docs[j], and dish_assignments[j][t] the dish of table t.
+    */
     state(const model_definition &defn,
           float alpha,
           float beta,
@@ -78,24 +212,139 @@ public:
           const nested_vector &table_assignments,
           const nested_vector &docs);
 
+    /**
+    * Worker state for a parallel sweep: a copy of the hyperparameters and
+    * per-dish totals of `global`, with no per-document data until some is
+    * moved in with swap_documents. The dish/word counts are read from
+    * `global`, which must not change while the worker lives, except for
+    * the words the worker changes: those are copied one word at a time on
+    * first change. New dishes take their ids from `dish_ids`.
+    */
+    state(const state &global, const std::shared_ptr<dish_id_pool> &dish_ids);
+
+    /**
+    * Exchanges the per-document data (tables, dish and table assignments,
+    * table counts) of documents `eids` with `other`.
+    */
+    void
+    swap_documents(state &other, const std::vector<size_t> &eids);
+
+    /**
+    * Exchanges all per-document data, the corpus included, with `shard`.
+    * The dish counts are left alone: they must already include the
+    * shard's tables (see count_shard), so a state can hold the counts of
+    * a whole corpus while only one shard of it is in memory.
+    */
+    void
+    swap_shard(document_shard &shard);
+
+    /**
+    * Adds the tables and seated words of `shard` to m_k, n_k and n_kv.
+    * The derived totals are stale until rebuild_dish_totals.
+    */
+    void
+    count_shard(const document_shard &shard);
+
+    /**
+    * Rebuilds the active dishes, table total, 1 / (n_k + V * beta),
+    * smoothing mass and word_dishes_ from m_k, n_k and n_kv.
+    */
+    void
+    rebuild_dish_totals();
+
+    /**
+    * The part of rebuild_dish_totals that reads only m_k and n_k, for
+    * when word_dishes_ is already up to date.
+    */
+    void
+    rebuild_dish_list();
+
+    /**
+    * Replaces the tables of document eid, other than table 0, with tables
+    * 1, ..., table_dishes.size() - 1, table t at dish table_dishes[t], and
+    * seats token i of the document in corpus order (run by run, not in
+    * the order given; see corpus) at table token_tables[i]. Every token
+    * must keep its dish and every new table must get a token, so only the
+    * document's tables and m_k change and every dish keeps a table.
+    * Allocates only when the document opens more tables than it has had,
+    * or a table slot gets more distinct words than it has held before.
+    */
+    void
+    reseat_document(size_t eid, const std::vector<uint32_t> &token_tables,
+                    const std::vector<size_t> &table_dishes);
+
+    /**
+    * Folds the count changes made by `workers` (each built from this
+    * state and given a disjoint set of documents) into this state, then
+    * rebuilds the active dishes and derived totals. Only the words some
+    * worker changed are visited, and for each only the dishes it is
+    * counted in before or after.
+    */
+    void
+    merge_workers(const std::vector<std::shared_ptr<state>> &workers);
+
+    /**
+    * Writes the hyperparameters, corpus, table and dish assignments and,
+    * with `with_counts`, the table, dish and dish/word counts to `path` in
+    * a versioned binary format (see src/lda/snapshot.cpp). `extra` is
+    * stored as is, for the caller's own data.
+    */
+    void
+    save_snapshot(const std::string &path, bool with_counts = true,
+                  const std::string &extra = std::string()) const;
+
+    /**
+    * Reads a file written by save_snapshot through mmap. Stored counts
+    * are used as they are, after checking that each dish's n_kv adds up
+    * to its n_k and that its n_k and m_k are those of its tables; with
+    * `verify` n_kv is also recounted from the assignments and must
+    * match. Without stored counts they are counted from the assignments.
+    * The extra data, if any, is returned through `extra`.
+    */
+    static std::shared_ptr<state>
+    load_snapshot(const std::string &path, std::string *extra = nullptr, bool verify = false);
+
+    /**
+    * The assignments save_snapshot writes, to be written later or on
+    * another thread while this state changes.
+    */
+    snapshot_assignments
+    flat_assignments() const;
+
+    /**
+    * Returns the documents as word ids, token by token in the order they
+    * were given; builds a new nested vector. Token indices (word_index)
+    * of the accessors below follow the same order.
+    */
+    nested_vector
+    documents() const;
+
+    /**
+    * Returns, for each entity, the dish each word is assigned to.
+    * This is derived from the table and dish assignments, so unlike
+    * the other accessors it builds a new nested vector.
+    */
     nested_vector
-    assignments();
+    assignments() const;
 
     /**
     * Returns, for each entity, a map from
     * table IDs -> (global) dish assignments
     *
     */
-    nested_vector
-    dish_assignments();
+    const nested_vector &
+    dish_assignments() const;
 
     /**
     * Returns, for each entity, an assignment vector
-    * from each word to the (local) table it is assigned to.
-    *
+    * from each word to the (local) table it is assigned to, in the
+    * order the documents were given (as documents() returns them).
+    * The tables are kept per run of a repeated word, so this builds a
+    * new nested vector; see table_assignment and run_tables for reads
+    * that do not.
     */
     nested_vector
-    table_assignments();
+    table_assignments() const;
 
     // Not implemented
     float
@@ -111,8 +360,18 @@ public:
     std::vector<std::vector<float>>
     document_distribution();
 
+    /**
+    * exp(-log likelihood per word) of the training documents under the
+    * current topic and document distributions. Reads the counts directly
+    * and visits each distinct word of a document once; the per-document
+    * terms are summed in document order, so the result does not depend on
+    * the number of threads.
+    */
+    double
+    perplexity(size_t nthreads = 1) const;
+
     double
-    perplexity();
+    perplexity(scheduler &scheduler) const;
 
     void
     leave_from_dish(size_t j, size_t t);
@@ -123,12 +382,38 @@ public:
     void
     seat_at_dish(size_t j, size_t t, size_t k_new);
 
+    /**
+    * Seats token word_index of document eid at table t_new; its previous
+    * seat must have been left with remove_table. add_run_token and
+    * remove_run_token are the same for token pos of run r.
+    */
+    void
+    add_table(size_t eid, size_t t_new, size_t word_index);
+
     void
-    add_table(size_t eid, size_t t_new, size_t did);
+    add_run_token(size_t eid, size_t t_new, size_t r, size_t pos);
+
+    /**
+    * Seats n of the unseated (table 0) tokens of run r of document eid at
+    * table t_new, and takes n tokens of run r off table tid back to table
+    * 0, deleting the table if it empties. The copies of a run's word are
+    * interchangeable, so the counts move once for all n tokens.
+    */
+    void
+    add_run_tokens(size_t eid, size_t t_new, size_t r, uint32_t n);
+
+    void
+    remove_run_tokens(size_t eid, size_t r, size_t tid, uint32_t n);
 
     void
     create_entity(size_t eid);
 
+    void
+    init_dish(size_t k_new);
+
+    void
+    init_table(size_t eid, size_t t_new, size_t k_new);
+
     size_t
     create_dish();
 
@@ -139,37 +424,200 @@ public:
     create_table(size_t eid, size_t k_new);
 
     void
-    remove_table(size_t eid, size_t tid);
+    create_table(size_t eid, size_t t_new, size_t k_new);
+
+    /**
+    * Takes token word_index of document eid off its table, deleting the
+    * table (and its dish) if it empties. The token's recorded table is
+    * left as it was until add_table.
+    */
+    void
+    remove_table(size_t eid, size_t word_index);
+
+    void
+    remove_run_token(size_t eid, size_t r, size_t pos);
 
     void
     delete_table(size_t eid, size_t tid);
 
-    inline size_t get_word(size_t eid, size_t word_index) const { return get_entity(eid)[word_index]; }
+    inline size_t get_word(size_t eid, size_t word_index) const { return x_ji->word_at(eid, x_ji->token(eid, word_index)); }
+
+    inline size_t table_assignment(size_t eid, size_t word_index) const {
+        auto seat = x_ji->locate(eid, word_index);
+        return run_tables_[eid].table(seat.first, seat.second);
+    }
 
-    inline std::vector<size_t> get_entity(size_t eid) const { return x_ji[eid]; }
+    inline const lda_util::run_tables &run_tables(size_t eid) const { return run_tables_[eid]; }
+
+    inline size_t nruns(size_t eid) const { return x_ji->nruns(eid); }
+
+    inline size_t run_word(size_t eid, size_t r) const { return x_ji->word(eid, r); }
+
+    inline size_t run_count(size_t eid, size_t r) const { return x_ji->count(eid, r); }
 
     inline size_t tablesize(size_t eid, size_t tid) const { return n_jt[eid][tid]; }
 
+    // n_kv and n_k hold raw counts; the beta prior is added when they are read.
+    inline float smoothed_n_kv(size_t did, size_t v) const { return dish_word_count(did, v) + beta_; }
+
+    inline float smoothed_n_k(size_t did) const { return n_k[did] + beta_ * V; }
+
+    inline float inv_smoothed_n_k(size_t did) const { return inv_n_k_[did]; }
+
+    // Called whenever n_k[did] changes.
+    inline void update_inv_n_k(size_t did) {
+        stamp_.touch();
+        reserve_lgamma(n_k[did]);
+        float inv_n_k = 1 / smoothed_n_k(did);
+        smoothing_mass_ += m_k[did] * (double(inv_n_k) - inv_n_k_[did]);
+        inv_n_k_[did] = inv_n_k;
+    }
+
+    // m_k must only change through these so that the table total and the
+    // smoothing mass stay in step.
+    inline void incr_dishsize(size_t did) {
+        stamp_.touch();
+        m_k[did] += 1;
+        ntables_ += 1;
+        smoothing_mass_ += inv_n_k_[did];
+        log_n_.reserve(m_k[did]);
+    }
+
+    inline void decr_dishsize(size_t did) {
+        MICROSCOPES_DCHECK(m_k[did] > 0, "m_k below zero");
+        stamp_.touch();
+        m_k[did] -= 1;
+        ntables_ -= 1;
+        smoothing_mass_ -= inv_n_k_[did];
+    }
+
+    // n_kv must only change through these so that word_dishes_ stays in step.
+    void
+    incr_n_kv(size_t did, size_t v, uint32_t n);
+
+    void
+    decr_n_kv(size_t did, size_t v, uint32_t n);
+
+    // Worker state: its copy of n_kv(., v), made on first use, with room
+    // for dish k.
+    inline word_column &touch_word(size_t v, size_t k) {
+        const int32_t slot = word_column_slot_[v];
+        if (slot >= 0 && k < word_columns_[slot].n_kv.size()) return word_columns_[slot];
+        return add_word_column(v, k);
+    }
+
+    word_column &
+    add_word_column(size_t v, size_t k);
+
+    /**
+    * Sum over active dishes of m_k / (n_k + V * beta); the word-independent
+    * part of sum_k m_k f_k(v) is beta times this.
+    */
+    inline double smoothing_mass() const { return smoothing_mass_; }
+
+    /**
+    * Recomputes the smoothing mass from m_k and 1 / (n_k + V * beta). The
+    * updates above add and subtract rounded terms, so the sweeps call
+    * this once each to keep the error from growing over a long chain.
+    */
+    void
+    resync_smoothing_mass();
+
+    /**
+    * Dishes that word v is currently counted in, in no particular order.
+    */
+    inline const std::vector<uint32_t> &word_dishes(size_t v) const {
+        if (!base_) return word_dishes_[v];
+        const int32_t slot = word_column_slot_[v];
+        return slot < 0 ? base_->word_dishes_[v] : word_columns_[slot].dishes;
+    }
+
+    inline size_t dish_nwords(size_t did) const { return n_k[did]; }
+
+    /**
+    * Read-only view of n_kv(., v) by dish id, valid until the counts next
+    * change. Ids past the end have count 0.
+    */
+    struct word_counts_view {
+        const uint32_t *data;
+        size_t stride;
+        size_t size;
+        inline uint32_t operator[](size_t did) const { return did < size ? data[did * stride] : 0; }
+    };
+
+    inline word_counts_view word_counts(size_t v) const {
+        if (!base_) return word_counts_view{n_kv.row(0) + v, n_kv.ncols(), n_kv.nrows()};
+        const int32_t slot = word_column_slot_[v];
+        if (slot < 0) return word_counts_view{base_->n_kv.row(0) + v, base_->n_kv.ncols(), base_ndishes_};
+        const auto &counts = word_columns_[slot].n_kv;
+        return word_counts_view{counts.data(), 1, counts.size()};
+    }
+
+    inline size_t dish_word_count(size_t did, size_t v) const { return word_counts(v)[did]; }
+
+    /**
+    * One past the largest dish id the per-dish counts have room for.
+    */
+    inline size_t dish_capacity() const { return m_k.size(); }
+
+    /**
+    * Changes with every update of the dish counts above, so that values
+    * computed from them can be kept between kernel calls (see
+    * lda_crp::workspace).
+    */
+    inline lda_util::modification_stamp::value_type stamp() const { return stamp_.value(); }
+
+    // Cached lgamma(n + beta), lgamma(n + V * beta) and log(n). The
+    // tables are grown as the counts change (see reserve_lgamma), so
+    // these only read and can be called from several threads.
+    inline float lgamma_beta(size_t n) const { return lgamma_beta_(n); }
+
+    inline float lgamma_vbeta(size_t n) const { return lgamma_vbeta_(n); }
+
+    inline float log_count(size_t n) const { return log_n_(n); }
+
+    /**
+    * Changes beta and drops the cached values that depend on it.
+    */
+    void
+    set_beta(float beta);
+
     inline size_t dish_assignment(size_t eid, size_t tid) const { return dish_assignments_[eid][tid]; }
 
-    inline void delete_dish(size_t did) { lda_util::removeFirst(dishes_, did); }
+    inline const word_histogram &table_words(size_t eid, size_t tid) const { return n_jtv[eid][tid]; }
 
-    inline std::vector<size_t> dishes() const { return dishes_; }
+    inline size_t dishsize(size_t did) const { return m_k[did]; }
 
-    inline size_t nentities() const { return x_ji.size(); }
+    inline void delete_dish(size_t did) {
+        stamp_.touch();
+        dishes_.erase(did);
+    }
+
+    inline const std::vector<size_t> &dishes() const { return dishes_.ids(); }
+
+    inline size_t nentities() const { return x_ji->size(); }
 
     inline size_t ntopics() const { return dishes_.size() - 1; }
 
     inline size_t nwords() const { return V; }
 
-    inline size_t nterms(size_t eid) const { return get_entity(eid).size(); }
+    inline size_t nterms(size_t eid) const { return x_ji->nterms(eid); }
 
     inline size_t ntables(size_t eid) const { return using_t[eid].size(); }
 
-    inline std::vector<size_t> tables(size_t eid) const { return using_t[eid]; }
+    // Active table ids of a document, in ascending order (table 0 first).
+    inline const std::vector<size_t> &tables(size_t eid) const { return using_t[eid].ids(); }
 
-    inline int ntables() const { return std::accumulate(m_k.begin()+1, m_k.end(), 0); }
+    inline int ntables() const { return ntables_; }
 
+private:
+    // Grows the lgamma caches for a dish with n words. The posteriors
+    // ask for a dish's count plus the words of one table, or the words of
+    // two dishes, so 2 n covers them as long as no dish had more.
+    inline void reserve_lgamma(size_t n) {
+        lgamma_beta_.reserve(2 * n);
+        lgamma_vbeta_.reserve(2 * n);
+    }
 };
 
 }
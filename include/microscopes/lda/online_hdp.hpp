@@ -0,0 +1,133 @@
+#pragma once
+
+#include <microscopes/common/random_fwd.hpp>
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/scheduler.hpp>
+
+#include <stddef.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Online variational inference for the HDP (Wang, Paisley & Blei 2011),
+* for document streams that are seen once. The corpus-level stick
+* breaking weights are truncated at T topics and each document's at K;
+* only the global parameters are kept: a Dirichlet over words for each
+* topic (lambda, T x V) and a Beta for each of the first T - 1 corpus
+* sticks. Each update runs the document-level coordinate ascent on a
+* mini-batch and moves the global parameters toward the estimate that
+* batch would give if the whole corpus were like it, with step size
+* rho_t = (tau + t)^-kappa at the t-th update.
+*
+* The model_definition's n is the (expected) corpus size D the batch
+* statistics are scaled to, and v the vocabulary size.
+*/
+class online_hdp {
+public:
+    /**
+    * lambda starts from Gamma(1, 1) noise scaled by 100 D / (T V), as in
+    * the authors' implementation. alpha and gamma are the concentrations
+    * of the document and corpus sticks, eta the Dirichlet prior on each
+    * topic's words.
+    */
+    online_hdp(const model_definition &defn, size_t T, size_t K,
+               float alpha, float eta, float gamma,
+               double kappa, double tau, common::rng_t &rng);
+
+    /**
+    * Document-level iterations stop once the document sticks change by
+    * less than tol on average, or after max_iter of them.
+    */
+    inline void set_e_step(size_t max_iter, double tol) { max_iter_ = max_iter; tol_ = tol; }
+
+    /**
+    * One stochastic step on a mini-batch. The documents' e-steps run on
+    * the scheduler's threads against the current global parameters and
+    * are combined in document order, so the result does not depend on
+    * the thread count. Returns the step size used.
+    */
+    double
+    update(const nested_vector &docs, scheduler &scheduler);
+
+    double
+    update(const nested_vector &docs, size_t nthreads = 1);
+
+    double
+    update(const corpus &docs, scheduler &scheduler);
+
+    double
+    update(const corpus &docs, size_t nthreads = 1);
+
+    /**
+    * E[p(v | topic)] for every topic, in the shape of
+    * state::word_distribution.
+    */
+    std::vector<std::map<size_t, float>>
+    word_distribution() const;
+
+    /**
+    * E[topic proportions] of each document after its e-step, in the
+    * shape of state::document_distribution: column 0 stands for a new
+    * topic and is always 0, since the truncated model leaves it no mass;
+    * column t + 1 is topic t.
+    */
+    std::vector<std::vector<float>>
+    document_distribution(const nested_vector &docs, size_t nthreads = 1) const;
+
+    /**
+    * E[corpus-level weight] of each topic under the stick parameters.
+    */
+    std::vector<float>
+    topic_weights() const;
+
+    inline size_t ntopics() const { return T_; }
+
+    inline size_t nwords() const { return V_; }
+
+    // Updates so far.
+    inline size_t nupdates() const { return nupdates_; }
+
+    inline double lambda(size_t t, size_t v) const { return lambda_[t * V_ + v]; }
+
+private:
+    // A document as distinct words and their counts.
+    typedef std::vector<std::pair<uint32_t, uint32_t>> word_counts;
+
+    // Result of a document's e-step: the responsibility of each corpus
+    // topic for each document stick (K x T) and for each distinct word
+    // (n x T), and the document stick parameters.
+    struct doc_params {
+        std::vector<double> var_phi;
+        std::vector<double> word_topics;
+        std::vector<double> a, b;
+    };
+
+    void
+    e_step(const word_counts &doc, doc_params &out) const;
+
+    double
+    update(const std::vector<word_counts> &docs, scheduler &scheduler);
+
+    // Recomputes E[log beta] and E[log corpus sticks] from the parameters.
+    void
+    refresh_expectations();
+
+    size_t D_, V_, T_, K_;
+    float alpha_, eta_, gamma_;
+    double kappa_, tau_;
+    size_t max_iter_;
+    double tol_;
+    size_t nupdates_;
+    std::vector<double> lambda_;     //!< T x V, topic-major
+    std::vector<double> sticks_a_;   //!< T - 1 corpus stick Beta parameters
+    std::vector<double> sticks_b_;
+    std::vector<double> elog_beta_;  //!< V x T, word-major
+    std::vector<double> elog_sticks_; //!< T
+};
+
+} // namespace lda
+} // namespace microscopes
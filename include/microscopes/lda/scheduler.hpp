@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Work done by one thread of a scheduler, summed over its runs.
+*/
+struct thread_stats {
+    size_t ntasks; //!< Tasks run by this thread
+    size_t nstolen; //!< Tasks among those taken from another thread's queue
+    double cost; //!< Estimated cost of the tasks run
+    double busy_seconds; //!< Time spent inside tasks
+};
+
+/**
+* Runs indexed tasks with estimated costs on a fixed number of threads.
+*
+* Tasks are first dealt to per-thread queues, heaviest first to the least
+* loaded thread, and each queue is run in ascending task order. A thread
+* whose queue is empty steals from the back of the queue with the most
+* work left, unless stealing is turned off for the run. Tasks must not
+* depend on which thread runs them for the results to be reproducible.
+*
+* The nthreads - 1 threads besides the caller's are started once, by the
+* constructor, and wait for work between runs.
+*/
+class scheduler {
+public:
+    explicit scheduler(size_t nthreads);
+
+    ~scheduler();
+
+    scheduler(const scheduler &) = delete;
+    scheduler &operator=(const scheduler &) = delete;
+
+    inline size_t nthreads() const { return nthreads_; }
+
+    /**
+    * The thread whose queue each task starts in.
+    */
+    std::vector<size_t>
+    partition(const std::vector<double> &costs) const;
+
+    /**
+    * Calls task(i, thread) once for each i < costs.size() and returns when
+    * all have finished. The calling thread is thread 0. Without stealing
+    * every task runs on the thread given by partition(costs).
+    *
+    * If a task throws, no further tasks are started, and once the running
+    * ones have finished the first exception thrown is rethrown here.
+    * Tasks must not call run on the same scheduler.
+    */
+    void
+    run(const std::vector<double> &costs,
+        const std::function<void(size_t, size_t)> &task,
+        bool steal = true);
+
+    inline const std::vector<thread_stats> &stats() const { return stats_; }
+
+    inline double wall_seconds() const { return wall_seconds_; }
+
+    /**
+    * Fraction of the wall time of all runs that each thread spent in tasks.
+    */
+    std::vector<double>
+    utilization() const;
+
+    void
+    reset_stats();
+
+private:
+    void
+    serve(size_t thread);
+
+    size_t nthreads_;
+    std::vector<thread_stats> stats_;
+    double wall_seconds_;
+
+    std::vector<std::thread> threads_; //!< Threads 1, ..., nthreads - 1
+    std::mutex pool_lock_; //!< Guards the members below
+    std::condition_variable work_ready_, work_done_;
+    const std::function<void(size_t)> *work_; //!< What the threads run for the current run
+    size_t generation_; //!< Number of runs started
+    size_t nbusy_; //!< Threads still working on the current run
+    bool stopping_;
+};
+
+} // namespace lda
+} // namespace microscopes
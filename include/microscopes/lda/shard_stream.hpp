@@ -0,0 +1,118 @@
+#pragma once
+
+#include <microscopes/common/random_fwd.hpp>
+#include <microscopes/lda/model.hpp>
+
+#include <stddef.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* An out-of-core chain. The documents and everything kept per document
+* (tables, table and dish assignments, per-table word counts) live in
+* shard files in a directory, and only the hyperparameters and the dish
+* counts stay in memory, in counts(). A sweep streams the shards through
+* counts() one at a time, reading the next `prefetch` shards and writing
+* finished ones on background threads while the current one is sampled.
+*
+* Each shard has two files; a sweep reads the current one, writes the
+* other, and then replaces the counts file that records which is
+* current, so the directory always holds the state after the last
+* complete sweep or append. After an error, open the directory again.
+*/
+class shard_stream {
+public:
+    /**
+    * Starts an empty chain in `dir`, which is created if missing; files
+    * of an earlier chain there are replaced as it grows.
+    */
+    static std::shared_ptr<shard_stream>
+    create(const std::string &dir, size_t V, float alpha, float beta, float gamma,
+           size_t prefetch = 1);
+
+    /**
+    * Reopens the chain in `dir` as of its last complete sweep or append.
+    */
+    static std::shared_ptr<shard_stream>
+    open(const std::string &dir, size_t prefetch = 1);
+
+    shard_stream(const shard_stream &) = delete;
+    shard_stream &operator=(const shard_stream &) = delete;
+
+    /**
+    * Adds `docs` as a new shard, each document starting at a table with a
+    * random dish as in state's random constructor; appending the pieces
+    * of a corpus in order with the same rng gives the same assignments
+    * as a state built on the whole corpus.
+    */
+    void
+    append(const std::shared_ptr<const corpus> &docs, size_t initial_dishes, common::rng_t &rng);
+
+    /**
+    * Calls step(counts(), shard) for each shard in order with that
+    * shard's documents swapped into counts() (document ids are then
+    * local to the shard; see first_entity), and writes the result back.
+    * The step may run any kernel that works on a state, e.g.
+    * kernels::lda_crp_gibbs.
+    */
+    void
+    sweep(const std::function<void(state &, size_t)> &step);
+
+    /**
+    * Reads shard `shard` as of the last complete sweep.
+    */
+    document_shard
+    load(size_t shard) const;
+
+    /**
+    * Recounts the dish counts from the shards on disk and checks them
+    * against counts().
+    */
+    void
+    validate() const;
+
+    inline state &counts() { return *counts_; }
+
+    inline const state &counts() const { return *counts_; }
+
+    inline const std::string &dir() const { return dir_; }
+
+    inline size_t nshards() const { return first_.size() - 1; }
+
+    inline size_t nentities() const { return first_.back(); }
+
+    inline size_t first_entity(size_t shard) const { return first_[shard]; }
+
+    inline size_t nentities(size_t shard) const { return first_[shard + 1] - first_[shard]; }
+
+    // Complete sweeps and appends so far.
+    inline size_t generation() const { return generation_; }
+
+private:
+    shard_stream(const std::string &dir, size_t prefetch);
+
+    // Each shard has two files and is read from one and written to the
+    // other; copy is 0 or 1.
+    std::string
+    shard_path(size_t shard, size_t copy) const;
+
+    // Writes the counts file, which records the shards and their current
+    // files, and renames it into place.
+    void
+    commit();
+
+    std::string dir_;
+    size_t prefetch_;
+    std::shared_ptr<state> counts_;
+    size_t generation_;
+    std::vector<size_t> first_; //!< First document of each shard, then the total
+    std::vector<size_t> copy_; //!< File holding the current version of each shard
+};
+
+} // namespace lda
+} // namespace microscopes
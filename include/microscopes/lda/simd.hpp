@@ -0,0 +1,70 @@
+#pragma once
+
+#include <microscopes/common/assert.hpp>
+
+#include <stddef.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace lda_util {
+
+    /**
+    * Replaces log weights with the running sums of exp(w[i] - max(w)),
+    * computing the max, the exponentials and the sums with AVX2 or SSE4.1
+    * when the build enables them. Entries of -inf add nothing. Returns the
+    * total, which is 0 (with every sum 0) when all entries are -inf.
+    */
+    float
+    exp_cumsum(float *w, size_t n);
+
+    /**
+    * Replaces non-negative weights with their running sums; returns the
+    * total.
+    */
+    float
+    cumsum(float *w, size_t n);
+
+    /**
+    * Index of the first running sum above u (a draw from [0, total)),
+    * never one whose weight is zero.
+    */
+    inline size_t
+    find_cumulative(const float *c, size_t n, float u){
+        size_t i = std::upper_bound(c, c + n, u) - c;
+        if(i == n){
+            // u rounded up to the total: take the last entry with weight.
+            i = std::lower_bound(c, c + n, c[n - 1]) - c;
+        }
+        return i;
+    }
+
+    /**
+    * Draws an index with probability proportional to exp(log_w[i]),
+    * without normalizing. log_w is overwritten with running sums. Throws
+    * if no entry has weight.
+    */
+    template<class RNG>
+    size_t
+    sample_log_weights(std::vector<float> &log_w, RNG &rng){
+        float total = exp_cumsum(log_w.data(), log_w.size());
+        MICROSCOPES_CHECK(total > 0, "no entry has weight");
+        float u = std::uniform_real_distribution<float>(0, total)(rng);
+        return find_cumulative(log_w.data(), log_w.size(), u);
+    }
+
+    /**
+    * Draws an index with probability proportional to w[i], without
+    * normalizing. w is overwritten with running sums. Throws if no entry
+    * has weight.
+    */
+    template<class RNG>
+    size_t
+    sample_weights(std::vector<float> &w, RNG &rng){
+        float total = cumsum(w.data(), w.size());
+        MICROSCOPES_CHECK(total > 0, "no entry has weight");
+        float u = std::uniform_real_distribution<float>(0, total)(rng);
+        return find_cumulative(w.data(), w.size(), u);
+    }
+
+}
@@ -1,6 +1,14 @@
 #pragma once
 
+#include <microscopes/common/assert.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <math.h>
+#include <random>
+#include <stdint.h>
+#include <utility>
 #include <vector>
 #include <set>
 
@@ -70,53 +78,683 @@ namespace lda_util {
         vec /= vec.sum();
     }
 
-    template<class T, class J>
-    class defaultdict{
-        J default_value;
-        std::map<T, J> map;
+    /**
+    * The digamma function for x > 0: the recurrence psi(x) = psi(x + 1) - 1/x
+    * up to x >= 6, then the asymptotic series, accurate to about 1e-12.
+    */
+    inline double
+    digamma(double x){
+        double ret = 0;
+        for(; x < 6; x += 1){
+            ret -= 1 / x;
+        }
+        const double r = 1 / (x * x);
+        return ret + log(x) - 0.5 / x
+            - r * (1.0 / 12 - r * (1.0 / 120 - r * (1.0 / 252 - r * (1.0 / 240 - r / 132))));
+    }
+
+    /**
+    * Non-owning view of a contiguous range of elements.
+    */
+    template<class T>
+    class array_view{
+        T *data_;
+        size_t size_;
     public:
-        defaultdict(J val){
-            default_value = val;
-            map = std::map<T, J>();
+        array_view(T *data, size_t size)
+            : data_(data), size_(size) {}
+
+        inline size_t size() const { return size_; }
+
+        inline bool empty() const { return size_ == 0; }
+
+        inline T &operator[](size_t i) const { return data_[i]; }
+
+        inline T *begin() const { return data_; }
+
+        inline T *end() const { return data_ + size_; }
+    };
+
+    /**
+    * Ragged two dimensional array held as one contiguous array of values
+    * plus row offsets (CSR layout). Rows are read through array_views.
+    */
+    template<class T>
+    class ragged_array{
+        std::vector<size_t> offsets_;
+        std::vector<T> values_;
+    public:
+        template<class U>
+        ragged_array(const std::vector<std::vector<U>> &nested)
+            : offsets_(), values_()
+        {
+            offsets_.reserve(nested.size() + 1);
+            offsets_.push_back(0);
+            for(auto &row: nested){
+                offsets_.push_back(offsets_.back() + row.size());
+            }
+            values_.reserve(offsets_.back());
+            for(auto &row: nested){
+                for(auto x: row){
+                    values_.push_back(static_cast<T>(x));
+                }
+            }
+        }
+
+        ragged_array(std::vector<size_t> &&offsets, std::vector<T> &&values)
+            : offsets_(std::move(offsets)), values_(std::move(values))
+        {
+            MICROSCOPES_CHECK(!offsets_.empty() && offsets_.back() == values_.size(),
+                "offsets do not match values");
         }
 
-        J get(T t) {
-            if(map.count(t) > 0){
-                return map[t];
+        inline size_t size() const { return offsets_.size() - 1; }
+
+        inline size_t total_size() const { return values_.size(); }
+
+        inline const std::vector<size_t> &offsets() const { return offsets_; }
+
+        inline const std::vector<T> &values() const { return values_; }
+
+        inline size_t row_size(size_t i) const { return offsets_[i + 1] - offsets_[i]; }
+
+        inline array_view<const T> operator[](size_t i) const {
+            return array_view<const T>(values_.data() + offsets_[i], row_size(i));
+        }
+    };
+
+    /**
+    * Histogram of (key, count) pairs held in one contiguous vector in
+    * ascending key order. Lookups are a binary search, so a table with
+    * many distinct words costs O(log n) per word; adding or erasing a key
+    * shifts the entries after it, a memmove of 8-byte pairs. Keys whose
+    * count drops to zero are erased, so iteration only visits keys that
+    * are present.
+    */
+    template<class K, class C>
+    class histogram{
+        typedef std::pair<K, C> entry;
+        std::vector<entry> entries_;
+
+        static inline bool key_less(const entry &e, K key) { return e.first < key; }
+
+        inline typename std::vector<entry>::iterator find(K key) {
+            return std::lower_bound(entries_.begin(), entries_.end(), key, key_less);
+        }
+
+        inline typename std::vector<entry>::const_iterator find(K key) const {
+            return std::lower_bound(entries_.begin(), entries_.end(), key, key_less);
+        }
+    public:
+        typedef typename std::vector<entry>::const_iterator const_iterator;
+
+        C
+        get(K key) const {
+            auto it = find(key);
+            return it != entries_.end() && it->first == key ? it->second : 0;
+        }
+
+        void
+        incr(K key, C by = 1){
+            auto it = find(key);
+            if(it != entries_.end() && it->first == key){
+                it->second += by;
             }
             else{
-                return default_value;
+                entries_.insert(it, entry(key, by));
             }
         }
 
         void
-        set(T t, J j){
-            map[t] = j;
+        decr(K key, C by = 1){
+            auto it = find(key);
+            MICROSCOPES_DCHECK(it != entries_.end() && it->first == key && it->second >= by,
+                "histogram count below zero");
+            it->second -= by;
+            if(it->second == 0){
+                entries_.erase(it);
+            }
+        }
+
+        // Drops every key, keeping the storage.
+        inline void clear() { entries_.clear(); }
+
+        inline size_t size() const { return entries_.size(); }
+
+        inline bool empty() const { return entries_.empty(); }
+
+        inline const_iterator begin() const { return entries_.begin(); }
+
+        inline const_iterator end() const { return entries_.end(); }
+    };
+
+    /**
+    * Dense row-major matrix of counts (e.g. dish x word). The number of
+    * columns is fixed at construction; rows are added as they are needed.
+    */
+    template<class T>
+    class count_matrix{
+        size_t ncols_;
+        std::vector<T> data_;
+    public:
+        count_matrix(size_t ncols)
+            : ncols_(ncols), data_() {}
+
+        inline size_t nrows() const { return data_.size() / ncols_; }
+
+        inline size_t ncols() const { return ncols_; }
+
+        void
+        resize(size_t nrows){
+            data_.resize(nrows * ncols_, 0);
+        }
+
+        inline T &operator()(size_t row, size_t col) { return data_[row * ncols_ + col]; }
+
+        inline const T &operator()(size_t row, size_t col) const { return data_[row * ncols_ + col]; }
+
+        inline const T *row(size_t row) const { return data_.data() + row * ncols_; }
+
+        inline T *row(size_t row) { return data_.data() + row * ncols_; }
+    };
+
+    /**
+    * Table of f(n + offset) for integer n. Used to replace transcendental
+    * calls on (count + hyperparameter) arguments in the samplers. Lookups
+    * only read, so they can be made from several threads; the owner
+    * grows the table with reserve() before it is asked for larger n, and
+    * reset() discards the values when the offset changes.
+    */
+    class cached_function{
+        float (*f_)(float);
+        float offset_;
+        std::vector<float> values_;
+
+        // Kept out of line so that reserve() stays small enough to be
+        // inlined into the count updates.
+        __attribute__((noinline)) void
+        grow(size_t n){
+            size_t size = std::max(n + 1, 2 * values_.size());
+            values_.reserve(size);
+            for(size_t i = values_.size(); i < size; i++){
+                values_.push_back(f_(i + offset_));
+            }
+        }
+    public:
+        cached_function(float (*f)(float), float offset = 0)
+            : f_(f), offset_(offset), values_() {}
+
+        inline float operator()(size_t n) const {
+            MICROSCOPES_DCHECK(n < values_.size(), "cached_function not reserved for n");
+            return values_[n];
+        }
+
+        inline size_t size() const { return values_.size(); }
+
+        inline float offset() const { return offset_; }
+
+        // Fills the table up to n.
+        inline void
+        reserve(size_t n){
+            if(n >= values_.size()) grow(n);
+        }
+
+        void
+        reset(float offset){
+            offset_ = offset;
+            values_.clear();
+        }
+    };
+
+    /**
+    * Walker alias table over a fixed set of weights; draws an index in
+    * proportion to its weight in O(1).
+    */
+    class alias_table{
+        std::vector<float> prob_;
+        std::vector<uint32_t> alias_;
+        double total_;
+    public:
+        alias_table() : prob_(), alias_(), total_(0) {}
+
+        void
+        build(const std::vector<float> &weights){
+            size_t n = weights.size();
+            prob_.assign(n, 1);
+            alias_.resize(n);
+            total_ = 0;
+            for(auto w: weights) total_ += w;
+            if(n == 0 || total_ <= 0) return;
+            std::vector<uint32_t> small, large;
+            std::vector<double> scaled(n);
+            for(size_t i = 0; i < n; i++){
+                alias_[i] = i;
+                scaled[i] = weights[i] * n / total_;
+                (scaled[i] < 1 ? small : large).push_back(i);
+            }
+            while(!small.empty() && !large.empty()){
+                uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                prob_[s] = scaled[s];
+                alias_[s] = l;
+                scaled[l] -= 1 - scaled[s];
+                if(scaled[l] < 1){
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // Whatever is left over is 1 up to rounding.
+        }
+
+        template<class RNG>
+        size_t
+        sample(RNG &rng) const {
+            size_t i = std::uniform_int_distribution<size_t>(0, prob_.size() - 1)(rng);
+            return std::uniform_real_distribution<float>(0, 1)(rng) < prob_[i] ? i : alias_[i];
+        }
+
+        inline double total() const { return total_; }
+
+        inline size_t size() const { return prob_.size(); }
+
+        inline bool empty() const { return prob_.empty(); }
+    };
+
+    /**
+    * Set of active ids, iterated in ascending order. Membership is a flag
+    * lookup and freed ids wait on a min-heap, so create() hands out the
+    * smallest free id in O(log n) without scanning. The ascending dense
+    * array is updated with a binary search and a shift of its tail, so
+    * create(), insert() and erase() are O(n) in the number of active ids,
+    * a memmove of at most n words. The kernels index this array with
+    * their draws, so keeping it sorted makes a chain depend only on the
+    * assignments and the random state, not on the history of create()
+    * and erase(). A swap-remove array with O(1) updates cannot keep that
+    * order, and sorting it lazily on read gains nothing, since the
+    * samplers read the ids right after each change, and is not safe for
+    * the threads that read a state's ids concurrently.
+    */
+    class id_set{
+        std::vector<size_t> ids_;
+        std::vector<char> active_;
+        std::vector<size_t> free_; // min-heap; may hold ids inserted since
+        size_t stale_ = 0; // how many of those there are
+
+        inline void activate(size_t id){
+            active_[id] = 1;
+            ids_.insert(std::lower_bound(ids_.begin(), ids_.end(), id), id);
+        }
+
+        // Every id below the capacity can be free and insert() leaves at
+        // most as many stale entries again, so once the heap has this much
+        // room erase() does not allocate.
+        inline void reserve_free(){
+            if(free_.capacity() < 2 * active_.size()) free_.reserve(2 * active_.capacity());
         }
 
+        // Rebuilds the heap from the flags. An ascending array is already
+        // a min-heap.
         void
-        incr(T t, J by){
-            if(map.count(t) > 0){
-                map[t] += by;
+        drop_stale(){
+            free_.clear();
+            for(size_t id = 0; id < active_.size(); id++){
+                if(!active_[id]) free_.push_back(id);
+            }
+            stale_ = 0;
+        }
+    public:
+        typedef std::vector<size_t>::const_iterator const_iterator;
+
+        size_t
+        create(){
+            // insert() leaves its id on the heap; such entries are dropped here.
+            while(!free_.empty() && contains(free_.front())){
+                std::pop_heap(free_.begin(), free_.end(), std::greater<size_t>());
+                free_.pop_back();
+                stale_--;
+            }
+            size_t id;
+            if(free_.empty()){
+                id = active_.size();
+                active_.push_back(0);
+                reserve_free();
             }
             else{
-                map[t] = by + default_value;
+                std::pop_heap(free_.begin(), free_.end(), std::greater<size_t>());
+                id = free_.back();
+                free_.pop_back();
+            }
+            activate(id);
+            return id;
+        }
+
+        // Activates a specific id; ids skipped over become free. The id
+        // itself stays on the heap until create() reaches it, or until
+        // there are more such entries than ids and the heap is rebuilt.
+        void
+        insert(size_t id){
+            while(active_.size() <= id){
+                free_.push_back(active_.size());
+                std::push_heap(free_.begin(), free_.end(), std::greater<size_t>());
+                active_.push_back(0);
             }
+            reserve_free();
+            MICROSCOPES_DCHECK(!contains(id), "id is already active");
+            activate(id);
+            if(++stale_ > active_.size()) drop_stale();
         }
 
+        // Replaces the contents with the ascending `ids`, all below
+        // `capacity`; the other ids below it are free.
         void
-        decr(T t, J by){
-            if(map.count(t) > 0){
-                map[t] -= by;
+        assign(const std::vector<size_t> &ids, size_t capacity){
+            MICROSCOPES_DCHECK(std::is_sorted(ids.begin(), ids.end()), "ids are not ascending");
+            ids_ = ids;
+            active_.assign(capacity, 0);
+            for(auto id: ids_){
+                MICROSCOPES_DCHECK(id < capacity, "id out of range");
+                MICROSCOPES_DCHECK(!active_[id], "duplicate id");
+                active_[id] = 1;
+            }
+            reserve_free();
+            drop_stale();
+        }
+
+        void
+        erase(size_t id){
+            MICROSCOPES_DCHECK(contains(id), "id is not active");
+            active_[id] = 0;
+            ids_.erase(std::lower_bound(ids_.begin(), ids_.end(), id));
+            free_.push_back(id);
+            std::push_heap(free_.begin(), free_.end(), std::greater<size_t>());
+        }
+
+        inline bool contains(size_t id) const {
+            return id < active_.size() && active_[id];
+        }
+
+        inline size_t size() const { return ids_.size(); }
+
+        // One past the largest id ever handed out.
+        inline size_t capacity() const { return active_.size(); }
+
+        inline size_t operator[](size_t i) const { return ids_[i]; }
+
+        inline const std::vector<size_t> &ids() const { return ids_; }
+
+        inline const_iterator begin() const { return ids_.begin(); }
+
+        inline const_iterator end() const { return ids_.end(); }
+    };
+
+    /**
+    * Tables of the tokens of one document stored as runs of a repeated
+    * word (see microscopes::lda::corpus). Each run is covered by
+    * (table, length) segments in token order, neighbouring segments of a
+    * run having different tables, so a run whose copies share a table is
+    * one segment however long it is. Each run keeps its segments in a
+    * window of slots of its own, so moving tokens only shifts segments of
+    * the same run; a full window is moved to the end with twice the room,
+    * and the slots left behind are reclaimed once they are half of all.
+    */
+    class run_tables{
+    public:
+        typedef std::pair<uint32_t, uint32_t> segment; // (table, number of tokens)
+
+        run_tables() : first_(), capacity_(), nsegments_(), slots_(), total_(0), unused_(0) {}
+
+        // Every token at table 0, for runs of count(0), ..., count(nruns - 1) tokens.
+        template<class Count>
+        run_tables(size_t nruns, Count count)
+            : first_(nruns), capacity_(nruns, 1), nsegments_(nruns, 1), slots_(nruns), total_(nruns), unused_(0)
+        {
+            for(size_t r = 0; r < nruns; ++r){
+                first_[r] = r;
+                slots_[r] = segment(0, count(r));
+            }
+        }
+
+        inline size_t nruns() const { return nsegments_.size(); }
+
+        inline size_t nsegments() const { return total_; }
+
+        inline size_t nsegments(size_t r) const { return nsegments_[r]; }
+
+        // Slots allocated for segments, in use or not.
+        inline size_t nslots() const { return slots_.size(); }
+
+        inline array_view<const segment> run(size_t r) const {
+            return array_view<const segment>(slots_.data() + first_[r], nsegments_[r]);
+        }
+
+        // Replaces the segments of run r, which must cover its tokens.
+        template<class It>
+        void
+        assign_run(size_t r, It begin, It end){
+            const size_t n = end - begin;
+            if(n > capacity_[r]) grow(r, n);
+            total_ += n - nsegments_[r];
+            nsegments_[r] = n;
+            std::copy(begin, end, slots_.begin() + first_[r]);
+        }
+
+        // Replaces the segments of run r with the tables of its n tokens,
+        // tables[0], ..., tables[n - 1].
+        void
+        assign_tables(size_t r, const uint32_t *tables, size_t n){
+            size_t nsegments = n > 0;
+            for(size_t i = 1; i < n; ++i) nsegments += tables[i] != tables[i - 1];
+            if(nsegments > capacity_[r]) grow(r, nsegments);
+            total_ += nsegments - nsegments_[r];
+            nsegments_[r] = nsegments;
+            size_t j = first_[r];
+            for(size_t i = 0; i < n; ++i){
+                if(i > 0 && tables[i] == tables[i - 1]) slots_[j - 1].second += 1;
+                else slots_[j++] = segment(tables[i], 1);
+            }
+        }
+
+        // Table of token pos of run r.
+        inline uint32_t table(size_t r, size_t pos) const {
+            size_t i = first_[r];
+            while(pos >= slots_[i].second) pos -= slots_[i++].second;
+            return slots_[i].first;
+        }
+
+        // Moves token pos of run r to table t.
+        void
+        set_table(size_t r, size_t pos, uint32_t t){
+            size_t i = first_[r];
+            while(pos >= slots_[i].second) pos -= slots_[i++].second;
+            const uint32_t old = slots_[i].first, n = slots_[i].second;
+            if(old == t) return;
+            const bool prev_t = i > first_[r] && slots_[i - 1].first == t;
+            const bool next_t = i + 1 < first_[r] + nsegments_[r] && slots_[i + 1].first == t;
+            if(n == 1){
+                if(prev_t && next_t){
+                    slots_[i - 1].second += 1 + slots_[i + 1].second;
+                    erase(r, i, 2);
+                }
+                else if(prev_t){
+                    slots_[i - 1].second += 1;
+                    erase(r, i, 1);
+                }
+                else if(next_t){
+                    slots_[i + 1].second += 1;
+                    erase(r, i, 1);
+                }
+                else{
+                    slots_[i].first = t;
+                }
+            }
+            else if(pos == 0){
+                slots_[i].second -= 1;
+                if(prev_t) slots_[i - 1].second += 1;
+                else slots_[insert(r, i, 1)] = segment(t, 1);
+            }
+            else if(pos == n - 1){
+                slots_[i].second -= 1;
+                if(next_t) slots_[i + 1].second += 1;
+                else slots_[insert(r, i + 1, 1)] = segment(t, 1);
             }
             else{
-                map[t] = default_value - by;
+                const size_t j = insert(r, i + 1, 2);
+                slots_[j - 1].second = pos;
+                slots_[j] = segment(t, 1);
+                slots_[j + 1] = segment(old, n - pos - 1);
+            }
+        }
+
+        // Moves n tokens of run r from table `from` to table `to`. The
+        // tokens of a run are copies of one word, so which ones move does
+        // not matter: they are taken from the last segments at `from`
+        // and added to the last segment at `to`, or a new segment at the
+        // end of the run.
+        void
+        move(size_t r, uint32_t from, uint32_t to, uint32_t n){
+            if(from == to || n == 0) return;
+            for(size_t i = nsegments_[r]; n > 0;){
+                MICROSCOPES_DCHECK(i > 0, "too few tokens at the table");
+                if(slots_[first_[r] + --i].first != from) continue;
+                const uint32_t taken = std::min(n, slots_[first_[r] + i].second);
+                slots_[first_[r] + i].second -= taken;
+                n -= taken;
+                add(r, to, taken);
+                if(slots_[first_[r] + i].second == 0) remove_empty(r, first_[r] + i);
+            }
+        }
+
+        // Appends the table of every token, in order.
+        void
+        expand(std::vector<size_t> &tables) const {
+            for(size_t r = 0; r < nruns(); ++r){
+                for(auto &s : run(r)) tables.insert(tables.end(), s.second, s.first);
+            }
+        }
+
+    private:
+        // Adds n tokens at table t to run r.
+        void
+        add(size_t r, uint32_t t, uint32_t n){
+            const size_t begin = first_[r], end = begin + nsegments_[r];
+            for(size_t i = end; i > begin; --i){
+                if(slots_[i - 1].first == t){
+                    slots_[i - 1].second += n;
+                    return;
+                }
+            }
+            if(end > begin && slots_[end - 1].second == 0){
+                slots_[end - 1] = segment(t, n);
+                return;
+            }
+            slots_[insert(r, end, 1)] = segment(t, n);
+        }
+
+        // Drops the segment at slot i of run r, now empty, merging its
+        // neighbours if they are at the same table.
+        void
+        remove_empty(size_t r, size_t i){
+            const size_t begin = first_[r], end = begin + nsegments_[r];
+            if(i > begin && i + 1 < end && slots_[i - 1].first == slots_[i + 1].first){
+                slots_[i - 1].second += slots_[i + 1].second;
+                erase(r, i, 2);
+            }
+            else if(end - begin > 1){
+                erase(r, i, 1);
+            }
+        }
+
+        // Opens n slots before slot i of run r; returns the first, which
+        // differs from i if the run had to move.
+        size_t
+        insert(size_t r, size_t i, size_t n){
+            if(nsegments_[r] + n > capacity_[r]){
+                const size_t offset = i - first_[r];
+                grow(r, nsegments_[r] + n);
+                i = first_[r] + offset;
+            }
+            auto end = slots_.begin() + first_[r] + nsegments_[r];
+            std::copy_backward(slots_.begin() + i, end, end + n);
+            nsegments_[r] += n;
+            total_ += n;
+            return i;
+        }
+
+        void
+        erase(size_t r, size_t i, size_t n){
+            auto end = slots_.begin() + first_[r] + nsegments_[r];
+            std::copy(slots_.begin() + i + n, end, slots_.begin() + i);
+            nsegments_[r] -= n;
+            total_ -= n;
+        }
+
+        // Moves run r to a window of at least n slots at the end.
+        void
+        grow(size_t r, size_t n){
+            if(2 * unused_ > slots_.size()) compact();
+            const size_t capacity = std::max(n, 2 * size_t(capacity_[r]));
+            const size_t first = slots_.size();
+            slots_.resize(first + capacity);
+            std::copy(slots_.begin() + first_[r], slots_.begin() + first_[r] + nsegments_[r], slots_.begin() + first);
+            unused_ += capacity_[r];
+            first_[r] = first;
+            capacity_[r] = capacity;
+        }
+
+        // Drops the windows left behind by grow.
+        void
+        compact(){
+            std::vector<segment> slots;
+            slots.reserve(slots_.size() - unused_);
+            for(size_t r = 0; r < nruns(); ++r){
+                const size_t first = slots.size();
+                slots.insert(slots.end(), slots_.begin() + first_[r], slots_.begin() + first_[r] + capacity_[r]);
+                first_[r] = first;
             }
+            slots_.swap(slots);
+            unused_ = 0;
         }
 
-        bool
-        contains(T t){
-            return map.count(t) > 0;
+        std::vector<uint32_t> first_; // first slot of each run's window
+        std::vector<uint32_t> capacity_; // slots in each run's window
+        std::vector<uint32_t> nsegments_;
+        std::vector<segment> slots_;
+        size_t total_;
+        size_t unused_; // slots in windows left behind by grow
+    };
+
+    /**
+    * Count of changes to an object, for caches of values derived from it
+    * that are kept elsewhere. Each instance, including every copy, also
+    * gets an id of its own, so an equal value() means the very same
+    * object with no change since.
+    */
+    class modification_stamp{
+        static inline uint64_t
+        next_id(){
+            static std::atomic<uint64_t> last(0);
+            return ++last;
         }
+    public:
+        typedef std::pair<uint64_t, uint64_t> value_type; // (id, count)
+
+        modification_stamp() : id_(next_id()), count_(0) {}
+
+        modification_stamp(const modification_stamp &) : id_(next_id()), count_(0) {}
+
+        modification_stamp &
+        operator=(const modification_stamp &){
+            id_ = next_id();
+            count_ = 0;
+            return *this;
+        }
+
+        inline void touch() { count_ += 1; }
+
+        inline value_type value() const { return value_type(id_, count_); }
+
+    private:
+        uint64_t id_;
+        uint64_t count_;
     };
-}
\ No newline at end of file
+}
@@ -1,5 +1,30 @@
+from libc.stddef cimport size_t
+from libcpp.vector cimport vector
+
 from _model_h cimport state
 from microscopes.common._random_fwd_h cimport rng_t
 
 cdef extern from "microscopes/lda/kernels.hpp":
-    void lda_crp_gibbs  "microscopes::kernels::lda_crp_gibbs" (state &, rng_t &)
\ No newline at end of file
+    cdef cppclass workspace "microscopes::kernels::lda_crp::workspace":
+        pass
+
+# Document, run and position within the run.
+ctypedef void (*token_sampler)(state &, size_t, size_t, size_t, rng_t &, workspace &)
+
+cdef extern from "microscopes/lda/kernels.hpp":
+    void sampling_t "microscopes::kernels::lda_crp::sampling_t" (state &, size_t, size_t, size_t, rng_t &, workspace &)
+    void sampling_t_sparse "microscopes::kernels::lda_crp::sampling_t_sparse" (state &, size_t, size_t, size_t, rng_t &, workspace &)
+    void sampling_t_run "microscopes::kernels::lda_crp::sampling_t_run" (state &, size_t, size_t, size_t, rng_t &, workspace &)
+    void lda_crp_gibbs  "microscopes::kernels::lda_crp_gibbs" (state &, rng_t &, token_sampler, size_t)
+    void lda_crp_mh  "microscopes::kernels::lda_crp_mh" (state &, rng_t &, size_t)
+    void lda_direct_gibbs  "microscopes::kernels::lda_direct_gibbs" (state &, rng_t &)
+
+cdef extern from "microscopes/lda/kernels.hpp":
+    cdef cppclass split_merge_stats "microscopes::kernels::lda_crp::split_merge_stats":
+        size_t nsplits_proposed
+        size_t nsplits_accepted
+        size_t nmerges_proposed
+        size_t nmerges_accepted
+        vector[size_t] ntopics
+
+    void split_merge "microscopes::kernels::lda_crp::split_merge" (state &, rng_t &, size_t, split_merge_stats &)
@@ -1,13 +1,27 @@
 from libcpp.vector cimport vector
 from libcpp.map cimport map
+from libcpp.utility cimport pair
 from libcpp.string cimport string
 from libc.stddef cimport size_t
 
 from microscopes.common._rng cimport rng
 from microscopes.lda._model_h cimport (
     state as c_state,
+    frozen_model as c_frozen_model,
     initialize as c_initialize,
     initialize_explicit as c_initialize_explicit,
+    initialize_corpus as c_initialize_corpus,
+    corpus_file as c_corpus_file,
+    corpus_format,
+    ldac_format,
+    tokens_format,
+    read_corpus as c_read_corpus,
+    parse_corpus as c_parse_corpus,
+    corpus_from_counts as c_corpus_from_counts,
+    load_snapshot as c_load_snapshot,
+    checkpointer as c_checkpointer,
+    load_checkpoint as c_load_checkpoint,
+    online_hdp as c_online_hdp,
 )
 from microscopes._shared_ptr_h cimport shared_ptr
 from microscopes.lda.definition cimport model_definition
@@ -22,6 +36,17 @@ cdef class state:
     cdef shared_ptr[c_state] _thisptr
     cdef model_definition _defn
     cdef _vocab
-    cdef vector[vector[size_t]] _data
     cdef float vocab_hp
-    cdef dict dish_hps
\ No newline at end of file
+    cdef dict dish_hps
+
+
+cdef class corpus:
+    cdef c_corpus_file _file
+
+
+cdef class checkpointer:
+    cdef c_checkpointer *_thisptr
+
+
+cdef class online_hdp:
+    cdef c_online_hdp *_thisptr
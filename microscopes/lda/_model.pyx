@@ -40,7 +40,10 @@ cdef class state:
         # Save and validate model definition
         self._defn = defn
         self._vocab = vocab
-        self._data = data
+
+        if kwargs.get('_restored'):
+            # Filled in by _wrap_state.
+            return
         validator.validate_len(data, defn.n, "data")
 
         for doc in data:
@@ -92,8 +95,48 @@ cdef class state:
             raise NotImplementedError(("Specify either: (1) initial_dishes or"
                 "(2) table_assignments and dish_assignments."))
 
-    def perplexity(self):
-        return self._thisptr.get().perplexity()
+    def perplexity(self, nthreads=1):
+        """Training perplexity, evaluated on `nthreads` threads.
+        """
+        return self._thisptr.get().perplexity(nthreads)
+
+    def heldout_log_likelihood(self, docs, rng r, nsamples=100, burnin=50, nthreads=1):
+        """Estimate log p(second half | first half) of held-out documents
+
+        Document completion (Wallach et al. 2009) against a frozen copy of
+        the current topics: the topics of the first half of each document
+        are Gibbs sampled for `burnin` sweeps and the likelihood of the
+        second half is averaged over the next `nsamples` sweeps. Runs on
+        `nthreads` threads; the result does not depend on their number.
+
+        Parameters
+        ----------
+        docs : list of documents, each a list of words from the vocabulary
+        r : rng
+        nsamples : int, optional
+        burnin : int, optional
+        nthreads : int, optional
+
+        Returns
+        -------
+        list with one log likelihood per document
+        """
+        cdef vector[vector[size_t]] numeric_docs = self._numeric_docs(docs)
+        cdef c_frozen_model *model = new c_frozen_model(self._thisptr.get()[0])
+        try:
+            return model.heldout_log_likelihood(numeric_docs, nsamples, burnin,
+                                                r._thisptr[0], nthreads)
+        finally:
+            del model
+
+    def _numeric_docs(self, docs):
+        """Documents of vocabulary words as lists of word ids.
+        """
+        word_to_int = {word: num for num, word in self._vocab.iteritems()}
+        try:
+            return [[word_to_int[word] for word in doc] for doc in docs]
+        except KeyError as e:
+            raise ValueError("Word not in vocabulary: {}".format(e.args[0]))
 
     def nentities(self):
         """Get number of entities/documents in model.
@@ -186,7 +229,8 @@ cdef class state:
         """Serialize state object as a string
         """
         proto_lda = LdaModelState()
-        flat, indices = utils.ragged_array_to_row_major_form(self._data)
+        flat, indices = utils.ragged_array_to_row_major_form(
+            self._thisptr.get().documents())
         proto_lda.docs.extend(flat)
         proto_lda.doc_index.extend(indices)
         proto_lda.alpha = self.dish_hps['alpha']
@@ -200,6 +244,15 @@ cdef class state:
         proto_lda.dish_assignment_index.extend(indices)
         return proto_lda.SerializeToString()
 
+    def save_snapshot(self, path, counts=True):
+        """Write the state to `path` in the binary snapshot format
+
+        Much faster than `serialize` for large states. With `counts` the
+        dish and table counts are stored as well, so that `load_snapshot`
+        does not recount them. The vocabulary is not stored.
+        """
+        self._thisptr.get().save_snapshot(path.encode('utf-8'), counts)
+
     def __reduce__(self):
         return (_reconstruct_state, (self._defn, self.serialize()))
 
@@ -223,7 +276,7 @@ cdef class state:
 
         doc_topic_distribution = self.topic_distribution_by_document()
 
-        doc_lengths = [len(doc) for doc in self._data]
+        doc_lengths = [len(doc) for doc in self._thisptr.get().documents()]
         vocab = [self._vocab[k] for k in sorted_num_vocab]
 
         ctr = self._corpus_term_id_frequency()
@@ -237,12 +290,12 @@ cdef class state:
 
     def _corpus_term_id_frequency(self):
         flatten = lambda l: list(itertools.chain.from_iterable(l))
-        ctr = Counter(flatten(self._data))
+        ctr = Counter(flatten(self._thisptr.get().documents()))
         return ctr
 
     def _corpus_term_frequency(self):
         flatten = lambda l: list(itertools.chain.from_iterable(l))
-        flat_data = flatten(self._data)
+        flat_data = flatten(self._thisptr.get().documents())
         flat_vocab = [self._vocab[tid] for tid in flat_data]
         ctr = Counter(flat_vocab)
         return ctr
@@ -276,44 +329,38 @@ cdef class state:
             (1 - weight) * np.log(phi_kw / p_w)
 
 
-    def predict(self, data, prng, max_iter=20, tol=1e-16):
+    def predict(self, data, prng, max_iter=20, tol=1e-16, nthreads=1):
         """Predict topic distributions for documents
 
-        Based on ariddell's implementation of the iterated pseudo-counts
-        method in Wallach et al. (2009).
+        Iterated pseudo-counts method of Wallach et al. (2009), run in C++
+        against a frozen copy of the current topics, on `nthreads` threads.
 
         cf. https://github.com/ariddell/lda/blob/055f12ed76ac33c43e26b22060e0c6435487eeb7/lda/lda.py#L180-L210
 
         Parameters
         ----------
         data : document or list of documents
+        prng : unused, kept for compatibility
         max_iter : int, optional
             Maximum number of iterations.
         tol: double, optional
             Tolerance value used for stopping
+        nthreads : int, optional
         Returns
         -------
         list of topic distributions for each input document
         """
         if not isinstance(data[0], list):
             data = [data]
-        return [self._predict_single(doc, prng, max_iter, tol) for doc in data]
-
-    def _predict_single(self, doc, prng, max_iter, tol):
-        PZS = np.zeros((len(doc), self.ntopics()))
-        word_dist = self.word_distribution_by_topic()
-        for iteration in range(max_iter + 1): # +1 is for initialization
-            PZS_new = [[d[word] for d in word_dist]
-                        for word in doc]
-            PZS_new = np.array(PZS_new)
-            PZS_new *= (PZS.sum(axis=0) - PZS + self.vocab_hp)
-            PZS_new /= PZS_new.sum(axis=1)[:, np.newaxis] # vector to single column matrix
-            PZS = PZS_new
-            if np.abs(PZS_new - PZS).sum() < tol:
-                break
-        theta_doc = PZS.sum(axis=0) / PZS.sum()
-        assert theta_doc.shape == (self.ntopics(),)
-        return theta_doc.tolist()
+        cdef vector[vector[size_t]] numeric_docs = self._numeric_docs(data)
+        cdef vector[float] theta
+        cdef c_frozen_model *model = new c_frozen_model(self._thisptr.get()[0])
+        try:
+            theta = model.predict(numeric_docs, max_iter, tol, nthreads)
+        finally:
+            del model
+        K = self.ntopics()
+        return np.asarray(theta).reshape(len(data), K).tolist()
 
 def _get_dishes_and_tables(kwargs, data):
     """Extract parameters from kwargs
@@ -347,7 +394,11 @@ def _validate_table_dish_assignment(table_assignments, dish_assignments, data):
         validator.validate_len(table_assignment, len(doc), "table_assignment")
         num_tables.append(max(table_assignment))
     for dish_assignment, num_table in zip(dish_assignments, num_tables):
-        validator.validate_len(dish_assignment, num_table+1, "dish_assignment")
+        # Trailing entries with dish 0 are deleted tables kept for reuse
+        if len(dish_assignment) < num_table + 1:
+            raise ValueError("expected dish_assignment to have at least "
+                             "{} entries, got {}".format(num_table + 1,
+                                                         len(dish_assignment)))
 
 
 def initialize(model_definition defn, data, r=None, **kwargs):
@@ -360,7 +411,9 @@ def initialize(model_definition defn, data, r=None, **kwargs):
     Parameters
     ----------
     defn : model definition object
-    data : a list of list of serializable objects (i.e. 'documents')
+    data : a list of list of serializable objects (i.e. 'documents'), or a
+        `corpus` from `load_corpus` (random assignment only); its
+        vocabulary maps word ids to the term ids of the file
     r : random state (required if specifying initial_dishes
     initial_dishes: maximum number of dishes (topics) for random state initialization (default: 10)
     vocab_hp : parameter on symmetric Dirichlet prior over topic distributions ("beta") (default: 0.5)
@@ -384,10 +437,35 @@ def initialize(model_definition defn, data, r=None, **kwargs):
     """
     if r is not None:
         kwargs['r'] = r
+    if isinstance(data, corpus):
+        return _initialize_corpus(defn, data, **kwargs)
     numeric_docs, vocab_lookup = _initialize_data(data)
     validator.validate_len(vocab_lookup, defn.v, "vocab_lookup")
     return state(defn=defn, data=numeric_docs, vocab=vocab_lookup, **kwargs)
 
+def _initialize_corpus(model_definition defn, corpus data, **kwargs):
+    validator.validate_kwargs(kwargs, ('r', 'dish_hps', 'vocab_hp', 'initial_dishes'))
+    validator.validate_len(data, defn.n, "data")
+    validator.validate_len(data.vocab(), defn.v, "vocab_lookup")
+    if 'r' not in kwargs:
+        raise NotImplementedError("a corpus needs a random state to initialize")
+    dish_hps = kwargs.get('dish_hps', None)
+    if dish_hps is None:
+        dish_hps = {'alpha': 0.1, 'gamma': 0.1}
+    validator.validate_kwargs(dish_hps, ('alpha', 'gamma',))
+    vocab_hp = kwargs.get('vocab_hp', 0.5)
+    validator.validate_positive(vocab_hp)
+    initial_dishes = kwargs.get('initial_dishes', DEFAULT_INITIAL_DISH_HINT)
+    p = c_initialize_corpus(
+        defn=defn._thisptr.get()[0],
+        alpha=dish_hps['alpha'],
+        beta=vocab_hp,
+        gamma=dish_hps['gamma'],
+        initial_dishes=initial_dishes,
+        docs=data._file.docs,
+        rng=(<rng> kwargs['r'])._thisptr[0])
+    return _wrap_state(p, data.vocab())
+
 def _initialize_data(docs):
     """Convert docs (list of list of hashable items) to list of list of
     positive integers and a map from the integers back to the terms
@@ -428,5 +506,248 @@ def deserialize(model_definition defn, bytes):
     return s
 
 
+cdef class corpus:
+    """Documents parsed in C++ by `load_corpus` or `parse_corpus`
+
+    Pass it to `initialize` to build a state without converting the
+    documents to Python lists. Term ids of the file are remapped to word
+    ids 0..V-1 in increasing order; `vocab` maps them back.
+    """
+    def __len__(self):
+        return self._file.docs.get().size()
+
+    def nentities(self):
+        return self._file.docs.get().size()
+
+    def nwords(self):
+        return self._file.nwords()
+
+    def ntokens(self):
+        return self._file.docs.get().ntokens()
+
+    def nruns(self):
+        """Number of runs of a repeated word over all documents.
+        """
+        return self._file.docs.get().nruns()
+
+    def vocab(self):
+        """Dict from word ids to the term ids of the file.
+        """
+        return {i: self._file.terms[i] for i in range(self._file.nwords())}
+
+    def documents(self):
+        """The documents as lists of the file's term ids.
+        """
+        return self._file.documents()
+
+
+_corpus_formats = {'ldac': ldac_format, 'tokens': tokens_format}
+
+
+def _corpus_format(format):
+    if format not in _corpus_formats:
+        raise ValueError("unknown corpus format {}; expected one of {}".format(
+            format, sorted(_corpus_formats)))
+    return _corpus_formats[format]
+
+
+def load_corpus(path, format='ldac', nthreads=1):
+    """Read a corpus file, one document per line, on `nthreads` threads
+
+    Parameters
+    ----------
+    path : file in LDA-C format ('ldac', "M term:count ... term:count"
+        per line) or of whitespace separated term ids ('tokens')
+    format : 'ldac' or 'tokens'
+    nthreads : int, optional
+
+    Returns
+    -------
+    corpus
+    """
+    cdef corpus c = corpus()
+    c._file = c_read_corpus(path.encode('utf-8'), _corpus_format(format), nthreads)
+    return c
+
+
+def parse_corpus(text, format='ldac', nthreads=1):
+    """Like `load_corpus`, for a corpus held in a string.
+    """
+    if isinstance(text, unicode):
+        text = text.encode('utf-8')
+    cdef bytes data = text
+    cdef corpus c = corpus()
+    c._file = c_parse_corpus(data, len(data), _corpus_format(format), nthreads,
+                             b'<corpus>')
+    return c
+
+
+def corpus_from_term_counts(docs):
+    """Build a corpus from (term id, count) pairs per document
+
+    Each pair becomes one run of `count` tokens, so a term repeated many
+    times is never expanded into a list.
+
+    Parameters
+    ----------
+    docs : list of lists or dicts of (term id, count)
+    """
+    cdef vector[vector[pair[size_t, size_t]]] c_docs
+    cdef vector[pair[size_t, size_t]] c_doc
+    for doc in docs:
+        c_doc.clear()
+        items = doc.iteritems() if isinstance(doc, dict) else doc
+        for term, count in items:
+            c_doc.push_back(pair[size_t, size_t](term, count))
+        c_docs.push_back(c_doc)
+    cdef corpus c = corpus()
+    c._file = c_corpus_from_counts(c_docs)
+    return c
+
+
+cdef state _wrap_state(shared_ptr[c_state] p, vocab):
+    cdef model_definition defn = model_definition(p.get().nentities(), p.get().nwords())
+    if vocab is None:
+        vocab = {i: i for i in range(p.get().nwords())}
+    cdef state s = state(defn, [], vocab, _restored=True)
+    s._thisptr = p
+    s.dish_hps = {'alpha': p.get().alpha_, 'gamma': p.get().gamma_}
+    s.vocab_hp = p.get().beta_
+    return s
+
+
+def load_snapshot(path, vocab=None, verify=False):
+    """Restore a state object written by `state.save_snapshot`.
+
+    Parameters
+    ----------
+    path : snapshot file
+    vocab : dict from word ids to the original words (default: word ids
+        map to themselves)
+    verify : recount the stored dish/word counts from the assignments and
+        refuse the file if they differ
+    """
+    return _wrap_state(c_load_snapshot(path.encode('utf-8'), NULL, verify), vocab)
+
+
+cdef class checkpointer:
+    """Writes checkpoints of a running chain to `path`
+
+    A checkpoint is taken by `maybe_save` every `every_iters` iterations
+    and/or every `every_seconds` seconds (0 turns either off). The table
+    and dish assignments are taken on the calling thread and written on a
+    background thread; `path` always holds the latest complete checkpoint.
+    Restore with `load_checkpoint`.
+    """
+    def __cinit__(self, path, every_iters=0, every_seconds=0, counts=True):
+        self._thisptr = new c_checkpointer(path.encode('utf-8'), every_iters,
+                                           every_seconds, counts)
+
+    def __dealloc__(self):
+        del self._thisptr
+
+    def maybe_save(self, state s, rng r, iteration):
+        """Checkpoint after `iteration` (counted from 1) if one is due.
+        """
+        return self._thisptr.maybe_save(s._thisptr.get()[0], r._thisptr[0], iteration)
+
+    def save(self, state s, rng r, iteration):
+        self._thisptr.save(s._thisptr.get()[0], r._thisptr[0], iteration)
+
+    def wait(self):
+        """Wait for the write in progress; raises if it failed.
+        """
+        self._thisptr.wait()
+
+    def nsaved(self):
+        return self._thisptr.nsaved()
+
+
+def load_checkpoint(path, rng r, like=None, into=None):
+    """Restore a chain from a checkpoint written by `checkpointer`.
+
+    Sets `r` to the generator state at the checkpoint and returns the
+    state and the number of iterations done. The vocabulary is taken from
+    the state `like`, if given. If `into` is given, the checkpoint
+    replaces its contents instead, so that every reference to it sees the
+    restored chain, and `into` is returned; it must have the checkpoint's
+    numbers of documents and words.
+    """
+    cdef shared_ptr[c_state] p
+    iteration = c_load_checkpoint(path.encode('utf-8'), p, r._thisptr[0])
+    cdef state s
+    if into is not None:
+        s = into
+        if (p.get().nentities() != s._defn.n or
+                p.get().nwords() != s._defn.v):
+            raise ValueError("{} does not fit the state it is loaded into"
+                             .format(path))
+        s._thisptr = p
+        s.dish_hps = {'alpha': p.get().alpha_, 'gamma': p.get().gamma_}
+        s.vocab_hp = p.get().beta_
+        return s, iteration
+    vocab = None
+    if like is not None:
+        s = like
+        vocab = s._vocab
+    return _wrap_state(p, vocab), iteration
+
+
+def snapshot_from_serialized(model_definition defn, bytes, path, counts=True):
+    """Convert a bytestring from `state.serialize()` (an LdaModelState
+    protobuf) to a snapshot file at `path`.
+    """
+    deserialize(defn, bytes).save_snapshot(path, counts)
+
+
 def _reconstruct_state(defn, bytes):
     return deserialize(defn, bytes)
+
+
+cdef class online_hdp:
+    """Online variational inference for the HDP (Wang, Paisley & Blei 2011)
+
+    For document streams seen once, in mini-batches. `defn.n` is the
+    expected corpus size and documents are lists of word ids below
+    `defn.v`. Topics are truncated at `ntopics` over the corpus and
+    `doc_topics` per document; the t-th update has step size
+    (tau + t) ** -kappa, with kappa in (0.5, 1].
+    """
+    def __cinit__(self, model_definition defn, rng r, ntopics=100,
+                  doc_topics=10, alpha=1.0, eta=0.01, gamma=1.0,
+                  kappa=0.6, tau=64.0):
+        self._thisptr = new c_online_hdp(defn._thisptr.get()[0], ntopics,
+                                         doc_topics, alpha, eta, gamma,
+                                         kappa, tau, r._thisptr[0])
+
+    def __dealloc__(self):
+        del self._thisptr
+
+    def set_e_step(self, max_iter, tol):
+        self._thisptr.set_e_step(max_iter, tol)
+
+    def update(self, docs, nthreads=1):
+        """One step on the mini-batch `docs`; returns the step size.
+        """
+        return self._thisptr.update(docs, nthreads)
+
+    def ntopics(self):
+        return self._thisptr.ntopics()
+
+    def nupdates(self):
+        return self._thisptr.nupdates()
+
+    def topic_weights(self):
+        return list(self._thisptr.topic_weights())
+
+    def topic_distribution_by_document(self, docs, nthreads=1):
+        """Expected topic proportions of each of `docs`, as in
+        `state.topic_distribution_by_document`.
+        """
+        doc_distribution = self._thisptr.document_distribution(docs, nthreads)
+        return [list(d)[1:] for d in doc_distribution]
+
+    def word_distribution_by_topic(self):
+        """Expected distribution over word ids for each topic.
+        """
+        return [dict(d) for d in self._thisptr.word_distribution()]
@@ -1,7 +1,9 @@
 from libcpp.vector cimport vector
 from libcpp.map cimport map
+from libcpp.utility cimport pair
 from libc.stddef cimport size_t
 from libcpp.string cimport string
+from libcpp cimport bool
 
 from microscopes._shared_ptr_h cimport shared_ptr
 from microscopes.common._random_fwd_h cimport rng_t
@@ -12,7 +14,12 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda":
         model_definition(size_t, size_t) except +
 
     cdef cppclass state:
-        double perplexity()
+        float alpha_
+        float beta_
+        float gamma_
+        double perplexity(size_t) except +
+        void save_snapshot(string, bool) except +
+        vector[vector[size_t]] documents()
         size_t nentities()
         size_t ntopics()
         size_t nwords()
@@ -30,6 +37,44 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda":
         float score_data(rng_t &)
 
 
+cdef extern from "microscopes/lda/corpus.hpp" namespace "microscopes::lda":
+    cdef cppclass corpus:
+        size_t size()
+        size_t nruns()
+        size_t ntokens()
+
+    ctypedef shared_ptr[corpus] corpus_ptr "std::shared_ptr<const microscopes::lda::corpus>"
+
+
+cdef extern from "microscopes/lda/corpus_io.hpp" namespace "microscopes::lda":
+    ctypedef enum corpus_format "microscopes::lda::corpus_format":
+        ldac_format "microscopes::lda::corpus_format::ldac"
+        tokens_format "microscopes::lda::corpus_format::tokens"
+
+    cdef cppclass corpus_file:
+        corpus_ptr docs
+        vector[unsigned int] terms
+        size_t nwords()
+        vector[vector[size_t]] documents()
+
+    corpus_file read_corpus(string path, corpus_format, size_t nthreads) except +
+    corpus_file parse_corpus(const char *, size_t, corpus_format, size_t nthreads,
+                             string name) except +
+    corpus_file corpus_from_counts(const vector[vector[pair[size_t, size_t]]] &) except +
+
+
+cdef extern from "microscopes/lda/inference.hpp" namespace "microscopes::lda":
+    cdef cppclass frozen_model:
+        frozen_model(const state &) except +
+        vector[double] heldout_log_likelihood(
+            const vector[vector[size_t]] &docs,
+            size_t nsamples, size_t burnin,
+            rng_t &rng, size_t nthreads) except +
+        vector[float] predict(
+            const vector[vector[size_t]] &docs,
+            size_t max_iter, double tol, size_t nthreads) except +
+
+
 cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda::state":
     shared_ptr[state] \
     initialize(const model_definition &defn,
@@ -38,10 +83,46 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda::state"
         vector[vector[size_t]] &docs,
         rng_t & rng) except +
 
+    shared_ptr[state] \
+    initialize_corpus "microscopes::lda::state::initialize" (
+        const model_definition &defn,
+        float alpha, float beta, float gamma,
+        size_t initial_dishes,
+        const corpus_ptr &docs,
+        rng_t & rng) except +
+
     shared_ptr[state] \
     initialize_explicit "microscopes::lda::state::initialize" (
         const model_definition &defn,
         float alpha, float beta, float gamma,
         const vector[vector[size_t]] &dish_assignments,
         const vector[vector[size_t]] &table_assignments,
-        vector[vector[size_t]] &docs) except +
\ No newline at end of file
+        vector[vector[size_t]] &docs) except +
+
+    shared_ptr[state] \
+    load_snapshot "microscopes::lda::state::load_snapshot" (string path, string *extra, bool verify) except +
+
+
+cdef extern from "microscopes/lda/checkpoint.hpp" namespace "microscopes::lda":
+    cdef cppclass checkpointer:
+        checkpointer(string, size_t, double, bool) except +
+        bool maybe_save(const state &, const rng_t &, size_t) except +
+        void save(const state &, const rng_t &, size_t) except +
+        void wait() except +
+        size_t nsaved()
+
+    size_t load_checkpoint "microscopes::lda::checkpointer::load" (
+        string path, shared_ptr[state] &, rng_t &) except +
+
+
+cdef extern from "microscopes/lda/online_hdp.hpp" namespace "microscopes::lda":
+    cdef cppclass online_hdp:
+        online_hdp(const model_definition &, size_t, size_t, float, float, float,
+                   double, double, rng_t &) except +
+        void set_e_step(size_t, double)
+        double update(const vector[vector[size_t]] &, size_t) except +
+        vector[map[size_t, float]] word_distribution() except +
+        vector[vector[float]] document_distribution(const vector[vector[size_t]] &, size_t) except +
+        vector[float] topic_weights() except +
+        size_t ntopics()
+        size_t nupdates()
@@ -1,3 +1,13 @@
-from microscopes.lda._kernels_h cimport lda_crp_gibbs as c_lda_crp_gibbs
+from microscopes.lda._kernels_h cimport (
+    lda_crp_gibbs as c_lda_crp_gibbs,
+    lda_crp_mh as c_lda_crp_mh,
+    lda_direct_gibbs as c_lda_direct_gibbs,
+    sampling_t as c_sampling_t,
+    sampling_t_sparse as c_sampling_t_sparse,
+    sampling_t_run as c_sampling_t_run,
+    split_merge as c_split_merge,
+    split_merge_stats,
+    token_sampler,
+)
 from microscopes.common._rng cimport rng
 from microscopes.lda._model cimport state
\ No newline at end of file
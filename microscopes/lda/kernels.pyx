@@ -1,10 +1,95 @@
 # cython: embedsignature=True
 
-def lda_crp_gibbs(state s, rng r):
+from microscopes.common import validator
+
+
+def lda_crp_gibbs(state s, rng r, token_kernel='dense', nthreads=1):
     """Gibbs transition kernel for LDA state object. Modifies
     state object in place.
 
     Implementation of "Posterior sampling in the Chinese restaurant
         franchise" as described in Teh et al (2005).
+
+    Parameters
+    ----------
+    token_kernel : 'dense', 'sparse' or 'runs'
+        How each word's table is drawn. 'sparse' splits the probabilities
+        into buckets (after Yao, Mimno & McCallum 2009) so that the cost
+        depends on the topics containing the word rather than on all
+        topics. 'runs' draws all copies of a word in a document together
+        and moves their counts a table at a time. All sample from the same
+        distribution.
+    nthreads : int
+        Number of threads for the word-level step. With more than one,
+        each thread samples its share of the documents against its own
+        copy of the topic counts, which are merged at the end of the step
+        (approximate distributed LDA, Newman et al. 2009), so the chain
+        only approximately targets the posterior.
+    """
+    validator.validate_positive(nthreads, param_name='nthreads')
+    cdef token_sampler sample_token
+    if token_kernel == 'dense':
+        sample_token = c_sampling_t
+    elif token_kernel == 'sparse':
+        sample_token = c_sampling_t_sparse
+    elif token_kernel == 'runs':
+        sample_token = c_sampling_t_run
+    else:
+        raise ValueError("unknown token_kernel: {}".format(token_kernel))
+    c_lda_crp_gibbs(s._thisptr.get()[0], r._thisptr[0], sample_token, nthreads)
+
+
+def lda_crp_mh(state s, rng r, nsteps=2):
+    """Metropolis-Hastings transition kernel for LDA state object.
+    Modifies state object in place.
+
+    Each word is moved by `nsteps` rounds of a document proposal and a
+    word proposal (alias tables built at the start of the sweep), with a
+    Metropolis-Hastings correction, so the cost per word does not grow
+    with the number of topics. Tables are then reassigned to dishes as in
+    `lda_crp_gibbs`.
+    """
+    validator.validate_positive(nsteps, param_name='nsteps')
+    c_lda_crp_mh(s._thisptr.get()[0], r._thisptr[0], nsteps)
+
+
+def lda_direct_gibbs(state s, rng r):
+    """Direct assignment Gibbs kernel for LDA state object (Teh et al
+    (2006), section 5.3). Modifies state object in place.
+
+    Each word draws its topic given the global topic weights, which are
+    drawn from the table counts at the start of the sweep; the tables
+    of each document are then redrawn given its words. The sweep is
+    cheaper than `lda_crp_gibbs`, but topics are only created one word at
+    a time, so it can take longer to find new ones. The state can be used
+    with either kernel afterwards; since the tables are kept, it needs as
+    much memory as with `lda_crp_gibbs`.
+    """
+    c_lda_direct_gibbs(s._thisptr.get()[0], r._thisptr[0])
+
+
+def lda_crp_split_merge(state s, rng r, nproposals=10):
+    """Split-merge Metropolis-Hastings moves on the topics, to be
+    interleaved with `lda_crp_gibbs` or `lda_direct_gibbs`. Modifies
+    state object in place.
+
+    Each of `nproposals` moves picks two tables at random and proposes to
+    split their topic if they share one, allocating its other tables
+    between the two, or else to merge their topics (sequentially
+    allocated split-merge, Wang & Blei 2012, in place of the restricted
+    Gibbs scans of Jain & Neal). A move can split a conflated topic that
+    single table moves would take many sweeps to pull apart.
+
+    Returns a dict with the number of splits and merges proposed and
+    accepted, and the number of topics afterwards.
     """
-    c_lda_crp_gibbs(s._thisptr.get()[0], r._thisptr[0])
\ No newline at end of file
+    validator.validate_positive(nproposals, param_name='nproposals')
+    cdef split_merge_stats stats
+    c_split_merge(s._thisptr.get()[0], r._thisptr[0], nproposals, stats)
+    return {
+        'splits_proposed': stats.nsplits_proposed,
+        'splits_accepted': stats.nsplits_accepted,
+        'merges_proposed': stats.nmerges_proposed,
+        'merges_accepted': stats.nmerges_accepted,
+        'ntopics': stats.ntopics.back(),
+    }
\ No newline at end of file
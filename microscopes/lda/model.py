@@ -1,5 +1,14 @@
 from microscopes.lda._model import (
     state,
     initialize,
-    deserialize
+    deserialize,
+    load_snapshot,
+    snapshot_from_serialized,
+    checkpointer,
+    load_checkpoint,
+    corpus,
+    load_corpus,
+    parse_corpus,
+    corpus_from_term_counts,
+    online_hdp,
 )
\ No newline at end of file
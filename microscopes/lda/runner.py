@@ -1,9 +1,16 @@
 """Implements the Runner interface fo LDA
 """
 
+import os
+
 from microscopes.common import validator
 from microscopes.common.rng import rng
-from microscopes.lda.kernels import lda_crp_gibbs
+from microscopes.lda.kernels import (
+    lda_crp_gibbs,
+    lda_direct_gibbs,
+    lda_crp_split_merge,
+)
+from microscopes.lda.model import checkpointer, load_checkpoint
 
 
 class runner(object):
@@ -14,25 +21,109 @@ class runner(object):
     defn : ``model_definition``: The structural definition.
     view :  A list of list of serializable objects (the 'documents')
     latent : ``state``: The initialization state.
+    kernel_config : 'assign' or 'direct'
+        'assign' samples in the Chinese restaurant franchise
+        (`lda_crp_gibbs`), 'direct' by direct assignment
+        (`lda_direct_gibbs`, single threaded).
     """
 
     def __init__(self, defn, view, latent, kernel_config='assign'):
+        if kernel_config not in ('assign', 'direct'):
+            raise ValueError("unknown kernel_config: {}".format(kernel_config))
         self._defn = defn
         self._view = view
         self._latent = latent
+        self._kernel_config = kernel_config
+        self._split_merge_stats = None
 
 
-    def run(self, r, niters=10000):
-        """Run the lda kernel for `niters`, in a single thread.
+    def run(self, r, niters=10000, nthreads=1, checkpoint=None,
+            checkpoint_every=0, checkpoint_seconds=0, resume=False,
+            split_merge_every=0, split_merge_proposals=10):
+        """Run the lda kernel for `niters`.
 
         Parameters
         ----------
         r : random state
         niters : int
+        nthreads : int
+            Threads for the word-level step of each iteration; see
+            `lda_crp_gibbs`.
+        checkpoint : str, optional
+            Path to write checkpoints to, every `checkpoint_every`
+            iterations and/or `checkpoint_seconds` seconds, and after the
+            last iteration (the only one if neither is set). They are
+            written on a background thread.
+        resume : bool
+            If `checkpoint` exists, continue from it (state, iteration
+            count and the state of `r`) instead of from the current state.
+            The checkpoint is loaded into the runner's latent state, so
+            the object passed to the constructor holds the chain.
+        split_merge_every : int
+            If positive, follow every `split_merge_every`-th iteration with
+            `split_merge_proposals` split-merge moves
+            (`lda_crp_split_merge`); see `split_merge_stats`.
 
         """
         validator.validate_type(r, rng, param_name='r')
         validator.validate_positive(niters, param_name='niters')
+        validator.validate_positive(nthreads, param_name='nthreads')
+        if split_merge_every < 0:
+            raise ValueError("split_merge_every must not be negative")
+        if split_merge_every:
+            validator.validate_positive(split_merge_proposals,
+                                        param_name='split_merge_proposals')
+        if self._kernel_config == 'direct' and nthreads > 1:
+            raise ValueError("the direct kernel runs on one thread")
+
+        done = 0
+        if resume and checkpoint is not None and os.path.exists(checkpoint):
+            _, done = load_checkpoint(checkpoint, r, into=self._latent)
+        checkpoints = None
+        if checkpoint is not None:
+            checkpoints = checkpointer(checkpoint, checkpoint_every, checkpoint_seconds)
+        saved = done
+
+        for iteration in xrange(done + 1, niters + 1):
+            if self._kernel_config == 'direct':
+                lda_direct_gibbs(self._latent, r)
+            else:
+                lda_crp_gibbs(self._latent, r, nthreads=nthreads)
+            if split_merge_every and iteration % split_merge_every == 0:
+                self._record_split_merge(
+                    iteration,
+                    lda_crp_split_merge(self._latent, r, split_merge_proposals))
+            if (checkpoints is not None and
+                    checkpoints.maybe_save(self._latent, r, iteration)):
+                saved = iteration
+        if checkpoints is not None:
+            if saved < niters:
+                checkpoints.save(self._latent, r, niters)
+            checkpoints.wait()
 
-        for _ in xrange(niters):
-            lda_crp_gibbs(self._latent, r)
+    def _record_split_merge(self, iteration, result):
+        stats = self._split_merge_stats
+        if stats is None:
+            stats = self._split_merge_stats = {
+                'splits_proposed': 0, 'splits_accepted': 0,
+                'merges_proposed': 0, 'merges_accepted': 0, 'ntopics': []}
+        for key in ('splits_proposed', 'splits_accepted',
+                    'merges_proposed', 'merges_accepted'):
+            stats[key] += result[key]
+        stats['ntopics'].append((iteration, result['ntopics']))
+
+    def split_merge_stats(self):
+        """Split-merge moves made by `run` so far: the number of splits and
+        merges proposed and accepted, their acceptance rates, and
+        (iteration, number of topics) after each round of moves. None if
+        none were made.
+        """
+        if self._split_merge_stats is None:
+            return None
+        stats = dict(self._split_merge_stats)
+        stats['ntopics'] = list(stats['ntopics'])
+        for move in ('split', 'merge'):
+            proposed = stats[move + 's_proposed']
+            stats[move + '_acceptance'] = \
+                float(stats[move + 's_accepted']) / proposed if proposed else 0.
+        return stats
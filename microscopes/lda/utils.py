@@ -46,6 +46,10 @@ def docs_from_ldac(stream):
 
     source: http://www.cs.princeton.edu/~blei/lda-c/readme.txt
 
+    The text is parsed in C++; to train on a large file, pass the
+    `corpus` from `model.load_corpus` to `model.initialize` instead of
+    building the documents in Python.
+
     Parameters
     ----------
     stream: file object
@@ -55,20 +59,20 @@ def docs_from_ldac(stream):
     Returns
     -------
     docs: variadic array of N entites
+
+    Raises
+    ------
+    ValueError if the text is not in LDA-C format
     """
-    n_entities = 0
-    docs = []
-    for line in stream:
-        line = line.strip().split(' ')
-        if len(line) == 1 and line[0] == '':
-            continue
-        unique_terms = int(line.pop(0))
-        term_counts = [tc.split(":") for tc in line]
-        term_counts = [(int(t), int(c)) for t, c in term_counts]
-        assert unique_terms == len(term_counts)
-        docs.append(_term_counts_to_doc(term_counts))
-        n_entities += 1
-    return docs
+    # Imported here, as _model imports this module.
+    from microscopes.lda.model import parse_corpus
+    text = stream.read()
+    if not text.strip():
+        return []
+    try:
+        return parse_corpus(text, format='ldac').documents()
+    except RuntimeError as e:
+        raise ValueError(str(e))
 
 
 def reindex_nested(l):
@@ -0,0 +1,99 @@
+#include <microscopes/lda/checkpoint.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sstream>
+
+namespace {
+
+// A checkpoint is a snapshot whose extra data is this tag, the iteration
+// and the rng state as written by operator<<.
+const char checkpoint_tag[] = "lda-checkpoint";
+const int checkpoint_version = 1;
+
+}
+
+microscopes::lda::checkpointer::checkpointer(const std::string &path,
+    size_t every_iters, double every_seconds, bool with_counts)
+    : path_(path), every_iters_(every_iters), every_seconds_(every_seconds),
+      with_counts_(with_counts), last_iteration_(0),
+      last_time_(std::chrono::steady_clock::now()), writer_(), error_(), nsaved_(0)
+{
+}
+
+microscopes::lda::checkpointer::~checkpointer()
+{
+    // Errors can no longer be reported; the previous checkpoint, if any,
+    // is still in place.
+    if (writer_.joinable()) writer_.join();
+}
+
+bool
+microscopes::lda::checkpointer::maybe_save(const state &state, const common::rng_t &rng, size_t iteration)
+{
+    bool due = every_iters_ > 0 && iteration >= last_iteration_ + every_iters_;
+    if (every_seconds_ > 0) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_time_).count();
+        due = due || elapsed >= every_seconds_;
+    }
+    if (due) save(state, rng, iteration);
+    return due;
+}
+
+void
+microscopes::lda::checkpointer::save(const state &state, const common::rng_t &rng, size_t iteration)
+{
+    wait();
+    auto assignments = std::make_shared<const snapshot_assignments>(state.flat_assignments());
+    std::ostringstream extra;
+    extra << checkpoint_tag << " " << checkpoint_version << "\n" << iteration << "\n" << rng;
+    last_iteration_ = iteration;
+    last_time_ = std::chrono::steady_clock::now();
+    nsaved_ += 1;
+
+    std::string contents = extra.str();
+    writer_ = std::thread([this, assignments, contents]() {
+        try {
+            std::string tmp = path_ + ".tmp";
+            assignments->save(tmp, with_counts_, contents);
+            MICROSCOPES_CHECK(rename(tmp.c_str(), path_.c_str()) == 0,
+                "cannot rename " + tmp + ": " + strerror(errno));
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+    });
+}
+
+void
+microscopes::lda::checkpointer::wait()
+{
+    if (writer_.joinable()) writer_.join();
+    if (error_) {
+        auto error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t
+microscopes::lda::checkpointer::load(const std::string &path, std::shared_ptr<state> &state, common::rng_t &rng)
+{
+    std::string extra;
+    auto loaded = microscopes::lda::state::load_snapshot(path, &extra);
+    std::istringstream in(extra);
+    std::string tag;
+    int version = 0;
+    size_t iteration = 0;
+    in >> tag >> version >> iteration;
+    MICROSCOPES_CHECK(in && tag == checkpoint_tag, path + " is not a checkpoint");
+    MICROSCOPES_CHECK(version == checkpoint_version, path + " has an unsupported checkpoint version");
+    common::rng_t restored;
+    in >> restored;
+    MICROSCOPES_CHECK(!in.fail(), path + " has a damaged rng state");
+    state = loaded;
+    rng = restored;
+    return iteration;
+}
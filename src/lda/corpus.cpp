@@ -0,0 +1,100 @@
+#include <microscopes/lda/corpus.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <algorithm>
+#include <limits>
+
+microscopes::lda::corpus::corpus(const nested_vector &docs)
+    : offsets_(1, 0), words_(), ends_(), order_offsets_(1, 0), order_(), ntokens_(0)
+{
+    // Corpus token i of a document that is not grouped yet is
+    // doc[grouped[i]].
+    std::vector<size_t> grouped;
+    for (auto &doc : docs) {
+        MICROSCOPES_CHECK(doc.size() <= std::numeric_limits<uint32_t>::max(), "document too long");
+        const bool in_order = std::is_sorted(doc.begin(), doc.end());
+        if (!in_order) {
+            grouped.resize(doc.size());
+            for (size_t i = 0; i < doc.size(); ++i) grouped[i] = i;
+            std::stable_sort(grouped.begin(), grouped.end(), [&doc](size_t a, size_t b) { return doc[a] < doc[b]; });
+            const size_t first = order_.size();
+            order_.resize(first + doc.size());
+            for (size_t i = 0; i < doc.size(); ++i) order_[first + grouped[i]] = i;
+        }
+        for (size_t i = 0; i < doc.size(); ++i) {
+            const size_t w = doc[in_order ? i : grouped[i]];
+            MICROSCOPES_CHECK(w <= std::numeric_limits<uint32_t>::max(), "word id out of range");
+            if (i > 0 && w == words_.back()) {
+                ends_.back() += 1;
+                continue;
+            }
+            words_.push_back(w);
+            ends_.push_back(i + 1);
+        }
+        offsets_.push_back(words_.size());
+        order_offsets_.push_back(order_.size());
+        ntokens_ += doc.size();
+    }
+    if (order_.empty()) order_offsets_.clear();
+}
+
+microscopes::lda::corpus::corpus(std::vector<size_t> &&offsets, std::vector<uint32_t> &&words,
+                                 std::vector<uint32_t> &&ends, std::vector<size_t> &&order_offsets,
+                                 std::vector<uint32_t> &&order)
+    : offsets_(std::move(offsets)), words_(std::move(words)), ends_(std::move(ends)),
+      order_offsets_(std::move(order_offsets)), order_(std::move(order)), ntokens_(0)
+{
+    MICROSCOPES_CHECK(!offsets_.empty() && offsets_.front() == 0 && offsets_.back() == words_.size(),
+        "bad run offsets");
+    MICROSCOPES_CHECK(ends_.size() == words_.size(), "runs and ends differ in length");
+    for (size_t j = 0; j < size(); ++j) {
+        MICROSCOPES_CHECK(offsets_[j] <= offsets_[j + 1], "bad run offsets");
+        uint32_t last = 0;
+        for (size_t r = offsets_[j]; r < offsets_[j + 1]; ++r) {
+            MICROSCOPES_CHECK(ends_[r] > last, "empty run");
+            last = ends_[r];
+        }
+        ntokens_ += last;
+    }
+    if (order_offsets_.empty()) {
+        MICROSCOPES_CHECK(order_.empty(), "bad token order offsets");
+        return;
+    }
+    MICROSCOPES_CHECK(order_offsets_.size() == offsets_.size() && order_offsets_.front() == 0 &&
+        order_offsets_.back() == order_.size(), "bad token order offsets");
+    // Each row must be empty or a permutation of the document's tokens.
+    std::vector<bool> seen;
+    for (size_t j = 0; j < size(); ++j) {
+        MICROSCOPES_CHECK(order_offsets_[j] <= order_offsets_[j + 1], "bad token order offsets");
+        if (in_order(j)) continue;
+        MICROSCOPES_CHECK(order_offsets_[j + 1] - order_offsets_[j] == nterms(j), "bad token order offsets");
+        seen.assign(nterms(j), false);
+        for (size_t p = 0; p < nterms(j); ++p) {
+            const size_t i = token(j, p);
+            MICROSCOPES_CHECK(i < seen.size() && !seen[i], "token order is not a permutation");
+            seen[i] = true;
+        }
+    }
+}
+
+void
+microscopes::lda::corpus::restore_order(size_t j, std::vector<size_t> &values) const
+{
+    if (in_order(j)) return;
+    const std::vector<size_t> grouped(values);
+    for (size_t p = 0; p < grouped.size(); ++p) values[p] = grouped[token(j, p)];
+}
+
+microscopes::lda::nested_vector
+microscopes::lda::corpus::documents() const
+{
+    nested_vector ret(size());
+    for (size_t j = 0; j < size(); ++j) {
+        ret[j].reserve(nterms(j));
+        for (size_t r = 0; r < nruns(j); ++r) {
+            ret[j].insert(ret[j].end(), count(j, r), word(j, r));
+        }
+        restore_order(j, ret[j]);
+    }
+    return ret;
+}
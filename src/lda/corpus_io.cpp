@@ -0,0 +1,327 @@
+#include <microscopes/lda/corpus_io.hpp>
+#include <microscopes/lda/mapped_file.hpp>
+#include <microscopes/lda/scheduler.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+
+namespace {
+
+using microscopes::lda::corpus_format;
+
+// Inputs are split into chunks of at least this many bytes, so small ones
+// are parsed in one piece.
+const size_t min_chunk_bytes = 1 << 20;
+
+const uint64_t max_count = std::numeric_limits<uint32_t>::max();
+const uint64_t max_term = std::numeric_limits<uint32_t>::max() - 1;
+const uint32_t no_word = std::numeric_limits<uint32_t>::max();
+
+// The documents on a stretch of whole lines as runs of one term (see
+// microscopes::lda::corpus), with the file's term ids, and the token
+// order of the lines that were not grouped already.
+struct chunk {
+    const char *begin;
+    const char *end;
+    std::vector<size_t> nruns;
+    std::vector<uint32_t> terms;
+    std::vector<uint32_t> ends;
+    std::vector<size_t> norder;
+    std::vector<uint32_t> order;
+    uint32_t max_term;
+    std::exception_ptr error;
+};
+
+class line_parser {
+public:
+    line_parser(const char *data, const chunk &c, const std::string &name)
+        : data_(data), pos_(c.begin), end_(c.end), name_(name)
+    {
+    }
+
+    inline bool at_end() const { return pos_ == end_; }
+
+    // Skips blanks; returns whether the line has another field.
+    inline bool more()
+    {
+        while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\r')) ++pos_;
+        return pos_ < end_ && *pos_ != '\n';
+    }
+
+    // To be called once more() is false.
+    inline void next_line()
+    {
+        if (pos_ < end_) ++pos_;
+    }
+
+    inline uint64_t number(uint64_t max, const char *what)
+    {
+        if (pos_ == end_ || *pos_ < '0' || *pos_ > '9') fail(std::string("expected ") + what);
+        uint64_t x = 0;
+        for (; pos_ < end_ && *pos_ >= '0' && *pos_ <= '9'; ++pos_) {
+            x = x * 10 + (*pos_ - '0');
+            if (x > max) fail(std::string(what) + " out of range");
+        }
+        return x;
+    }
+
+    inline void expect(char c)
+    {
+        if (pos_ == end_ || *pos_ != c) fail(std::string("expected '") + c + "'");
+        ++pos_;
+    }
+
+    void fail(const std::string &message) const
+    {
+        size_t line = 1 + std::count(data_, pos_, '\n');
+        MICROSCOPES_CHECK(false, name_ + ":" + std::to_string(line) + ": " + message);
+    }
+
+private:
+    const char *data_;
+    const char *pos_;
+    const char *end_;
+    const std::string &name_;
+};
+
+void
+parse_chunk(chunk &c, corpus_format format, const char *data, const std::string &name)
+{
+    line_parser in(data, c, name);
+    c.max_term = 0;
+    // A document's (term, count) pairs, or (term, position) of its
+    // tokens, sorted by term at the end of its line so that every copy of
+    // a term shares a run.
+    std::vector<std::pair<uint32_t, uint64_t>> pairs;
+    // Adds count tokens of term to the current document, extending its
+    // last run when the term repeats.
+    uint64_t length = 0;
+    size_t first_run = 0;
+    auto add = [&](uint32_t term, uint64_t count) {
+        if (count == 0) return;
+        length += count;
+        if (length > max_count) in.fail("document too long");
+        if (c.terms.size() > first_run && c.terms.back() == term) {
+            c.ends.back() = length;
+            return;
+        }
+        c.terms.push_back(term);
+        c.ends.push_back(length);
+        c.max_term = std::max(c.max_term, term);
+    };
+    while (!in.at_end()) {
+        if (!in.more()) {
+            in.next_line(); // blank
+            continue;
+        }
+        length = 0;
+        first_run = c.terms.size();
+        const size_t first_order = c.order.size();
+        pairs.clear();
+        if (format == corpus_format::ldac) {
+            uint64_t npairs = in.number(max_count, "number of terms"), seen = 0;
+            for (; in.more(); ++seen) {
+                uint32_t term = in.number(max_term, "term id");
+                in.expect(':');
+                pairs.push_back(std::make_pair(term, in.number(max_count, "count")));
+            }
+            if (seen != npairs) {
+                in.fail("expected " + std::to_string(npairs) + " terms, found " + std::to_string(seen));
+            }
+            std::sort(pairs.begin(), pairs.end());
+            for (auto &tc : pairs) add(tc.first, tc.second);
+        }
+        else {
+            while (in.more()) {
+                pairs.push_back(std::make_pair(uint32_t(in.number(max_term, "term id")), uint64_t(pairs.size())));
+            }
+            // Token p of the line is corpus token order[p].
+            if (!std::is_sorted(pairs.begin(), pairs.end())) {
+                std::sort(pairs.begin(), pairs.end());
+                c.order.resize(first_order + pairs.size());
+                for (size_t i = 0; i < pairs.size(); ++i) c.order[first_order + pairs[i].second] = i;
+            }
+            for (auto &tp : pairs) add(tp.first, 1);
+        }
+        c.nruns.push_back(c.terms.size() - first_run);
+        c.norder.push_back(c.order.size() - first_order);
+        in.next_line();
+    }
+}
+
+}
+
+microscopes::lda::nested_vector
+microscopes::lda::corpus_file::documents() const
+{
+    nested_vector ret = docs->documents();
+    for (auto &doc : ret) {
+        for (auto &w : doc) w = terms[w];
+    }
+    return ret;
+}
+
+microscopes::lda::corpus_file
+microscopes::lda::parse_corpus(const char *data, size_t size, corpus_format format,
+                               size_t nthreads, const std::string &name)
+{
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+
+    // Cut at the first line break after each even split.
+    const size_t nchunks = std::max(size_t(1), std::min(4 * scheduler.nthreads(), size / min_chunk_bytes));
+    const char *end = data + size;
+    std::vector<chunk> chunks;
+    for (const char *begin = data; begin < end;) {
+        const char *stop = std::max(begin, data + size * (chunks.size() + 1) / nchunks);
+        stop = std::find(stop, end, '\n');
+        if (stop < end) ++stop;
+        chunks.push_back(chunk());
+        chunks.back().begin = begin;
+        chunks.back().end = stop;
+        begin = stop;
+    }
+    std::vector<double> costs(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        costs[i] = chunks[i].end - chunks[i].begin;
+    }
+
+    // The scheduler would rethrow whichever error was thrown first; the
+    // first error in the text is rethrown here instead.
+    scheduler.run(costs, [&](size_t i, size_t) {
+        try {
+            parse_chunk(chunks[i], format, data, name);
+        }
+        catch (...) {
+            chunks[i].error = std::current_exception();
+        }
+    });
+    size_t nruns = 0;
+    uint32_t top = 0;
+    for (auto &c : chunks) {
+        if (c.error) std::rethrow_exception(c.error);
+        nruns += c.terms.size();
+        if (!c.terms.empty()) top = std::max(top, c.max_term);
+    }
+
+    // Word ids are the ranks of the term ids that occur: through a dense
+    // table when the ids are compact, and by binary search otherwise.
+    std::vector<uint32_t> terms, word_of;
+    const bool dense = nruns && top <= 2 * nruns + min_chunk_bytes;
+    if (dense) {
+        word_of.assign(size_t(top) + 1, no_word);
+        for (auto &c : chunks) {
+            for (auto t : c.terms) word_of[t] = 0;
+        }
+        for (size_t t = 0; t < word_of.size(); ++t) {
+            if (word_of[t] == no_word) continue;
+            word_of[t] = terms.size();
+            terms.push_back(t);
+        }
+    }
+    else {
+        std::vector<std::vector<uint32_t>> distinct(chunks.size());
+        scheduler.run(costs, [&](size_t i, size_t) {
+            distinct[i] = chunks[i].terms;
+            std::sort(distinct[i].begin(), distinct[i].end());
+            distinct[i].erase(std::unique(distinct[i].begin(), distinct[i].end()), distinct[i].end());
+        });
+        for (auto &d : distinct) terms.insert(terms.end(), d.begin(), d.end());
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    }
+    scheduler.run(costs, [&](size_t i, size_t) {
+        for (auto &t : chunks[i].terms) {
+            t = dense ? word_of[t] : std::lower_bound(terms.begin(), terms.end(), t) - terms.begin();
+        }
+    });
+
+    std::vector<size_t> offsets(1, 0), starts, order_offsets(1, 0), order_starts;
+    for (auto &c : chunks) {
+        starts.push_back(offsets.back());
+        order_starts.push_back(order_offsets.back());
+        for (auto n : c.nruns) offsets.push_back(offsets.back() + n);
+        for (auto n : c.norder) order_offsets.push_back(order_offsets.back() + n);
+    }
+    MICROSCOPES_CHECK(offsets.size() > 1, name + " has no documents");
+    MICROSCOPES_CHECK(!terms.empty(), name + " has no words");
+    std::vector<uint32_t> words, ends, order;
+    if (chunks.size() == 1) {
+        words.swap(chunks[0].terms);
+        ends.swap(chunks[0].ends);
+        order.swap(chunks[0].order);
+    }
+    else {
+        words.resize(nruns);
+        ends.resize(nruns);
+        order.resize(order_offsets.back());
+        scheduler.run(costs, [&](size_t i, size_t) {
+            std::copy(chunks[i].terms.begin(), chunks[i].terms.end(), words.begin() + starts[i]);
+            std::copy(chunks[i].ends.begin(), chunks[i].ends.end(), ends.begin() + starts[i]);
+            std::copy(chunks[i].order.begin(), chunks[i].order.end(), order.begin() + order_starts[i]);
+            std::vector<uint32_t>().swap(chunks[i].terms);
+            std::vector<uint32_t>().swap(chunks[i].ends);
+            std::vector<uint32_t>().swap(chunks[i].order);
+        });
+    }
+    if (order.empty()) order_offsets.clear();
+
+    corpus_file ret;
+    ret.docs = std::make_shared<const corpus>(std::move(offsets), std::move(words), std::move(ends),
+                                              std::move(order_offsets), std::move(order));
+    ret.terms.swap(terms);
+    return ret;
+}
+
+microscopes::lda::corpus_file
+microscopes::lda::read_corpus(const std::string &path, corpus_format format, size_t nthreads)
+{
+    mapped_file file(path);
+    return parse_corpus(file.data(), file.size(), format, nthreads, path);
+}
+
+microscopes::lda::corpus_file
+microscopes::lda::corpus_from_counts(const std::vector<std::vector<std::pair<size_t, size_t>>> &docs)
+{
+    std::vector<size_t> terms;
+    for (auto &doc : docs) {
+        for (auto &tc : doc) {
+            MICROSCOPES_CHECK(tc.first <= max_term, "term id out of range");
+            if (tc.second > 0) terms.push_back(tc.first);
+        }
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    MICROSCOPES_CHECK(!docs.empty(), "corpus has no documents");
+    MICROSCOPES_CHECK(!terms.empty(), "corpus has no words");
+
+    std::vector<size_t> offsets(1, 0);
+    std::vector<uint32_t> words, ends;
+    std::vector<std::pair<size_t, size_t>> sorted;
+    for (auto &doc : docs) {
+        const size_t first_run = words.size();
+        uint64_t length = 0;
+        // Sorted by term so that every copy of a term shares a run.
+        sorted.assign(doc.begin(), doc.end());
+        std::sort(sorted.begin(), sorted.end());
+        for (auto &tc : sorted) {
+            if (tc.second == 0) continue;
+            length += tc.second;
+            MICROSCOPES_CHECK(tc.second <= max_count && length <= max_count, "document too long");
+            uint32_t w = std::lower_bound(terms.begin(), terms.end(), tc.first) - terms.begin();
+            if (words.size() > first_run && words.back() == w) {
+                ends.back() = length;
+                continue;
+            }
+            words.push_back(w);
+            ends.push_back(length);
+        }
+        offsets.push_back(words.size());
+    }
+
+    corpus_file ret;
+    ret.docs = std::make_shared<const corpus>(std::move(offsets), std::move(words), std::move(ends));
+    ret.terms.assign(terms.begin(), terms.end());
+    return ret;
+}
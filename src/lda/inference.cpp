@@ -0,0 +1,206 @@
+#include <microscopes/lda/inference.hpp>
+#include <microscopes/lda/simd.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <algorithm>
+#include <math.h>
+
+microscopes::lda::frozen_model::frozen_model(const state &state)
+    : V_(state.nwords()), alpha_(state.alpha_), dishes_(state.dishes()), prior_(), phi_()
+{
+    // Same topic weights as state::document_distribution: m_k for the
+    // trained dishes, gamma for a new one.
+    const size_t K = ncolumns();
+    prior_.resize(K);
+    double total = 0;
+    for (size_t c = 0; c < K; ++c) {
+        prior_[c] = dishes_[c] == 0 ? state.gamma_ : state.dishsize(dishes_[c]);
+        total += prior_[c];
+    }
+    for (auto &a : prior_) a *= alpha_ / total;
+
+    phi_.resize(V_ * K);
+    for (size_t v = 0; v < V_; ++v) {
+        float *phi_v = &phi_[v * K];
+        for (size_t c = 0; c < K; ++c) {
+            size_t k = dishes_[c];
+            phi_v[c] = k == 0 ? 1.0f / V_ : state.smoothed_n_kv(k, v) * state.inv_smoothed_n_k(k);
+        }
+    }
+}
+
+void
+microscopes::lda::frozen_model::check_words(const nested_vector &docs) const
+{
+    for (const auto &doc : docs) {
+        for (auto v : doc) {
+            MICROSCOPES_CHECK(v < V_, "word id out of range");
+        }
+    }
+}
+
+std::vector<double>
+microscopes::lda::frozen_model::heldout_log_likelihood(const nested_vector &docs,
+    size_t nsamples, size_t burnin, common::rng_t &rng, size_t nthreads) const
+{
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    return heldout_log_likelihood(docs, nsamples, burnin, rng, scheduler);
+}
+
+std::vector<double>
+microscopes::lda::frozen_model::heldout_log_likelihood(const nested_vector &docs,
+    size_t nsamples, size_t burnin, common::rng_t &rng, scheduler &scheduler) const
+{
+    MICROSCOPES_CHECK(nsamples > 0, "no samples");
+    check_words(docs);
+    const size_t K = ncolumns();
+    std::vector<common::rng_t::result_type> seeds(docs.size());
+    for (auto &seed : seeds) seed = rng();
+    std::vector<double> costs(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) {
+        costs[d] = double(docs[d].size()) * (burnin + nsamples);
+    }
+
+    struct buffers {
+        std::vector<size_t> z;
+        std::vector<float> n_k, p;
+        std::vector<double> sample_ll;
+    };
+    std::vector<buffers> thread_buffers(scheduler.nthreads());
+    std::vector<double> ret(docs.size());
+    scheduler.run(costs, [&](size_t d, size_t thread) {
+        const auto &doc = docs[d];
+        const size_t n_observed = doc.size() / 2;
+        auto &b = thread_buffers[thread];
+        b.z.resize(n_observed);
+        b.n_k.assign(K, 0);
+        b.p.resize(K);
+        b.sample_ll.clear();
+        common::rng_t doc_rng(seeds[d]);
+
+        // p(z_i = c | z_-i) is proportional to (n_c + prior_c) phi_c(w_i);
+        // the first sweep seats the words one after another.
+        auto resample = [&](size_t i) {
+            const float *phi_v = word_topics(doc[i]);
+            for (size_t c = 0; c < K; ++c) {
+                b.p[c] = (b.n_k[c] + prior_[c]) * phi_v[c];
+            }
+            b.z[i] = lda_util::sample_weights(b.p, doc_rng);
+            b.n_k[b.z[i]] += 1;
+        };
+        for (size_t i = 0; i < n_observed; ++i) resample(i);
+
+        const size_t nsweeps = n_observed ? burnin + nsamples : nsamples;
+        for (size_t sweep = 0; sweep < nsweeps; ++sweep) {
+            for (size_t i = 0; i < n_observed; ++i) {
+                b.n_k[b.z[i]] -= 1;
+                resample(i);
+            }
+            if (sweep + nsamples < nsweeps) continue;
+            // Held-out words under theta_c = (n_c + prior_c) / (n + alpha).
+            double ll = -double(doc.size() - n_observed) * log(n_observed + alpha_);
+            for (size_t i = n_observed; i < doc.size(); ++i) {
+                const float *phi_v = word_topics(doc[i]);
+                double p = 0;
+                for (size_t c = 0; c < K; ++c) {
+                    p += (b.n_k[c] + prior_[c]) * phi_v[c];
+                }
+                ll += log(p);
+            }
+            b.sample_ll.push_back(ll);
+        }
+
+        // log of the mean over samples of p(held-out | theta).
+        double max = *std::max_element(b.sample_ll.begin(), b.sample_ll.end());
+        double sum = 0;
+        for (auto ll : b.sample_ll) sum += exp(ll - max);
+        ret[d] = max + log(sum / b.sample_ll.size());
+    });
+    return ret;
+}
+
+std::vector<float>
+microscopes::lda::frozen_model::predict(const nested_vector &docs,
+    size_t max_iter, double tol, size_t nthreads) const
+{
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    return predict(docs, max_iter, tol, scheduler);
+}
+
+std::vector<float>
+microscopes::lda::frozen_model::predict(const nested_vector &docs,
+    size_t max_iter, double tol, scheduler &scheduler) const
+{
+    check_words(docs);
+    // Only the trained topics (columns 1..K) take part, as in
+    // word_distribution().
+    const size_t K = ncolumns() - 1;
+    std::vector<double> costs(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) {
+        costs[d] = docs[d].size() + 1;
+    }
+
+    // Every occurrence of a word gets the same responsibilities, so they
+    // are kept once per distinct word and weighted by its count.
+    struct buffers {
+        std::vector<size_t> words, counts;
+        std::vector<double> r, r_new, s, s_new;
+    };
+    std::vector<buffers> thread_buffers(scheduler.nthreads());
+    std::vector<float> theta(docs.size() * K);
+    scheduler.run(costs, [&](size_t d, size_t thread) {
+        auto &b = thread_buffers[thread];
+        b.words.assign(docs[d].begin(), docs[d].end());
+        std::sort(b.words.begin(), b.words.end());
+        b.counts.clear();
+        size_t nunique = 0;
+        for (size_t i = 0; i < b.words.size(); ++i) {
+            if (nunique && b.words[nunique - 1] == b.words[i]) {
+                b.counts.back() += 1;
+            } else {
+                b.words[nunique++] = b.words[i];
+                b.counts.push_back(1);
+            }
+        }
+        b.words.resize(nunique);
+        b.r.assign(nunique * K, 0);
+        b.r_new.resize(nunique * K);
+        b.s.assign(K, 0);
+        b.s_new.resize(K);
+
+        // r_new[w][k] is proportional to phi_k(w) (s_k - r[w][k] + prior_k);
+        // the first update, from r = 0, is the initialization.
+        for (size_t iter = 0; iter <= max_iter; ++iter) {
+            std::fill(b.s_new.begin(), b.s_new.end(), 0);
+            double change = 0;
+            for (size_t u = 0; u < nunique; ++u) {
+                const float *phi_v = word_topics(b.words[u]) + 1;
+                const double *r_u = &b.r[u * K];
+                double *r_new_u = &b.r_new[u * K];
+                double total = 0;
+                for (size_t k = 0; k < K; ++k) {
+                    r_new_u[k] = phi_v[k] * (b.s[k] - r_u[k] + prior_[k + 1]);
+                    total += r_new_u[k];
+                }
+                for (size_t k = 0; k < K; ++k) {
+                    r_new_u[k] /= total;
+                    change += b.counts[u] * fabs(r_new_u[k] - r_u[k]);
+                    b.s_new[k] += b.counts[u] * r_new_u[k];
+                }
+            }
+            b.r.swap(b.r_new);
+            b.s.swap(b.s_new);
+            if (change < tol) break;
+        }
+
+        float *theta_d = &theta[d * K];
+        if (nunique == 0) {
+            // Nothing observed: the prior.
+            for (size_t k = 0; k < K; ++k) b.s[k] = prior_[k + 1];
+        }
+        double total = 0;
+        for (size_t k = 0; k < K; ++k) total += b.s[k];
+        for (size_t k = 0; k < K; ++k) theta_d[k] = b.s[k] / total;
+    });
+    return theta;
+}
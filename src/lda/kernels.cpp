@@ -1,133 +1,1340 @@
 #include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/simd.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <random>
 
 namespace microscopes {
 namespace kernels {
+
+// The overloads taking a thread count are called once per sweep, so the
+// scheduler, and with it its threads, is kept between calls (one per
+// calling thread).
+static microscopes::lda::scheduler &
+sweep_scheduler(size_t nthreads)
+{
+    static thread_local std::unique_ptr<microscopes::lda::scheduler> cached;
+    if (!cached || cached->nthreads() != nthreads) {
+        cached.reset(new microscopes::lda::scheduler(nthreads));
+    }
+    return *cached;
+}
+
 namespace lda_crp {
 
-std::vector<float>
-calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
-    std::vector<float> log_p_k(state.dishes_.size());
+// Unnormalized log posterior over dishes for calc_dish_posterior_t.
+static void
+dish_log_weights_t(const microscopes::lda::state &state, size_t eid, size_t t,
+                   std::vector<float> &log_p, bool seated) {
+    const auto &dishes = state.dishes();
+    log_p.resize(dishes.size());
+    // A local pointer keeps the compiler from reloading log_p's data.
+    float *log_p_k = log_p.data();
 
+    // k_old is 0 if the table's dish was removed by leave_from_dish, in
+    // which case the table's words are no longer counted in any dish.
+    // All lgamma/log arguments are integer counts (plus beta or V*beta),
+    // so they are read from the state's caches.
     auto k_old = state.dish_assignment(eid, t);
-    auto n_jt_val = state.n_jt[eid][t];
-    for (size_t i = 0; i < state.dishes_.size(); i++) {
-        auto k = state.dishes_[i];
-        float n_k_val = state.n_k.get(k); // V*beta when k == i == 0
-        if (k == k_old) n_k_val -= n_jt_val;
-        log_p_k[i] = distributions::fast_log(i == 0 ? state.gamma_ : state.m_k[k]);
-        log_p_k[i] += distributions::fast_lgamma(n_k_val);
-        log_p_k[i] -= distributions::fast_lgamma(n_k_val + n_jt_val);
+    size_t n_jt_val = state.tablesize(eid, t);
+    float log_gamma = distributions::fast_log(state.gamma_);
+    for (size_t i = 0; i < dishes.size(); i++) {
+        auto k = dishes[i];
+        size_t n_k_val = state.dish_nwords(k); // 0 when k == i == 0
+        size_t m_k_val = state.dishsize(k);
+        if (k == k_old && k_old != 0) {
+            n_k_val -= n_jt_val;
+            // A dish left with no tables gets weight log(0) = -inf.
+            if (seated) m_k_val -= 1;
+        }
+        log_p_k[i] = i == 0 ? log_gamma : state.log_count(m_k_val);
+        log_p_k[i] += state.lgamma_vbeta(n_k_val);
+        log_p_k[i] -= state.lgamma_vbeta(n_k_val + n_jt_val);
     }
 
-    for (auto &kv : state.n_jtv[eid][t]) {
+    for (auto &kv : state.table_words(eid, t)) {
         auto w = kv.first; // w is word index
-        auto n_jtw = kv.second; // n_jtw is # of times word w appears at table t in doc eid.
-        if (n_jtw == 0) continue; // if word w isn't at table t, continue. log_pk wouldn't change.
+        size_t n_jtw = kv.second; // n_jtw is # of times word w appears at table t in doc eid (never 0).
 
-        for (size_t i = 0; i < state.dishes_.size(); i++) {
-            float n_kw;
-            n_kw = state.n_kv[state.dishes_[i]].get(w); // beta when k == i == 0
-            if (state.dishes_[i] == state.dish_assignment(eid, t)) n_kw -= n_jtw;
-            log_p_k[i] += distributions::fast_lgamma(n_kw + n_jtw);
-            log_p_k[i] -= distributions::fast_lgamma(n_kw);
+        const auto n_kw_counts = state.word_counts(w);
+        for (size_t i = 0; i < dishes.size(); i++) {
+            size_t n_kw = n_kw_counts[dishes[i]]; // 0 when k == i == 0
+            if (dishes[i] == k_old && k_old != 0) n_kw -= n_jtw;
+            log_p_k[i] += state.lgamma_beta(n_kw + n_jtw);
+            log_p_k[i] -= state.lgamma_beta(n_kw);
         }
     }
+}
 
-    std::vector<float> p_k;
-    p_k.reserve(state.dishes_.size());
-    float max_value = *std::max_element(log_p_k.begin(), log_p_k.end());
-    for (auto log_p_k_value : log_p_k) {
-        p_k.push_back(exp(log_p_k_value - max_value));
+void
+calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng,
+                      std::vector<float> &p_k, bool seated) {
+    dish_log_weights_t(state, eid, t, p_k, seated);
+    float max_value = *std::max_element(p_k.begin(), p_k.end());
+    for (auto &p : p_k) {
+        p = exp(p - max_value);
     }
     lda_util::normalize(p_k);
+}
+
+std::vector<float>
+calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng, bool seated) {
+    std::vector<float> p_k;
+    calc_dish_posterior_t(state, eid, t, rng, p_k, seated);
     return p_k;
 }
 
+// Unnormalized calc_dish_posterior_w.
+static void
+dish_weights_w(microscopes::lda::state &state, const std::vector<float> &f_k, std::vector<float> &p_k) {
+    const auto &dishes = state.dishes();
+    p_k.resize(dishes.size());
+    for (size_t i = 0; i < dishes.size(); ++i) {
+        p_k[i] = state.dishsize(dishes[i]) * f_k[dishes[i]];
+    }
+    p_k[0] = state.gamma_ / state.V;
+}
+
+void
+calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng,
+                      std::vector<float> &p_k) {
+    dish_weights_w(state, f_k, p_k);
+    lda_util::normalize(p_k);
+}
+
 std::vector<float>
 calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng){
-    Eigen::VectorXf p_k(state.dishes_.size());
-    for (size_t i = 0; i < state.dishes_.size(); ++i) {
-        p_k(i) = state.m_k[state.dishes_[i]] * f_k[state.dishes_[i]];
+    std::vector<float> p_k;
+    calc_dish_posterior_w(state, f_k, rng, p_k);
+    return p_k;
+}
+
+void
+calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng, std::vector<float> &f_k) {
+    // Indexed by dish id; only active dishes are filled in.
+    f_k.assign(state.dish_capacity(), 0);
+    const auto n_kv = state.word_counts(v);
+    for (auto k : state.dishes()) {
+        if (k == 0) continue;
+        f_k[k] = (n_kv[k] + state.beta_) * state.inv_smoothed_n_k(k);
     }
-    p_k(0) = state.gamma_ / state.V;
-    p_k /= p_k.sum();
-    return std::vector<float>(p_k.data(), p_k.data() + p_k.size());
 }
 
 std::vector<float>
 calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng) {
-    Eigen::VectorXf f_k(state.n_kv.size());
+    std::vector<float> f_k;
+    calc_f_k(state, v, rng, f_k);
+    return f_k;
+}
 
-    f_k(0) = 0;
-    for (size_t k = 1; k < state.n_kv.size(); k++)
-    {
-        f_k(k) = state.n_kv[k].get(v) / state.n_k.get(k);
+// f_k(v) for one dish, as calc_f_k fills it in.
+static inline float
+dish_f_k(const microscopes::lda::state &state, size_t k, size_t v) {
+    return k != 0 && state.dishes_.contains(k) ? state.smoothed_n_kv(k, v) * state.inv_smoothed_n_k(k) : 0;
+}
+
+// sum_k f_k m_k over the active dishes.
+static double
+f_k_mass(const microscopes::lda::state &state, const std::vector<float> &f_k) {
+    double mass = 0;
+    for (auto k : state.dishes()) {
+        mass += f_k[k] * state.dishsize(k);
     }
+    return mass;
+}
 
-    return std::vector<float>(f_k.data(), f_k.data() + f_k.size());
+// f_k_mass for word v without f_k: beta times the smoothing mass plus
+// the dishes v is counted in, so O(dishes of v) rather than O(K).
+static double
+word_mass(const microscopes::lda::state &state, size_t v) {
+    const auto n_kv = state.word_counts(v);
+    double mass = state.beta_ * state.smoothing_mass();
+    for (auto k : state.word_dishes(v)) {
+        mass += state.dishsize(k) * n_kv[k] * state.inv_smoothed_n_k(k);
+    }
+    return mass;
 }
 
-std::vector<float>
-calc_table_posterior(microscopes::lda::state &state, size_t eid, std::vector<float> &f_k, common::rng_t &rng) {
-    std::vector<size_t> using_table = state.using_t[eid];
-    Eigen::VectorXf p_t(using_table.size());
+// Unnormalized calc_table_posterior, given f_k_mass and f_k of the
+// dish of each of the document's tables.
+template <class F>
+static void
+table_weights(microscopes::lda::state &state, size_t eid, F f_k, double mass, std::vector<float> &p_t) {
+    const auto &using_table = state.tables(eid);
+    p_t.resize(using_table.size());
 
     for (size_t i = 1; i < using_table.size(); i++) {
         auto p = using_table[i];
-        p_t(i) = state.n_jt[eid][p] * f_k[state.dish_assignment(eid, p)];
+        p_t[i] = state.tablesize(eid, p) * f_k(state.dish_assignment(eid, p));
     }
-    Eigen::Map<Eigen::VectorXf> eigen_f_k(f_k.data(), f_k.size());
-    Eigen::Map<Eigen::Matrix<size_t, Eigen::Dynamic, 1>> eigen_m_k(state.m_k.data(), state.m_k.size());
-    float p_x_ji = state.gamma_ / state.V + eigen_f_k.dot(eigen_m_k.cast<float>());
-    p_t(0) = p_x_ji * state.alpha_ / (state.gamma_ + state.ntables());
-    p_t /= p_t.sum();
-    return std::vector<float>(p_t.data(), p_t.data() + p_t.size());
+    double p_x_ji = state.gamma_ / state.V + mass;
+    p_t[0] = p_x_ji * state.alpha_ / (state.gamma_ + state.ntables());
 }
 
 void
-sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng) {
-    state.remove_table(eid, i);
-    size_t v = state.get_word(eid, i);
-    std::vector<float> f_k = calc_f_k(state, v, rng);
-    std::vector<float> p_t = calc_table_posterior(state, eid, f_k, rng);
+calc_table_posterior(microscopes::lda::state &state, size_t eid, const std::vector<float> &f_k, common::rng_t &rng,
+                     std::vector<float> &p_t) {
+    table_weights(state, eid, [&](size_t k) { return f_k[k]; }, f_k_mass(state, f_k), p_t);
+    lda_util::normalize(p_t);
+}
+
+std::vector<float>
+calc_table_posterior(microscopes::lda::state &state, size_t eid, std::vector<float> &f_k, common::rng_t &rng) {
+    std::vector<float> p_t;
+    calc_table_posterior(state, eid, f_k, rng, p_t);
+    return p_t;
+}
+
+void
+sampling_t(microscopes::lda::state &state, size_t eid, size_t r, size_t pos, common::rng_t &rng, workspace &ws) {
+    const size_t v = state.run_word(eid, r);
+    const size_t t_old = state.run_tables(eid).table(r, pos);
+    const size_t k_old = t_old != 0 ? state.dish_assignment(eid, t_old) : 0;
+
+    // The table weights need f_k only at the dishes of the document's
+    // tables, and sum_k m_k f_k comes from the dishes v is counted in
+    // (word_mass). Only k_old's term of the sum changes from here until
+    // the table is drawn, and only k_new's after, so a cached sum is
+    // patched at those two. Only a new table needs f_k of every dish.
+    const bool cached = ws.cached_stamp == state.stamp() && ws.cached_word == v;
+    double mass = ws.cached_mass;
+    if (cached) mass -= dish_f_k(state, k_old, v) * state.dishsize(k_old);
+    state.remove_run_token(eid, r, pos);
+    if (cached) mass += dish_f_k(state, k_old, v) * state.dishsize(k_old);
+    else mass = word_mass(state, v);
+    table_weights(state, eid, [&](size_t k) { return dish_f_k(state, k, v); }, mass, ws.p_t);
 
-    size_t t_new = state.using_t[eid][common::util::sample_discrete(p_t, rng)];
+    size_t t_new = state.tables(eid)[lda_util::sample_weights(ws.p_t, rng)];
+    size_t k_new;
     if (t_new == 0)
     {
-        auto p_k = calc_dish_posterior_w(state, f_k, rng);
-        size_t k_new = state.dishes_[common::util::sample_discrete(p_k, rng)];
+        calc_f_k(state, v, rng, ws.f_k);
+        dish_weights_w(state, ws.f_k, ws.p_k);
+        k_new = state.dishes()[lda_util::sample_weights(ws.p_k, rng)];
+        if (k_new == 0) k_new = state.create_dish();
+    }
+    else {
+        k_new = state.dish_assignment(eid, t_new);
+    }
+    mass -= dish_f_k(state, k_new, v) * state.dishsize(k_new);
+    if (t_new == 0) t_new = state.create_table(eid, k_new);
+    state.add_run_token(eid, t_new, r, pos);
+    mass += dish_f_k(state, k_new, v) * state.dishsize(k_new);
+
+    ws.cached_stamp = state.stamp();
+    ws.cached_word = v;
+    ws.cached_mass = mass;
+}
+
+void
+sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng, workspace &ws) {
+    auto seat = state.x_ji->locate(eid, i);
+    sampling_t(state, eid, seat.first, seat.second, rng, ws);
+}
+
+void
+sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng) {
+    workspace ws;
+    sampling_t(state, eid, i, rng, ws);
+}
+
+void
+sampling_t_sparse(microscopes::lda::state &state, size_t eid, size_t run, size_t pos, common::rng_t &rng, workspace &) {
+    // The CRF token step draws from the joint over
+    //   existing table t:          n_jt * f_k(v)
+    //   new table at dish k:       c * m_k * f_k(v)
+    //   new table at a new dish:   c * gamma / V
+    // with c = alpha / (gamma + M) and f_k(v) = (n_kv + beta) / (n_k + V*beta).
+    // Splitting f_k(v) gives three buckets (after Yao, Mimno & McCallum):
+    //   q: the document's tables (few per document),
+    //   r: c * m_k * n_kv / (n_k + V*beta) over dishes with n_kv > 0,
+    //   s: c * (gamma / V + beta * sum_k m_k / (n_k + V*beta)),
+    // where the sum in s is kept up to date by the state.
+    state.remove_run_token(eid, run, pos);
+    size_t v = state.run_word(eid, run);
+    const auto &tables = state.tables(eid);
+    const auto &word_dishes = state.word_dishes(v);
+    const auto n_kv = state.word_counts(v);
+    const float beta = state.beta_;
+    const double c = state.alpha_ / (state.gamma_ + state.ntables());
+
+    double q = 0;
+    for (auto t : tables) {
+        if (t == 0) continue;
+        auto k = state.dish_assignment(eid, t);
+        q += state.tablesize(eid, t) * (n_kv[k] + beta) * state.inv_smoothed_n_k(k);
+    }
+    double r = 0;
+    for (auto k : word_dishes) {
+        r += state.dishsize(k) * n_kv[k] * state.inv_smoothed_n_k(k);
+    }
+    r *= c;
+    const double p_new_dish = state.gamma_ / state.V;
+    double s = c * (p_new_dish + beta * state.smoothing_mass());
+
+    double u = std::uniform_real_distribution<double>(0, q + r + s)(rng);
+    size_t t_new = 0, k_new = 0;
+    if (u < q) {
+        for (auto t : tables) {
+            if (t == 0) continue;
+            auto k = state.dish_assignment(eid, t);
+            t_new = t;
+            u -= state.tablesize(eid, t) * (n_kv[k] + beta) * state.inv_smoothed_n_k(k);
+            if (u < 0) break;
+        }
+    }
+    else if ((u -= q) < r) {
+        u /= c;
+        for (auto k : word_dishes) {
+            k_new = k;
+            u -= state.dishsize(k) * n_kv[k] * state.inv_smoothed_n_k(k);
+            if (u < 0) break;
+        }
+    }
+    else {
+        u = (u - r) / c - p_new_dish;
+        if (u >= 0) {
+            u /= beta;
+            for (auto k : state.dishes()) {
+                if (k == 0 || state.dishsize(k) == 0) continue;
+                k_new = k;
+                u -= state.dishsize(k) * state.inv_smoothed_n_k(k);
+                if (u < 0) break;
+            }
+        }
         if (k_new == 0) k_new = state.create_dish();
+    }
+    if (t_new == 0) t_new = state.create_table(eid, k_new);
+    state.add_run_token(eid, t_new, run, pos);
+}
+
+void
+sampling_t_sparse(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng, workspace &ws) {
+    auto seat = state.x_ji->locate(eid, i);
+    sampling_t_sparse(state, eid, seat.first, seat.second, rng, ws);
+}
+
+void
+sampling_t_sparse(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng) {
+    workspace ws;
+    sampling_t_sparse(state, eid, i, rng, ws);
+}
+
+void
+sampling_t_run(microscopes::lda::state &state, size_t eid, size_t r, size_t pos, common::rng_t &rng, workspace &ws) {
+    const size_t n = state.run_count(eid, r);
+    if (n == 1) {
+        sampling_t(state, eid, r, pos, rng, ws);
+        return;
+    }
+    if (pos != 0) return;
+
+    // One Gibbs step per copy, each on a copy picked at random: the copy
+    // leaves its table and is seated by the conditional given the other
+    // copies, as in sampling_t. The copies only move in local counts
+    // until the end. A table the run leaves empty drops out of its dish's
+    // m_k and gets no more copies; a table the run opens, and its dish if
+    // new, exists only here.
+    // Dishes are numbered as in the state, and past the state's capacity
+    // for the new ones. The by-dish counts are zero between calls, so
+    // only the dishes of the document's tables are cleared at the end.
+    const size_t v = state.run_word(eid, r);
+    const size_t ndishes = state.dish_capacity();
+    const auto &tables = state.tables(eid);
+    auto &before = ws.run_before;
+    auto &after = ws.run_after;
+    auto &sizes = ws.run_sizes;
+    before.assign(state.using_t[eid].capacity(), 0);
+    for (auto &s : state.run_tables(eid).run(r)) before[s.first] += s.second;
+    after = before;
+    sizes.resize(before.size());
+    for (auto t : tables) sizes[t] = state.tablesize(eid, t);
+    auto &dish_words = ws.run_dish_words;
+    auto &dish_tables = ws.run_dish_tables;
+    if (dish_words.size() < ndishes) {
+        dish_words.resize(ndishes, 0);
+        dish_tables.resize(ndishes, 0);
+    }
+    auto &new_tables = ws.run_new_tables;
+    auto &new_dishes = ws.run_new_dishes;
+    new_tables.clear();
+    new_dishes.clear();
+
+    // f_k is computed where it is needed, from the state's counts and the
+    // local changes, so only the dishes of the document's tables are
+    // visited per copy, and every dish only when a copy opens a table.
+    double mass = word_mass(state, v);
+    size_t ntables = state.ntables();
+    const float beta = state.beta_, vbeta = state.beta_ * state.V;
+    auto dishsize = [&](size_t k) -> double {
+        return k < ndishes ? state.dishsize(k) + dish_tables[k] : new_dishes[k - ndishes].first;
+    };
+    auto f = [&](size_t k) -> float {
+        if (k >= ndishes) return (new_dishes[k - ndishes].second + beta) / (new_dishes[k - ndishes].second + vbeta);
+        return (state.smoothed_n_kv(k, v) + dish_words[k]) / (state.smoothed_n_k(k) + dish_words[k]);
+    };
+    // Moves a copy into (by 1) or out of (by -1) dish k.
+    auto move_word = [&](size_t k, int by) {
+        mass -= dishsize(k) * f(k);
+        if (k < ndishes) dish_words[k] += by;
+        else new_dishes[k - ndishes].second += by;
+        mass += dishsize(k) * f(k);
+    };
+    // Opens (by 1) or closes (by -1) a table at dish k.
+    auto move_table = [&](size_t k, int by) {
+        if (k < ndishes) dish_tables[k] += by;
+        else new_dishes[k - ndishes].first += by;
+        mass += by * f(k);
+        ntables += by;
+    };
+
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    for (size_t step = 0; step < n; step++) {
+        // Unseated copies go first, so that one sweep seats them all.
+        size_t u = step < before[0] ? 0 : pick(rng), i = 0, j = 0;
+        while (i < tables.size() && u >= after[tables[i]]) u -= after[tables[i++]];
+        if (i < tables.size()) {
+            const size_t t = tables[i];
+            after[t] -= 1;
+            if (t != 0) {
+                const size_t k = state.dish_assignment(eid, t);
+                move_word(k, -1);
+                if (--sizes[t] == 0) move_table(k, -1);
+            }
+        }
+        else {
+            while (u >= new_tables[j].second) u -= new_tables[j++].second;
+            const size_t k = new_tables[j].first;
+            move_word(k, -1);
+            if (--new_tables[j].second == 0) {
+                move_table(k, -1);
+                new_tables[j] = new_tables.back();
+                new_tables.pop_back();
+            }
+        }
+
+        auto &p_t = ws.p_t;
+        p_t.resize(tables.size() + new_tables.size());
+        for (i = 1; i < tables.size(); i++) {
+            const size_t t = tables[i];
+            p_t[i] = sizes[t] * f(state.dish_assignment(eid, t));
+        }
+        for (j = 0; j < new_tables.size(); j++) {
+            p_t[i + j] = new_tables[j].second * f(new_tables[j].first);
+        }
+        p_t[0] = (state.gamma_ / state.V + mass) * state.alpha_ / (state.gamma_ + ntables);
+        i = lda_util::sample_weights(p_t, rng);
+        if (i != 0 && i < tables.size()) {
+            const size_t t = tables[i];
+            const size_t k = state.dish_assignment(eid, t);
+            sizes[t] += 1;
+            after[t] += 1;
+            move_word(k, 1);
+            continue;
+        }
+        if (i != 0) {
+            new_tables[i - tables.size()].second += 1;
+            move_word(new_tables[i - tables.size()].first, 1);
+            continue;
+        }
+
+        const auto &dishes = state.dishes();
+        auto &p_k = ws.p_k;
+        p_k.resize(dishes.size() + new_dishes.size());
+        for (i = 1; i < dishes.size(); i++) {
+            p_k[i] = dishsize(dishes[i]) * f(dishes[i]);
+        }
+        for (j = 0; j < new_dishes.size(); j++) {
+            p_k[i + j] = dishsize(ndishes + j) * f(ndishes + j);
+        }
+        p_k[0] = state.gamma_ / state.V;
+        i = lda_util::sample_weights(p_k, rng);
+        size_t k;
+        if (i == 0) {
+            // A new dish, reusing one that has lost its tables.
+            for (j = 0; j < new_dishes.size() && new_dishes[j].first > 0; j++);
+            if (j == new_dishes.size()) new_dishes.push_back(std::make_pair(0, 0));
+            k = ndishes + j;
+        }
+        else {
+            k = i < dishes.size() ? dishes[i] : ndishes + i - dishes.size();
+        }
+        move_table(k, 1);
+        new_tables.push_back(std::make_pair(k, 1));
+        move_word(k, 1);
+    }
+
+    // Into the state, a table at a time. The new tables are opened first
+    // so that their dishes outlive the tables the run leaves, which free
+    // copies for the tables the run joins.
+    auto &left = ws.run_left;
+    left.assign(tables.begin() + 1, tables.end());
+    for (auto t : left) {
+        const size_t k = state.dish_assignment(eid, t);
+        dish_words[k] = dish_tables[k] = 0;
+    }
+    for (auto &nt : new_tables) {
+        if (nt.first < ndishes) dish_words[nt.first] = dish_tables[nt.first] = 0;
+    }
+    auto &ids = ws.run_new_dish_ids;
+    ids.assign(new_dishes.size(), 0);
+    auto &opened = ws.run_opened;
+    opened.clear();
+    for (auto &nt : new_tables) {
+        size_t k = nt.first;
+        if (k >= ndishes) {
+            if (ids[k - ndishes] == 0) ids[k - ndishes] = state.create_dish();
+            k = ids[k - ndishes];
+        }
+        opened.push_back(std::make_pair(state.create_table(eid, k), nt.second));
+    }
+    for (auto t : left) {
+        if (after[t] < before[t]) state.remove_run_tokens(eid, r, t, before[t] - after[t]);
+    }
+    for (auto t : left) {
+        if (after[t] > before[t]) state.add_run_tokens(eid, t, r, after[t] - before[t]);
+    }
+    for (auto &nt : opened) {
+        state.add_run_tokens(eid, nt.first, r, nt.second);
+    }
+}
+
+mh_proposals::mh_proposals(const microscopes::lda::state &state)
+    : gamma_(state.gamma_),
+      dishes_(),
+      prior_weights_(state.dish_capacity(), 0),
+      smoothing_weights_(state.dish_capacity(), 0),
+      words_(state.nwords()),
+      nassigned_(state.nentities(), 0)
+{
+    // Dish id 0 stands for a new dish in all of the weight vectors.
+    prior_weights_[0] = state.gamma_;
+    smoothing_weights_[0] = state.gamma_ / state.V;
+    dishes_.push_back(0);
+    for (auto k : state.dishes()) {
+        if (k == 0 || state.dishsize(k) == 0) continue;
+        prior_weights_[k] = state.dishsize(k);
+        smoothing_weights_[k] = state.beta_ * state.dishsize(k) * state.inv_smoothed_n_k(k);
+        dishes_.push_back(k);
+    }
+    std::vector<float> weights;
+    for (auto k : dishes_) weights.push_back(prior_weights_[k]);
+    prior_.build(weights);
+    weights.clear();
+    for (auto k : dishes_) weights.push_back(smoothing_weights_[k]);
+    smoothing_.build(weights);
+
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        for (auto t : state.tables(eid)) {
+            if (t != 0) nassigned_[eid] += state.tablesize(eid, t);
+        }
+    }
+}
+
+const mh_proposals::word_proposal &
+mh_proposals::word(microscopes::lda::state &state, size_t v) {
+    auto &w = words_[v];
+    if (!w.built) {
+        const auto &dishes = state.word_dishes(v);
+        w.dishes.assign(dishes.begin(), dishes.end());
+        std::sort(w.dishes.begin(), w.dishes.end()); // for lookups in word_probability
+        w.weights.clear();
+        for (auto k : w.dishes) {
+            w.weights.push_back(state.dishsize(k) * state.dish_word_count(k, v) * state.inv_smoothed_n_k(k));
+        }
+        w.alias.build(w.weights);
+        w.built = true;
+    }
+    return w;
+}
+
+size_t
+mh_proposals::sample_prior(common::rng_t &rng) const {
+    return dishes_[prior_.sample(rng)];
+}
+
+size_t
+mh_proposals::sample_word(microscopes::lda::state &state, size_t v, common::rng_t &rng) {
+    const auto &w = word(state, v);
+    double r = w.alias.total();
+    if (std::uniform_real_distribution<double>(0, r + smoothing_.total())(rng) < r) {
+        return w.dishes[w.alias.sample(rng)];
+    }
+    return dishes_[smoothing_.sample(rng)];
+}
+
+double
+mh_proposals::prior_probability(size_t k) const {
+    return k < prior_weights_.size() ? prior_weights_[k] / prior_.total() : 0;
+}
+
+double
+mh_proposals::word_probability(microscopes::lda::state &state, size_t v, size_t k) {
+    const auto &w = word(state, v);
+    double p = k < smoothing_weights_.size() ? smoothing_weights_[k] : 0;
+    if (k != 0) {
+        auto it = std::lower_bound(w.dishes.begin(), w.dishes.end(), k);
+        if (it != w.dishes.end() && *it == k) p += w.weights[it - w.dishes.begin()];
+    }
+    return p / (w.alias.total() + smoothing_.total());
+}
+
+namespace {
+
+// Where a word sits while sampling_t_mh moves it: an existing table t, or
+// a new table (t == 0) at dish k, with k == 0 for a new dish.
+struct seat {
+    size_t t;
+    size_t k;
+};
+
+}
+
+void
+sampling_t_mh(microscopes::lda::state &state, mh_proposals &proposals, size_t eid, size_t r, size_t pos,
+              size_t nsteps, common::rng_t &rng) {
+    size_t t_old = state.run_tables(eid).table(r, pos);
+    if (t_old == 0) {
+        workspace ws;
+        sampling_t_sparse(state, eid, r, pos, rng, ws);
+        proposals.assigned(eid);
+        return;
+    }
+    // The word's seat once it is removed: its table, a new table at its
+    // dish if the table empties, or a new dish if the dish empties too.
+    seat cur = {t_old, state.dish_assignment(eid, t_old)};
+    if (state.tablesize(eid, t_old) == 1) {
+        cur.t = 0;
+        if (state.dishsize(cur.k) == 1) cur.k = 0;
+    }
+    state.remove_run_token(eid, r, pos);
+
+    const size_t v = state.run_word(eid, r);
+    const size_t i = state.x_ji->begin(eid, r) + pos;
+    const size_t nterms = state.nterms(eid);
+    size_t search_steps = 1;
+    for (size_t n = state.nruns(eid); n > 1; n >>= 1) search_steps++;
+    const auto &tables = state.tables(eid);
+    const double alpha = state.alpha_;
+    const double c = state.alpha_ / (state.gamma_ + state.ntables());
+    const double n_j = proposals.nassigned(eid) - 1;
+
+    // The conditional that sampling_t draws from, unnormalized.
+    auto target = [&](const seat &s) -> double {
+        if (s.t == 0 && s.k == 0) return c * state.gamma_ / state.V;
+        double f_k = state.smoothed_n_kv(s.k, v) * state.inv_smoothed_n_k(s.k);
+        return (s.t != 0 ? state.tablesize(eid, s.t) : c * state.dishsize(s.k)) * f_k;
+    };
+
+    // Document proposal: the table of another seated word in the document,
+    // or a new table. The new table's dish comes half the time from the
+    // stale prior and half the time uniformly from the current dishes
+    // (dishes()[0] being a new dish), so that dishes created since the
+    // snapshot can still be proposed.
+    const auto &dishes = state.dishes();
+    auto doc_probability = [&](const seat &s) -> double {
+        if (s.t != 0) return state.tablesize(eid, s.t) / (n_j + alpha);
+        bool active = s.k == 0 || state.dishsize(s.k) > 0;
+        double p_k = 0.5 * proposals.prior_probability(s.k) + (active ? 0.5 / dishes.size() : 0);
+        return alpha / (n_j + alpha) * p_k;
+    };
+    auto propose_doc = [&]() -> seat {
+        if (std::uniform_real_distribution<double>(0, n_j + alpha)(rng) >= n_j) {
+            if (std::uniform_int_distribution<int>(0, 1)(rng)) {
+                return seat{0, proposals.sample_prior(rng)};
+            }
+            return seat{0, dishes[std::uniform_int_distribution<size_t>(0, dishes.size() - 1)(rng)]};
+        }
+        // A random position costs a search over the document's runs, so
+        // short table lists are walked instead.
+        if (4 * n_j >= nterms && tables.size() > search_steps) {
+            std::uniform_int_distribution<size_t> position(0, nterms - 1);
+            while (true) {
+                size_t p = position(rng), rp = state.x_ji->run_of(eid, p);
+                size_t t = state.run_tables(eid).table(rp, p - state.x_ji->begin(eid, rp));
+                if (p != i && t != 0) return seat{t, state.dish_assignment(eid, t)};
+            }
+        }
+        // Few tables, or few words seated yet (first sweep).
+        double u = std::uniform_real_distribution<double>(0, n_j)(rng);
+        size_t t_pick = 0;
+        for (auto t : tables) {
+            if (t == 0) continue;
+            t_pick = t;
+            u -= state.tablesize(eid, t);
+            if (u < 0) break;
+        }
+        return seat{t_pick, state.dish_assignment(eid, t_pick)};
+    };
+
+    // Word proposal: a dish from the stale word + smoothing mixture, then a
+    // table at that dish in proportion to its weight in the target.
+    auto dish_mass = [&](size_t k) -> double {
+        double z = c * state.dishsize(k);
+        for (auto t : tables) {
+            if (t != 0 && state.dish_assignment(eid, t) == k) z += state.tablesize(eid, t);
+        }
+        return z;
+    };
+    auto word_probability = [&](const seat &s) -> double {
+        double p = proposals.word_probability(state, v, s.k);
+        if (s.k == 0) return p;
+        double z = dish_mass(s.k);
+        if (z == 0) return 0;
+        return p * (s.t != 0 ? state.tablesize(eid, s.t) : c * state.dishsize(s.k)) / z;
+    };
+    auto propose_word = [&]() -> seat {
+        size_t k = proposals.sample_word(state, v, rng);
+        if (k == 0) return seat{0, 0};
+        double u = std::uniform_real_distribution<double>(0, dish_mass(k))(rng);
+        for (auto t : tables) {
+            if (t == 0 || state.dish_assignment(eid, t) != k) continue;
+            u -= state.tablesize(eid, t);
+            if (u < 0) return seat{t, k};
+        }
+        return seat{0, k};
+    };
+
+    double p_cur = target(cur);
+    double q_cur[2] = {-1, -1}; // doc and word proposal probabilities of cur, once known
+    std::uniform_real_distribution<double> unif(0, 1);
+    for (size_t step = 0; step < 2 * nsteps; ++step) {
+        bool doc_step = step % 2 == 0;
+        seat prop = doc_step ? propose_doc() : propose_word();
+        double q_fwd = doc_step ? doc_probability(prop) : word_probability(prop);
+        double &q_rev = q_cur[doc_step ? 0 : 1];
+        if (q_rev < 0) q_rev = doc_step ? doc_probability(cur) : word_probability(cur);
+        double p_prop = target(prop);
+        if (unif(rng) * p_cur * q_fwd < p_prop * q_rev) {
+            cur = prop;
+            p_cur = p_prop;
+            q_cur[0] = q_cur[1] = -1;
+            q_cur[doc_step ? 0 : 1] = q_fwd;
+        }
+    }
+
+    size_t t_new = cur.t;
+    if (t_new == 0) {
+        size_t k_new = cur.k == 0 ? state.create_dish() : cur.k;
         t_new = state.create_table(eid, k_new);
     }
-    state.add_table(eid, t_new, i);
+    state.add_run_token(eid, t_new, r, pos);
 }
 
 void
-sampling_k(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
+sampling_t_mh(microscopes::lda::state &state, mh_proposals &proposals, size_t eid, size_t i,
+              size_t nsteps, common::rng_t &rng) {
+    auto seat = state.x_ji->locate(eid, i);
+    sampling_t_mh(state, proposals, eid, seat.first, seat.second, nsteps, rng);
+}
+
+void
+sampling_k(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng, workspace &ws) {
     state.leave_from_dish(eid, t);
-    auto p_k = calc_dish_posterior_t(state, eid, t, rng);
-    size_t k_new = state.dishes_[common::util::sample_discrete(p_k, rng)];
+    dish_log_weights_t(state, eid, t, ws.p_k, false);
+    size_t k_new = state.dishes()[lda_util::sample_log_weights(ws.p_k, rng)];
     if (k_new == 0) k_new = state.create_dish();
     state.seat_at_dish(eid, t, k_new);
 }
 
+void
+sampling_k(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
+    workspace ws;
+    sampling_k(state, eid, t, rng, ws);
+}
+
+void
+sampling_t_document(microscopes::lda::state &state, size_t eid, token_sampler sample_token,
+                    common::rng_t &rng, workspace &ws)
+{
+    for (size_t r = 0; r < state.nruns(eid); ++r) {
+        for (size_t pos = 0; pos < state.run_count(eid, r); ++pos) {
+            sample_token(state, eid, r, pos, rng, ws);
+        }
+    }
+}
+
+std::vector<double>
+document_costs(const microscopes::lda::state &state)
+{
+    std::vector<double> costs(state.nentities());
+    for (size_t eid = 0; eid < costs.size(); ++eid) {
+        costs[eid] = state.nterms(eid) + state.ntables(eid);
+    }
+    return costs;
+}
+
+void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, workspace &ws)
+{
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        for (auto t : state.tables(eid)) {
+            if (t != 0) {
+                sampling_k(state, eid, t, rng, ws);
+            }
+        }
+    }
+}
+
+void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, size_t nthreads)
+{
+    if (nthreads <= 1) {
+        workspace ws;
+        sampling_k_sweep(state, rng, ws);
+        return;
+    }
+    sampling_k_sweep(state, rng, sweep_scheduler(nthreads));
+}
+
+void
+sampling_k_sweep(microscopes::lda::state &state, common::rng_t &rng, microscopes::lda::scheduler &scheduler)
+{
+    // Speculative: the next `window` tables each draw a dish from their
+    // posterior against the current counts, one task per table with an
+    // rng seeded from rng, and the draws are applied in table order up
+    // to the first that moves a table. The tables after it drew against
+    // counts that have since changed, so they draw again. Every draw
+    // applied is thus made against the counts it is applied to, as in
+    // the serial sweep. The window grows while whole windows are applied
+    // and shrinks to twice the draws applied otherwise; it depends only
+    // on the draws, so the result depends only on rng.
+    const size_t min_window = 8, max_window = 256;
+    std::vector<std::pair<size_t, size_t>> tables;
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        for (auto t : state.tables(eid)) {
+            if (t != 0) tables.push_back(std::make_pair(eid, t));
+        }
+    }
+    std::vector<size_t> proposed(tables.size());
+    std::vector<common::rng_t::result_type> seeds;
+    std::vector<double> costs;
+
+    std::vector<workspace> ws(scheduler.nthreads());
+    size_t window = min_window;
+    for (size_t first = 0; first < tables.size();) {
+        const size_t n = std::min(window, tables.size() - first);
+        seeds.resize(n);
+        costs.resize(n);
+        for (size_t d = 0; d < n; ++d) {
+            seeds[d] = rng();
+            const auto &table = tables[first + d];
+            costs[d] = state.table_words(table.first, table.second).size() + 1;
+        }
+        scheduler.run(costs, [&](size_t d, size_t thread) {
+            const auto &table = tables[first + d];
+            common::rng_t table_rng(seeds[d]);
+            auto &p_k = ws[thread].p_k;
+            dish_log_weights_t(state, table.first, table.second, p_k, true);
+            proposed[first + d] = state.dishes()[lda_util::sample_log_weights(p_k, table_rng)];
+        });
+        const size_t next = apply_dish_draws(state, tables, proposed, first, first + n);
+        window = next - first == n ? 2 * n : 2 * (next - first);
+        window = std::min(max_window, std::max(min_window, window));
+        first = next;
+    }
+}
+
+size_t
+apply_dish_draws(microscopes::lda::state &state, const std::vector<std::pair<size_t, size_t>> &tables,
+                 const std::vector<size_t> &proposed, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i) {
+        const size_t eid = tables[i].first, t = tables[i].second;
+        size_t k_new = proposed[i];
+        if (k_new == state.dish_assignment(eid, t)) continue;
+        MICROSCOPES_DCHECK(k_new == 0 || state.dishes_.contains(k_new), "drawn dish is gone");
+        state.leave_from_dish(eid, t);
+        if (k_new == 0) k_new = state.create_dish();
+        state.seat_at_dish(eid, t, k_new);
+        return i + 1;
+    }
+    return last;
+}
+
+namespace {
+
+// Two groups of tables in a split-merge proposal: their table and word
+// counts, and counts by word, kept for the words that have been seen.
+struct split_groups {
+    size_t ntables[2];
+    size_t nwords[2];
+    std::vector<uint32_t> counts[2];
+    std::vector<uint32_t> seen;
+
+    explicit split_groups(size_t V)
+    {
+        counts[0].assign(V, 0);
+        counts[1].assign(V, 0);
+    }
+
+    void
+    clear()
+    {
+        for (auto v : seen) counts[0][v] = counts[1][v] = 0;
+        seen.clear();
+        ntables[0] = ntables[1] = nwords[0] = nwords[1] = 0;
+    }
+
+    void
+    add(const microscopes::lda::state &state, size_t eid, size_t t, int g)
+    {
+        ntables[g] += 1;
+        nwords[g] += state.tablesize(eid, t);
+        for (auto &kv : state.table_words(eid, t)) {
+            if (counts[0][kv.first] == 0 && counts[1][kv.first] == 0) seen.push_back(kv.first);
+            counts[g][kv.first] += kv.second;
+        }
+    }
+
+    // log ntables[g] + log p(words of table t | words of group g).
+    double
+    log_weight(microscopes::lda::state &state, size_t eid, size_t t, int g)
+    {
+        double ret = log(double(ntables[g]));
+        ret += state.lgamma_vbeta(nwords[g]) - state.lgamma_vbeta(nwords[g] + state.tablesize(eid, t));
+        for (auto &kv : state.table_words(eid, t)) {
+            const size_t n = counts[g][kv.first];
+            ret += state.lgamma_beta(n + kv.second) - state.lgamma_beta(n);
+        }
+        return ret;
+    }
+
+    // log p(state with the groups as two dishes) - log p(state with them as one).
+    double
+    log_split_ratio(microscopes::lda::state &state)
+    {
+        double ret = log(double(state.gamma_));
+        ret += lgamma(double(ntables[0])) + lgamma(double(ntables[1])) - lgamma(double(ntables[0] + ntables[1]));
+        ret += state.lgamma_vbeta(0) + state.lgamma_vbeta(nwords[0] + nwords[1]);
+        ret -= state.lgamma_vbeta(nwords[0]) + state.lgamma_vbeta(nwords[1]);
+        for (auto v : seen) {
+            const size_t a = counts[0][v], b = counts[1][v];
+            ret += state.lgamma_beta(a) + state.lgamma_beta(b);
+            ret -= state.lgamma_beta(a + b) + state.lgamma_beta(0);
+        }
+        return ret;
+    }
+};
+
+}
+
+void
+split_merge(microscopes::lda::state &state, common::rng_t &rng, size_t nproposals, split_merge_stats &stats)
+{
+    // Every table with a dish, and each dish's tables as indices into them;
+    // rebuilt after each accepted move.
+    typedef std::pair<size_t, size_t> table_id;
+    std::vector<table_id> tables;
+    std::vector<std::vector<size_t>> dish_tables;
+    auto index_tables = [&]() {
+        tables.clear();
+        dish_tables.assign(state.dish_capacity(), std::vector<size_t>());
+        for (size_t eid = 0; eid < state.nentities(); ++eid) {
+            for (auto t : state.tables(eid)) {
+                const size_t k = state.dish_assignment(eid, t);
+                if (k == 0) continue;
+                dish_tables[k].push_back(tables.size());
+                tables.push_back(table_id(eid, t));
+            }
+        }
+    };
+    auto dish_of = [&](size_t i) { return state.dish_assignment(tables[i].first, tables[i].second); };
+
+    index_tables();
+    split_groups groups(state.V);
+    std::vector<size_t> others, moved;
+    std::uniform_real_distribution<double> unif(0, 1);
+    for (size_t p = 0; p < nproposals && tables.size() >= 2; ++p) {
+        const size_t a = std::uniform_int_distribution<size_t>(0, tables.size() - 1)(rng);
+        size_t b = std::uniform_int_distribution<size_t>(0, tables.size() - 2)(rng);
+        if (b >= a) ++b;
+        const size_t k_a = dish_of(a), k_b = dish_of(b);
+        const bool split = k_a == k_b;
+
+        others.clear();
+        for (auto i : dish_tables[k_a]) {
+            if (i != a && i != b) others.push_back(i);
+        }
+        if (!split) {
+            for (auto i : dish_tables[k_b]) {
+                if (i != b) others.push_back(i);
+            }
+        }
+        std::shuffle(others.begin(), others.end(), rng);
+
+        // Group 0 grows from table a and group 1 from table b. For a merge
+        // the tables go where they are now, which gives the probability
+        // of the split that would undo it.
+        groups.clear();
+        groups.add(state, tables[a].first, tables[a].second, 0);
+        groups.add(state, tables[b].first, tables[b].second, 1);
+        moved.assign(1, a);
+        double log_q = 0;
+        for (auto i : others) {
+            const size_t eid = tables[i].first, t = tables[i].second;
+            const double diff = groups.log_weight(state, eid, t, 1) - groups.log_weight(state, eid, t, 0);
+            const double p_0 = 1 / (1 + exp(diff));
+            int g;
+            if (split) {
+                g = unif(rng) < p_0 ? 0 : 1;
+            }
+            else {
+                g = dish_of(i) == k_a ? 0 : 1;
+            }
+            log_q += log(g == 0 ? p_0 : 1 - p_0);
+            groups.add(state, eid, t, g);
+            if (g == 0) moved.push_back(i);
+        }
+
+        const double log_ratio = groups.log_split_ratio(state);
+        const double log_accept = split ? log_ratio - log_q : log_q - log_ratio;
+        if (split) {
+            stats.nsplits_proposed += 1;
+        }
+        else {
+            stats.nmerges_proposed += 1;
+        }
+        if (log_accept < 0 && log(unif(rng)) >= log_accept) continue;
+
+        // Group 0 moves to a new dish for a split, or to k_b for a merge.
+        const size_t k_new = split ? state.create_dish() : k_b;
+        for (auto i : moved) {
+            const size_t eid = tables[i].first, t = tables[i].second;
+            state.leave_from_dish(eid, t);
+            state.seat_at_dish(eid, t, k_new);
+        }
+        if (split) {
+            stats.nsplits_accepted += 1;
+        }
+        else {
+            stats.nmerges_accepted += 1;
+        }
+        index_tables();
+    }
+    stats.ntopics.push_back(state.ntopics());
+}
+
 } // namespace lda_crp
 
+namespace lda_direct {
+
+// Part of ws.smoothing for dish k.
+static inline double
+smoothing_term(const microscopes::lda::state &state, const workspace &ws, size_t k) {
+    return state.alpha_ * ws.beta[k] * state.beta_ * state.inv_smoothed_n_k(k);
+}
+
+// Makes room in ws for dish ids up to the state's capacity.
+static void
+reserve_dishes(const microscopes::lda::state &state, workspace &ws) {
+    const size_t ndishes = state.dish_capacity();
+    if (ws.beta.size() < ndishes) ws.beta.resize(ndishes, 0);
+    if (ws.n_jk.size() < ndishes) {
+        ws.n_jk.resize(ndishes, 0);
+        ws.table_of.resize(ndishes, 0);
+        ws.offsets.resize(ndishes, 0);
+    }
+}
+
+void
+sample_beta(const microscopes::lda::state &state, common::rng_t &rng, workspace &ws) {
+    ws.beta.assign(state.dish_capacity(), 0);
+    double total = std::gamma_distribution<double>(state.gamma_, 1.0)(rng);
+    ws.beta_new = total;
+    for (auto k : state.dishes()) {
+        if (k == 0) continue;
+        MICROSCOPES_DCHECK(state.dishsize(k) > 0, "active dish without tables");
+        ws.beta[k] = std::gamma_distribution<double>(state.dishsize(k), 1.0)(rng);
+        total += ws.beta[k];
+    }
+    for (auto &b : ws.beta) b /= total;
+    ws.beta_new /= total;
+}
+
+void
+begin_document(const microscopes::lda::state &state, size_t eid, workspace &ws) {
+    reserve_dishes(state, ws);
+    for (auto t : state.tables(eid)) {
+        if (t == 0 || state.tablesize(eid, t) == 0) continue;
+        const size_t k = state.dish_assignment(eid, t);
+        ws.n_jk[k] += state.tablesize(eid, t);
+        ws.table_of[k] = t;
+    }
+    // Recomputed for each document so that rounding does not build up.
+    ws.smoothing = state.alpha_ * ws.beta_new / state.V;
+    for (auto k : state.dishes()) {
+        if (k != 0) ws.smoothing += smoothing_term(state, ws, k);
+    }
+}
+
+void
+sampling_z(microscopes::lda::state &state, size_t eid, size_t run, size_t pos, common::rng_t &rng,
+           workspace &ws) {
+    const size_t v = state.run_word(eid, run);
+    const size_t t_old = state.run_tables(eid).table(run, pos);
+    if (t_old != 0) {
+        const size_t k_old = state.dish_assignment(eid, t_old);
+        ws.smoothing -= smoothing_term(state, ws, k_old);
+        state.remove_run_token(eid, run, pos);
+        // A deleted dish has n_k = 0, so its term is alpha * beta_k / V,
+        // the same as it adds to the new dish term when beta_k goes back.
+        ws.smoothing += smoothing_term(state, ws, k_old);
+        ws.n_jk[k_old] -= 1;
+        if (!state.dishes_.contains(k_old)) {
+            ws.beta_new += ws.beta[k_old];
+            ws.beta[k_old] = 0;
+        }
+        if (ws.table_of[k_old] == t_old && !state.using_t[eid].contains(t_old)) {
+            ws.table_of[k_old] = 0;
+            for (auto t : state.tables(eid)) {
+                if (t != 0 && state.tablesize(eid, t) > 0 && state.dish_assignment(eid, t) == k_old) {
+                    ws.table_of[k_old] = t;
+                }
+            }
+        }
+    }
+
+    // The weight of dish k is
+    //   (n_jk + alpha * beta_k) * (n_kv + beta) / (n_k + V*beta)
+    // and of a new dish alpha * beta_new / V. Split as
+    //   word:      (n_jk + alpha * beta_k) * n_kv / (n_k + V*beta) over dishes with n_kv > 0,
+    //   document:  n_jk * beta / (n_k + V*beta) over the document's tables,
+    //   smoothing: alpha * beta_k * beta / (n_k + V*beta), and the new dish (ws.smoothing).
+    const double alpha = state.alpha_;
+    const float beta = state.beta_;
+    const auto &word_dishes = state.word_dishes(v);
+    const auto n_kv = state.word_counts(v);
+    const auto &tables = state.tables(eid);
+    double word_mass = 0;
+    for (auto k : word_dishes) {
+        word_mass += (ws.n_jk[k] + alpha * ws.beta[k]) * n_kv[k] * state.inv_smoothed_n_k(k);
+    }
+    double doc_mass = 0;
+    for (auto t : tables) {
+        if (t == 0) continue;
+        doc_mass += state.tablesize(eid, t) * beta * state.inv_smoothed_n_k(state.dish_assignment(eid, t));
+    }
+
+    double u = std::uniform_real_distribution<double>(0, word_mass + doc_mass + ws.smoothing)(rng);
+    size_t k_new = 0;
+    if (u < word_mass) {
+        for (auto k : word_dishes) {
+            k_new = k;
+            u -= (ws.n_jk[k] + alpha * ws.beta[k]) * n_kv[k] * state.inv_smoothed_n_k(k);
+            if (u < 0) break;
+        }
+    }
+    else if ((u -= word_mass) < doc_mass) {
+        for (auto t : tables) {
+            if (t == 0 || state.tablesize(eid, t) == 0) continue;
+            k_new = state.dish_assignment(eid, t);
+            u -= state.tablesize(eid, t) * beta * state.inv_smoothed_n_k(k_new);
+            if (u < 0) break;
+        }
+    }
+    else {
+        u -= doc_mass;
+        for (auto k : state.dishes()) {
+            if (k == 0) continue;
+            u -= smoothing_term(state, ws, k);
+            if (u < 0) {
+                k_new = k;
+                break;
+            }
+        }
+    }
+    if (k_new == 0) {
+        // Break the new dish's weight off beta_new: b ~ Beta(1, gamma).
+        k_new = state.create_dish();
+        reserve_dishes(state, ws);
+        const double x = std::gamma_distribution<double>(1.0, 1.0)(rng);
+        const double y = std::gamma_distribution<double>(state.gamma_, 1.0)(rng);
+        ws.beta[k_new] = ws.beta_new * x / (x + y);
+        ws.beta_new -= ws.beta[k_new];
+    }
+
+    ws.smoothing -= smoothing_term(state, ws, k_new);
+    size_t t_new = ws.table_of[k_new];
+    if (t_new == 0) t_new = ws.table_of[k_new] = state.create_table(eid, k_new);
+    state.add_run_token(eid, t_new, run, pos);
+    ws.n_jk[k_new] += 1;
+    ws.smoothing += smoothing_term(state, ws, k_new);
+}
+
+void
+sampling_m(microscopes::lda::state &state, size_t eid, common::rng_t &rng, workspace &ws) {
+    // The document's words, grouped by dish and in document order within
+    // each dish.
+    auto &dishes = ws.doc_dishes;
+    dishes.clear();
+    for (auto t : state.tables(eid)) {
+        if (t == 0 || state.tablesize(eid, t) == 0) continue;
+        dishes.push_back(state.dish_assignment(eid, t));
+    }
+    std::sort(dishes.begin(), dishes.end());
+    dishes.erase(std::unique(dishes.begin(), dishes.end()), dishes.end());
+    uint32_t offset = 0;
+    for (auto k : dishes) {
+        ws.offsets[k] = offset;
+        offset += ws.n_jk[k];
+    }
+    MICROSCOPES_DCHECK(offset == state.nterms(eid), "words not seated");
+    ws.order.resize(offset);
+    uint32_t i = 0;
+    for (size_t r = 0; r < state.nruns(eid); ++r) {
+        for (auto &s : state.run_tables(eid).run(r)) {
+            const size_t k = state.dish_assignment(eid, s.first);
+            for (uint32_t c = 0; c < s.second; ++c) ws.order[ws.offsets[k]++] = i++;
+        }
+    }
+
+    // Each word of dish k starts a new table with probability
+    // a / (a + i) for a = alpha * beta_k after i others, and otherwise
+    // joins the table of one of those drawn uniformly (that is, a table
+    // in proportion to its size).
+    ws.token_tables.resize(offset);
+    ws.table_dishes.assign(1, 0);
+    size_t begin = 0;
+    for (auto k : dishes) {
+        const double a = state.alpha_ * ws.beta[k];
+        const size_t n = ws.n_jk[k];
+        for (size_t c = 0; c < n; ++c) {
+            const uint32_t token = ws.order[begin + c];
+            if (c == 0 || std::uniform_real_distribution<double>(0, a + c)(rng) < a) {
+                ws.token_tables[token] = ws.table_dishes.size();
+                ws.table_dishes.push_back(k);
+            }
+            else {
+                const size_t other = std::uniform_int_distribution<size_t>(0, c - 1)(rng);
+                ws.token_tables[token] = ws.token_tables[ws.order[begin + other]];
+            }
+        }
+        begin += n;
+        ws.n_jk[k] = 0;
+        ws.table_of[k] = 0;
+    }
+    state.reseat_document(eid, ws.token_tables, ws.table_dishes);
+}
+
+void
+sampling_document(microscopes::lda::state &state, size_t eid, common::rng_t &rng, workspace &ws) {
+    begin_document(state, eid, ws);
+    for (size_t r = 0; r < state.nruns(eid); ++r) {
+        for (size_t pos = 0; pos < state.run_count(eid, r); ++pos) {
+            sampling_z(state, eid, r, pos, rng, ws);
+        }
+    }
+    sampling_m(state, eid, rng, ws);
+}
+
+} // namespace lda_direct
+
 void
 lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng)
+{
+    lda_crp_gibbs(state, rng, lda_crp::sampling_t);
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token)
+{
+    lda_crp::workspace ws;
+    lda_crp_gibbs(state, rng, sample_token, ws);
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token, lda_crp::workspace &ws)
 {
     for (size_t eid = 0; eid < state.nentities(); ++eid) {
-        for (size_t i = 0; i < state.nterms(eid); ++i) {
-            lda_crp::sampling_t(state, eid, i, rng);
-        }
+        lda_crp::sampling_t_document(state, eid, sample_token, rng, ws);
+    }
+    lda_crp::sampling_k_sweep(state, rng, ws);
+    // merge_workers does this for the parallel sweep.
+    state.resync_smoothing_mass();
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token, size_t nthreads)
+{
+    if (nthreads <= 1) {
+        lda_crp_gibbs(state, rng, sample_token);
+        return;
     }
+    lda_crp_gibbs(state, rng, sample_token, sweep_scheduler(nthreads));
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_crp::token_sampler sample_token, microscopes::lda::scheduler &scheduler)
+{
+    // Approximate distributed sweep (Newman et al., AD-LDA): each worker
+    // samples its own documents against a private copy of the global
+    // counts, and the count changes are summed afterwards. A document
+    // must be sampled against the same worker's counts whatever the
+    // thread timing, so the documents are dealt to the workers by cost
+    // and not stolen; setting up and tearing down the workers is.
+    // Worker seeds come from rng, so the result depends only on rng and
+    // the number of threads.
+    const size_t nworkers = scheduler.nthreads();
+    auto costs = lda_crp::document_costs(state);
+    auto owner = scheduler.partition(costs);
+    std::vector<std::vector<size_t>> parts(nworkers);
+    for (size_t eid = 0; eid < owner.size(); ++eid) {
+        parts[owner[eid]].push_back(eid);
+    }
+    std::vector<std::shared_ptr<microscopes::lda::state>> workers(nworkers);
+    std::vector<common::rng_t> worker_rngs;
+    for (size_t w = 0; w < nworkers; ++w) {
+        worker_rngs.push_back(common::rng_t(rng()));
+    }
+    std::vector<lda_crp::workspace> ws(nworkers);
+    const std::vector<double> per_worker(nworkers, 1);
+
+    scheduler.run(per_worker, [&](size_t w, size_t) {
+        auto ids = std::make_shared<microscopes::lda::dish_id_pool>(state.dishes_, w, nworkers);
+        workers[w] = std::make_shared<microscopes::lda::state>(state, ids);
+        workers[w]->swap_documents(state, parts[w]);
+    });
+    scheduler.run(costs, [&](size_t eid, size_t w) {
+        lda_crp::sampling_t_document(*workers[w], eid, sample_token, worker_rngs[w], ws[w]);
+    }, false);
+    scheduler.run(per_worker, [&](size_t w, size_t) {
+        workers[w]->swap_documents(state, parts[w]);
+    });
+
+    state.merge_workers(workers);
+    lda_crp::sampling_k_sweep(state, rng, scheduler);
+}
+
+void
+lda_crp_mh(microscopes::lda::state &state, common::rng_t &rng, size_t nsteps)
+{
+    lda_crp::mh_proposals proposals(state);
     for (size_t eid = 0; eid < state.nentities(); ++eid) {
-        for (auto t : state.using_t[eid]) {
-            if (t != 0) {
-                lda_crp::sampling_k(state, eid, t, rng);
+        for (size_t r = 0; r < state.nruns(eid); ++r) {
+            for (size_t pos = 0; pos < state.run_count(eid, r); ++pos) {
+                lda_crp::sampling_t_mh(state, proposals, eid, r, pos, nsteps, rng);
             }
         }
     }
+    lda_crp::sampling_k_sweep(state, rng, 1);
+}
+
+void
+lda_direct_gibbs(microscopes::lda::state &state, common::rng_t &rng)
+{
+    lda_direct::workspace ws;
+    lda_direct_gibbs(state, rng, ws);
+}
+
+void
+lda_direct_gibbs(microscopes::lda::state &state, common::rng_t &rng, lda_direct::workspace &ws)
+{
+    lda_direct::sample_beta(state, rng, ws);
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        lda_direct::sampling_document(state, eid, rng, ws);
+    }
 }
 
 } // namespace kernels
@@ -0,0 +1,38 @@
+#include <microscopes/lda/mapped_file.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+microscopes::lda::mapped_file::mapped_file(const std::string &path)
+    : path_(path), fd_(-1), data_(nullptr), size_(0)
+{
+    fd_ = open(path.c_str(), O_RDONLY);
+    MICROSCOPES_CHECK(fd_ >= 0, "cannot open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        std::string error = strerror(errno);
+        ::close(fd_);
+        MICROSCOPES_CHECK(false, "cannot stat " + path + ": " + error);
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (data == MAP_FAILED) {
+            std::string error = strerror(errno);
+            ::close(fd_);
+            MICROSCOPES_CHECK(false, "cannot map " + path + ": " + error);
+        }
+        data_ = static_cast<const char *>(data);
+    }
+}
+
+microscopes::lda::mapped_file::~mapped_file()
+{
+    if (data_) munmap(const_cast<char *>(data_), size_);
+    if (fd_ >= 0) ::close(fd_);
+}
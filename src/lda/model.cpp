@@ -1,11 +1,24 @@
 #include <microscopes/lda/model.hpp>
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+float lgamma_f(float x) { return distributions::fast_lgamma(x); }
+
+float log_f(float x) { return distributions::fast_log(x); }
+
+}
+
 
 microscopes::lda::model_definition::model_definition(size_t n, size_t v)
     : n_(n), v_(v)
 {
     MICROSCOPES_DCHECK(n > 0, "no docs");
     MICROSCOPES_DCHECK(v > 0, "no terms");
+    MICROSCOPES_DCHECK(v <= std::numeric_limits<uint32_t>::max(), "too many terms");
 }
 
 microscopes::lda::state::state(const model_definition &defn,
@@ -13,16 +26,38 @@ microscopes::lda::state::state(const model_definition &defn,
       float beta,
       float gamma,
       const microscopes::lda::nested_vector &docs)
-    : V(defn.v()),
+    : state(defn.v(), alpha, beta, gamma, std::make_shared<const corpus>(docs)) {
+}
+
+microscopes::lda::state::state(size_t V,
+      float alpha,
+      float beta,
+      float gamma,
+      const std::shared_ptr<const corpus> &docs)
+    : V(V),
       alpha_(alpha),
       beta_(beta),
       gamma_(gamma),
       x_ji(docs),
-      n_k(lda_util::defaultdict<size_t, float>(beta * defn.v()))
+      n_kv(V),
+      ntables_(0),
+      smoothing_mass_(0),
+      word_dishes_(V),
+      base_(nullptr),
+      base_ndishes_(0),
+      lgamma_beta_(lgamma_f, beta),
+      lgamma_vbeta_(lgamma_f, V * beta),
+      log_n_(log_f)
       {
         // This page intentionally left blank
 }
 
+microscopes::lda::state::state(size_t V, float alpha, float beta, float gamma)
+    : state(V, alpha, beta, gamma, std::make_shared<const corpus>(nested_vector())) {
+    MICROSCOPES_DCHECK(V > 0, "no terms");
+    create_dish(); // Dummy dish
+}
+
 microscopes::lda::state::state(const model_definition &defn,
       float alpha,
       float beta,
@@ -30,7 +65,18 @@ microscopes::lda::state::state(const model_definition &defn,
       size_t initial_dishes,
       const microscopes::lda::nested_vector &docs,
       common::rng_t &rng)
-    : state(defn, alpha, beta, gamma, docs) {
+    : state(defn, alpha, beta, gamma, initial_dishes, std::make_shared<const corpus>(docs), rng) {
+}
+
+microscopes::lda::state::state(const model_definition &defn,
+      float alpha,
+      float beta,
+      float gamma,
+      size_t initial_dishes,
+      const std::shared_ptr<const corpus> &docs,
+      common::rng_t &rng)
+    : state(defn.v(), alpha, beta, gamma, docs) {
+    MICROSCOPES_DCHECK(docs->size() == defn.n(), "corpus does not match definition");
 
     auto dish_pool = microscopes::common::util::range(initial_dishes);
 
@@ -39,7 +85,7 @@ microscopes::lda::state::state(const model_definition &defn,
         create_entity(eid);
 
         auto did = common::util::sample_choice(dish_pool, rng);
-        if (did > dishes_.back()){
+        if (!dishes_.contains(did)){
             did = create_dish();
         }
         create_table(eid, did);
@@ -59,8 +105,9 @@ microscopes::lda::state::state(const model_definition &defn,
         // table_assignment maps words to tables (and should be the same
         //  shape as docs)
         // dish_assignment maps tables to dishes (its outer length should
-        //  be the the same as docs. Its inner length one plus the maximum
-        //  table index value for the given entity/doc.)
+        //  be the the same as docs. Its inner length is at least one plus
+        //  the maximum table index value for the given entity/doc; slots
+        //  after the first with dish 0 are tables that have been deleted.)
 
         // Create all the dishes we will need.
         for(auto dish: lda_util::unique_members(dish_assignments)) {
@@ -69,8 +116,11 @@ microscopes::lda::state::state(const model_definition &defn,
         for (size_t eid = 0; eid < nentities(); ++eid) {
             create_entity(eid);
             // Create all the tables we will need and assign them to their dish.
-            for(auto did: dish_assignments[eid]){
-                create_table(eid, did);
+            for(size_t tid = 0; tid < dish_assignments[eid].size(); tid++){
+                auto did = dish_assignments[eid][tid];
+                if(tid == 0 || did != 0){
+                    create_table(eid, tid, did);
+                }
             }
             // Assign words to tables.
             for(size_t word_index = 0; word_index < table_assignments[eid].size(); word_index++){
@@ -80,25 +130,268 @@ microscopes::lda::state::state(const model_definition &defn,
         }
 }
 
+microscopes::lda::state::state(const state &global, const std::shared_ptr<dish_id_pool> &dish_ids)
+    : V(global.V),
+      alpha_(global.alpha_),
+      beta_(global.beta_),
+      gamma_(global.gamma_),
+      using_t(global.nentities()),
+      dishes_(global.dishes_),
+      x_ji(global.x_ji),
+      dish_assignments_(global.nentities()),
+      n_jt(global.nentities()),
+      n_jtv(global.nentities()),
+      m_k(global.m_k),
+      n_k(global.n_k),
+      n_kv(global.V),
+      run_tables_(global.nentities()),
+      ntables_(global.ntables_),
+      inv_n_k_(global.inv_n_k_),
+      smoothing_mass_(global.smoothing_mass_),
+      word_dishes_(),
+      dish_ids_(dish_ids),
+      base_(&global),
+      base_ndishes_(global.n_kv.nrows()),
+      word_column_slot_(global.V, -1),
+      word_columns_(),
+      lgamma_beta_(global.lgamma_beta_),
+      lgamma_vbeta_(global.lgamma_vbeta_),
+      log_n_(global.log_n_)
+{
+}
+
+void
+microscopes::lda::state::swap_documents(state &other, const std::vector<size_t> &eids) {
+    for (auto eid : eids) {
+        std::swap(using_t[eid], other.using_t[eid]);
+        std::swap(dish_assignments_[eid], other.dish_assignments_[eid]);
+        std::swap(n_jt[eid], other.n_jt[eid]);
+        std::swap(n_jtv[eid], other.n_jtv[eid]);
+        std::swap(run_tables_[eid], other.run_tables_[eid]);
+    }
+}
+
+void
+microscopes::lda::state::swap_shard(document_shard &shard) {
+    std::swap(x_ji, shard.docs);
+    using_t.swap(shard.using_t);
+    dish_assignments_.swap(shard.dish_assignments);
+    n_jt.swap(shard.n_jt);
+    n_jtv.swap(shard.n_jtv);
+    run_tables_.swap(shard.run_tables);
+}
+
+void
+microscopes::lda::state::count_shard(const document_shard &shard) {
+    // Table 0 is counted like any other table with a dish, but the words
+    // at it are not seated.
+    auto grow = [this](size_t k) {
+        if (k < m_k.size()) return;
+        m_k.resize(k + 1, 0);
+        n_k.resize(k + 1, 0);
+        n_kv.resize(k + 1);
+    };
+    for (size_t eid = 0; eid < shard.size(); ++eid) {
+        const auto &k_jt = shard.dish_assignments[eid];
+        for (auto t : shard.using_t[eid]) {
+            if (k_jt[t] == 0) continue;
+            grow(k_jt[t]);
+            m_k[k_jt[t]] += 1;
+        }
+        const auto &runs = shard.run_tables[eid];
+        for (size_t r = 0; r < runs.nruns(); ++r) {
+            const size_t v = shard.docs->word(eid, r);
+            for (auto &seg : runs.run(r)) {
+                if (seg.first == 0) continue;
+                const size_t k = k_jt[seg.first];
+                n_k[k] += seg.second;
+                n_kv(k, v) += seg.second;
+            }
+        }
+    }
+}
+
+void
+microscopes::lda::state::merge_workers(const std::vector<std::shared_ptr<state>> &workers) {
+    // Each worker holds this state's counts plus its own changes, so the
+    // merged count is this + sum(worker - this). The changes are all
+    // taken before any is added. Every worker only takes its own
+    // documents' words off a cell, so the cell never drops below zero
+    // whatever order the changes are added in.
+    struct cell_change {
+        uint32_t k, v;
+        int64_t n;
+    };
+    // A changed cell is non-zero before or after, so it is in this
+    // state's word_dishes_ or the worker's.
+    std::vector<cell_change> changes;
+    const size_t nrows_old = n_kv.nrows();
+    for (auto &w : workers) {
+        for (auto &column : w->word_columns_) {
+            const size_t v = column.v;
+            for (auto k : word_dishes_[v]) {
+                int64_t n = int64_t(column.n_kv[k]) - n_kv(k, v);
+                if (n != 0) changes.push_back(cell_change{k, uint32_t(v), n});
+            }
+            for (auto k : column.dishes) {
+                if (k < nrows_old && n_kv(k, v) != 0) continue;
+                changes.push_back(cell_change{k, uint32_t(v), column.n_kv[k]});
+            }
+        }
+    }
+
+    const std::vector<size_t> m_k_old(m_k), n_k_old(n_k);
+    size_t nrows = m_k.size();
+    for (auto &w : workers) nrows = std::max(nrows, w->m_k.size());
+    m_k.resize(nrows, 0);
+    n_k.resize(nrows, 0);
+    n_kv.resize(nrows);
+    for (auto &w : workers) {
+        for (size_t k = 0; k < w->m_k.size(); ++k) {
+            const bool old = k < m_k_old.size();
+            m_k[k] += w->m_k[k] - (old ? m_k_old[k] : 0);
+            n_k[k] += w->n_k[k] - (old ? n_k_old[k] : 0);
+        }
+    }
+    for (auto &c : changes) {
+        if (c.n > 0) incr_n_kv(c.k, c.v, c.n);
+        else decr_n_kv(c.k, c.v, -c.n);
+    }
+
+    rebuild_dish_list();
+}
+
+void
+microscopes::lda::state::rebuild_dish_totals() {
+    rebuild_dish_list();
+    for (auto &dishes : word_dishes_) dishes.clear();
+    for (auto k : dishes_) {
+        for (size_t v = 0; v < V; ++v) {
+            if (n_kv(k, v) > 0) word_dishes_[v].push_back(k);
+        }
+    }
+}
+
+void
+microscopes::lda::state::rebuild_dish_list() {
+    // Dishes are active iff they have a table.
+    const size_t nrows = m_k.size();
+    std::vector<size_t> active(1, 0);
+    for (size_t k = 1; k < nrows; ++k) {
+        if (m_k[k] > 0) {
+            active.push_back(k);
+        }
+        else {
+            MICROSCOPES_DCHECK(n_k[k] == 0, "dish without tables has words");
+        }
+    }
+    dishes_.assign(active, active.back() + 1);
+    ntables_ = std::accumulate(m_k.begin(), m_k.end(), size_t(0));
+    inv_n_k_.assign(nrows, 0);
+    smoothing_mass_ = 0;
+    for (size_t k = 0; k < nrows; ++k) {
+        update_inv_n_k(k);
+        log_n_.reserve(m_k[k]);
+    }
+}
+
+void
+microscopes::lda::state::reseat_document(size_t eid, const std::vector<uint32_t> &token_tables,
+                                         const std::vector<size_t> &table_dishes) {
+    MICROSCOPES_DCHECK(token_tables.size() == nterms(eid), "wrong number of tokens");
+    // The words stay with their dishes, so n_k and n_kv are left alone.
+    // The tables are taken off from the last, which erases nothing but
+    // the end of using_t; the slots keep their storage.
+    auto &tables = using_t[eid];
+    while (tables.size() > 1) {
+        const size_t t = tables[tables.size() - 1];
+        decr_dishsize(dish_assignments_[eid][t]);
+        tables.erase(t);
+        dish_assignments_[eid][t] = 0;
+        n_jt[eid][t] = 0;
+        n_jtv[eid][t].clear();
+    }
+    for (size_t t = 1; t < table_dishes.size(); ++t) {
+        create_table(eid, t, table_dishes[t]);
+    }
+
+    for (size_t r = 0; r < nruns(eid); ++r) {
+        const size_t begin = x_ji->begin(eid, r);
+        run_tables_[eid].assign_tables(r, token_tables.data() + begin, run_count(eid, r));
+        const size_t v = run_word(eid, r);
+        for (auto &s : run_tables_[eid].run(r)) {
+            MICROSCOPES_DCHECK(s.first > 0 && s.first < table_dishes.size(), "token not seated");
+            n_jt[eid][s.first] += s.second;
+            n_jtv[eid][s.first].incr(v, s.second);
+        }
+    }
+    for (size_t t = 1; t < table_dishes.size(); ++t) {
+        MICROSCOPES_DCHECK(n_jt[eid][t] > 0, "new table without tokens");
+    }
+}
+
+microscopes::lda::dish_id_pool::dish_id_pool(const lda_util::id_set &dishes, size_t worker, size_t nworkers)
+    : free_(), next_(dishes.capacity() + worker), stride_(nworkers)
+{
+    size_t nfree = 0;
+    for (size_t id = 0; id < dishes.capacity(); ++id) {
+        if (dishes.contains(id)) continue;
+        if (nfree++ % nworkers == worker) free_.push_back(id);
+    }
+    std::reverse(free_.begin(), free_.end());
+}
+
+size_t
+microscopes::lda::dish_id_pool::create() {
+    if (!free_.empty()) {
+        size_t id = free_.back();
+        free_.pop_back();
+        return id;
+    }
+    size_t id = next_;
+    next_ += stride_;
+    return id;
+}
+
+void
+microscopes::lda::state::resync_smoothing_mass() {
+    smoothing_mass_ = 0;
+    for (auto k : dishes_) {
+        smoothing_mass_ += m_k[k] * double(inv_n_k_[k]);
+    }
+}
+
+void
+microscopes::lda::state::set_beta(float beta){
+    beta_ = beta;
+    lgamma_beta_.reset(beta);
+    lgamma_vbeta_.reset(V * beta);
+    for (size_t k = 0; k < inv_n_k_.size(); ++k) {
+        update_inv_n_k(k);
+    }
+}
+
 void
 microscopes::lda::state::create_entity(size_t eid){
-    using_t.push_back(std::vector<size_t>());
+    using_t.push_back(lda_util::id_set());
     n_jt.push_back(std::vector<size_t>());
     dish_assignments_.push_back(std::vector<size_t>());
-    table_assignments_.push_back(std::vector<size_t>(nterms(eid), 0));
-    n_jtv.push_back(std::vector< std::map<size_t, size_t>>());
+    const corpus &docs = *x_ji;
+    run_tables_.push_back(lda_util::run_tables(docs.nruns(eid), [&](size_t r) { return docs.count(eid, r); }));
+    n_jtv.push_back(std::vector<word_histogram>());
 }
 
 microscopes::lda::nested_vector
-microscopes::lda::state::assignments() {
-    microscopes::lda::nested_vector ret;
-    ret.resize(nentities());
+microscopes::lda::state::documents() const {
+    return x_ji->documents();
+}
 
+microscopes::lda::nested_vector
+microscopes::lda::state::assignments() const {
+    microscopes::lda::nested_vector ret = table_assignments();
     for (size_t eid = 0; eid < nentities(); eid++) {
-        ret[eid].resize(table_assignments_[eid].size());
-        for (size_t did = 0; did < table_assignments_[eid].size(); did++) {
-            auto table = table_assignments_[eid][did];
-            ret[eid][did] = dish_assignments_[eid][table];
+        for (auto &t : ret[eid]) {
+            t = dish_assignments_[eid][t];
         }
     }
     return ret;
@@ -110,8 +403,8 @@ microscopes::lda::state::assignments() {
 * table IDs -> (global) dish assignments
 *
 */
-microscopes::lda::nested_vector
-microscopes::lda::state::dish_assignments() {
+const microscopes::lda::nested_vector &
+microscopes::lda::state::dish_assignments() const {
     return dish_assignments_;
 }
 
@@ -121,8 +414,14 @@ microscopes::lda::state::dish_assignments() {
 *
 */
 microscopes::lda::nested_vector
-microscopes::lda::state::table_assignments() {
-    return table_assignments_;
+microscopes::lda::state::table_assignments() const {
+    microscopes::lda::nested_vector ret(nentities());
+    for (size_t eid = 0; eid < nentities(); eid++) {
+        ret[eid].reserve(nterms(eid));
+        run_tables_[eid].expand(ret[eid]);
+        x_ji->restore_order(eid, ret[eid]);
+    }
+    return ret;
 }
 
 float
@@ -147,7 +446,7 @@ microscopes::lda::state::word_distribution() {
         if (k == 0) continue;
         vec.push_back(std::map<size_t, float>());
         for (size_t v = 0; v < V; ++v) {
-            vec.back()[v] = n_kv[k].get(v) / n_k.get(k);
+            vec.back()[v] = smoothed_n_kv(k, v) * inv_n_k_[k];
         }
     }
     return vec;
@@ -176,7 +475,7 @@ microscopes::lda::state::document_distribution  () {
             size_t k = dish_assignments_[j][t];
             p_jk[k] += n_jt_[t];
         }
-        p_jk = lda_util::selectByIndex(p_jk, dishes_);
+        p_jk = lda_util::selectByIndex(p_jk, dishes());
         lda_util::normalize<float>(p_jk);
         theta.push_back(p_jk);
     }
@@ -184,27 +483,82 @@ microscopes::lda::state::document_distribution  () {
 }
 
 double
-microscopes::lda::state::perplexity() {
-    std::vector<std::map<size_t, float>> phi = word_distribution();
-    std::vector<std::vector<float>> theta = document_distribution();
-    phi.insert(phi.begin(), std::map<size_t, float>());
-    double log_likelihood = 0;
-    size_t N = 0;
-    for (size_t eid = 0; eid < nentities(); eid++) {
-        for (auto &v : get_entity(eid)) {
-            double word_prob = 0;
-            for (size_t did = 0; did < dishes_.size(); did++) {
-                MICROSCOPES_DCHECK(theta[eid].size() == dishes_.size(), "theta[eid] wrong");
-                // Probability that topic of word occurs in document
-                // times probability word occurs in topic
-                word_prob += theta[eid][did] * phi[did][v];
+microscopes::lda::state::perplexity(size_t nthreads) const {
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    return perplexity(scheduler);
+}
+
+double
+microscopes::lda::state::perplexity(scheduler &scheduler) const {
+    // theta_jk is (alpha m_k / (T + gamma) + n_jk) / (alpha + n_j), with
+    // n_jk the words of document j at tables serving dish k, and phi_kv is
+    // (n_kv + beta) / (n_k + V beta); the new dish adds nothing. Split as
+    //   sum_k theta_jk phi_kv = beta sum_k theta_jk / (n_k + V beta)
+    //                         + sum_{k: n_kv > 0} theta_jk n_kv / (n_k + V beta),
+    // the first term is the same for every word of the document and the
+    // second only visits the dishes that hold the word.
+    std::vector<float> am_k(m_k.size(), 0);
+    double sum_am = gamma_;
+    for (auto k : dishes_) {
+        if (k != 0) sum_am += m_k[k];
+    }
+    for (auto k : dishes_) {
+        if (k != 0) am_k[k] = alpha_ * m_k[k] / sum_am;
+    }
+
+    std::vector<double> costs(nentities());
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        costs[eid] = nruns(eid) + using_t[eid].size();
+    }
+    std::vector<std::vector<double>> theta(scheduler.nthreads());
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> words(scheduler.nthreads());
+    std::vector<double> log_likelihood(nentities(), 0);
+    scheduler.run(costs, [&](size_t eid, size_t thread) {
+        auto &theta_k = theta[thread];
+        theta_k.resize(m_k.size());
+        for (auto k : dishes_) theta_k[k] = am_k[k];
+        double n_j = 0;
+        for (auto t : using_t[eid]) {
+            if (t == 0) continue;
+            theta_k[dish_assignments_[eid][t]] += n_jt[eid][t];
+            n_j += n_jt[eid][t];
+        }
+        double smoothing = 0;
+        for (auto k : dishes_) {
+            if (k == 0) continue;
+            theta_k[k] *= inv_n_k_[k];
+            smoothing += theta_k[k];
+        }
+        smoothing *= beta_;
+
+        // Distinct words, each with its number of occurrences; a word can
+        // have several runs in a document given token by token.
+        auto &w = words[thread];
+        w.clear();
+        for (size_t r = 0; r < nruns(eid); ++r) {
+            w.push_back(std::make_pair(run_word(eid, r), run_count(eid, r)));
+        }
+        std::sort(w.begin(), w.end());
+        double ll = 0;
+        for (size_t i = 0; i < w.size();) {
+            size_t v = w[i].first, count = 0;
+            for (; i < w.size() && w[i].first == v; ++i) count += w[i].second;
+            double word_prob = smoothing;
+            for (auto k : word_dishes_[v]) {
+                word_prob += theta_k[k] * n_kv(k, v);
             }
-            log_likelihood -= distributions::fast_log(word_prob);
+            ll += count * log(word_prob);
         }
+        log_likelihood[eid] = ll - nterms(eid) * log(alpha_ + n_j);
+    });
+
+    double total = 0;
+    size_t N = 0;
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        total += log_likelihood[eid];
         N += nterms(eid);
     }
-
-    return exp(log_likelihood / N);
+    return exp(-total / N);
 }
 
 
@@ -215,151 +569,289 @@ microscopes::lda::state::leave_from_dish(size_t j, size_t t) {
     size_t k = dish_assignments_[j][t];
     MICROSCOPES_DCHECK(k > 0, "k < = 0");
     MICROSCOPES_DCHECK(m_k[k] > 0, "m_k[k] <= 0");
-    m_k[k] -= 1; // one less table for topic k
+    decr_dishsize(k); // one less table for topic k
     if (m_k[k] == 0) // destroy table
     {
+        // The table's words leave with the dish, so counts of inactive
+        // dishes are always zero.
+        n_k[k] -= n_jt[j][t];
+        for (auto kv : n_jtv[j][t]) {
+            decr_n_kv(k, kv.first, kv.second);
+        }
+        update_inv_n_k(k);
         delete_dish(k);
         dish_assignments_[j][t] = 0;
     }
 }
 
+microscopes::lda::state::word_column &
+microscopes::lda::state::add_word_column(size_t v, size_t k) {
+    int32_t &slot = word_column_slot_[v];
+    if (slot < 0) {
+        slot = word_columns_.size();
+        word_columns_.push_back(word_column());
+        auto &column = word_columns_.back();
+        column.v = v;
+        column.n_kv.resize(std::max(base_ndishes_, m_k.size()), 0);
+        column.dishes = base_->word_dishes_[v];
+        for (auto d : column.dishes) {
+            column.n_kv[d] = base_->n_kv(d, v);
+        }
+    }
+    auto &column = word_columns_[slot];
+    if (k >= column.n_kv.size()) column.n_kv.resize(m_k.size(), 0);
+    return column;
+}
+
+// Takes dish k out of an unordered list of dishes.
+static inline void
+erase_dish(std::vector<uint32_t> &dishes, size_t k) {
+    auto it = std::find(dishes.begin(), dishes.end(), k);
+    MICROSCOPES_DCHECK(it != dishes.end(), "dish missing from word_dishes_");
+    *it = dishes.back();
+    dishes.pop_back();
+}
+
+void
+microscopes::lda::state::incr_n_kv(size_t k, size_t v, uint32_t n) {
+    MICROSCOPES_DCHECK(n > 0, "incrementing by zero");
+    if (base_) {
+        auto &column = touch_word(v, k);
+        if (column.n_kv[k] == 0) column.dishes.push_back(k);
+        column.n_kv[k] += n;
+        return;
+    }
+    if (n_kv(k, v) == 0) {
+        word_dishes_[v].push_back(k);
+    }
+    n_kv(k, v) += n;
+}
+
+void
+microscopes::lda::state::decr_n_kv(size_t k, size_t v, uint32_t n) {
+    if (base_) {
+        auto &column = touch_word(v, k);
+        MICROSCOPES_DCHECK(column.n_kv[k] >= n, "n_kv below zero");
+        column.n_kv[k] -= n;
+        if (column.n_kv[k] == 0) erase_dish(column.dishes, k);
+        return;
+    }
+    MICROSCOPES_DCHECK(n_kv(k, v) >= n, "n_kv below zero");
+    n_kv(k, v) -= n;
+    if (n_kv(k, v) == 0) {
+        erase_dish(word_dishes_[v], k);
+    }
+}
+
 void
 microscopes::lda::state::validate_n_k_values() {
-    return;
-    std::map<size_t, std::tuple<float, float>> values;
     for (auto k : dishes_) {
-        float n_kv_sum = 0;
+        size_t n_kv_sum = 0;
         for (size_t v = 0; v < V; v++) {
-            n_kv_sum += n_kv[k].get(v);
+            n_kv_sum += n_kv(k, v);
         }
-        values[k] = std::tuple<float, float>(n_kv_sum, n_k.get(k));
+        MICROSCOPES_CHECK(n_kv_sum == n_k[k], "n_kv doesn't match n_k");
     }
-    for (auto kv : values) {
-        if (kv.first == 0) continue;
-        MICROSCOPES_CHECK(std::abs((std::get<0>(kv.second) - std::get<1>(kv.second))) < 0.01,
-                          "n_kv doesn't match n_k");
+    MICROSCOPES_CHECK(std::accumulate(m_k.begin(), m_k.end(), size_t(0)) == ntables_,
+        "ntables_ doesn't match m_k");
+    // Recount the dish totals from the documents' tables.
+    std::vector<size_t> tables_at(m_k.size(), 0), words_at(n_k.size(), 0);
+    MICROSCOPES_CHECK(n_kv.nrows() == m_k.size(), "n_kv doesn't have a row per dish");
+    lda_util::count_matrix<uint32_t> word_counts_at(V);
+    word_counts_at.resize(n_kv.nrows());
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        for (auto t : using_t[eid]) {
+            auto k = dish_assignments_[eid][t];
+            if (k == 0) continue;
+            MICROSCOPES_CHECK(dishes_.contains(k), "table seated at inactive dish");
+            tables_at[k] += 1;
+            words_at[k] += n_jt[eid][t];
+            for (auto &kv : table_words(eid, t)) {
+                word_counts_at(k, kv.first) += kv.second;
+            }
+        }
+    }
+    for (size_t k = 1; k < m_k.size(); ++k) {
+        MICROSCOPES_CHECK(tables_at[k] == m_k[k], "m_k doesn't match the tables");
+        MICROSCOPES_CHECK(words_at[k] == n_k[k], "n_k doesn't match the tables");
+        for (size_t v = 0; v < V; v++) {
+            MICROSCOPES_CHECK(word_counts_at(k, v) == n_kv(k, v), "n_kv doesn't match the tables");
+        }
+    }
+    for (size_t v = 0; v < V; v++) {
+        size_t nonzero = 0;
+        for (auto k : dishes_) {
+            if (n_kv(k, v) > 0) nonzero++;
+        }
+        MICROSCOPES_CHECK(nonzero == word_dishes_[v].size(), "word_dishes_ doesn't match n_kv");
+        for (auto k : word_dishes_[v]) {
+            MICROSCOPES_CHECK(n_kv(k, v) > 0, "word_dishes_ doesn't match n_kv");
+        }
     }
 }
 
 
 void
 microscopes::lda::state::seat_at_dish(size_t j, size_t t, size_t k_new) {
-    m_k[k_new] += 1;
+    incr_dishsize(k_new);
 
     size_t k_old = dish_assignments_[j][t];
     if (k_new != k_old)
     {
         MICROSCOPES_DCHECK(k_new != 0, "k_new is 0");
         dish_assignments_[j][t] = k_new;
-        float n_jt_val = n_jt[j][t];
+        size_t n_jt_val = n_jt[j][t];
 
         if (k_old != 0)
         {
-            n_k.decr(k_old, n_jt_val);
+            n_k[k_old] -= n_jt_val;
         }
-        n_k.incr(k_new, n_jt_val);
+        n_k[k_new] += n_jt_val;
         for (auto kv : n_jtv[j][t]) {
             auto v = kv.first;
             auto n = kv.second;
             MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
             if (k_old != 0)
             {
-                n_kv[k_old].decr(v, n);
+                decr_n_kv(k_old, v, n);
             }
-            n_kv[k_new].incr(v, n);
+            incr_n_kv(k_new, v, n);
+        }
+        if (k_old != 0)
+        {
+            update_inv_n_k(k_old);
         }
+        update_inv_n_k(k_new);
     }
 }
 
 
 void
 microscopes::lda::state::add_table(size_t eid, size_t tid, size_t word_index) {
-    table_assignments_[eid][word_index] = tid;
+    auto seat = x_ji->locate(eid, word_index);
+    add_run_token(eid, tid, seat.first, seat.second);
+}
+
+void
+microscopes::lda::state::add_run_token(size_t eid, size_t tid, size_t r, size_t pos) {
+    run_tables_[eid].set_table(r, pos, tid);
     n_jt[eid][tid] += 1;
 
     size_t k_new = dish_assignments_[eid][tid];
-    n_k.incr(k_new, 1);
+    n_k[k_new] += 1;
+    update_inv_n_k(k_new);
 
-    size_t v = get_word(eid, word_index);
+    size_t v = run_word(eid, r);
     MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
-    n_kv[k_new].incr(v, 1);
-    n_jtv[eid][tid][v] += 1;
+    incr_n_kv(k_new, v, 1);
+    n_jtv[eid][tid].incr(v);
 }
 
 void
-microscopes::lda::state::create_dish(size_t k_new){
-    while(k_new >= m_k.size())
+microscopes::lda::state::add_run_tokens(size_t eid, size_t tid, size_t r, uint32_t n) {
+    MICROSCOPES_DCHECK(tid > 0, "tokens seated at table 0");
+    run_tables_[eid].move(r, 0, tid, n);
+    n_jt[eid][tid] += n;
+
+    size_t k_new = dish_assignments_[eid][tid];
+    n_k[k_new] += n;
+    update_inv_n_k(k_new);
+
+    size_t v = run_word(eid, r);
+    MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
+    incr_n_kv(k_new, v, n);
+    n_jtv[eid][tid].incr(v, n);
+}
+
+void
+microscopes::lda::state::init_dish(size_t k_new){
+    if(k_new >= m_k.size())
     {
-        m_k.push_back(0);
-        n_kv.push_back(lda_util::defaultdict<size_t, float>(beta_));
-    }
-    if(dishes_.size() > k_new)
-        dishes_.insert(dishes_.begin() + k_new, k_new);
-    else
-        dishes_.push_back(k_new);
-    n_k.set(k_new, beta_ * V);
-    n_kv[k_new] = lda_util::defaultdict<size_t, float>(beta_);
+        m_k.resize(k_new + 1, 0);
+        n_k.resize(k_new + 1, 0);
+        inv_n_k_.resize(k_new + 1);
+        // A worker state keeps its dish/word counts in word_columns_.
+        if (!base_) n_kv.resize(k_new + 1);
+    }
+    MICROSCOPES_DCHECK(n_k[k_new] == 0, "inactive dish has words");
     m_k[k_new] = 0;
+    update_inv_n_k(k_new);
+}
+
+void
+microscopes::lda::state::create_dish(size_t k_new){
+    dishes_.insert(k_new);
+    init_dish(k_new);
 }
 
 size_t
 microscopes::lda::state::create_dish() {
-    size_t k_new = dishes_.size();
-    for (size_t i = 0; i < dishes_.size(); ++i)
-    {
-        if (i != dishes_[i])
-        {
-            k_new = i;
-            break;
-        }
+    size_t k_new;
+    if (dish_ids_) {
+        k_new = dish_ids_->create();
+        dishes_.insert(k_new);
+    }
+    else {
+        k_new = dishes_.create();
     }
-    create_dish(k_new);
+    init_dish(k_new);
     return k_new;
-
 }
 
-size_t
-microscopes::lda::state::create_table(size_t eid, size_t k_new)
+void
+microscopes::lda::state::init_table(size_t eid, size_t t_new, size_t k_new)
 {
-    size_t t_new = using_t[eid].size();
-    for (size_t i = 0; i < using_t[eid].size(); ++i)
-    {
-        if (i != using_t[eid][i])
-        {
-            t_new = i;
-            break;
-        }
-    }
-    if (t_new == using_t[eid].size())
+    if (t_new >= n_jt[eid].size())
     {
-        n_jt[eid].push_back(0);
-        dish_assignments_[eid].push_back(0);
-
-        n_jtv[eid].push_back(std::map<size_t, size_t>());
+        n_jt[eid].resize(t_new + 1, 0);
+        dish_assignments_[eid].resize(t_new + 1, 0);
+        n_jtv[eid].resize(t_new + 1);
     }
-    using_t[eid].insert(using_t[eid].begin() + t_new, t_new);
+    // A reused slot keeps the histogram storage it had.
+    MICROSCOPES_DCHECK(n_jtv[eid][t_new].empty(), "new table has words");
     n_jt[eid][t_new] = 0;
     dish_assignments_[eid][t_new] = k_new;
     if (k_new != 0){
-        m_k[k_new] += 1;
+        incr_dishsize(k_new);
     }
+}
+
+size_t
+microscopes::lda::state::create_table(size_t eid, size_t k_new)
+{
+    size_t t_new = using_t[eid].create();
+    init_table(eid, t_new, k_new);
     return t_new;
 }
 
+void
+microscopes::lda::state::create_table(size_t eid, size_t t_new, size_t k_new)
+{
+    using_t[eid].insert(t_new);
+    init_table(eid, t_new, k_new);
+}
+
 void
 microscopes::lda::state::remove_table(size_t eid, size_t word_index) {
-    size_t tid = table_assignments_[eid][word_index];
+    auto seat = x_ji->locate(eid, word_index);
+    remove_run_token(eid, seat.first, seat.second);
+}
+
+void
+microscopes::lda::state::remove_run_token(size_t eid, size_t r, size_t pos) {
+    size_t tid = run_tables_[eid].table(r, pos);
     if (tid > 0)
     {
         size_t k = dish_assignments_[eid][tid];
         MICROSCOPES_DCHECK(k > 0, "k <= 0");
         // decrease counters
-        size_t v = get_word(eid, word_index);
+        size_t v = run_word(eid, r);
         MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
-        n_kv[k].decr(v, 1);
-        n_k.decr(k, 1);
+        decr_n_kv(k, v, 1);
+        n_k[k] -= 1;
+        update_inv_n_k(k);
         n_jt[eid][tid] -= 1;
-        n_jtv[eid][tid][v] -= 1;
+        n_jtv[eid][tid].decr(v);
 
         if (n_jt[eid][tid] == 0)
         {
@@ -368,28 +860,36 @@ microscopes::lda::state::remove_table(size_t eid, size_t word_index) {
     }
 }
 
+void
+microscopes::lda::state::remove_run_tokens(size_t eid, size_t r, size_t tid, uint32_t n) {
+    MICROSCOPES_DCHECK(tid > 0, "tokens taken off table 0");
+    MICROSCOPES_DCHECK(n <= n_jt[eid][tid], "too few tokens at the table");
+    run_tables_[eid].move(r, tid, 0, n);
+    size_t k = dish_assignments_[eid][tid];
+    size_t v = run_word(eid, r);
+    MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
+    decr_n_kv(k, v, n);
+    n_k[k] -= n;
+    update_inv_n_k(k);
+    n_jt[eid][tid] -= n;
+    n_jtv[eid][tid].decr(v, n);
+
+    if (n_jt[eid][tid] == 0)
+    {
+        delete_table(eid, tid);
+    }
+}
+
 void
 microscopes::lda::state::delete_table(size_t eid, size_t tid) {
     size_t k = dish_assignments_[eid][tid];
-    lda_util::removeFirst(using_t[eid], tid);
-    m_k[k] -= 1;
-    MICROSCOPES_DCHECK(m_k[k] >= 0, "m_k[k] < 0");
+    using_t[eid].erase(tid);
+    decr_dishsize(k);
     if (m_k[k] == 0)
     {
         delete_dish(k);
     }
-
-    // Prune dish assignment vector
+    // The slot stays allocated for reuse; a zero dish marks it as free.
     dish_assignments_[eid][tid] = 0;
-    while(dish_assignments_[eid].empty() == false)
-   {
-        if(dish_assignments_[eid].back() == 0){
-            dish_assignments_[eid].pop_back();
-            n_jt[eid].pop_back();
-            n_jtv[eid].pop_back();
-        }
-        else break;
-   }
-
 }
 
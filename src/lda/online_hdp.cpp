@@ -0,0 +1,315 @@
+#include <microscopes/lda/online_hdp.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <algorithm>
+#include <math.h>
+#include <random>
+
+namespace {
+
+using lda_util::digamma;
+
+// E[log stick weight] of each of a.size() + 1 sticks broken with
+// Beta(a_i, b_i) proportions; the last one takes what is left.
+void
+expect_log_sticks(const std::vector<double> &a, const std::vector<double> &b, std::vector<double> &out)
+{
+    out.resize(a.size() + 1);
+    double rest = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        const double dig_sum = digamma(a[i] + b[i]);
+        out[i] = digamma(a[i]) - dig_sum + rest;
+        rest += digamma(b[i]) - dig_sum;
+    }
+    out.back() = rest;
+}
+
+// E[stick weight] for the same sticks.
+void
+expect_sticks(const std::vector<double> &a, const std::vector<double> &b, std::vector<double> &out)
+{
+    out.resize(a.size() + 1);
+    double rest = 1;
+    for (size_t i = 0; i < a.size(); ++i) {
+        out[i] = rest * a[i] / (a[i] + b[i]);
+        rest *= b[i] / (a[i] + b[i]);
+    }
+    out.back() = rest;
+}
+
+// Exponentiates and normalizes log weights in place.
+void
+log_normalize(double *x, size_t n)
+{
+    const double top = *std::max_element(x, x + n);
+    double total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = exp(x[i] - top);
+        total += x[i];
+    }
+    for (size_t i = 0; i < n; ++i) x[i] /= total;
+}
+
+}
+
+microscopes::lda::online_hdp::online_hdp(const model_definition &defn, size_t T, size_t K,
+                                         float alpha, float eta, float gamma,
+                                         double kappa, double tau, common::rng_t &rng)
+    : D_(defn.n()), V_(defn.v()), T_(T), K_(K), alpha_(alpha), eta_(eta), gamma_(gamma),
+      kappa_(kappa), tau_(tau), max_iter_(100), tol_(1e-4), nupdates_(0),
+      lambda_(), sticks_a_(), sticks_b_(), elog_beta_(), elog_sticks_()
+{
+    MICROSCOPES_CHECK(T > 0 && K > 0, "truncation levels must be positive");
+    MICROSCOPES_CHECK(kappa > 0.5 && kappa <= 1, "kappa must be in (0.5, 1]");
+    MICROSCOPES_CHECK(tau >= 0, "tau must not be negative");
+    lambda_.resize(T_ * V_);
+    sticks_a_.assign(T_ - 1, 1.0);
+    sticks_b_.resize(T_ - 1);
+    std::gamma_distribution<double> noise(1.0, 1.0);
+    const double scale = 100.0 * D_ / (T_ * V_);
+    for (auto &x : lambda_) x = noise(rng) * scale;
+    for (size_t t = 0; t + 1 < T_; ++t) sticks_b_[t] = T_ - 1 - t;
+    refresh_expectations();
+}
+
+void
+microscopes::lda::online_hdp::refresh_expectations()
+{
+    elog_beta_.resize(V_ * T_);
+    for (size_t t = 0; t < T_; ++t) {
+        const double *row = &lambda_[t * V_];
+        double total = 0;
+        for (size_t v = 0; v < V_; ++v) total += row[v];
+        const double dig_total = digamma(total);
+        for (size_t v = 0; v < V_; ++v) {
+            elog_beta_[v * T_ + t] = digamma(row[v]) - dig_total;
+        }
+    }
+    expect_log_sticks(sticks_a_, sticks_b_, elog_sticks_);
+}
+
+void
+microscopes::lda::online_hdp::e_step(const word_counts &doc, doc_params &out) const
+{
+    // The first three passes leave out the stick priors, which lets the
+    // responsibilities settle from the words first (as the authors do).
+    const size_t N = doc.size(), T = T_, K = K_;
+    const size_t warmup = 3;
+    std::vector<double> phi(N * K, 1.0 / K), elog_doc_sticks(K, 0), totals(K), last_a;
+    out.var_phi.resize(K * T);
+    out.a.assign(K - 1, 1.0);
+    out.b.assign(K - 1, alpha_);
+    for (size_t it = 0; it < max_iter_; ++it) {
+        // Corpus topic of each document stick.
+        for (size_t i = 0; i < K; ++i) {
+            double *row = &out.var_phi[i * T];
+            for (size_t t = 0; t < T; ++t) row[t] = it >= warmup ? elog_sticks_[t] : 0;
+        }
+        for (size_t n = 0; n < N; ++n) {
+            const double *elog_beta = &elog_beta_[doc[n].first * T];
+            for (size_t i = 0; i < K; ++i) {
+                const double w = doc[n].second * phi[n * K + i];
+                double *row = &out.var_phi[i * T];
+                for (size_t t = 0; t < T; ++t) row[t] += w * elog_beta[t];
+            }
+        }
+        for (size_t i = 0; i < K; ++i) log_normalize(&out.var_phi[i * T], T);
+
+        // Document stick of each word.
+        std::fill(totals.begin(), totals.end(), 0);
+        for (size_t n = 0; n < N; ++n) {
+            const double *elog_beta = &elog_beta_[doc[n].first * T];
+            double *row = &phi[n * K];
+            for (size_t i = 0; i < K; ++i) {
+                const double *var_phi = &out.var_phi[i * T];
+                double x = it >= warmup ? elog_doc_sticks[i] : 0;
+                for (size_t t = 0; t < T; ++t) x += var_phi[t] * elog_beta[t];
+                row[i] = x;
+            }
+            log_normalize(row, K);
+            for (size_t i = 0; i < K; ++i) totals[i] += doc[n].second * row[i];
+        }
+
+        double rest = 0;
+        for (size_t i = K - 1; i-- > 0;) {
+            rest += totals[i + 1];
+            out.a[i] = 1 + totals[i];
+            out.b[i] = alpha_ + rest;
+        }
+        expect_log_sticks(out.a, out.b, elog_doc_sticks);
+
+        if (it > warmup) {
+            double change = 0;
+            for (size_t i = 0; i + 1 < K; ++i) change += fabs(out.a[i] - last_a[i]);
+            if (change <= tol_ * (K - 1)) break;
+        }
+        last_a = out.a;
+    }
+
+    out.word_topics.assign(N * T, 0);
+    for (size_t n = 0; n < N; ++n) {
+        double *row = &out.word_topics[n * T];
+        for (size_t i = 0; i < K; ++i) {
+            const double w = doc[n].second * phi[n * K + i];
+            const double *var_phi = &out.var_phi[i * T];
+            for (size_t t = 0; t < T; ++t) row[t] += w * var_phi[t];
+        }
+    }
+}
+
+double
+microscopes::lda::online_hdp::update(const std::vector<word_counts> &docs, scheduler &scheduler)
+{
+    MICROSCOPES_CHECK(!docs.empty(), "empty mini-batch");
+    std::vector<double> costs(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) costs[d] = docs[d].size() + 1;
+    std::vector<doc_params> params(docs.size());
+    scheduler.run(costs, [&](size_t d, size_t) { e_step(docs[d], params[d]); });
+
+    // Each parameter moves to (1 - rho) of itself plus rho of its estimate
+    // from the batch scaled up to D documents.
+    nupdates_ += 1;
+    const double rho = pow(tau_ + nupdates_, -kappa_);
+    const double scale = double(D_) / docs.size();
+    for (auto &x : lambda_) x = (1 - rho) * x + rho * eta_;
+    std::vector<double> sticks_ss(T_, 0);
+    for (size_t d = 0; d < docs.size(); ++d) {
+        const auto &p = params[d];
+        for (size_t i = 0; i < K_; ++i) {
+            for (size_t t = 0; t < T_; ++t) sticks_ss[t] += p.var_phi[i * T_ + t];
+        }
+        for (size_t n = 0; n < docs[d].size(); ++n) {
+            const size_t v = docs[d][n].first;
+            for (size_t t = 0; t < T_; ++t) {
+                lambda_[t * V_ + v] += rho * scale * p.word_topics[n * T_ + t];
+            }
+        }
+    }
+    double rest = 0;
+    for (size_t t = T_ - 1; t-- > 0;) {
+        rest += scale * sticks_ss[t + 1];
+        sticks_a_[t] = (1 - rho) * sticks_a_[t] + rho * (1 + scale * sticks_ss[t]);
+        sticks_b_[t] = (1 - rho) * sticks_b_[t] + rho * (gamma_ + rest);
+    }
+    refresh_expectations();
+    return rho;
+}
+
+namespace {
+
+typedef std::vector<std::pair<uint32_t, uint32_t>> word_counts;
+
+// Sorts (word, count) pairs and merges repeated words.
+void
+merge_counts(word_counts &doc)
+{
+    std::sort(doc.begin(), doc.end());
+    size_t out = 0;
+    for (size_t i = 0; i < doc.size(); ++i) {
+        if (out > 0 && doc[out - 1].first == doc[i].first) {
+            doc[out - 1].second += doc[i].second;
+        }
+        else {
+            doc[out++] = doc[i];
+        }
+    }
+    doc.resize(out);
+}
+
+std::vector<word_counts>
+counts_of(const microscopes::lda::nested_vector &docs, size_t V)
+{
+    std::vector<word_counts> ret(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) {
+        for (auto v : docs[d]) {
+            MICROSCOPES_CHECK(v < V, "word id out of range");
+            ret[d].push_back(std::make_pair(uint32_t(v), 1u));
+        }
+        merge_counts(ret[d]);
+    }
+    return ret;
+}
+
+std::vector<word_counts>
+counts_of(const microscopes::lda::corpus &docs, size_t V)
+{
+    std::vector<word_counts> ret(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) {
+        for (size_t r = 0; r < docs.nruns(d); ++r) {
+            MICROSCOPES_CHECK(docs.word(d, r) < V, "word id out of range");
+            ret[d].push_back(std::make_pair(docs.word(d, r), uint32_t(docs.count(d, r))));
+        }
+        merge_counts(ret[d]);
+    }
+    return ret;
+}
+
+}
+
+double
+microscopes::lda::online_hdp::update(const nested_vector &docs, scheduler &scheduler)
+{
+    return update(counts_of(docs, V_), scheduler);
+}
+
+double
+microscopes::lda::online_hdp::update(const nested_vector &docs, size_t nthreads)
+{
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    return update(docs, scheduler);
+}
+
+double
+microscopes::lda::online_hdp::update(const corpus &docs, scheduler &scheduler)
+{
+    return update(counts_of(docs, V_), scheduler);
+}
+
+double
+microscopes::lda::online_hdp::update(const corpus &docs, size_t nthreads)
+{
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    return update(docs, scheduler);
+}
+
+std::vector<std::map<size_t, float>>
+microscopes::lda::online_hdp::word_distribution() const
+{
+    std::vector<std::map<size_t, float>> ret(T_);
+    for (size_t t = 0; t < T_; ++t) {
+        const double *row = &lambda_[t * V_];
+        double total = 0;
+        for (size_t v = 0; v < V_; ++v) total += row[v];
+        for (size_t v = 0; v < V_; ++v) ret[t][v] = row[v] / total;
+    }
+    return ret;
+}
+
+std::vector<std::vector<float>>
+microscopes::lda::online_hdp::document_distribution(const nested_vector &docs, size_t nthreads) const
+{
+    const auto counts = counts_of(docs, V_);
+    std::vector<double> costs(docs.size());
+    for (size_t d = 0; d < docs.size(); ++d) costs[d] = counts[d].size() + 1;
+    std::vector<std::vector<float>> ret(docs.size());
+    scheduler scheduler(std::max(nthreads, size_t(1)));
+    scheduler.run(costs, [&](size_t d, size_t) {
+        doc_params p;
+        e_step(counts[d], p);
+        std::vector<double> pi;
+        expect_sticks(p.a, p.b, pi);
+        ret[d].assign(T_ + 1, 0);
+        for (size_t i = 0; i < K_; ++i) {
+            for (size_t t = 0; t < T_; ++t) ret[d][t + 1] += pi[i] * p.var_phi[i * T_ + t];
+        }
+    });
+    return ret;
+}
+
+std::vector<float>
+microscopes::lda::online_hdp::topic_weights() const
+{
+    std::vector<double> pi;
+    expect_sticks(sticks_a_, sticks_b_, pi);
+    return std::vector<float>(pi.begin(), pi.end());
+}
@@ -0,0 +1,206 @@
+#include <microscopes/lda/scheduler.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <numeric>
+
+namespace {
+
+typedef std::chrono::steady_clock scheduler_clock;
+
+double seconds_since(scheduler_clock::time_point start)
+{
+    return std::chrono::duration<double>(scheduler_clock::now() - start).count();
+}
+
+// One thread's tasks and the estimated cost of those not yet taken.
+struct task_queue {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+    double cost;
+
+    task_queue() : lock(), tasks(), cost(0) {}
+};
+
+}
+
+microscopes::lda::scheduler::scheduler(size_t nthreads)
+    : nthreads_(nthreads), stats_(), wall_seconds_(0),
+      threads_(), pool_lock_(), work_ready_(), work_done_(),
+      work_(nullptr), generation_(0), nbusy_(0), stopping_(false)
+{
+    MICROSCOPES_CHECK(nthreads > 0, "no threads");
+    reset_stats();
+    threads_.reserve(nthreads_ - 1);
+    for (size_t thread = 1; thread < nthreads_; ++thread) {
+        threads_.emplace_back(&scheduler::serve, this, thread);
+    }
+}
+
+microscopes::lda::scheduler::~scheduler()
+{
+    {
+        std::lock_guard<std::mutex> guard(pool_lock_);
+        stopping_ = true;
+    }
+    work_ready_.notify_all();
+    for (auto &thread : threads_) thread.join();
+}
+
+void
+microscopes::lda::scheduler::serve(size_t thread)
+{
+    size_t seen = 0;
+    for (;;) {
+        const std::function<void(size_t)> *work;
+        {
+            std::unique_lock<std::mutex> guard(pool_lock_);
+            work_ready_.wait(guard, [&] { return stopping_ || generation_ != seen; });
+            if (stopping_) return;
+            seen = generation_;
+            work = work_;
+        }
+        (*work)(thread);
+        std::lock_guard<std::mutex> guard(pool_lock_);
+        if (--nbusy_ == 0) work_done_.notify_one();
+    }
+}
+
+std::vector<size_t>
+microscopes::lda::scheduler::partition(const std::vector<double> &costs) const
+{
+    // Longest processing time first: deal the tasks, heaviest first, to
+    // the thread with the least work so far (ties to the lower index).
+    std::vector<size_t> order(costs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+    std::vector<double> load(nthreads_, 0);
+    std::vector<size_t> owner(costs.size());
+    for (auto i : order) {
+        size_t thread = std::min_element(load.begin(), load.end()) - load.begin();
+        owner[i] = thread;
+        load[thread] += costs[i];
+    }
+    return owner;
+}
+
+void
+microscopes::lda::scheduler::run(const std::vector<double> &costs,
+    const std::function<void(size_t, size_t)> &task,
+    bool steal)
+{
+    auto owner = partition(costs);
+    std::vector<task_queue> queues(nthreads_);
+    for (size_t i = 0; i < costs.size(); ++i) {
+        queues[owner[i]].tasks.push_back(i);
+        queues[owner[i]].cost += costs[i];
+    }
+
+    // The first exception thrown by a task; once there is one, no more
+    // tasks are started.
+    std::mutex error_lock;
+    std::exception_ptr error;
+    std::atomic<bool> failed(false);
+
+    // Takes the next task of `thread`'s own queue, or else the last task
+    // of the queue with the most work left.
+    auto next = [&](size_t thread, size_t &i, bool &stolen) {
+        if (failed) return false;
+        {
+            auto &q = queues[thread];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                i = q.tasks.front();
+                q.tasks.pop_front();
+                q.cost -= costs[i];
+                stolen = false;
+                return true;
+            }
+        }
+        while (steal) {
+            size_t victim = nthreads_;
+            double most = 0;
+            for (size_t v = 0; v < nthreads_; ++v) {
+                std::lock_guard<std::mutex> guard(queues[v].lock);
+                if (!queues[v].tasks.empty() && (victim == nthreads_ || queues[v].cost > most)) {
+                    victim = v;
+                    most = queues[v].cost;
+                }
+            }
+            if (victim == nthreads_) break;
+            auto &q = queues[victim];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) continue; // emptied since the scan
+            i = q.tasks.back();
+            q.tasks.pop_back();
+            q.cost -= costs[i];
+            stolen = true;
+            return true;
+        }
+        return false;
+    };
+
+    std::function<void(size_t)> work = [&](size_t thread) {
+        auto &stats = stats_[thread];
+        size_t i;
+        bool stolen;
+        while (next(thread, i, stolen)) {
+            auto start = scheduler_clock::now();
+            try {
+                task(i, thread);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+            stats.busy_seconds += seconds_since(start);
+            stats.ntasks += 1;
+            stats.nstolen += stolen;
+            stats.cost += costs[i];
+        }
+    };
+
+    auto start = scheduler_clock::now();
+    if (!threads_.empty()) {
+        {
+            std::lock_guard<std::mutex> guard(pool_lock_);
+            work_ = &work;
+            nbusy_ = threads_.size();
+            ++generation_;
+        }
+        work_ready_.notify_all();
+    }
+    work(0);
+    if (!threads_.empty()) {
+        std::unique_lock<std::mutex> guard(pool_lock_);
+        work_done_.wait(guard, [&] { return nbusy_ == 0; });
+        work_ = nullptr;
+    }
+    wall_seconds_ += seconds_since(start);
+    if (error) std::rethrow_exception(error);
+}
+
+std::vector<double>
+microscopes::lda::scheduler::utilization() const
+{
+    std::vector<double> ret(nthreads_, 0);
+    if (wall_seconds_ > 0) {
+        for (size_t thread = 0; thread < nthreads_; ++thread) {
+            ret[thread] = stats_[thread].busy_seconds / wall_seconds_;
+        }
+    }
+    return ret;
+}
+
+void
+microscopes::lda::scheduler::reset_stats()
+{
+    stats_.assign(nthreads_, thread_stats());
+    wall_seconds_ = 0;
+}
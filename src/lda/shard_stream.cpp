@@ -0,0 +1,201 @@
+#include <microscopes/lda/shard_stream.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/util.hpp>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <sstream>
+
+namespace {
+
+// The counts file is a snapshot of the counts state, which has no
+// documents, whose extra data is this tag, the generation and, for each
+// shard, its number of documents and current file.
+const char shards_tag[] = "lda-shards";
+const int shards_version = 1;
+const char counts_file[] = "/counts";
+
+void
+rename_into_place(const std::string &tmp, const std::string &path)
+{
+    MICROSCOPES_CHECK(rename(tmp.c_str(), path.c_str()) == 0,
+        "cannot rename " + tmp + ": " + strerror(errno));
+}
+
+void
+save_shard(const microscopes::lda::document_shard &shard, const std::string &path, size_t V)
+{
+    std::string tmp = path + ".tmp";
+    shard.save(tmp, V);
+    rename_into_place(tmp, path);
+}
+
+}
+
+microscopes::lda::shard_stream::shard_stream(const std::string &dir, size_t prefetch)
+    : dir_(dir), prefetch_(prefetch), counts_(), generation_(0), first_(1, 0), copy_()
+{
+}
+
+std::shared_ptr<microscopes::lda::shard_stream>
+microscopes::lda::shard_stream::create(const std::string &dir, size_t V, float alpha, float beta,
+                                       float gamma, size_t prefetch)
+{
+    MICROSCOPES_CHECK(mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST,
+        "cannot create " + dir + ": " + strerror(errno));
+    std::shared_ptr<shard_stream> ret(new shard_stream(dir, prefetch));
+    ret->counts_ = std::make_shared<state>(V, alpha, beta, gamma);
+    ret->commit();
+    return ret;
+}
+
+std::shared_ptr<microscopes::lda::shard_stream>
+microscopes::lda::shard_stream::open(const std::string &dir, size_t prefetch)
+{
+    std::shared_ptr<shard_stream> ret(new shard_stream(dir, prefetch));
+    const std::string path = dir + counts_file;
+    std::string extra;
+    ret->counts_ = state::load_snapshot(path, &extra);
+    MICROSCOPES_CHECK(ret->counts_->nentities() == 0, path + " holds documents");
+
+    std::istringstream in(extra);
+    std::string tag;
+    int version = 0;
+    size_t nshards = 0;
+    in >> tag >> version;
+    MICROSCOPES_CHECK(in && tag == shards_tag, path + " is not a shard index");
+    MICROSCOPES_CHECK(version == shards_version, path + " has an unsupported shard index version");
+    in >> ret->generation_ >> nshards;
+    for (size_t i = 0; i < nshards && in; ++i) {
+        size_t ndocs = 0, copy = 0;
+        in >> ndocs >> copy;
+        ret->first_.push_back(ret->first_.back() + ndocs);
+        ret->copy_.push_back(copy);
+    }
+    MICROSCOPES_CHECK(!in.fail() && ret->copy_.size() == nshards, path + " has a damaged shard index");
+    return ret;
+}
+
+std::string
+microscopes::lda::shard_stream::shard_path(size_t shard, size_t copy) const
+{
+    return dir_ + "/shard-" + std::to_string(shard) + "." + std::to_string(copy);
+}
+
+void
+microscopes::lda::shard_stream::commit()
+{
+    std::ostringstream extra;
+    extra << shards_tag << " " << shards_version << "\n" << generation_ << " " << nshards() << "\n";
+    for (size_t i = 0; i < nshards(); ++i) {
+        extra << nentities(i) << " " << copy_[i] << "\n";
+    }
+    const std::string path = dir_ + counts_file, tmp = path + ".tmp";
+    counts_->save_snapshot(tmp, true, extra.str());
+    rename_into_place(tmp, path);
+}
+
+void
+microscopes::lda::shard_stream::append(const std::shared_ptr<const corpus> &docs, size_t initial_dishes,
+                                       common::rng_t &rng)
+{
+    MICROSCOPES_CHECK(docs->size() > 0, "shard has no documents");
+    for (auto v : docs->words()) {
+        MICROSCOPES_CHECK(v < counts_->nwords(), "word id out of range");
+    }
+    document_shard shard;
+    shard.docs = docs;
+    counts_->swap_shard(shard);
+
+    auto dish_pool = microscopes::common::util::range(initial_dishes);
+    for (size_t eid = 0; eid < docs->size(); ++eid) {
+        counts_->create_entity(eid);
+        auto did = common::util::sample_choice(dish_pool, rng);
+        if (!counts_->dishes_.contains(did)) {
+            did = counts_->create_dish();
+        }
+        counts_->create_table(eid, did);
+    }
+    counts_->swap_shard(shard);
+
+    save_shard(shard, shard_path(nshards(), 0), counts_->nwords());
+    first_.push_back(first_.back() + docs->size());
+    copy_.push_back(0);
+    generation_ += 1;
+    commit();
+}
+
+microscopes::lda::document_shard
+microscopes::lda::shard_stream::load(size_t shard) const
+{
+    MICROSCOPES_DCHECK(shard < nshards(), "no such shard");
+    document_shard ret = document_shard::load(shard_path(shard, copy_[shard]), counts_->nwords());
+    MICROSCOPES_CHECK(ret.size() == nentities(shard), shard_path(shard, copy_[shard]) + " has the wrong documents");
+    return ret;
+}
+
+void
+microscopes::lda::shard_stream::sweep(const std::function<void(state &, size_t)> &step)
+{
+    // Up to prefetch_ shards are read ahead and up to prefetch_ + 1 are
+    // being written behind, so at most 2 * prefetch_ + 2 are in memory.
+    // The futures wait for their tasks if step throws.
+    const size_t V = counts_->nwords();
+    std::deque<std::future<document_shard>> reads;
+    std::deque<std::future<void>> writes;
+    size_t nread = 0;
+    for (size_t s = 0; s < nshards(); ++s) {
+        for (; nread < nshards() && reads.size() <= prefetch_; ++nread) {
+            reads.push_back(std::async(std::launch::async, &shard_stream::load, this, nread));
+        }
+        document_shard shard = reads.front().get();
+        reads.pop_front();
+
+        counts_->swap_shard(shard);
+        step(*counts_, s);
+        counts_->swap_shard(shard);
+
+        for (; writes.size() > prefetch_; writes.pop_front()) {
+            writes.front().get();
+        }
+        auto done = std::make_shared<const document_shard>(std::move(shard));
+        const std::string path = shard_path(s, 1 - copy_[s]);
+        writes.push_back(std::async(std::launch::async, [done, path, V]() { save_shard(*done, path, V); }));
+    }
+    for (; !writes.empty(); writes.pop_front()) {
+        writes.front().get();
+    }
+
+    for (auto &copy : copy_) copy = 1 - copy;
+    generation_ += 1;
+    commit();
+}
+
+void
+microscopes::lda::shard_stream::validate() const
+{
+    state recount(counts_->nwords(), counts_->alpha_, counts_->beta_, counts_->gamma_);
+    for (size_t s = 0; s < nshards(); ++s) {
+        recount.count_shard(load(s));
+    }
+    const size_t nrows = std::max(recount.m_k.size(), counts_->m_k.size());
+    recount.m_k.resize(nrows, 0);
+    recount.n_k.resize(nrows, 0);
+    recount.n_kv.resize(nrows);
+    const state &counts = *counts_;
+    for (size_t k = 0; k < nrows; ++k) {
+        const bool in_counts = k < counts.m_k.size();
+        MICROSCOPES_CHECK(recount.m_k[k] == (in_counts ? counts.m_k[k] : 0), "m_k doesn't match the shards");
+        MICROSCOPES_CHECK(recount.n_k[k] == (in_counts ? counts.n_k[k] : 0), "n_k doesn't match the shards");
+        for (size_t v = 0; v < counts.nwords(); ++v) {
+            MICROSCOPES_CHECK(recount.n_kv(k, v) == (in_counts ? counts.n_kv(k, v) : 0),
+                "n_kv doesn't match the shards");
+        }
+    }
+}
@@ -0,0 +1,212 @@
+#include <microscopes/lda/simd.hpp>
+
+#include <algorithm>
+#include <math.h>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+namespace {
+
+// exp(x) is taken as 0 below this, where it leaves the normal floats.
+const float min_exp_arg = -87.3f;
+
+// Cephes expf: exp(x) = 2^n exp(r) with n = round(x / ln 2), r reduced in
+// two steps and exp(r) from a degree 5 polynomial; about 1e-7 relative
+// error over [min_exp_arg, 0], which is all that log weights minus their
+// max can take.
+const float log2e = 1.44269504088896341f;
+const float ln2_hi = 0.693359375f;
+const float ln2_lo = -2.12194440e-4f;
+const float exp_p0 = 1.9875691500e-4f;
+const float exp_p1 = 1.3981999507e-3f;
+const float exp_p2 = 8.3334519073e-3f;
+const float exp_p3 = 4.1665795894e-2f;
+const float exp_p4 = 1.6666665459e-1f;
+const float exp_p5 = 5.0000001201e-1f;
+
+#if defined(__AVX2__)
+
+inline __m256
+exp_nonpositive(__m256 x)
+{
+    __m256 keep = _mm256_cmp_ps(x, _mm256_set1_ps(min_exp_arg), _CMP_GE_OQ);
+    x = _mm256_max_ps(x, _mm256_set1_ps(min_exp_arg));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(log2e)),
+                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(ln2_hi)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(ln2_lo)));
+    __m256 y = _mm256_set1_ps(exp_p0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(exp_p1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(exp_p2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(exp_p3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(exp_p4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(exp_p5));
+    y = _mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), _mm256_add_ps(x, _mm256_set1_ps(1)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_and_ps(_mm256_mul_ps(y, _mm256_castsi256_ps(e)), keep);
+}
+
+// Running sums of the 8 lanes, plus carry (the sum so far in every lane).
+inline __m256
+scan(__m256 v, __m256 carry)
+{
+    v = _mm256_add_ps(v, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(v), 4)));
+    v = _mm256_add_ps(v, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(v), 8)));
+    // Each 128-bit half is scanned; add the low half's total to the high.
+    __m256 low_total = _mm256_shuffle_ps(v, v, 0xFF);
+    v = _mm256_add_ps(v, _mm256_permute2f128_ps(low_total, low_total, 0x08));
+    return _mm256_add_ps(v, carry);
+}
+
+inline __m256
+last_lane(__m256 v)
+{
+    __m256 high = _mm256_permute2f128_ps(v, v, 0x11);
+    return _mm256_shuffle_ps(high, high, 0xFF);
+}
+
+const size_t lanes = 8;
+
+#elif defined(__SSE4_1__)
+
+inline __m128
+exp_nonpositive(__m128 x)
+{
+    __m128 keep = _mm_cmpge_ps(x, _mm_set1_ps(min_exp_arg));
+    x = _mm_max_ps(x, _mm_set1_ps(min_exp_arg));
+    __m128 n = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps(log2e)),
+                            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(ln2_hi)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(ln2_lo)));
+    __m128 y = _mm_set1_ps(exp_p0);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(exp_p1));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(exp_p2));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(exp_p3));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(exp_p4));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(exp_p5));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, _mm_set1_ps(1)));
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_and_ps(_mm_mul_ps(y, _mm_castsi128_ps(e)), keep);
+}
+
+// Running sums of the 4 lanes, plus carry (the sum so far in every lane).
+inline __m128
+scan(__m128 v, __m128 carry)
+{
+    v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4)));
+    v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 8)));
+    return _mm_add_ps(v, carry);
+}
+
+inline __m128
+last_lane(__m128 v)
+{
+    return _mm_shuffle_ps(v, v, 0xFF);
+}
+
+const size_t lanes = 4;
+
+#endif
+
+inline float
+exp_nonpositive(float x)
+{
+    return x < min_exp_arg ? 0 : expf(x);
+}
+
+}
+
+float
+lda_util::exp_cumsum(float *w, size_t n)
+{
+    // The max gets a pass of its own. Folding it into the sums would mean
+    // rescaling every sum already written each time it rises, which is
+    // quadratic for ascending weights; this pass only reads, and leaves
+    // the weights in cache for the next.
+    size_t i = 0;
+    float max = -std::numeric_limits<float>::infinity();
+#if defined(__AVX2__)
+    __m256 vmax = _mm256_set1_ps(max);
+    for (; i + lanes <= n; i += lanes) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(w + i));
+    }
+    float lane_max[lanes];
+    _mm256_storeu_ps(lane_max, vmax);
+    for (auto m : lane_max) max = std::max(max, m);
+#elif defined(__SSE4_1__)
+    __m128 vmax = _mm_set1_ps(max);
+    for (; i + lanes <= n; i += lanes) {
+        vmax = _mm_max_ps(vmax, _mm_loadu_ps(w + i));
+    }
+    float lane_max[lanes];
+    _mm_storeu_ps(lane_max, vmax);
+    for (auto m : lane_max) max = std::max(max, m);
+#endif
+    for (; i < n; ++i) max = std::max(max, w[i]);
+    if (max == -std::numeric_limits<float>::infinity()) {
+        // No weight at all; w - max would be -inf - -inf = NaN.
+        std::fill(w, w + n, 0.0f);
+        return 0;
+    }
+
+    i = 0;
+    float total = 0;
+#if defined(__AVX2__)
+    __m256 vmax_all = _mm256_set1_ps(max), carry = _mm256_setzero_ps();
+    for (; i + lanes <= n; i += lanes) {
+        __m256 v = exp_nonpositive(_mm256_sub_ps(_mm256_loadu_ps(w + i), vmax_all));
+        v = scan(v, carry);
+        _mm256_storeu_ps(w + i, v);
+        carry = last_lane(v);
+    }
+    total = _mm256_cvtss_f32(carry);
+#elif defined(__SSE4_1__)
+    __m128 vmax_all = _mm_set1_ps(max), carry = _mm_setzero_ps();
+    for (; i + lanes <= n; i += lanes) {
+        __m128 v = exp_nonpositive(_mm_sub_ps(_mm_loadu_ps(w + i), vmax_all));
+        v = scan(v, carry);
+        _mm_storeu_ps(w + i, v);
+        carry = last_lane(v);
+    }
+    total = _mm_cvtss_f32(carry);
+#endif
+    for (; i < n; ++i) {
+        total += exp_nonpositive(w[i] - max);
+        w[i] = total;
+    }
+    return total;
+}
+
+float
+lda_util::cumsum(float *w, size_t n)
+{
+    size_t i = 0;
+    float total = 0;
+#if defined(__AVX2__)
+    __m256 carry = _mm256_setzero_ps();
+    for (; i + lanes <= n; i += lanes) {
+        __m256 v = scan(_mm256_loadu_ps(w + i), carry);
+        _mm256_storeu_ps(w + i, v);
+        carry = last_lane(v);
+    }
+    total = _mm256_cvtss_f32(carry);
+#elif defined(__SSE4_1__)
+    __m128 carry = _mm_setzero_ps();
+    for (; i + lanes <= n; i += lanes) {
+        __m128 v = scan(_mm_loadu_ps(w + i), carry);
+        _mm_storeu_ps(w + i, v);
+        carry = last_lane(v);
+    }
+    total = _mm_cvtss_f32(carry);
+#endif
+    for (; i < n; ++i) {
+        total += w[i];
+        w[i] = total;
+    }
+    return total;
+}
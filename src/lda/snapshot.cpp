@@ -0,0 +1,594 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/mapped_file.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <numeric>
+
+// Snapshot layout, version 4. Integers are in host byte order; the header
+// records byte_order_mark so that a file written on a machine of the
+// other byte order is refused. Every section starts on an 8-byte boundary.
+//
+//   snapshot_header
+//   uint64 doc_offsets[ndocs + 1]     row offsets of the runs
+//   uint32 words[nruns]               word of each run
+//   uint32 ends[nruns]                tokens of the document through each run
+//   uint64 segment_offsets[ndocs + 1] row offsets of the segments
+//   uint32 nsegments[nruns]           segments covering each run
+//   uint32 segments[2 * nsegments]    (t_ji, number of tokens) in token order
+//   uint64 table_offsets[ndocs + 1]   row offsets of the table slots
+//   uint32 dish_assignments[ntables]  k_jt; 0 for a free slot
+// and, when flags has has_order (version 4; see corpus::token):
+//   uint64 order_offsets[ndocs + 1]   row offsets of the token order
+//   uint32 order[norder]              corpus token of each token as given
+// and, when flags has has_counts:
+//   uint32 n_jt[ntables]
+//   uint64 m_k[ndishes]
+//   uint64 n_k[ndishes]
+//   uint32 n_kv[ndishes * V]          dish x word, row-major
+// and, when flags has has_extra (version 2):
+//   uint64 extra_size
+//   char extra[extra_size]            opaque to the state, e.g. a checkpoint's rng
+//
+// A document_shard is written in the same layout with is_shard set, no
+// counts and zero hyperparameters.
+//
+// Versions 1 and 2 store the documents token by token in place of the
+// runs and segments:
+//   uint64 doc_offsets[ndocs + 1]     row offsets of words and t_ji
+//   uint32 words[ntokens]
+//   uint32 table_assignments[ntokens]
+
+namespace {
+
+const char snapshot_magic[8] = {'M', 'S', 'L', 'D', 'A', 'S', 'N', 'P'};
+const uint32_t snapshot_version = 4;
+const uint32_t byte_order_mark = 0x01020304;
+const uint32_t has_counts = 1;
+const uint32_t has_extra = 2;
+const uint32_t is_shard = 4;
+const uint32_t has_order = 8;
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t flags;
+    float alpha;
+    float beta;
+    float gamma;
+    uint64_t V;
+    uint64_t ndocs;
+    uint64_t ntokens;
+    uint64_t ntables;
+    uint64_t ndishes;
+};
+
+static_assert(sizeof(snapshot_header) % 8 == 0, "header breaks section alignment");
+
+class snapshot_writer {
+public:
+    explicit snapshot_writer(const std::string &path)
+        : out_(path.c_str(), std::ios::binary | std::ios::trunc), pos_(0)
+    {
+        MICROSCOPES_CHECK(out_.good(), "cannot open " + path + " for writing");
+    }
+
+    template <class T>
+    void write(const T *data, size_t n)
+    {
+        out_.write(reinterpret_cast<const char *>(data), n * sizeof(T));
+        pos_ += n * sizeof(T);
+        static const char zeros[8] = {0};
+        out_.write(zeros, (8 - pos_ % 8) % 8);
+        pos_ += (8 - pos_ % 8) % 8;
+    }
+
+    template <class T, class U>
+    void write_as(const U &values)
+    {
+        std::vector<T> converted(values.begin(), values.end());
+        write(converted.data(), converted.size());
+    }
+
+    void close(const std::string &path)
+    {
+        out_.close();
+        MICROSCOPES_CHECK(!out_.fail(), "error writing " + path);
+    }
+
+private:
+    std::ofstream out_;
+    size_t pos_;
+};
+
+// A mapped file read front to back in sections.
+class snapshot_reader {
+public:
+    explicit snapshot_reader(const std::string &path)
+        : file_(path), pos_(0)
+    {
+    }
+
+    template <class T>
+    const T *read(size_t n)
+    {
+        const size_t size = file_.size();
+        MICROSCOPES_CHECK(n <= (size - pos_) / sizeof(T), file_.path() + " is truncated");
+        const T *ret = reinterpret_cast<const T *>(file_.data() + pos_);
+        pos_ += n * sizeof(T);
+        pos_ = std::min(size, pos_ + (8 - pos_ % 8) % 8);
+        return ret;
+    }
+
+    inline bool at_end() const { return pos_ == file_.size(); }
+
+private:
+    microscopes::lda::mapped_file file_;
+    size_t pos_;
+};
+
+// Offsets must start at 0, never decrease and end at `total`.
+void
+check_offsets(const uint64_t *offsets, size_t nrows, uint64_t total, const std::string &what)
+{
+    MICROSCOPES_CHECK(offsets[0] == 0 && offsets[nrows] == total, "bad " + what + " offsets");
+    for (size_t i = 0; i < nrows; ++i) {
+        MICROSCOPES_CHECK(offsets[i] <= offsets[i + 1], "bad " + what + " offsets");
+    }
+}
+
+
+using microscopes::lda::corpus;
+using microscopes::lda::document_shard;
+using microscopes::lda::nested_vector;
+using lda_util::run_tables;
+
+snapshot_header
+make_header(uint32_t flags, size_t V, const corpus &docs, size_t ntables, size_t ndishes)
+{
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.version = snapshot_version;
+    header.byte_order = byte_order_mark;
+    header.flags = flags | (docs.order().empty() ? 0 : has_order);
+    header.V = V;
+    header.ndocs = docs.size();
+    header.ntokens = docs.ntokens();
+    header.ntables = ntables;
+    header.ndishes = ndishes;
+    return header;
+}
+
+const snapshot_header &
+read_header(snapshot_reader &in, const std::string &path)
+{
+    const snapshot_header &header = *in.read<snapshot_header>(1);
+    MICROSCOPES_CHECK(memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) == 0,
+        path + " is not an lda snapshot");
+    MICROSCOPES_CHECK(header.version >= 1 && header.version <= snapshot_version,
+        path + " has an unsupported snapshot version");
+    MICROSCOPES_CHECK(header.byte_order == byte_order_mark, path + " was written with another byte order");
+    MICROSCOPES_CHECK(header.V > 0 && header.ndishes > 0, path + " has no words or dishes");
+    return header;
+}
+
+// Flattens the per-run segments and table slots as write_documents
+// writes them.
+void
+flatten_documents(const corpus &docs, const std::vector<run_tables> &tables,
+                  const nested_vector &dish_assignments, microscopes::lda::snapshot_assignments &flat)
+{
+    flat.segment_offsets.assign(1, 0);
+    flat.table_offsets.assign(1, 0);
+    flat.nsegments.clear();
+    flat.segments.clear();
+    flat.dishes.clear();
+    flat.nsegments.reserve(docs.nruns());
+    for (size_t eid = 0; eid < docs.size(); ++eid) {
+        const auto &runs = tables[eid];
+        for (size_t r = 0; r < runs.nruns(); ++r) {
+            flat.nsegments.push_back(runs.nsegments(r));
+            for (auto &seg : runs.run(r)) {
+                flat.segments.push_back(seg.first);
+                flat.segments.push_back(seg.second);
+            }
+        }
+        flat.segment_offsets.push_back(flat.segments.size() / 2);
+        flat.dishes.insert(flat.dishes.end(), dish_assignments[eid].begin(), dish_assignments[eid].end());
+        flat.table_offsets.push_back(flat.dishes.size());
+    }
+}
+
+// The sections from doc_offsets through dish_assignments.
+void
+write_documents(snapshot_writer &out, const corpus &docs, const microscopes::lda::snapshot_assignments &flat)
+{
+    out.write_as<uint64_t>(docs.offsets());
+    out.write(docs.words().data(), docs.nruns());
+    out.write(docs.ends().data(), docs.nruns());
+    out.write(flat.segment_offsets.data(), flat.segment_offsets.size());
+    out.write(flat.nsegments.data(), flat.nsegments.size());
+    out.write(flat.segments.data(), flat.segments.size());
+    out.write(flat.table_offsets.data(), flat.table_offsets.size());
+    out.write(flat.dishes.data(), flat.dishes.size());
+    if (!docs.order().empty()) {
+        out.write_as<uint64_t>(docs.order_offsets());
+        out.write(docs.order().data(), docs.order().size());
+    }
+}
+
+size_t
+count_slots(const nested_vector &dish_assignments)
+{
+    size_t n = 0;
+    for (auto &k_jt : dish_assignments) n += k_jt.size();
+    return n;
+}
+
+// Reads the sections written by write_documents into `shard`, checking
+// them against the header. The table counts and per-table word
+// histograms are rebuilt from the table assignments.
+void
+read_documents(snapshot_reader &in, const snapshot_header &header, const std::string &path,
+               document_shard &shard)
+{
+    const size_t ndocs = header.ndocs;
+
+    // The documents as runs, with the tables of their tokens as segments.
+    std::vector<size_t> run_offsets(1, 0);
+    std::vector<uint32_t> run_words, run_ends;
+    std::vector<std::vector<uint32_t>> first_segments(ndocs);
+    std::vector<std::vector<run_tables::segment>> segments(ndocs);
+    const uint64_t *doc_offsets = in.read<uint64_t>(ndocs + 1);
+    if (header.version >= 3) {
+        const uint64_t nruns = doc_offsets[ndocs];
+        check_offsets(doc_offsets, ndocs, nruns, "document");
+        const uint32_t *words = in.read<uint32_t>(nruns);
+        const uint32_t *ends = in.read<uint32_t>(nruns);
+        const uint64_t *segment_offsets = in.read<uint64_t>(ndocs + 1);
+        const uint64_t nsegments_total = segment_offsets[ndocs];
+        check_offsets(segment_offsets, ndocs, nsegments_total, "segment");
+        const uint32_t *nsegments = in.read<uint32_t>(nruns);
+        MICROSCOPES_CHECK(nsegments_total <= std::numeric_limits<size_t>::max() / 2, path + " is too large");
+        const uint32_t *segment_data = in.read<uint32_t>(2 * nsegments_total);
+        run_offsets.assign(doc_offsets, doc_offsets + ndocs + 1);
+        run_words.assign(words, words + nruns);
+        run_ends.assign(ends, ends + nruns);
+        for (size_t eid = 0; eid < ndocs; ++eid) {
+            // Each run's segments must cover exactly its tokens.
+            uint64_t seg = segment_offsets[eid], end = 0;
+            auto &first = first_segments[eid];
+            first.push_back(0);
+            for (size_t r = doc_offsets[eid]; r < doc_offsets[eid + 1]; ++r) {
+                MICROSCOPES_CHECK(nsegments[r] <= segment_offsets[eid + 1] - seg, path + " has bad segments");
+                uint64_t length = 0;
+                for (size_t i = 0; i < nsegments[r]; ++i, ++seg) {
+                    MICROSCOPES_CHECK(segment_data[2 * seg + 1] > 0, path + " has bad segments");
+                    segments[eid].push_back(std::make_pair(segment_data[2 * seg], segment_data[2 * seg + 1]));
+                    length += segment_data[2 * seg + 1];
+                }
+                MICROSCOPES_CHECK(ends[r] > end && length == ends[r] - end, path + " has bad segments");
+                end = ends[r];
+                first.push_back(segments[eid].size());
+            }
+            MICROSCOPES_CHECK(seg == segment_offsets[eid + 1], path + " has bad segments");
+        }
+        MICROSCOPES_CHECK(std::accumulate(first_segments.begin(), first_segments.end(), uint64_t(0),
+                              [](uint64_t n, const std::vector<uint32_t> &first) { return n + first.back(); }) == nsegments_total,
+            path + " has bad segments");
+    }
+    else {
+        // Token by token: consecutive repeats become runs, and repeats at
+        // the same table segments.
+        check_offsets(doc_offsets, ndocs, header.ntokens, "document");
+        const uint32_t *words = in.read<uint32_t>(header.ntokens);
+        const uint32_t *tables = in.read<uint32_t>(header.ntokens);
+        for (size_t eid = 0; eid < ndocs; ++eid) {
+            auto &first = first_segments[eid];
+            auto &segs = segments[eid];
+            for (size_t i = doc_offsets[eid]; i < doc_offsets[eid + 1]; ++i) {
+                const bool new_run = i == doc_offsets[eid] || words[i] != words[i - 1];
+                if (new_run) {
+                    run_words.push_back(words[i]);
+                    run_ends.push_back(0);
+                    first.push_back(segs.size());
+                }
+                run_ends.back() = i + 1 - doc_offsets[eid];
+                if (!new_run && segs.back().first == tables[i]) {
+                    segs.back().second += 1;
+                }
+                else {
+                    segs.push_back(std::make_pair(tables[i], 1u));
+                }
+            }
+            first.push_back(segs.size());
+            run_offsets.push_back(run_words.size());
+        }
+    }
+    const uint64_t *table_offsets = in.read<uint64_t>(ndocs + 1);
+    check_offsets(table_offsets, ndocs, header.ntables, "table");
+    const uint32_t *dishes = in.read<uint32_t>(header.ntables);
+
+    for (auto v : run_words) {
+        MICROSCOPES_CHECK(v < header.V, path + " has a word id out of range");
+    }
+    for (size_t i = 0; i < header.ntables; ++i) {
+        MICROSCOPES_CHECK(dishes[i] < header.ndishes, path + " has a dish id out of range");
+    }
+    std::vector<size_t> order_offsets;
+    std::vector<uint32_t> order;
+    if (header.flags & has_order) {
+        MICROSCOPES_CHECK(header.version >= 4, path + " has an unsupported snapshot version");
+        const uint64_t *offsets = in.read<uint64_t>(ndocs + 1);
+        check_offsets(offsets, ndocs, offsets[ndocs], "token order");
+        const uint32_t *data = in.read<uint32_t>(offsets[ndocs]);
+        order_offsets.assign(offsets, offsets + ndocs + 1);
+        order.assign(data, data + offsets[ndocs]);
+    }
+
+    auto docs = std::make_shared<const corpus>(std::move(run_offsets), std::move(run_words), std::move(run_ends),
+                                               std::move(order_offsets), std::move(order));
+    MICROSCOPES_CHECK(docs->ntokens() == header.ntokens, path + " has bad document lengths");
+    shard.docs = docs;
+    shard.using_t.assign(ndocs, lda_util::id_set());
+    shard.dish_assignments.assign(ndocs, std::vector<size_t>());
+    shard.n_jt.assign(ndocs, std::vector<size_t>());
+    shard.n_jtv.assign(ndocs, std::vector<microscopes::lda::word_histogram>());
+    shard.run_tables.clear();
+    shard.run_tables.reserve(ndocs);
+
+    std::vector<size_t> active;
+    for (size_t eid = 0; eid < ndocs; ++eid) {
+        const uint32_t *k_jt = dishes + table_offsets[eid];
+        const size_t nslots = table_offsets[eid + 1] - table_offsets[eid];
+        MICROSCOPES_CHECK(nslots > 0, path + " has a document without table 0");
+        // Table 0 always exists; other slots are tables iff they have a dish.
+        active.clear();
+        for (size_t t = 0; t < nslots; ++t) {
+            if (t == 0 || k_jt[t] != 0) active.push_back(t);
+        }
+        shard.using_t[eid].assign(active, nslots);
+        shard.dish_assignments[eid].assign(k_jt, k_jt + nslots);
+        shard.n_jt[eid].assign(nslots, 0);
+        shard.n_jtv[eid].resize(nslots);
+
+        // Words at table 0 are not seated and are not counted.
+        shard.run_tables.push_back(run_tables(docs->nruns(eid), [&](size_t r) { return docs->count(eid, r); }));
+        auto &runs = shard.run_tables.back();
+        const auto &first = first_segments[eid];
+        for (size_t r = 0; r < runs.nruns(); ++r) {
+            runs.assign_run(r, segments[eid].begin() + first[r], segments[eid].begin() + first[r + 1]);
+        }
+        for (size_t r = 0; r < runs.nruns(); ++r) {
+            const size_t v = docs->word(eid, r);
+            for (auto &seg : runs.run(r)) {
+                const size_t t = seg.first, n = seg.second;
+                MICROSCOPES_CHECK(t < nslots && (t == 0 || k_jt[t] != 0), path + " seats a word at a free table");
+                if (t == 0) continue;
+                shard.n_jtv[eid][t].incr(v, n);
+                shard.n_jt[eid][t] += n;
+            }
+        }
+    }
+}
+
+}
+
+void
+microscopes::lda::state::save_snapshot(const std::string &path, bool with_counts,
+                                       const std::string &extra) const
+{
+    const uint32_t flags = (with_counts ? has_counts : 0) | (extra.empty() ? 0 : has_extra);
+    snapshot_header header = make_header(flags, V, *x_ji, count_slots(dish_assignments_), n_kv.nrows());
+    header.alpha = alpha_;
+    header.beta = beta_;
+    header.gamma = gamma_;
+
+    snapshot_assignments flat;
+    flatten_documents(*x_ji, run_tables_, dish_assignments_, flat);
+    snapshot_writer out(path);
+    out.write(&header, 1);
+    write_documents(out, *x_ji, flat);
+    if (with_counts) {
+        std::vector<uint32_t> table_counts;
+        table_counts.reserve(header.ntables);
+        for (auto &counts : n_jt) table_counts.insert(table_counts.end(), counts.begin(), counts.end());
+        out.write(table_counts.data(), table_counts.size());
+        out.write_as<uint64_t>(m_k);
+        out.write_as<uint64_t>(n_k);
+        out.write(n_kv.row(0), header.ndishes * V);
+    }
+    if (!extra.empty()) {
+        uint64_t extra_size = extra.size();
+        out.write(&extra_size, 1);
+        out.write(extra.data(), extra.size());
+    }
+    out.close(path);
+}
+
+microscopes::lda::snapshot_assignments
+microscopes::lda::state::flat_assignments() const
+{
+    snapshot_assignments flat;
+    flat.V = V;
+    flat.alpha = alpha_;
+    flat.beta = beta_;
+    flat.gamma = gamma_;
+    flat.ndishes = n_kv.nrows();
+    flat.docs = x_ji;
+    flatten_documents(*x_ji, run_tables_, dish_assignments_, flat);
+    return flat;
+}
+
+void
+microscopes::lda::snapshot_assignments::save(const std::string &path, bool with_counts,
+                                             const std::string &extra) const
+{
+    const uint32_t flags = (with_counts ? has_counts : 0) | (extra.empty() ? 0 : has_extra);
+    snapshot_header header = make_header(flags, V, *docs, dishes.size(), ndishes);
+    header.alpha = alpha;
+    header.beta = beta;
+    header.gamma = gamma;
+
+    snapshot_writer out(path);
+    out.write(&header, 1);
+    write_documents(out, *docs, *this);
+    if (with_counts) {
+        // Counted as count_shard does: every slot with a dish is a table,
+        // and the words at table 0 are not seated.
+        std::vector<uint32_t> table_counts(dishes.size(), 0);
+        std::vector<uint64_t> m_k(ndishes, 0), n_k(ndishes, 0);
+        std::vector<uint32_t> n_kv(ndishes * V, 0);
+        for (auto k : dishes) {
+            if (k != 0) m_k[k] += 1;
+        }
+        size_t seg = 0;
+        for (size_t eid = 0; eid < docs->size(); ++eid) {
+            const size_t slots = table_offsets[eid];
+            for (size_t r = 0; r < docs->nruns(eid); ++r) {
+                const size_t v = docs->word(eid, r);
+                for (size_t end = seg + nsegments[docs->offsets()[eid] + r]; seg < end; ++seg) {
+                    const uint32_t t = segments[2 * seg], n = segments[2 * seg + 1];
+                    if (t == 0) continue;
+                    const size_t k = dishes[slots + t];
+                    table_counts[slots + t] += n;
+                    n_k[k] += n;
+                    n_kv[k * V + v] += n;
+                }
+            }
+        }
+        out.write(table_counts.data(), table_counts.size());
+        out.write(m_k.data(), m_k.size());
+        out.write(n_k.data(), n_k.size());
+        out.write(n_kv.data(), n_kv.size());
+    }
+    if (!extra.empty()) {
+        uint64_t extra_size = extra.size();
+        out.write(&extra_size, 1);
+        out.write(extra.data(), extra.size());
+    }
+    out.close(path);
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_snapshot(const std::string &path, std::string *extra, bool verify)
+{
+    snapshot_reader in(path);
+    const snapshot_header &header = read_header(in, path);
+    MICROSCOPES_CHECK(!(header.flags & is_shard), path + " is a document shard, not a snapshot");
+    const size_t V = header.V, ndishes = header.ndishes;
+
+    document_shard shard;
+    read_documents(in, header, path, shard);
+    const bool with_counts = header.flags & has_counts;
+    const uint32_t *table_counts = nullptr;
+    const uint64_t *dish_tables = nullptr, *dish_words = nullptr;
+    const uint32_t *dish_word_counts = nullptr;
+    if (with_counts) {
+        table_counts = in.read<uint32_t>(header.ntables);
+        dish_tables = in.read<uint64_t>(ndishes);
+        dish_words = in.read<uint64_t>(ndishes);
+        MICROSCOPES_CHECK(ndishes <= std::numeric_limits<size_t>::max() / V, path + " is too large");
+        dish_word_counts = in.read<uint32_t>(ndishes * V);
+    }
+    if (extra) extra->clear();
+    if (header.flags & has_extra) {
+        MICROSCOPES_CHECK(header.version >= 2, path + " has an unsupported snapshot version");
+        uint64_t extra_size = *in.read<uint64_t>(1);
+        const char *extra_data = in.read<char>(extra_size);
+        if (extra) extra->assign(extra_data, extra_size);
+    }
+    MICROSCOPES_CHECK(in.at_end(), path + " has trailing data");
+
+    std::shared_ptr<state> s(new state(V, header.alpha, header.beta, header.gamma, shard.docs));
+    s->m_k.assign(ndishes, 0);
+    s->n_k.assign(ndishes, 0);
+    s->n_kv.resize(ndishes);
+    if (!with_counts) {
+        s->count_shard(shard);
+    }
+    else {
+        // The stored counts are taken as they are. Checking them against
+        // the assignments needs a recount, so only invariants that cost
+        // no more than reading them are checked unless `verify` is set.
+        std::copy(dish_tables, dish_tables + ndishes, s->m_k.begin());
+        std::copy(dish_words, dish_words + ndishes, s->n_k.begin());
+        std::copy(dish_word_counts, dish_word_counts + ndishes * V, s->n_kv.row(0));
+        for (size_t k = 0; k < ndishes; ++k) {
+            const uint32_t *row = s->n_kv.row(k);
+            MICROSCOPES_CHECK(std::accumulate(row, row + V, uint64_t(0)) == s->n_k[k],
+                path + " has dish/word counts (n_kv) that do not add up to n_k");
+        }
+        // Without documents (as a shard_stream keeps its counts) there
+        // are no tables to check against.
+        if (shard.size() > 0) {
+            std::vector<uint64_t> tables(ndishes, 0), words(ndishes, 0);
+            for (size_t eid = 0, i = 0; eid < shard.size(); ++eid) {
+                const auto &k_jt = shard.dish_assignments[eid];
+                // The per-table word histograms are built from the
+                // assignments, so n_jt comes with them.
+                for (size_t t = 0; t < k_jt.size(); ++t, ++i) {
+                    MICROSCOPES_CHECK(shard.n_jt[eid][t] == table_counts[i],
+                        path + " has table counts that do not match its tables");
+                }
+                for (auto t : shard.using_t[eid]) {
+                    if (k_jt[t] == 0) continue;
+                    tables[k_jt[t]] += 1;
+                    words[k_jt[t]] += shard.n_jt[eid][t];
+                }
+            }
+            MICROSCOPES_CHECK(std::equal(tables.begin(), tables.end(), s->m_k.begin()),
+                path + " has dish table counts (m_k) that do not match its tables");
+            MICROSCOPES_CHECK(std::equal(words.begin(), words.end(), s->n_k.begin()),
+                path + " has dish word counts (n_k) that do not match its tables");
+        }
+        if (verify && shard.size() > 0) {
+            state recount(V, header.alpha, header.beta, header.gamma, shard.docs);
+            recount.m_k.assign(ndishes, 0);
+            recount.n_k.assign(ndishes, 0);
+            recount.n_kv.resize(ndishes);
+            recount.count_shard(shard);
+            MICROSCOPES_CHECK(recount.n_kv.nrows() == ndishes &&
+                std::equal(dish_word_counts, dish_word_counts + ndishes * V, recount.n_kv.row(0)),
+                path + " has dish/word counts (n_kv) that do not match its tables");
+        }
+    }
+    s->swap_shard(shard);
+    s->rebuild_dish_totals();
+    return s;
+}
+
+void
+microscopes::lda::document_shard::save(const std::string &path, size_t V) const
+{
+    size_t ndishes = 1;
+    for (auto &k_jt : dish_assignments) {
+        for (auto k : k_jt) ndishes = std::max(ndishes, k + 1);
+    }
+    snapshot_header header = make_header(is_shard, V, *docs, count_slots(dish_assignments), ndishes);
+    microscopes::lda::snapshot_assignments flat;
+    flatten_documents(*docs, run_tables, dish_assignments, flat);
+    snapshot_writer out(path);
+    out.write(&header, 1);
+    write_documents(out, *docs, flat);
+    out.close(path);
+}
+
+microscopes::lda::document_shard
+microscopes::lda::document_shard::load(const std::string &path, size_t V)
+{
+    snapshot_reader in(path);
+    const snapshot_header &header = read_header(in, path);
+    MICROSCOPES_CHECK((header.flags & ~has_order) == is_shard, path + " is not a document shard");
+    MICROSCOPES_CHECK(header.V == V, path + " has a different vocabulary size");
+    document_shard shard;
+    read_documents(in, header, path, shard);
+    MICROSCOPES_CHECK(in.at_end(), path + " has trailing data");
+    return shard;
+}
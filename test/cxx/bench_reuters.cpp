@@ -0,0 +1,139 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/corpus_io.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/models/distributions.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// Times Gibbs sweeps over the Reuters corpus, reporting the word-level
+// (sampling_t) and table-level (sampling_k) phases separately. With more
+// than one thread the whole parallel sweep is timed as one phase, and the
+// scheduler's per-thread utilization is reported. Loading the corpus and
+// the final perplexity evaluation are timed too. The direct assignment
+// kernel is timed as one phase. With split_merge > 0, that many
+// split-merge proposals follow each sweep; they are timed separately and
+// their acceptance rates and the number of topics are reported.
+//
+//   bench_reuters [path/to/reuters.ldac] [nsweeps] [seed] [dense|sparse|runs|mh|direct] [nthreads] [split_merge]
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double
+seconds_since(bench_clock::time_point start)
+{
+    return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char **argv){
+    string path = argc > 1 ? argv[1] : "test/data/reuters.ldac";
+    size_t nsweeps = argc > 2 ? strtoul(argv[2], NULL, 10) : 10;
+    size_t seed = argc > 3 ? strtoul(argv[3], NULL, 10) : 12345;
+    string kernel = argc > 4 ? argv[4] : "dense";
+    size_t nthreads = argc > 5 ? strtoul(argv[5], NULL, 10) : 1;
+    size_t split_merge = argc > 6 ? strtoul(argv[6], NULL, 10) : 0;
+    kernels::lda_crp::token_sampler sample_token = kernels::lda_crp::sampling_t;
+    if (kernel == "sparse") {
+        sample_token = kernels::lda_crp::sampling_t_sparse;
+    } else if (kernel == "runs") {
+        sample_token = kernels::lda_crp::sampling_t_run;
+    } else {
+        MICROSCOPES_CHECK(kernel == "dense" || kernel == "mh" || kernel == "direct", "unknown kernel " + kernel);
+    }
+    MICROSCOPES_CHECK(nthreads <= 1 || (kernel != "mh" && kernel != "direct"), "the " + kernel + " kernel is serial only");
+
+    auto start_load = bench_clock::now();
+    auto file = lda::read_corpus(path, lda::corpus_format::ldac, nthreads);
+    cout << file.docs->size() << " documents, " << file.nwords() << " terms, "
+         << file.docs->ntokens() << " tokens in " << file.docs->nruns() << " runs, loaded in "
+         << seconds_since(start_load) << "s" << endl;
+
+    rng_t r(seed);
+    lda::model_definition defn(file.docs->size(), file.nwords());
+    lda::state state(defn, 0.2, 0.01, 0.5, 10, file.docs, r);
+
+    lda::scheduler scheduler(max(nthreads, size_t(1)));
+    kernels::lda_crp::workspace ws;
+    kernels::lda_direct::workspace direct_ws;
+    kernels::lda_crp::split_merge_stats split_merge_stats;
+    double t_phase = 0, k_phase = 0, split_merge_phase = 0;
+    for (size_t sweep = 0; sweep < nsweeps; ++sweep) {
+        auto start = bench_clock::now();
+        if (split_merge > 0) {
+            kernels::lda_crp::split_merge(state, r, split_merge, split_merge_stats);
+            split_merge_phase += seconds_since(start);
+            start = bench_clock::now();
+        }
+        if (nthreads > 1) {
+            kernels::lda_crp_gibbs(state, r, sample_token, scheduler);
+            t_phase += seconds_since(start);
+            continue;
+        }
+        if (kernel == "direct") {
+            kernels::lda_direct_gibbs(state, r, direct_ws);
+            t_phase += seconds_since(start);
+            continue;
+        }
+        if (kernel == "mh") {
+            kernels::lda_crp::mh_proposals proposals(state);
+            for (size_t eid = 0; eid < state.nentities(); ++eid) {
+                for (size_t q = 0; q < state.nruns(eid); ++q) {
+                    for (size_t pos = 0; pos < state.run_count(eid, q); ++pos) {
+                        kernels::lda_crp::sampling_t_mh(state, proposals, eid, q, pos, 2, r);
+                    }
+                }
+            }
+        } else {
+            for (size_t eid = 0; eid < state.nentities(); ++eid) {
+                kernels::lda_crp::sampling_t_document(state, eid, sample_token, r, ws);
+            }
+        }
+        t_phase += seconds_since(start);
+
+        start = bench_clock::now();
+        kernels::lda_crp::sampling_k_sweep(state, r, ws);
+        k_phase += seconds_since(start);
+    }
+
+    cout << "kernel: " << kernel << ", sweeps: " << nsweeps
+         << ", threads: " << nthreads << endl;
+    if (kernel == "direct") {
+        cout << "sweep: " << 1e3 * t_phase / nsweeps << " ms/sweep" << endl;
+    } else if (nthreads > 1) {
+        cout << "sweep: " << 1e3 * t_phase / nsweeps << " ms/sweep" << endl;
+        auto utilization = scheduler.utilization();
+        for (size_t thread = 0; thread < nthreads; ++thread) {
+            const auto &stats = scheduler.stats()[thread];
+            cout << "thread " << thread << ": " << 100 * utilization[thread] << "% busy, "
+                 << stats.ntasks << " tasks, " << stats.nstolen << " stolen" << endl;
+        }
+    } else {
+        cout << "sampling_t: " << 1e3 * t_phase / nsweeps << " ms/sweep" << endl;
+        cout << "sampling_k: " << 1e3 * k_phase / nsweeps << " ms/sweep" << endl;
+    }
+    if (split_merge > 0) {
+        cout << "split_merge: " << 1e3 * split_merge_phase / nsweeps << " ms/sweep, accepted "
+             << 100 * split_merge_stats.split_acceptance() << "% of " << split_merge_stats.nsplits_proposed
+             << " splits and " << 100 * split_merge_stats.merge_acceptance() << "% of "
+             << split_merge_stats.nmerges_proposed << " merges" << endl;
+        cout << "topics by sweep:";
+        const auto &ntopics = split_merge_stats.ntopics;
+        for (size_t sweep = 0; sweep < ntopics.size(); sweep += max(ntopics.size() / 10, size_t(1))) {
+            cout << " " << ntopics[sweep];
+        }
+        cout << endl;
+    }
+    cout << "topics: " << state.ntopics() << ", tables: " << state.ntables() << endl;
+    auto start = bench_clock::now();
+    double perplexity = state.perplexity(scheduler);
+    cout << "perplexity: " << perplexity << " (" << 1e3 * seconds_since(start) << " ms)" << endl;
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/models/distributions.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// Count every heap allocation made by the test binary.
+static size_t allocations = 0;
+
+void *
+operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// Reads everything a Gibbs sweep reads from the state. Returns a checksum
+// so that the reads are not optimized away.
+static size_t
+read_sweep(const lda::state &state)
+{
+    size_t checksum = 0;
+    for (auto did : state.dishes()) {
+        checksum += state.dishsize(did);
+    }
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        for (size_t r = 0; r < state.nruns(eid); ++r) {
+            checksum += state.run_word(eid, r) + state.run_count(eid, r);
+            for (auto &seg : state.run_tables(eid).run(r)) {
+                checksum += seg.first + seg.second;
+            }
+        }
+        for (size_t i = 0; i < state.nterms(eid); ++i) {
+            checksum += state.get_word(eid, i) + state.table_assignment(eid, i);
+        }
+        for (auto t : state.tables(eid)) {
+            checksum += state.tablesize(eid, t) + state.dish_assignment(eid, t);
+            for (auto &kv : state.table_words(eid, t)) {
+                checksum += kv.second;
+            }
+        }
+        checksum += state.dish_assignments()[eid].size();
+    }
+    return checksum;
+}
+
+static void
+test_read_allocations()
+{
+    rng_t r(5849343);
+    lda::model_definition defn(data::random_docs.size(), 5);
+    lda::state state(defn, 1, .5, 1, 1, data::random_docs, r);
+    for (size_t i = 0; i < 10; i++) {
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    size_t before = allocations;
+    size_t checksum = read_sweep(state);
+    MICROSCOPES_CHECK(checksum > 0, "nothing was read");
+    MICROSCOPES_CHECK(allocations == before, "reading the state allocated");
+}
+
+static void
+test_sweep_allocations()
+{
+    rng_t r(5849343);
+    lda::model_definition defn(data::random_docs.size(), 5);
+    lda::state state(defn, 1, .5, 1, 1, data::random_docs, r);
+    kernels::lda_crp::workspace ws;
+    for (size_t i = 0; i < 300; i++) {
+        microscopes::kernels::lda_crp_gibbs(state, r, kernels::lda_crp::sampling_t, ws);
+    }
+
+    // The posteriors only write into the workspace. sampling_t keeps its
+    // f_k apart, so ws.f_k is sized by the first pass.
+    auto posteriors = [&]() {
+        for (size_t eid = 0; eid < state.nentities(); ++eid) {
+            kernels::lda_crp::calc_f_k(state, state.get_word(eid, 0), r, ws.f_k);
+            kernels::lda_crp::calc_table_posterior(state, eid, ws.f_k, r, ws.p_t);
+            kernels::lda_crp::calc_dish_posterior_w(state, ws.f_k, r, ws.p_k);
+            for (auto t : state.tables(eid)) {
+                if (t != 0) kernels::lda_crp::calc_dish_posterior_t(state, eid, t, r, ws.p_k, true);
+            }
+        }
+    };
+    posteriors();
+    size_t before = allocations;
+    posteriors();
+    MICROSCOPES_CHECK(allocations == before, "posteriors allocated");
+
+}
+
+// A sweep allocates only when the state reaches a new high-water mark: a
+// document opening more tables than it has before, a table slot getting
+// more distinct words than it has held, a dish count outgrowing the
+// lgamma cache. On a corpus this small every slot has reached its mark by
+// the end of the burn-in.
+static void
+test_steady_sweep_allocations()
+{
+    lda::nested_vector docs;
+    for (size_t j = 0; j < 10; ++j) {
+        docs.emplace_back(data::random_docs[j].begin(), data::random_docs[j].begin() + 5);
+    }
+    rng_t r(5849343);
+    lda::model_definition defn(docs.size(), 5);
+
+    lda::state crf(defn, 1, .5, 1, 1, docs, r);
+    kernels::lda_crp::workspace ws;
+    for (size_t i = 0; i < 1000; i++) {
+        microscopes::kernels::lda_crp_gibbs(crf, r, kernels::lda_crp::sampling_t, ws);
+    }
+    size_t before = allocations;
+    for (size_t i = 0; i < 10; i++) {
+        microscopes::kernels::lda_crp_gibbs(crf, r, kernels::lda_crp::sampling_t, ws);
+    }
+    MICROSCOPES_CHECK(allocations == before, "crf sweeps allocated");
+
+    lda::state direct(defn, 1, .5, 1, 1, docs, r);
+    kernels::lda_direct::workspace dws;
+    for (size_t i = 0; i < 1000; i++) {
+        microscopes::kernels::lda_direct_gibbs(direct, r, dws);
+    }
+    before = allocations;
+    for (size_t i = 0; i < 10; i++) {
+        microscopes::kernels::lda_direct_gibbs(direct, r, dws);
+    }
+    MICROSCOPES_CHECK(allocations == before, "direct sweeps allocated");
+}
+
+// Reseating a document onto the tables it already has reuses every slot,
+// so it allocates nothing whatever the chain did before.
+static void
+test_reseat_allocations()
+{
+    rng_t r(5849343);
+    lda::model_definition defn(data::random_docs.size(), 5);
+    lda::state state(defn, 1, .5, 1, 1, data::random_docs, r);
+    kernels::lda_direct::workspace ws;
+    for (size_t i = 0; i < 10; i++) {
+        microscopes::kernels::lda_direct_gibbs(state, r, ws);
+    }
+
+    std::vector<std::vector<uint32_t>> token_tables(state.nentities());
+    std::vector<std::vector<size_t>> table_dishes(state.nentities());
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        // The direct kernel leaves each document at tables 1, ..., T.
+        table_dishes[eid].push_back(0);
+        for (auto t : state.tables(eid)) {
+            if (t == 0) continue;
+            MICROSCOPES_CHECK(t == table_dishes[eid].size(), "tables are not 1, ..., T");
+            table_dishes[eid].push_back(state.dish_assignment(eid, t));
+        }
+        // In corpus order, run by run, as reseat_document takes them.
+        for (size_t r = 0; r < state.nruns(eid); ++r) {
+            for (size_t pos = 0; pos < state.run_count(eid, r); ++pos) {
+                token_tables[eid].push_back(state.run_tables(eid).table(r, pos));
+            }
+        }
+    }
+
+    size_t before = allocations;
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        state.reseat_document(eid, token_tables[eid], table_dishes[eid]);
+    }
+    MICROSCOPES_CHECK(allocations == before, "reseat_document allocated");
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        for (size_t r = 0, i = 0; r < state.nruns(eid); ++r) {
+            for (size_t pos = 0; pos < state.run_count(eid, r); ++pos, ++i) {
+                MICROSCOPES_CHECK(state.run_tables(eid).table(r, pos) == token_tables[eid][i], "token moved");
+            }
+        }
+    }
+}
+
+int main(void){
+    test_read_allocations();
+    std::cout << "test_read_allocations passed" << std::endl;
+    test_sweep_allocations();
+    std::cout << "test_sweep_allocations passed" << std::endl;
+    test_steady_sweep_allocations();
+    std::cout << "test_steady_sweep_allocations passed" << std::endl;
+    test_reseat_allocations();
+    std::cout << "test_reseat_allocations passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <microscopes/lda/checkpoint.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static const string path = "test_checkpoint.tmp";
+
+static std::shared_ptr<lda::state>
+new_state(rng_t &r){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,3}, {0,1,4,5,1,6}, {0,1,5,6}, {2,2,4}};
+    lda::model_definition defn(4, 7);
+    return lda::state::initialize(defn, 0.5, 0.1, 1.0, 3, docs, r);
+}
+
+static bool
+same_chain(const lda::state &a, const rng_t &ra, const lda::state &b, const rng_t &rb){
+    return ra == rb && a.table_assignments() == b.table_assignments()
+        && a.dish_assignments() == b.dish_assignments() && a.dishes() == b.dishes();
+}
+
+// Resuming from a checkpoint must continue the chain exactly as if it
+// had not been interrupted.
+static void
+test_resume(){
+    rng_t r(51);
+    auto state = new_state(r);
+    {
+        lda::checkpointer checkpoints(path, 7, 0);
+        for(size_t it = 1; it <= 20; ++it){
+            microscopes::kernels::lda_crp_gibbs(*state, r);
+            checkpoints.maybe_save(*state, r, it);
+        }
+        checkpoints.wait();
+        MICROSCOPES_CHECK(checkpoints.nsaved() == 2, "wrong number of checkpoints");
+    }
+
+    std::shared_ptr<lda::state> resumed;
+    rng_t r_resumed;
+    size_t it = lda::checkpointer::load(path, resumed, r_resumed);
+    MICROSCOPES_CHECK(it == 14, "wrong checkpoint iteration");
+
+    rng_t r_replay(51);
+    auto replay = new_state(r_replay);
+    for(size_t i = 0; i < it; ++i){
+        microscopes::kernels::lda_crp_gibbs(*replay, r_replay);
+    }
+    MICROSCOPES_CHECK(same_chain(*replay, r_replay, *resumed, r_resumed), "checkpoint differs from the chain");
+
+    for(; it < 20; ++it){
+        microscopes::kernels::lda_crp_gibbs(*resumed, r_resumed);
+    }
+    MICROSCOPES_CHECK(same_chain(*state, r, *resumed, r_resumed), "resumed chain diverged");
+    std::remove(path.c_str());
+}
+
+static void
+test_time_and_errors(){
+    rng_t r(52);
+    auto state = new_state(r);
+    lda::checkpointer every_time(path, 0, 1e-9, false);
+    for(size_t it = 1; it <= 3; ++it){
+        MICROSCOPES_CHECK(every_time.maybe_save(*state, r, it), "checkpoint by time not taken");
+    }
+    every_time.wait();
+    std::remove(path.c_str());
+
+    lda::checkpointer never(path, 0, 0);
+    MICROSCOPES_CHECK(!never.maybe_save(*state, r, 1000), "checkpoint taken when none is due");
+
+    lda::checkpointer broken("no/such/directory/checkpoint", 1, 0);
+    broken.save(*state, r, 1);
+    bool thrown = false;
+    try{
+        broken.wait();
+    }catch(const std::exception &){
+        thrown = true;
+    }
+    MICROSCOPES_CHECK(thrown, "write error not reported");
+    broken.wait();
+}
+
+int main(void){
+    test_resume();
+    cout << "test_resume passed" << endl;
+    test_time_and_errors();
+    cout << "test_time_and_errors passed" << endl;
+    return 0;
+}
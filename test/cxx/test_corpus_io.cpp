@@ -0,0 +1,169 @@
+#include <microscopes/lda/corpus_io.hpp>
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static const string path = "test_corpus_io.tmp";
+
+static lda::corpus_file
+parse(const string &text, lda::corpus_format format, size_t nthreads = 1){
+    return lda::parse_corpus(text.data(), text.size(), format, nthreads, "text");
+}
+
+static void
+test_formats(){
+    // Term ids 5, 7 and 9 become words 0, 1 and 2.
+    auto ldac = parse("2 5:2 9:1\n\n0\n 3 9:1\t5:1 7:3 \r\n", lda::corpus_format::ldac);
+    MICROSCOPES_CHECK(ldac.terms == vector<uint32_t>({5, 7, 9}), "wrong terms");
+    MICROSCOPES_CHECK(ldac.docs->size() == 3, "wrong number of documents");
+    // One run per term, never expanded, grouped by term within a document.
+    MICROSCOPES_CHECK(ldac.docs->words() == vector<uint32_t>({0, 2, 0, 1, 2}), "wrong words");
+    MICROSCOPES_CHECK(ldac.docs->ends() == vector<uint32_t>({2, 3, 1, 4, 5}), "wrong run ends");
+    MICROSCOPES_CHECK(ldac.docs->ntokens() == 8 && ldac.docs->nterms(2) == 5, "wrong lengths");
+    lda::nested_vector expected {{5, 5, 9}, {}, {5, 7, 7, 7, 9}};
+    MICROSCOPES_CHECK(ldac.documents() == expected, "wrong documents");
+
+    // Every copy of a term shares a run, repeated or not, and the tokens
+    // keep the order of their line; zero counts are dropped.
+    auto tokens = parse("5 5 9\n\n9 7 5 7 7", lda::corpus_format::tokens);
+    MICROSCOPES_CHECK(tokens.terms == ldac.terms, "wrong terms");
+    MICROSCOPES_CHECK(tokens.docs->nruns() == 5, "repeats not merged");
+    MICROSCOPES_CHECK(tokens.docs->words() == vector<uint32_t>({0, 2, 0, 1, 2}), "wrong words");
+    MICROSCOPES_CHECK(tokens.docs->in_order(0) && !tokens.docs->in_order(1), "wrong token order");
+    MICROSCOPES_CHECK(tokens.documents() == lda::nested_vector({{5, 5, 9}, {9, 7, 5, 7, 7}}),
+        "wrong documents");
+    auto merged = parse("4 5:1 7:1 9:0 5:2\n", lda::corpus_format::ldac);
+    MICROSCOPES_CHECK(merged.docs->nruns() == 2 && merged.documents() == lda::nested_vector({{5, 5, 5, 7}}),
+        "wrong runs");
+
+    auto counts = lda::corpus_from_counts({{{5, 2}, {9, 1}}, {}, {{9, 1}, {5, 1}, {6, 0}, {7, 3}}});
+    MICROSCOPES_CHECK(counts.terms == ldac.terms && counts.docs->words() == ldac.docs->words() &&
+                      counts.docs->ends() == ldac.docs->ends(), "wrong corpus from counts");
+}
+
+// Large inputs are parsed in chunks; the result must not depend on the
+// thread count, and compact and scattered term ids must both be ranked.
+// The same documents as shuffled tokens come back in their order.
+static void
+test_chunks(){
+    rng_t r(51);
+    for(uint32_t stride : {1u, 1000003u}){
+        lda::nested_vector docs, shuffled;
+        ostringstream text, token_text;
+        while(text.tellp() < (5 << 20)){
+            size_t npairs = r() % 20;
+            docs.push_back(vector<size_t>());
+            text << npairs;
+            for(size_t i = 0; i < npairs; ++i){
+                size_t term = (r() % 3000) * stride, count = 1 + r() % 3;
+                docs.back().insert(docs.back().end(), count, term);
+                text << " " << term << ":" << count;
+            }
+            text << "\n";
+            if(npairs > 0){
+                shuffled.push_back(docs.back());
+                std::shuffle(shuffled.back().begin(), shuffled.back().end(), r);
+                for(auto term : shuffled.back()) token_text << term << " ";
+                token_text << "\n";
+            }
+            std::sort(docs.back().begin(), docs.back().end());
+        }
+        auto one = parse(text.str(), lda::corpus_format::ldac, 1);
+        auto four = parse(text.str(), lda::corpus_format::ldac, 4);
+        MICROSCOPES_CHECK(one.documents() == docs, "wrong documents");
+        MICROSCOPES_CHECK(four.terms == one.terms, "terms depend on the thread count");
+        MICROSCOPES_CHECK(four.docs->offsets() == one.docs->offsets() &&
+                          four.docs->words() == one.docs->words() &&
+                          four.docs->ends() == one.docs->ends(), "words depend on the thread count");
+        for(size_t w = 1; w < one.nwords(); ++w){
+            MICROSCOPES_CHECK(one.terms[w - 1] < one.terms[w], "terms out of order");
+        }
+        auto tokens_one = parse(token_text.str(), lda::corpus_format::tokens, 1);
+        auto tokens_four = parse(token_text.str(), lda::corpus_format::tokens, 4);
+        MICROSCOPES_CHECK(tokens_one.documents() == shuffled, "tokens reordered");
+        MICROSCOPES_CHECK(tokens_four.docs->words() == tokens_one.docs->words() &&
+                          tokens_four.docs->order_offsets() == tokens_one.docs->order_offsets() &&
+                          tokens_four.docs->order() == tokens_one.docs->order(),
+                          "token order depends on the thread count");
+
+        {
+            ofstream out(path.c_str());
+            out << text.str();
+        }
+        auto file = lda::read_corpus(path, lda::corpus_format::ldac, 2);
+        MICROSCOPES_CHECK(file.terms == one.terms && file.docs->words() == one.docs->words() &&
+                          file.docs->ends() == one.docs->ends(), "file differs from text");
+        std::remove(path.c_str());
+    }
+}
+
+static void
+test_errors(){
+    auto fails = [](const string &text, lda::corpus_format format, const string &where){
+        try{
+            parse(text, format);
+        }catch(const std::exception &e){
+            return string(e.what()).find(where) != string::npos;
+        }
+        return false;
+    };
+    MICROSCOPES_CHECK(fails("1 0:1\n2 0:1\n", lda::corpus_format::ldac, "text:2:"), "wrong pair count accepted");
+    MICROSCOPES_CHECK(fails("1 0:1\n\n1 0x1\n", lda::corpus_format::ldac, "text:3:"), "missing colon accepted");
+    MICROSCOPES_CHECK(fails("1 a:1\n", lda::corpus_format::ldac, "text:1:"), "bad term accepted");
+    MICROSCOPES_CHECK(fails("1 4294967295:1\n", lda::corpus_format::ldac, "text:1:"), "term id too large accepted");
+    MICROSCOPES_CHECK(fails("0 1 -2\n", lda::corpus_format::tokens, "text:1:"), "negative term accepted");
+    MICROSCOPES_CHECK(fails("\n\n", lda::corpus_format::tokens, "no documents"), "empty corpus accepted");
+    MICROSCOPES_CHECK(fails("0\n0\n", lda::corpus_format::ldac, "no words"), "corpus without words accepted");
+    bool missing = false;
+    try{
+        lda::read_corpus("no/such/corpus", lda::corpus_format::ldac);
+    }catch(const std::exception &){
+        missing = true;
+    }
+    MICROSCOPES_CHECK(missing, "read a missing file");
+}
+
+// A state built on a parsed corpus shares it and samples as usual.
+static void
+test_state(){
+    auto file = parse("3 10:2 20:1 30:1\n2 20:3 40:1\n1 50:2\n", lda::corpus_format::ldac);
+    rng_t r(52);
+    lda::model_definition defn(file.docs->size(), file.nwords());
+    lda::state state(defn, 0.5, 0.1, 1.0, 2, file.docs, r);
+    MICROSCOPES_CHECK(state.nwords() == 5 && state.nentities() == 3, "wrong state size");
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    state.validate_n_k_values();
+
+    rng_t r1(53), r2(53);
+    lda::state from_corpus(defn, 0.5, 0.1, 1.0, 2, file.docs, r1);
+    lda::state from_docs(defn, 0.5, 0.1, 1.0, 2, from_corpus.documents(), r2);
+    MICROSCOPES_CHECK(from_corpus.dish_assignments() == from_docs.dish_assignments(),
+        "initial state depends on how the corpus was given");
+}
+
+int main(void){
+    test_formats();
+    cout << "test_formats passed" << endl;
+    test_chunks();
+    cout << "test_chunks passed" << endl;
+    test_errors();
+    cout << "test_errors passed" << endl;
+    test_state();
+    cout << "test_state passed" << endl;
+    return 0;
+}
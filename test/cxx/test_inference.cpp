@@ -0,0 +1,160 @@
+#include <microscopes/lda/inference.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static lda::state
+trained_state(rng_t &r){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,3,3}, {0,1,4,5,1}, {0,1,5,6,6}, {2,2,4,6}};
+    lda::model_definition defn(4, 7);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, docs, r);
+    for(unsigned i = 0; i < 20; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    return state;
+}
+
+static void
+test_frozen_model(){
+    rng_t r(31);
+    auto state = trained_state(r);
+    lda::frozen_model model(state);
+    MICROSCOPES_CHECK(model.ncolumns() == state.ntopics() + 1, "wrong number of columns");
+    double prior = 0;
+    for(auto a : model.topic_prior()) prior += a;
+    MICROSCOPES_CHECK(std::abs(prior - model.alpha()) < 1e-5, "topic prior does not sum to alpha");
+    for(size_t c = 0; c < model.ncolumns(); ++c){
+        double total = 0;
+        for(size_t v = 0; v < model.nwords(); ++v) total += model.word_topics(v)[c];
+        MICROSCOPES_CHECK(std::abs(total - 1) < 1e-5, "topic is not a distribution over words");
+    }
+}
+
+// With one observed word every Gibbs draw of its topic is exact, so the
+// estimate must converge to sum_z p(z | w1) p(w2 | theta(z)).
+static void
+test_two_word_document(){
+    rng_t r(32);
+    auto state = trained_state(r);
+    lda::frozen_model model(state);
+    const size_t w1 = 3, w2 = 2;
+    const size_t K = model.ncolumns();
+    const auto &prior = model.topic_prior();
+    double z_total = 0, expected = 0;
+    for(size_t z = 0; z < K; ++z){
+        double p_z = prior[z] * model.word_topics(w1)[z];
+        double p_w2 = 0;
+        for(size_t c = 0; c < K; ++c){
+            p_w2 += (prior[c] + (c == z)) * model.word_topics(w2)[c];
+        }
+        z_total += p_z;
+        expected += p_z * p_w2 / (1 + model.alpha());
+    }
+    expected /= z_total;
+
+    lda::nested_vector docs {{w1, w2}};
+    auto ll = model.heldout_log_likelihood(docs, 20000, 0, r);
+    MICROSCOPES_CHECK(ll.size() == 1, "one value per document");
+    MICROSCOPES_CHECK(std::abs(std::exp(ll[0]) - expected) < 0.02 * expected, "held-out estimate is off");
+
+    // Nothing observed: the held-out words are scored under the prior.
+    lda::nested_vector single {{w2}};
+    double prior_p = 0;
+    for(size_t c = 0; c < K; ++c) prior_p += prior[c] * model.word_topics(w2)[c];
+    ll = model.heldout_log_likelihood(single, 1, 5, r);
+    MICROSCOPES_CHECK(std::abs(ll[0] - std::log(prior_p / model.alpha())) < 1e-5, "prior-only estimate is off");
+}
+
+static void
+test_thread_count(){
+    rng_t r(33);
+    auto state = trained_state(r);
+    lda::frozen_model model(state);
+    lda::nested_vector docs {{0,1,2,3}, {4,4,5,6,1,0}, {}, {6,5}, {2,3,3,2,1,0,4}};
+    rng_t r1(7), r2(7);
+    auto serial = model.heldout_log_likelihood(docs, 10, 5, r1, 1);
+    auto parallel = model.heldout_log_likelihood(docs, 10, 5, r2, 3);
+    MICROSCOPES_CHECK(serial == parallel, "held-out likelihood depends on the thread count");
+    MICROSCOPES_CHECK(serial[2] == 0, "empty document has probability 1");
+    for(auto ll : serial){
+        MICROSCOPES_CHECK(ll <= 0, "log likelihood above 0");
+    }
+}
+
+// Fold-in by the token-level update, for comparison with predict().
+static vector<double>
+fold_in(const lda::frozen_model &model, const vector<size_t> &doc, size_t max_iter){
+    const size_t K = model.ncolumns() - 1;
+    const auto &prior = model.topic_prior();
+    vector<vector<double>> r(doc.size(), vector<double>(K, 0));
+    for(size_t iter = 0; iter <= max_iter; ++iter){
+        vector<double> s(K, 0);
+        for(auto &r_i : r) for(size_t k = 0; k < K; ++k) s[k] += r_i[k];
+        auto r_new = r;
+        for(size_t i = 0; i < doc.size(); ++i){
+            double total = 0;
+            for(size_t k = 0; k < K; ++k){
+                r_new[i][k] = model.word_topics(doc[i])[k + 1] * (s[k] - r[i][k] + prior[k + 1]);
+                total += r_new[i][k];
+            }
+            for(auto &x : r_new[i]) x /= total;
+        }
+        r = r_new;
+    }
+    vector<double> theta(K, 0);
+    for(auto &r_i : r) for(size_t k = 0; k < K; ++k) theta[k] += r_i[k] / doc.size();
+    return theta;
+}
+
+static void
+test_predict(){
+    rng_t r(34);
+    auto state = trained_state(r);
+    lda::frozen_model model(state);
+    const size_t K = state.ntopics();
+    lda::nested_vector docs {{0,1,2,3}, {4,4,5,6,1,0}, {}, {6,6,6,5}, {2,3,3,2,1,0,4}};
+    auto theta = model.predict(docs, 5, 0);
+    MICROSCOPES_CHECK(theta.size() == docs.size() * K, "wrong theta shape");
+    for(size_t d = 0; d < docs.size(); ++d){
+        double total = 0;
+        for(size_t k = 0; k < K; ++k) total += theta[d * K + k];
+        MICROSCOPES_CHECK(std::abs(total - 1) < 1e-5, "theta row does not sum to 1");
+        if(docs[d].empty()) continue;
+        auto expected = fold_in(model, docs[d], 5);
+        for(size_t k = 0; k < K; ++k){
+            MICROSCOPES_CHECK(std::abs(theta[d * K + k] - expected[k]) < 1e-5, "predict differs from token-level fold-in");
+        }
+    }
+    for(size_t k = 0; k < K; ++k){
+        MICROSCOPES_CHECK(std::abs(theta[2 * K + k] - model.topic_prior()[k + 1] / (model.alpha() - model.topic_prior()[0])) < 1e-5,
+            "empty document does not get the prior");
+    }
+    MICROSCOPES_CHECK(model.predict(docs, 5, 0, 3) == theta, "predict depends on the thread count");
+
+    // Run to convergence, the result no longer depends on max_iter.
+    auto converged = model.predict(docs, 1000, 1e-12);
+    auto longer = model.predict(docs, 2000, 1e-12);
+    for(size_t i = 0; i < theta.size(); ++i){
+        MICROSCOPES_CHECK(std::abs(converged[i] - longer[i]) < 1e-6, "fold-in did not converge");
+    }
+}
+
+int main(void){
+    test_frozen_model();
+    cout << "test_frozen_model passed" << endl;
+    test_two_word_document();
+    cout << "test_two_word_document passed" << endl;
+    test_thread_count();
+    cout << "test_thread_count passed" << endl;
+    test_predict();
+    cout << "test_predict passed" << endl;
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <microscopes/lda/online_hdp.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <math.h>
+
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// Three topics over 30 words, each on its own block of 10; every
+// document mixes one or two of them.
+static const size_t V = 30, ntrue = 3;
+
+static lda::nested_vector
+make_docs(size_t ndocs, rng_t &r){
+    lda::nested_vector docs(ndocs);
+    for(auto &doc : docs){
+        size_t a = r() % ntrue, b = r() % ntrue;
+        for(size_t i = 0; i < 40; ++i){
+            size_t topic = r() % 4 == 0 ? b : a;
+            doc.push_back(10 * topic + r() % 10);
+        }
+    }
+    return docs;
+}
+
+static void
+test_digamma(){
+    MICROSCOPES_CHECK(fabs(lda_util::digamma(1) + 0.5772156649015329) < 1e-10, "wrong digamma(1)");
+    MICROSCOPES_CHECK(fabs(lda_util::digamma(0.5) + 1.9635100260214235) < 1e-10, "wrong digamma(0.5)");
+    MICROSCOPES_CHECK(fabs(lda_util::digamma(30) - 3.3844381326855246) < 1e-10, "wrong digamma(30)");
+}
+
+// The topics are recovered from mini-batches, and the results have the
+// shapes of the Gibbs state's.
+static void
+test_recovery(){
+    rng_t r(71);
+    const size_t ndocs = 400, batch = 20;
+    auto docs = make_docs(ndocs, r);
+    lda::model_definition defn(ndocs, V);
+    lda::online_hdp model(defn, 10, 5, 1.0, 0.01, 1.0, 0.6, 1.0, r);
+    double last_rho = 1;
+    for(size_t pass = 0; pass < 3; ++pass){
+        for(size_t begin = 0; begin < ndocs; begin += batch){
+            lda::nested_vector mini(docs.begin() + begin, docs.begin() + begin + batch);
+            double rho = model.update(mini);
+            MICROSCOPES_CHECK(rho < last_rho && rho > 0, "step size not decaying");
+            last_rho = rho;
+        }
+    }
+    MICROSCOPES_CHECK(model.nupdates() == 3 * ndocs / batch, "wrong number of updates");
+
+    auto phi = model.word_distribution();
+    MICROSCOPES_CHECK(phi.size() == model.ntopics(), "wrong number of topics");
+    auto weights = model.topic_weights();
+    for(size_t truth = 0; truth < ntrue; ++truth){
+        // Some topic with a real share of the corpus puts most of its mass
+        // on the block of words of each true topic.
+        bool found = false;
+        for(size_t t = 0; t < phi.size(); ++t){
+            MICROSCOPES_CHECK(phi[t].size() == V, "topic does not cover the vocabulary");
+            double mass = 0;
+            for(size_t v = 10 * truth; v < 10 * truth + 10; ++v) mass += phi[t][v];
+            found = found || (mass > 0.9 && weights[t] > 0.05);
+        }
+        MICROSCOPES_CHECK(found, "topic not recovered");
+    }
+
+    lda::nested_vector pure {{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1}, {20, 21, 22, 23, 24, 25}};
+    auto theta = model.document_distribution(pure, 2);
+    MICROSCOPES_CHECK(theta.size() == 2, "wrong number of documents");
+    for(size_t d = 0; d < theta.size(); ++d){
+        MICROSCOPES_CHECK(theta[d].size() == model.ntopics() + 1 && theta[d][0] == 0, "wrong shape");
+        double total = 0;
+        size_t top = 1;
+        for(size_t c = 1; c < theta[d].size(); ++c){
+            total += theta[d][c];
+            if(theta[d][c] > theta[d][top]) top = c;
+        }
+        MICROSCOPES_CHECK(fabs(total - 1) < 1e-4, "proportions do not sum to 1");
+        double mass = 0;
+        for(size_t v = 20 * d; v < 20 * d + 10; ++v) mass += phi[top - 1][v];
+        MICROSCOPES_CHECK(mass > 0.9, "document not assigned to its topic");
+    }
+}
+
+// Updates do not depend on the thread count or on how the batch is given.
+static void
+test_threads(){
+    rng_t r(72), r1(73), r2(73);
+    auto docs = make_docs(60, r);
+    lda::model_definition defn(600, V);
+    lda::online_hdp one(defn, 8, 4, 1.0, 0.01, 1.0, 0.7, 4.0, r1);
+    lda::online_hdp three(defn, 8, 4, 1.0, 0.01, 1.0, 0.7, 4.0, r2);
+    for(size_t begin = 0; begin < docs.size(); begin += 15){
+        lda::nested_vector mini(docs.begin() + begin, docs.begin() + begin + 15);
+        one.update(mini, 1);
+        three.update(lda::corpus(mini), 3);
+    }
+    for(size_t t = 0; t < one.ntopics(); ++t){
+        for(size_t v = 0; v < V; ++v){
+            MICROSCOPES_CHECK(one.lambda(t, v) == three.lambda(t, v), "update depends on the thread count");
+        }
+    }
+}
+
+int main(void){
+    test_digamma();
+    cout << "test_digamma passed" << endl;
+    test_recovery();
+    cout << "test_recovery passed" << endl;
+    test_threads();
+    cout << "test_threads passed" << endl;
+    return 0;
+}
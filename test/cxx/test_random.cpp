@@ -1,11 +1,19 @@
 #include <microscopes/lda/model.hpp>
 #include <microscopes/lda/kernels.hpp>
 #include <microscopes/lda/random_docs.hpp>
+#include <microscopes/lda/simd.hpp>
 #include <microscopes/common/macros.hpp>
 #include <microscopes/models/distributions.hpp>
 #include <microscopes/common/random_fwd.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
 #include <random>
+#include <set>
+#include <string>
+#include <utility>
 #include <iostream>
 
 using namespace std;
@@ -54,10 +62,852 @@ test_explicit_initializtion(){
     MICROSCOPES_CHECK(dish_assignments.size() == state.dish_assignments().size(), "table_assignments is wrong length");
 }
 
+static void
+test_explicit_deleted_slots(){
+    // Table 2 of the first document and dish 2 have been deleted; their
+    // ids should be free for reuse.
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4}, {0,1,5,6}};
+    size_t V = 7;
+    lda::model_definition defn(3, V);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 3, 3, 1}, {1, 1, 1}, {1, 1, 1, 1}};
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1, 0, 3}, {0, 3}, {0, 1}};
+    lda::state state(defn, 0.2, 0.01, 0.5,
+                     dish_assignments, table_assignments, docs);
+    MICROSCOPES_CHECK(state.tables(0) == std::vector<size_t>({0, 1, 3}), "deleted table is active");
+    MICROSCOPES_CHECK(state.dishes() == std::vector<size_t>({0, 1, 3}), "deleted dish is active");
+    MICROSCOPES_CHECK(state.ntables() == 4, "ntables() is wrong");
+    MICROSCOPES_CHECK(state.create_dish() == 2, "free dish id not reused");
+    MICROSCOPES_CHECK(state.create_table(0, 2) == 2, "free table id not reused");
+    MICROSCOPES_CHECK(state.tables(0) == std::vector<size_t>({0, 1, 2, 3}), "tables out of order");
+    MICROSCOPES_CHECK(state.dishes() == std::vector<size_t>({0, 1, 2, 3}), "dishes out of order");
+
+    // A state rebuilt from a sampled state's assignments has the same
+    // active tables and dishes.
+    rng_t r(3);
+    lda::state sampled(defn, 0.2, 0.01, 0.5, 2, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(sampled, r);
+    }
+    lda::state restored(defn, 0.2, 0.01, 0.5,
+                        sampled.dish_assignments(), sampled.table_assignments(), docs);
+    MICROSCOPES_CHECK(restored.dishes() == sampled.dishes(), "restored dishes differ");
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        MICROSCOPES_CHECK(restored.tables(eid) == sampled.tables(eid), "restored tables differ");
+    }
+    restored.validate_n_k_values();
+}
+
+static void
+test_sparse_chain(){
+    rng_t r(7);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 0.2, 0.01, 0.5, 2, docs, r);
+    // The mass is kept up to date incrementally and recomputed after
+    // every sweep, so it stays within rounding of the sum however long
+    // the chain.
+    for(unsigned i = 0; i < 500; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r, kernels::lda_crp::sampling_t_sparse);
+        double mass = 0;
+        for(auto k : state.dishes()){
+            if(k != 0) mass += state.dishsize(k) / double(state.smoothed_n_k(k));
+        }
+        MICROSCOPES_CHECK(std::abs(mass - state.smoothing_mass()) < 1e-6 * mass, "smoothing mass drifted");
+    }
+    state.validate_n_k_values();
+}
+
+// Outcome of placing word i of document eid, keyed by (existing table,
+// its dish) or (0, dish) for a new table, with dish 0 meaning a new dish.
+// Tables and dishes are "existing" if they are active in `removed`.
+static std::pair<size_t, size_t>
+seat_of(const lda::state &s, const lda::state &removed, size_t eid, size_t i){
+    size_t t = s.table_assignments()[eid][i];
+    size_t k = s.dish_assignment(eid, t);
+    const auto &old_tables = removed.tables(eid);
+    const auto &old_dishes = removed.dishes();
+    if(std::find(old_tables.begin(), old_tables.end(), t) == old_tables.end()){
+        t = 0;
+        if(std::find(old_dishes.begin(), old_dishes.end(), k) == old_dishes.end()) k = 0;
+    }
+    return std::make_pair(t, k);
+}
+
+// Exact conditional distribution of word i's seat, from the dense kernel.
+static std::map<std::pair<size_t, size_t>, double>
+exact_seat_distribution(lda::state &removed, size_t eid, size_t i, rng_t &r){
+    using namespace kernels::lda_crp;
+    auto f_k = calc_f_k(removed, removed.get_word(eid, i), r);
+    auto p_t = calc_table_posterior(removed, eid, f_k, r);
+    auto p_k = calc_dish_posterior_w(removed, f_k, r);
+    std::map<std::pair<size_t, size_t>, double> expected;
+    for(size_t idx = 1; idx < p_t.size(); ++idx){
+        auto t = removed.tables(eid)[idx];
+        expected[std::make_pair(t, removed.dish_assignment(eid, t))] += p_t[idx];
+    }
+    for(size_t idx = 0; idx < p_k.size(); ++idx){
+        expected[std::make_pair(size_t(0), removed.dishes()[idx])] += p_t[0] * p_k[idx];
+    }
+    return expected;
+}
+
+static void
+check_seat_distribution(const std::map<std::pair<size_t, size_t>, double> &expected,
+                        std::map<std::pair<size_t, size_t>, double> &observed,
+                        size_t ndraws, double slack, const std::string &what){
+    for(auto &kv : observed){
+        MICROSCOPES_CHECK(expected.count(kv.first), what + " drew an impossible outcome");
+    }
+    for(auto &kv : expected){
+        double sigma = std::sqrt(kv.second * (1 - kv.second) / ndraws);
+        MICROSCOPES_CHECK(std::abs(observed[kv.first] - kv.second) < slack * sigma + 1e-3,
+            what + " distribution differs from dense kernel");
+    }
+}
+
+// The sparse token step must draw from the same distribution as the dense
+// one.
+static void
+test_sparse_token_distribution(){
+    rng_t r(5);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5,1}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 2.0, 0.5, 1.0, 2, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    const size_t eid = 1, i = 4;
+    lda::state removed(state);
+    removed.remove_table(eid, i);
+    auto expected = exact_seat_distribution(removed, eid, i, r);
+
+    const size_t ndraws = 20000;
+    std::map<std::pair<size_t, size_t>, double> observed;
+    for(size_t n = 0; n < ndraws; ++n){
+        lda::state s(state);
+        kernels::lda_crp::sampling_t_sparse(s, eid, i, r);
+        observed[seat_of(s, removed, eid, i)] += 1.0 / ndraws;
+    }
+    check_seat_distribution(expected, observed, ndraws, 5, "sparse kernel");
+}
+
+// Repeated MH steps on one word (everything else fixed) must leave the
+// exact conditional invariant. The proposals are deliberately stale: they
+// are built before the other words are moved into place.
+static void
+test_mh_token_distribution(){
+    rng_t r(11);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5,1,6}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 2.0, 0.5, 1.0, 2, docs, r);
+    microscopes::kernels::lda_crp_gibbs(state, r);
+    kernels::lda_crp::mh_proposals proposals(state);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    const size_t eid = 1, i = 4;
+    lda::state removed(state);
+    removed.remove_table(eid, i);
+    auto expected = exact_seat_distribution(removed, eid, i, r);
+
+    const size_t ndraws = 50000;
+    std::map<std::pair<size_t, size_t>, double> observed;
+    for(size_t n = 0; n < ndraws; ++n){
+        kernels::lda_crp::sampling_t_mh(state, proposals, eid, i, 1, r);
+        observed[seat_of(state, removed, eid, i)] += 1.0 / ndraws;
+    }
+    // MH draws are correlated, so allow more slack than for exact draws.
+    check_seat_distribution(expected, observed, ndraws, 10, "MH kernel");
+}
+
+static void
+test_mh_chain(){
+    rng_t r(7);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 0.2, 0.01, 0.5, 2, docs, r);
+    for(unsigned i = 0; i < 50; ++i){
+        microscopes::kernels::lda_crp_mh(state, r, 2);
+    }
+    state.validate_n_k_values();
+    std::cout << "perplexity: " << state.perplexity() << std::endl;
+}
+
+static void
+test_parallel_chain(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}, {2,3,3,6}, {4,4,5,1}};
+    lda::model_definition defn(docs.size(), 7);
+
+    // One thread is the serial sweep.
+    rng_t r1(7), r2(7);
+    lda::state serial(defn, 0.2, 0.01, 0.5, 2, docs, r1);
+    lda::state single(defn, 0.2, 0.01, 0.5, 2, docs, r2);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(serial, r1, kernels::lda_crp::sampling_t_sparse);
+        microscopes::kernels::lda_crp_gibbs(single, r2, kernels::lda_crp::sampling_t_sparse, 1);
+    }
+    serial.validate_n_k_values();
+    MICROSCOPES_CHECK(serial.table_assignments() == single.table_assignments(), "nthreads=1 differs from serial");
+
+    // Several threads: counts stay consistent and the result only depends
+    // on the seed.
+    rng_t r3(11), r4(11);
+    lda::state a(defn, 0.2, 0.01, 0.5, 2, docs, r3);
+    lda::state b(defn, 0.2, 0.01, 0.5, 2, docs, r4);
+    for(unsigned i = 0; i < 50; ++i){
+        microscopes::kernels::lda_crp_gibbs(a, r3, kernels::lda_crp::sampling_t, 3);
+        microscopes::kernels::lda_crp_gibbs(b, r4, kernels::lda_crp::sampling_t, 3);
+        a.validate_n_k_values();
+    }
+    MICROSCOPES_CHECK(a.table_assignments() == b.table_assignments(), "parallel sweep is not deterministic");
+    MICROSCOPES_CHECK(a.dishes() == b.dishes(), "parallel sweep is not deterministic");
+    double mass = 0;
+    for(auto k : a.dishes()){
+        if(k != 0) mass += a.dishsize(k) / a.smoothed_n_k(k);
+    }
+    MICROSCOPES_CHECK(std::abs(mass - a.smoothing_mass()) < 1e-4, "smoothing mass drifted");
+}
+
+static void
+test_parallel_dish_sweep(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}, {2,3,3,6}, {4,4,5,1}};
+    lda::model_definition defn(docs.size(), 7);
+    rng_t r(3);
+    lda::state state(defn, 0.2, 0.01, 0.5, 2, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r, kernels::lda_crp::sampling_t);
+    }
+
+    // Scoring a seated table matches scoring it after it leaves its dish,
+    // as long as the dish survives.
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        for(auto t : state.tables(eid)){
+            size_t k = state.dish_assignment(eid, t);
+            if(t == 0 || state.dishsize(k) < 2) continue;
+            auto seated = kernels::lda_crp::calc_dish_posterior_t(state, eid, t, r, true);
+            lda::state left = state;
+            left.leave_from_dish(eid, t);
+            auto expected = kernels::lda_crp::calc_dish_posterior_t(left, eid, t, r);
+            MICROSCOPES_CHECK(seated.size() == expected.size(), "seated posterior has the wrong size");
+            for(size_t i = 0; i < seated.size(); ++i){
+                MICROSCOPES_CHECK(std::abs(seated[i] - expected[i]) < 1e-5, "seated posterior differs");
+            }
+        }
+    }
+
+    lda::state copy = state;
+    rng_t r1(5), r2(5);
+    for(unsigned i = 0; i < 20; ++i){
+        kernels::lda_crp::sampling_k_sweep(state, r1, 3);
+        kernels::lda_crp::sampling_k_sweep(copy, r2, 3);
+        state.validate_n_k_values();
+    }
+    MICROSCOPES_CHECK(state.dish_assignments() == copy.dish_assignments(), "parallel dish sweep is not deterministic");
+}
+
+// Dish draws are applied in order up to the first one that moves a table;
+// later draws were made against counts that have since changed.
+static void
+test_apply_dish_draws(){
+    std::vector< std::vector<size_t>> docs {{0,0}, {1,1}, {2,2}, {3}};
+    lda::model_definition defn(docs.size(), 4);
+    lda::state state(defn, 0.2, 0.01, 0.5,
+                     {{0,1}, {0,2}, {0,3}, {0,4}}, {{1,1}, {1,1}, {1,1}, {1}}, docs);
+    std::vector<std::pair<size_t, size_t>> tables {{0,1}, {1,1}, {2,1}, {3,1}};
+    // Table (0,1) stays at dish 1, table (1,1) leaves dish 2 for a new
+    // dish, and the draws for (2,1) and (3,1) are stale after that.
+    std::vector<size_t> proposed {1, 0, 4, 0};
+    size_t next = kernels::lda_crp::apply_dish_draws(state, tables, proposed, 0, 4);
+    MICROSCOPES_CHECK(next == 2, "applied past the first move");
+    MICROSCOPES_CHECK(state.dish_assignment(0, 1) == 1, "draw not applied");
+    MICROSCOPES_CHECK(state.dish_assignment(2, 1) == 3 && state.dish_assignment(3, 1) == 4, "stale draws applied");
+    state.validate_n_k_values();
+
+    // Draws that move nothing are all applied.
+    std::vector<size_t> again {0, 0, 3, 4};
+    next = kernels::lda_crp::apply_dish_draws(state, tables, again, 2, 4);
+    MICROSCOPES_CHECK(next == 4, "draws that move nothing stopped the batch");
+    state.validate_n_k_values();
+}
+
+// Partition of the tables into dishes, with dishes numbered in order of
+// first appearance.
+static std::vector<size_t>
+dish_partition(const lda::state &state){
+    std::vector<size_t> ret;
+    std::map<size_t, size_t> label;
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        for(auto t : state.tables(eid)){
+            if(t == 0) continue;
+            auto it = label.insert(std::make_pair(state.dish_assignment(eid, t), label.size())).first;
+            ret.push_back(it->second);
+        }
+    }
+    return ret;
+}
+
+// One parallel table-level sweep from a fixed state must give the dish
+// partitions of the serial sweep with the same probabilities. Tables
+// sharing words pull towards the same dish, so most draws move a table
+// and later draws have to be made again.
+static void
+test_parallel_dish_sweep_distribution(){
+    std::vector< std::vector<size_t>> docs {{0,0,1}, {1,1,0}, {2,2,3}, {3,3,2}, {0,1,2}, {2,3,0}};
+    lda::model_definition defn(docs.size(), 4);
+    lda::state state(defn, 1.0, 0.5, 1.0,
+                     {{0,1,2}, {0,2,3}, {0,3,1}, {0,1,2}, {0,2,3}, {0,3,1}},
+                     {{1,1,2}, {1,2,2}, {1,1,2}, {1,2,2}, {1,1,2}, {1,2,2}}, docs);
+    const size_t ndraws = 20000;
+    std::map<std::vector<size_t>, double> serial, parallel;
+    rng_t r1(61), r2(67);
+    kernels::lda_crp::workspace ws;
+    microscopes::lda::scheduler scheduler(3);
+    for(size_t n = 0; n < ndraws; ++n){
+        lda::state a(state), b(state);
+        kernels::lda_crp::sampling_k_sweep(a, r1, ws);
+        kernels::lda_crp::sampling_k_sweep(b, r2, scheduler);
+        serial[dish_partition(a)] += 1.0 / ndraws;
+        parallel[dish_partition(b)] += 1.0 / ndraws;
+    }
+    for(auto &kv : parallel) serial[kv.first] += 0;
+    for(auto &kv : serial){
+        const double p = kv.second, q = parallel[kv.first];
+        const double sigma = std::sqrt((p * (1 - p) + q * (1 - q)) / ndraws);
+        MICROSCOPES_CHECK(std::abs(p - q) < 5 * sigma + 1e-3, "parallel dish sweep differs from serial");
+    }
+}
+
+// The vectorized running sums must match scalar exp and addition, for
+// lengths that leave every possible tail and with -inf entries mixed in.
+static void
+test_exp_cumsum(){
+    rng_t r(21);
+    std::uniform_real_distribution<float> logw(-120, 30);
+    for(size_t n = 2; n < 40; ++n){
+        std::vector<float> w(n);
+        for(auto &x : w) x = logw(r);
+        w[n / 2] = -std::numeric_limits<float>::infinity();
+        float max = *std::max_element(w.begin(), w.end());
+
+        std::vector<float> c(w);
+        float total = lda_util::exp_cumsum(c.data(), n);
+        double expected = 0;
+        for(size_t i = 0; i < n; ++i){
+            expected += std::exp(double(w[i]) - max);
+            MICROSCOPES_CHECK(std::abs(c[i] - expected) <= 1e-5 * expected + 1e-30,
+                "exp_cumsum differs from scalar exp");
+        }
+        MICROSCOPES_CHECK(total == c[n - 1], "exp_cumsum total is not the last sum");
+        MICROSCOPES_CHECK(c[n / 2] == c[n / 2 - 1], "-inf added weight");
+
+        for(auto &x : w) x = std::exp(x / 10);
+        c = w;
+        total = lda_util::cumsum(c.data(), n);
+        expected = 0;
+        for(size_t i = 0; i < n; ++i){
+            expected += w[i];
+            MICROSCOPES_CHECK(std::abs(c[i] - expected) <= 1e-5 * expected, "cumsum differs from scalar sums");
+        }
+        MICROSCOPES_CHECK(total == c[n - 1], "cumsum total is not the last sum");
+
+        // With no weight at all the sums are 0, not NaN, and drawing fails.
+        w.assign(n, -std::numeric_limits<float>::infinity());
+        c = w;
+        MICROSCOPES_CHECK(lda_util::exp_cumsum(c.data(), n) == 0, "all -inf has a total");
+        for(auto x : c) MICROSCOPES_CHECK(x == 0, "all -inf left a sum that is not 0");
+        bool threw = false;
+        try{
+            lda_util::sample_log_weights(w, r);
+        }catch(const std::exception &){
+            threw = true;
+        }
+        MICROSCOPES_CHECK(threw, "drew from weights that are all -inf");
+    }
+}
+
+// Draws from unnormalized log weights follow the softmax and never land
+// on an entry of weight zero, including the last one.
+static void
+test_sample_log_weights(){
+    rng_t r(22);
+    const float ninf = -std::numeric_limits<float>::infinity();
+    const std::vector<float> log_w {0.5, ninf, -1, 2, 0, ninf, -3, 1, 0.25, ninf};
+    std::vector<double> p(log_w.size());
+    double z = 0;
+    for(size_t i = 0; i < p.size(); ++i) z += p[i] = std::exp(double(log_w[i]));
+    for(auto &x : p) x /= z;
+
+    const size_t ndraws = 100000;
+    std::vector<double> observed(p.size());
+    std::vector<float> w;
+    for(size_t n = 0; n < ndraws; ++n){
+        w = log_w;
+        observed[lda_util::sample_log_weights(w, r)] += 1.0 / ndraws;
+    }
+    for(size_t i = 0; i < p.size(); ++i){
+        if(p[i] == 0){
+            MICROSCOPES_CHECK(observed[i] == 0, "drew an entry of weight zero");
+            continue;
+        }
+        double sigma = std::sqrt(p[i] * (1 - p[i]) / ndraws);
+        MICROSCOPES_CHECK(std::abs(observed[i] - p[i]) < 5 * sigma, "draws do not follow the softmax");
+    }
+
+    // A draw of exactly the total must still pick an entry with weight.
+    const std::vector<float> c {1, 2, 2, 3, 3};
+    MICROSCOPES_CHECK(lda_util::find_cumulative(c.data(), c.size(), 3) == 3, "picked a zero weight at the end");
+    MICROSCOPES_CHECK(lda_util::find_cumulative(c.data(), c.size(), 2) == 3, "picked a zero weight in the middle");
+}
+
+// The dense token step, which samples from unnormalized weights, must
+// draw from the normalized posteriors.
+static void
+test_dense_token_distribution(){
+    rng_t r(23);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5,1}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 2.0, 0.5, 1.0, 2, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    const size_t eid = 1, i = 4;
+    lda::state removed(state);
+    removed.remove_table(eid, i);
+    auto expected = exact_seat_distribution(removed, eid, i, r);
+
+    const size_t ndraws = 20000;
+    std::map<std::pair<size_t, size_t>, double> observed;
+    for(size_t n = 0; n < ndraws; ++n){
+        lda::state s(state);
+        kernels::lda_crp::sampling_t(s, eid, i, r);
+        observed[seat_of(s, removed, eid, i)] += 1.0 / ndraws;
+    }
+    check_seat_distribution(expected, observed, ndraws, 5, "dense kernel");
+}
+
+// The direct assignment token step draws its dish from
+// (n_jk + alpha * beta_k) * f_k(v), or a new dish with alpha * beta_new / V.
+static void
+test_direct_token_distribution(){
+    rng_t r(29);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5,1}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    lda::state state(defn, 2.0, 0.5, 1.0, 2, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_direct_gibbs(state, r);
+    }
+    kernels::lda_direct::workspace ws;
+    kernels::lda_direct::sample_beta(state, r, ws);
+    const size_t eid = 1, i = 4, v = state.get_word(eid, i);
+    lda::state removed(state);
+    removed.remove_table(eid, i);
+
+    // A dish the word leaves empty gives its weight back to new dishes.
+    std::vector<double> n_jk(removed.n_kv.nrows(), 0);
+    for(auto t : removed.tables(eid)){
+        if(t != 0) n_jk[removed.dish_assignment(eid, t)] += removed.tablesize(eid, t);
+    }
+    double beta_new = ws.beta_new;
+    for(auto k : state.dishes()){
+        if(!removed.dishes_.contains(k)) beta_new += ws.beta[k];
+    }
+    std::map<size_t, double> expected;
+    double total = 0;
+    for(auto k : removed.dishes()){
+        expected[k] = k == 0 ? state.alpha_ * beta_new / state.V
+            : (n_jk[k] + state.alpha_ * ws.beta[k]) * removed.smoothed_n_kv(k, v) / removed.smoothed_n_k(k);
+        total += expected[k];
+    }
+    for(auto &kv : expected) kv.second /= total;
+
+    const size_t ndraws = 20000;
+    const auto seat = state.x_ji->locate(eid, i);
+    const size_t run = seat.first, pos = seat.second;
+    std::map<size_t, double> observed;
+    for(size_t n = 0; n < ndraws; ++n){
+        lda::state s(state);
+        auto w = ws;
+        kernels::lda_direct::begin_document(s, eid, w);
+        kernels::lda_direct::sampling_z(s, eid, run, pos, r, w);
+        size_t k = s.dish_assignment(eid, s.table_assignment(eid, i));
+        observed[removed.dishes_.contains(k) ? k : 0] += 1.0 / ndraws;
+    }
+    for(auto &kv : observed){
+        MICROSCOPES_CHECK(expected.count(kv.first), "direct kernel drew an impossible dish");
+    }
+    for(auto &kv : expected){
+        double sigma = std::sqrt(kv.second * (1 - kv.second) / ndraws);
+        MICROSCOPES_CHECK(std::abs(observed[kv.first] - kv.second) < 5 * sigma + 1e-3,
+            "direct kernel dish distribution is wrong");
+    }
+}
+
+// The tables drawn for n words at one dish number sum_{i < n} a / (a + i)
+// on average, for a = alpha * beta_k.
+static void
+test_direct_table_counts(){
+    rng_t r(37);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,0,1,2,3,0,1,2,3}};
+    std::vector< std::vector<size_t>> dish_assignments {{0, 1}};
+    std::vector< std::vector<size_t>> table_assignments {std::vector<size_t>(12, 1)};
+    lda::model_definition defn(1, 4);
+    lda::state state(defn, 3.0, 0.5, 1.0, dish_assignments, table_assignments, docs);
+    kernels::lda_direct::workspace ws;
+    ws.beta = {0, 0.6};
+    ws.beta_new = 0.4;
+    const double a = 3.0 * 0.6;
+    double expected = 0;
+    for(size_t i = 0; i < 12; ++i) expected += a / (a + i);
+
+    const size_t ndraws = 20000;
+    double mean = 0;
+    for(size_t n = 0; n < ndraws; ++n){
+        kernels::lda_direct::begin_document(state, 0, ws);
+        kernels::lda_direct::sampling_m(state, 0, r, ws);
+        mean += double(state.ntables(0) - 1) / ndraws;
+    }
+    state.validate_n_k_values();
+    MICROSCOPES_CHECK(state.dishsize(1) == state.ntables(0) - 1 && state.dish_nwords(1) == 12,
+        "tables not counted");
+    // The count is a sum of independent Bernoullis, so its variance is
+    // below its mean.
+    MICROSCOPES_CHECK(std::abs(mean - expected) < 5 * std::sqrt(expected / ndraws), "wrong number of tables");
+}
+
+static void
+test_direct_chain(){
+    rng_t r(31);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}, {2,3,3,6}, {4,4,5,1}};
+    lda::model_definition defn(docs.size(), 7);
+    lda::state state(defn, 0.2, 0.01, 0.5, 2, docs, r);
+    kernels::lda_direct::workspace ws;
+    for(unsigned i = 0; i < 50; ++i){
+        microscopes::kernels::lda_direct_gibbs(state, r, ws);
+        state.validate_n_k_values();
+    }
+    double mass = 0;
+    for(auto k : state.dishes()){
+        if(k != 0) mass += state.dishsize(k) / state.smoothed_n_k(k);
+    }
+    MICROSCOPES_CHECK(std::abs(mass - state.smoothing_mass()) < 1e-4, "smoothing mass drifted");
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        for(auto t : state.tables(eid)){
+            MICROSCOPES_CHECK(t == 0 || state.tablesize(eid, t) > 0, "empty table left");
+        }
+    }
+
+    // The franchise kernels carry on from the result, and back.
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+        microscopes::kernels::lda_direct_gibbs(state, r, ws);
+        state.validate_n_k_values();
+    }
+    std::cout << "perplexity: " << state.perplexity() << std::endl;
+}
+
+// Both samplers target the same posterior: compare the mean number of
+// dishes and tables over long chains.
+static void
+test_direct_matches_crf(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}, {2,3,3,6}, {4,4,5,1}};
+    std::vector< std::vector<size_t>> dish_assignments(docs.size(), std::vector<size_t>{0, 1});
+    std::vector< std::vector<size_t>> table_assignments;
+    for(auto &doc : docs) table_assignments.push_back(std::vector<size_t>(doc.size(), 1));
+    lda::model_definition defn(docs.size(), 7);
+    lda::state crf(defn, 1.0, 0.5, 1.0, dish_assignments, table_assignments, docs);
+    lda::state direct(crf);
+    rng_t r1(41), r2(43);
+    const size_t burnin = 200, nsweeps = 4000;
+    double crf_dishes = 0, crf_tables = 0, direct_dishes = 0, direct_tables = 0;
+    for(size_t i = 0; i < burnin + nsweeps; ++i){
+        microscopes::kernels::lda_crp_gibbs(crf, r1);
+        microscopes::kernels::lda_direct_gibbs(direct, r2);
+        if(i < burnin) continue;
+        crf_dishes += double(crf.ntopics()) / nsweeps;
+        crf_tables += double(crf.ntables()) / nsweeps;
+        direct_dishes += double(direct.ntopics()) / nsweeps;
+        direct_tables += double(direct.ntables()) / nsweeps;
+    }
+    std::cout << "dishes " << crf_dishes << " " << direct_dishes
+              << ", tables " << crf_tables << " " << direct_tables << std::endl;
+    MICROSCOPES_CHECK(std::abs(crf_dishes - direct_dishes) < 0.1 * crf_dishes, "samplers disagree on dishes");
+    MICROSCOPES_CHECK(std::abs(crf_tables - direct_tables) < 0.1 * crf_tables, "samplers disagree on tables");
+}
+
+// With the rest of the corpus fixed, resampling a document's runs with
+// sampling_t_run must leave the same distribution over its seating as
+// sampling_t one token at a time. Drawing each copy from the predictive
+// given only the copies before it would not: it joins the first copy's
+// table at dish 2 about 12% of the time instead of 8%.
+static void
+test_run_token_distribution(){
+    using namespace kernels::lda_crp;
+    std::vector< std::vector<size_t>> docs {{0,0},{1,1}};
+    lda::model_definition defn(docs.size(), 2);
+    std::vector< std::vector<size_t>> dish_assignments {{0, 1}, {0, 2}};
+    std::vector< std::vector<size_t>> table_assignments {{1, 1}, {1, 1}};
+    lda::state state(defn, 1.0, 0.5, 1.0, dish_assignments, table_assignments, docs);
+    const size_t ndraws = 100000;
+    std::map<std::pair<size_t, size_t>, double> dense, runs;
+    rng_t r(61);
+    workspace ws;
+    lda::state s1(state), s2(state);
+    for(size_t n = 0; n < ndraws; ++n){
+        sampling_t_document(s1, 0, sampling_t, r, ws);
+        sampling_t_document(s2, 0, sampling_t_run, r, ws);
+        dense[std::make_pair(s1.ntables(0), s1.ntopics())] += 1.0 / ndraws;
+        runs[std::make_pair(s2.ntables(0), s2.ntopics())] += 1.0 / ndraws;
+    }
+    for(auto &kv : dense){
+        MICROSCOPES_CHECK(std::abs(runs[kv.first] - kv.second) < 0.01, "run kernel distribution differs from dense kernel");
+    }
+    s2.validate_n_k_values();
+}
+
+// Resampling runs as a block targets the same posterior as drawing the
+// copies one at a time, keeps the counts in step and leaves each run one
+// segment per table.
+static void
+test_run_chain(){
+    std::vector< std::vector<size_t>> docs {{0,0,0,1,2,2}, {3,3,3,3,3,1}, {1,0,1,4,4,4,4}, {2,2,2,1}, {4,4,5,5,5}};
+    lda::model_definition defn(docs.size(), 6);
+    rng_t r1(53), r2(59);
+    lda::state dense(defn, 1.0, 0.5, 1.0, 2, docs, r1);
+    lda::state runs(dense);
+    const size_t burnin = 200, nsweeps = 4000;
+    double dense_dishes = 0, dense_tables = 0, run_dishes = 0, run_tables = 0;
+    for(size_t i = 0; i < burnin + nsweeps; ++i){
+        microscopes::kernels::lda_crp_gibbs(dense, r1);
+        microscopes::kernels::lda_crp_gibbs(runs, r2, kernels::lda_crp::sampling_t_run);
+        if(i % 100 == 0){
+            runs.validate_n_k_values();
+            for(size_t eid = 0; eid < docs.size(); ++eid){
+                for(size_t q = 0; q < runs.nruns(eid); ++q){
+                    std::set<uint32_t> seen;
+                    for(auto &seg : runs.run_tables(eid).run(q)){
+                        MICROSCOPES_CHECK(seg.first != 0 && seen.insert(seg.first).second, "run split at a table");
+                    }
+                }
+            }
+        }
+        if(i < burnin) continue;
+        dense_dishes += double(dense.ntopics()) / nsweeps;
+        dense_tables += double(dense.ntables()) / nsweeps;
+        run_dishes += double(runs.ntopics()) / nsweeps;
+        run_tables += double(runs.ntables()) / nsweeps;
+    }
+    std::cout << "dishes " << dense_dishes << " " << run_dishes
+              << ", tables " << dense_tables << " " << run_tables << std::endl;
+    MICROSCOPES_CHECK(std::abs(dense_dishes - run_dishes) < 0.1 * dense_dishes, "run kernel disagrees on dishes");
+    MICROSCOPES_CHECK(std::abs(dense_tables - run_tables) < 0.1 * dense_tables, "run kernel disagrees on tables");
+}
+
+// log p(words) for a dish holding `counts`, as the state scores it.
+static double
+dish_log_likelihood(const std::map<size_t, size_t> &counts, double beta, size_t V){
+    size_t n = 0;
+    double ret = 0;
+    for(auto &kv : counts){
+        ret += std::lgamma(kv.second + beta) - std::lgamma(beta);
+        n += kv.second;
+    }
+    return ret + std::lgamma(V * beta) - std::lgamma(n + V * beta);
+}
+
+// With the tables fixed, split-merge moves alone must visit each grouping
+// of the tables into dishes in proportion to its posterior
+//   gamma^K prod_k (m_k - 1)! p(words of dish k),
+// found here by enumerating the 15 groupings of 4 tables.
+static void
+test_split_merge_distribution(){
+    rng_t r(47);
+    const size_t V = 4;
+    const double beta = 0.5, gamma = 1.5;
+    std::vector< std::vector<size_t>> docs {{0,0,1,2,2,3}, {0,1,1,3,3}};
+    std::vector< std::vector<size_t>> dish_assignments {{0, 1, 1}, {0, 1, 1}};
+    std::vector< std::vector<size_t>> table_assignments {{1,1,1,2,2,2}, {1,1,2,2,2}};
+    lda::model_definition defn(docs.size(), V);
+    lda::state state(defn, 1.0, beta, gamma, dish_assignments, table_assignments, docs);
+    const std::vector<std::pair<size_t, size_t>> tables {{0, 1}, {0, 2}, {1, 1}, {1, 2}};
+
+    // Groupings as restricted growth strings: table i joins one of the
+    // groups before it or starts the next.
+    std::map<std::vector<size_t>, double> expected;
+    std::vector<size_t> g(4, 0);
+    double total = 0;
+    for(g[1] = 0; g[1] <= 1; ++g[1]){
+        for(g[2] = 0; g[2] <= *std::max_element(g.begin(), g.begin() + 2) + 1; ++g[2]){
+            for(g[3] = 0; g[3] <= *std::max_element(g.begin(), g.begin() + 3) + 1; ++g[3]){
+                const size_t K = *std::max_element(g.begin(), g.end()) + 1;
+                double log_p = K * std::log(gamma);
+                for(size_t k = 0; k < K; ++k){
+                    std::map<size_t, size_t> counts;
+                    size_t m = 0;
+                    for(size_t i = 0; i < tables.size(); ++i){
+                        if(g[i] != k) continue;
+                        m += 1;
+                        for(auto &kv : state.table_words(tables[i].first, tables[i].second)){
+                            counts[kv.first] += kv.second;
+                        }
+                    }
+                    log_p += std::lgamma(double(m)) + dish_log_likelihood(counts, beta, V);
+                }
+                expected[g] = std::exp(log_p);
+                total += expected[g];
+            }
+        }
+    }
+    MICROSCOPES_CHECK(expected.size() == 15, "wrong number of groupings");
+    for(auto &kv : expected) kv.second /= total;
+
+    kernels::lda_crp::split_merge_stats stats;
+    const size_t ndraws = 100000;
+    std::map<std::vector<size_t>, double> observed;
+    for(size_t n = 0; n < ndraws; ++n){
+        kernels::lda_crp::split_merge(state, r, 1, stats);
+        std::map<size_t, size_t> relabel;
+        for(size_t i = 0; i < tables.size(); ++i){
+            size_t k = state.dish_assignment(tables[i].first, tables[i].second);
+            if(!relabel.count(k)){
+                const size_t next = relabel.size();
+                relabel[k] = next;
+            }
+            g[i] = relabel[k];
+        }
+        observed[g] += 1.0 / ndraws;
+    }
+    state.validate_n_k_values();
+    MICROSCOPES_CHECK(stats.nsplits_proposed + stats.nmerges_proposed == ndraws && stats.ntopics.size() == ndraws,
+        "wrong counts");
+    MICROSCOPES_CHECK(stats.nsplits_accepted > 0 && stats.nmerges_accepted > 0, "no moves accepted");
+    for(auto &kv : expected){
+        // MH draws are correlated, so allow more slack than for exact draws.
+        double sigma = std::sqrt(kv.second * (1 - kv.second) / ndraws);
+        MICROSCOPES_CHECK(std::abs(observed[kv.first] - kv.second) < 10 * sigma + 1e-3,
+            "split-merge distribution is wrong");
+    }
+}
+
+// Words of topic 0 (ids 0-4) and topic 1 (ids 5-9) in dish k.
+static std::pair<size_t, size_t>
+topic_words(const lda::state &state, size_t k){
+    size_t low = 0, high = 0;
+    for(size_t v = 0; v < 10; ++v) (v < 5 ? low : high) += state.dish_word_count(k, v);
+    return std::make_pair(low, high);
+}
+
+// Two topics on disjoint words that start out as one dish are pulled
+// apart by split-merge moves. Every document sits at one table of one
+// topic, so in each chain the moves alone must leave every dish with one
+// topic's words. That takes a few hundred proposals: a split can leave
+// one table of each topic together, and only picking that pair of the
+// 190 splits them again. Gibbs sweeps then move words between tables
+// and can leave a stray word in the other topic's dish, which moves of
+// whole tables cannot undo, so after those each chain only needs nearly
+// all words in a dish of their own topic.
+static void
+test_split_merge_chain(){
+    rng_t r(53);
+    const unsigned nchains = 10;
+    unsigned npure = 0;
+    kernels::lda_crp::split_merge_stats all;
+    for(unsigned c = 0; c < nchains; ++c){
+        std::vector< std::vector<size_t>> docs;
+        for(size_t d = 0; d < 20; ++d){
+            std::vector<size_t> doc;
+            for(size_t i = 0; i < 20; ++i) doc.push_back(5 * (d % 2) + r() % 5);
+            docs.push_back(doc);
+        }
+        std::vector< std::vector<size_t>> dish_assignments(docs.size(), std::vector<size_t>{0, 1});
+        std::vector< std::vector<size_t>> table_assignments(docs.size(), std::vector<size_t>(20, 1));
+        lda::model_definition defn(docs.size(), 10);
+        lda::state state(defn, 0.5, 0.1, 0.5, dish_assignments, table_assignments, docs);
+
+        kernels::lda_crp::split_merge_stats stats;
+        for(unsigned i = 0; i < 10; ++i){
+            kernels::lda_crp::split_merge(state, r, 100, stats);
+            state.validate_n_k_values();
+        }
+        MICROSCOPES_CHECK(stats.nsplits_accepted > 0, "no split accepted");
+        MICROSCOPES_CHECK(stats.ntopics.size() == 10 && stats.ntopics.back() >= 2, "topics not split");
+        for(auto k : state.dishes()){
+            if(k == 0) continue;
+            auto words = topic_words(state, k);
+            MICROSCOPES_CHECK(words.first == 0 || words.second == 0, "dish mixes the topics");
+        }
+
+        for(unsigned i = 0; i < 5; ++i){
+            kernels::lda_crp::split_merge(state, r, 20, stats);
+            microscopes::kernels::lda_crp_gibbs(state, r);
+            state.validate_n_k_values();
+        }
+        // Words in a dish whose majority is their own topic.
+        size_t majority = 0, total = 0;
+        bool pure = true;
+        for(auto k : state.dishes()){
+            if(k == 0) continue;
+            auto words = topic_words(state, k);
+            majority += std::max(words.first, words.second);
+            total += words.first + words.second;
+            pure = pure && (words.first == 0 || words.second == 0);
+        }
+        MICROSCOPES_CHECK(majority >= 0.98 * total, "dishes mix the topics after Gibbs sweeps");
+        npure += pure;
+        all.nsplits_proposed += stats.nsplits_proposed;
+        all.nsplits_accepted += stats.nsplits_accepted;
+        all.nmerges_proposed += stats.nmerges_proposed;
+        all.nmerges_accepted += stats.nmerges_accepted;
+    }
+    MICROSCOPES_CHECK(npure >= nchains - 3, "topics not separated in most chains");
+    std::cout << "split acceptance " << all.split_acceptance()
+              << ", merge acceptance " << all.merge_acceptance()
+              << ", " << npure << "/" << nchains << " chains separated" << std::endl;
+}
+
 int main(void){
     test_random_sequences();
     std::cout << "test_random_sequences passed" << std::endl;
     test_explicit_initializtion();
     std::cout << "test_explicit_initializtion passed" << std::endl;
+    test_explicit_deleted_slots();
+    std::cout << "test_explicit_deleted_slots passed" << std::endl;
+    test_sparse_chain();
+    std::cout << "test_sparse_chain passed" << std::endl;
+    test_sparse_token_distribution();
+    std::cout << "test_sparse_token_distribution passed" << std::endl;
+    test_mh_token_distribution();
+    std::cout << "test_mh_token_distribution passed" << std::endl;
+    test_mh_chain();
+    std::cout << "test_mh_chain passed" << std::endl;
+    test_parallel_chain();
+    std::cout << "test_parallel_chain passed" << std::endl;
+    test_parallel_dish_sweep();
+    std::cout << "test_parallel_dish_sweep passed" << std::endl;
+    test_apply_dish_draws();
+    std::cout << "test_apply_dish_draws passed" << std::endl;
+    test_parallel_dish_sweep_distribution();
+    std::cout << "test_parallel_dish_sweep_distribution passed" << std::endl;
+    test_exp_cumsum();
+    std::cout << "test_exp_cumsum passed" << std::endl;
+    test_sample_log_weights();
+    std::cout << "test_sample_log_weights passed" << std::endl;
+    test_dense_token_distribution();
+    std::cout << "test_dense_token_distribution passed" << std::endl;
+    test_direct_token_distribution();
+    std::cout << "test_direct_token_distribution passed" << std::endl;
+    test_direct_table_counts();
+    std::cout << "test_direct_table_counts passed" << std::endl;
+    test_direct_chain();
+    std::cout << "test_direct_chain passed" << std::endl;
+    test_direct_matches_crf();
+    std::cout << "test_direct_matches_crf passed" << std::endl;
+    test_run_token_distribution();
+    std::cout << "test_run_token_distribution passed" << std::endl;
+    test_run_chain();
+    std::cout << "test_run_chain passed" << std::endl;
+    test_split_merge_distribution();
+    std::cout << "test_split_merge_distribution passed" << std::endl;
+    test_split_merge_chain();
+    std::cout << "test_split_merge_chain passed" << std::endl;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include <microscopes/lda/scheduler.hpp>
+#include <microscopes/common/macros.hpp>
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+
+// A few heavy tasks among many light ones, like long reports among tweets.
+static vector<double>
+skewed_costs(){
+    vector<double> costs(200, 1);
+    costs[3] = 400;
+    costs[50] = 300;
+    costs[51] = 300;
+    return costs;
+}
+
+static void
+test_partition(){
+    lda::scheduler scheduler(4);
+    auto costs = skewed_costs();
+    auto owner = scheduler.partition(costs);
+    MICROSCOPES_CHECK(owner.size() == costs.size(), "wrong partition size");
+    vector<double> load(4, 0);
+    for(size_t i = 0; i < costs.size(); ++i){
+        MICROSCOPES_CHECK(owner[i] < 4, "task dealt to a missing thread");
+        load[owner[i]] += costs[i];
+    }
+    // Heaviest first to the least loaded thread: each big task gets its
+    // own thread and the small ones all go to the fourth, so no thread
+    // has more than the biggest task.
+    MICROSCOPES_CHECK(owner[3] != owner[50] && owner[50] != owner[51] && owner[3] != owner[51],
+        "heavy tasks share a thread");
+    for(auto l : load){
+        MICROSCOPES_CHECK(l <= 400, "unbalanced partition");
+    }
+    MICROSCOPES_CHECK(scheduler.partition(costs) == owner, "partition is not deterministic");
+}
+
+static void
+test_run(bool steal){
+    lda::scheduler scheduler(4);
+    auto costs = skewed_costs();
+    vector<atomic<int>> runs(costs.size());
+    for(auto &n : runs) n = 0;
+    vector<size_t> ran_on(costs.size());
+    scheduler.run(costs, [&](size_t i, size_t thread){
+        runs[i] += 1;
+        ran_on[i] = thread;
+    }, steal);
+
+    for(auto &n : runs){
+        MICROSCOPES_CHECK(n == 1, "task not run exactly once");
+    }
+    size_t ntasks = 0, nstolen = 0;
+    double cost = 0;
+    for(auto &stats : scheduler.stats()){
+        ntasks += stats.ntasks;
+        nstolen += stats.nstolen;
+        cost += stats.cost;
+    }
+    MICROSCOPES_CHECK(ntasks == costs.size(), "task counters are off");
+    MICROSCOPES_CHECK(cost == 1197, "cost counters are off");
+    for(auto u : scheduler.utilization()){
+        MICROSCOPES_CHECK(u >= 0 && u <= 1.01, "utilization out of range");
+    }
+    if(!steal){
+        MICROSCOPES_CHECK(nstolen == 0, "stole with stealing off");
+        MICROSCOPES_CHECK(ran_on == scheduler.partition(costs), "task ran off its thread");
+    }
+
+    scheduler.reset_stats();
+    MICROSCOPES_CHECK(scheduler.stats()[0].ntasks == 0 && scheduler.wall_seconds() == 0, "stats not reset");
+}
+
+static void
+test_single_thread(){
+    lda::scheduler scheduler(1);
+    vector<size_t> order;
+    scheduler.run(vector<double>{3, 1, 2}, [&](size_t i, size_t thread){
+        MICROSCOPES_CHECK(thread == 0, "wrong thread");
+        order.push_back(i);
+    });
+    MICROSCOPES_CHECK((order == vector<size_t>{0, 1, 2}), "tasks not run in order");
+}
+
+static void
+test_threads_kept(){
+    // The same threads serve every run.
+    lda::scheduler scheduler(3);
+    vector<double> costs(30, 1);
+    vector<thread::id> first(3), ids(3);
+    scheduler.run(costs, [&](size_t, size_t thread){ first[thread] = this_thread::get_id(); }, false);
+    for(unsigned run = 0; run < 20; ++run){
+        scheduler.run(costs, [&](size_t, size_t thread){ ids[thread] = this_thread::get_id(); }, false);
+        MICROSCOPES_CHECK(ids == first, "run started new threads");
+    }
+    MICROSCOPES_CHECK(first[0] == this_thread::get_id(), "thread 0 is not the caller");
+    MICROSCOPES_CHECK(scheduler.stats()[1].ntasks == 21 * 10, "task counters are off");
+}
+
+static void
+test_exception(){
+    // A throwing task ends the run with its exception, on any thread, and
+    // the scheduler can still be used afterwards.
+    lda::scheduler scheduler(4);
+    auto costs = skewed_costs();
+    for(size_t bad : {size_t(3), size_t(50), size_t(120)}){
+        bool caught = false;
+        try {
+            scheduler.run(costs, [&](size_t i, size_t){
+                if(i == bad) throw runtime_error("task failed");
+            });
+        }
+        catch(const runtime_error &e){
+            caught = string(e.what()) == "task failed";
+        }
+        MICROSCOPES_CHECK(caught, "task exception not rethrown");
+    }
+    atomic<size_t> ran(0);
+    scheduler.run(costs, [&](size_t, size_t){ ran += 1; });
+    MICROSCOPES_CHECK(ran == costs.size(), "scheduler broken after an exception");
+
+    // No task starts after the exception.
+    lda::scheduler single(1);
+    vector<size_t> order;
+    try {
+        single.run(vector<double>(10, 1), [&](size_t i, size_t){
+            if(i == 4) throw runtime_error("task failed");
+            order.push_back(i);
+        });
+    }
+    catch(const runtime_error &){}
+    MICROSCOPES_CHECK((order == vector<size_t>{0, 1, 2, 3}), "task ran after the exception");
+}
+
+int main(void){
+    test_partition();
+    cout << "test_partition passed" << endl;
+    test_run(true);
+    cout << "test_run (stealing) passed" << endl;
+    test_run(false);
+    cout << "test_run (no stealing) passed" << endl;
+    test_single_thread();
+    cout << "test_single_thread passed" << endl;
+    test_threads_kept();
+    cout << "test_threads_kept passed" << endl;
+    test_exception();
+    cout << "test_exception passed" << endl;
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <microscopes/lda/shard_stream.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static const string dir = "test_shard_stream.tmp";
+
+static void
+remove_dir(){
+    for(size_t s = 0; s < 10; ++s){
+        for(int copy = 0; copy < 2; ++copy){
+            std::remove((dir + "/shard-" + to_string(s) + "." + to_string(copy)).c_str());
+        }
+    }
+    std::remove((dir + "/counts").c_str());
+    rmdir(dir.c_str());
+}
+
+// Documents [begin, end) of data::random_docs.
+static shared_ptr<const lda::corpus>
+piece(size_t begin, size_t end){
+    lda::nested_vector docs(data::random_docs.begin() + begin, data::random_docs.begin() + end);
+    return make_shared<const lda::corpus>(docs);
+}
+
+// Word-level then table-level moves, one document at a time, so that a
+// sweep over shards visits everything in the same order as a sweep over
+// the whole corpus.
+static void
+sweep_documents(lda::state &state, rng_t &r){
+    kernels::lda_crp::workspace ws;
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        kernels::lda_crp::sampling_t_document(state, eid, kernels::lda_crp::sampling_t, r, ws);
+        vector<size_t> tables = state.tables(eid);
+        for(auto t : tables){
+            if(t != 0) kernels::lda_crp::sampling_k(state, eid, t, r, ws);
+        }
+    }
+}
+
+// The shards, concatenated.
+static lda::nested_vector
+table_assignments(const lda::shard_stream &stream, lda::nested_vector *dishes){
+    lda::nested_vector ret;
+    dishes->clear();
+    for(size_t s = 0; s < stream.nshards(); ++s){
+        auto shard = stream.load(s);
+        lda::state view(stream.counts().nwords(), 0.5, 0.1, 1.0);
+        view.swap_shard(shard);
+        auto tables = view.table_assignments();
+        ret.insert(ret.end(), tables.begin(), tables.end());
+        dishes->insert(dishes->end(), view.dish_assignments().begin(), view.dish_assignments().end());
+    }
+    return ret;
+}
+
+// A chain streamed through shards is the chain on the whole corpus.
+static void
+test_same_chain(size_t prefetch){
+    const size_t V = 5, ndocs = data::random_docs.size();
+    rng_t r1(61), r2(61);
+    lda::model_definition defn(ndocs, V);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, data::random_docs, r1);
+
+    remove_dir();
+    auto stream = lda::shard_stream::create(dir, V, 0.5, 0.1, 1.0, prefetch);
+    stream->append(piece(0, 20), 3, r2);
+    stream->append(piece(20, 21), 3, r2);
+    stream->append(piece(21, ndocs), 3, r2);
+    MICROSCOPES_CHECK(stream->nshards() == 3 && stream->nentities() == ndocs &&
+                      stream->first_entity(2) == 21 && stream->nentities(1) == 1, "wrong shards");
+    lda::nested_vector dishes;
+    MICROSCOPES_CHECK(table_assignments(*stream, &dishes) == state.table_assignments() &&
+                      dishes == state.dish_assignments(), "initial state depends on the shards");
+
+    for(int it = 0; it < 5; ++it){
+        sweep_documents(state, r1);
+        stream->sweep([&](lda::state &s, size_t){ sweep_documents(s, r2); });
+    }
+    MICROSCOPES_CHECK(table_assignments(*stream, &dishes) == state.table_assignments() &&
+                      dishes == state.dish_assignments(), "streamed chain differs");
+    MICROSCOPES_CHECK(stream->counts().dishes() == state.dishes() && stream->counts().m_k == state.m_k &&
+                      stream->counts().n_k == state.n_k, "streamed counts differ");
+    stream->validate();
+    MICROSCOPES_CHECK(stream->generation() == 8, "wrong generation");
+    remove_dir();
+}
+
+// Any kernel runs on a shard; reopening recovers the counts, and a sweep
+// that fails leaves the last complete one on disk.
+static void
+test_reopen(){
+    const size_t V = 5;
+    rng_t r(62);
+    remove_dir();
+    auto stream = lda::shard_stream::create(dir, V, 0.5, 0.1, 1.0);
+    for(size_t begin = 0; begin < 50; begin += 10){
+        stream->append(piece(begin, begin + 10), 2, r);
+    }
+    for(int it = 0; it < 3; ++it){
+        stream->sweep([&](lda::state &s, size_t){ kernels::lda_crp_gibbs(s, r); });
+        stream->sweep([&](lda::state &s, size_t){
+            kernels::lda_crp_gibbs(s, r, kernels::lda_crp::sampling_t_sparse, 2);
+        });
+    }
+    stream->validate();
+
+    auto reopened = lda::shard_stream::open(dir);
+    MICROSCOPES_CHECK(reopened->nshards() == 5 && reopened->nentities() == 50 &&
+                      reopened->generation() == stream->generation(), "wrong shards after reopening");
+    MICROSCOPES_CHECK(reopened->counts().dishes() == stream->counts().dishes() &&
+                      reopened->counts().m_k == stream->counts().m_k &&
+                      reopened->counts().n_k == stream->counts().n_k, "counts differ after reopening");
+    lda::nested_vector dishes, dishes_before;
+    auto before = table_assignments(*stream, &dishes_before);
+
+    bool failed = false;
+    try{
+        reopened->sweep([&](lda::state &s, size_t shard){
+            kernels::lda_crp_gibbs(s, r);
+            if(shard == 3) throw std::runtime_error("interrupted");
+        });
+    }catch(const std::runtime_error &){
+        failed = true;
+    }
+    MICROSCOPES_CHECK(failed, "error not passed on");
+    auto recovered = lda::shard_stream::open(dir);
+    MICROSCOPES_CHECK(table_assignments(*recovered, &dishes) == before && dishes == dishes_before,
+        "failed sweep changed the chain");
+    recovered->validate();
+    recovered->sweep([&](lda::state &s, size_t){ kernels::lda_crp_gibbs(s, r); });
+    recovered->validate();
+    remove_dir();
+}
+
+int main(void){
+    test_same_chain(0);
+    test_same_chain(1);
+    test_same_chain(3);
+    cout << "test_same_chain passed" << endl;
+    test_reopen();
+    cout << "test_reopen passed" << endl;
+    return 0;
+}
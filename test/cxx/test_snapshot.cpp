@@ -0,0 +1,262 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static const string path = "test_snapshot.tmp";
+
+static void
+check_same(const lda::state &a, const lda::state &b){
+    MICROSCOPES_CHECK(a.documents() == b.documents(), "documents differ");
+    MICROSCOPES_CHECK(a.alpha_ == b.alpha_ && a.beta_ == b.beta_ && a.gamma_ == b.gamma_, "hyperparameters differ");
+    MICROSCOPES_CHECK(a.table_assignments() == b.table_assignments(), "table assignments differ");
+    MICROSCOPES_CHECK(a.dish_assignments() == b.dish_assignments(), "dish assignments differ");
+    MICROSCOPES_CHECK(a.n_jt == b.n_jt, "table counts differ");
+    MICROSCOPES_CHECK(a.dishes() == b.dishes(), "active dishes differ");
+    MICROSCOPES_CHECK(a.ntables() == b.ntables(), "table totals differ");
+    for(size_t eid = 0; eid < a.nentities(); ++eid){
+        MICROSCOPES_CHECK(a.tables(eid) == b.tables(eid), "active tables differ");
+        for(auto t : a.tables(eid)){
+            for(auto &vc : a.table_words(eid, t)){
+                MICROSCOPES_CHECK(b.table_words(eid, t).get(vc.first) == vc.second, "table words differ");
+            }
+            MICROSCOPES_CHECK(a.table_words(eid, t).size() == b.table_words(eid, t).size(), "table words differ");
+        }
+    }
+    for(auto k : a.dishes()){
+        MICROSCOPES_CHECK(a.dishsize(k) == b.dishsize(k), "m_k differs");
+        MICROSCOPES_CHECK(a.smoothed_n_k(k) == b.smoothed_n_k(k), "n_k differs");
+        for(size_t v = 0; v < a.nwords(); ++v){
+            MICROSCOPES_CHECK(a.dish_word_count(k, v) == b.dish_word_count(k, v), "n_kv differs");
+        }
+    }
+    MICROSCOPES_CHECK(std::abs(a.smoothing_mass() - b.smoothing_mass()) < 1e-9, "smoothing mass differs");
+}
+
+// A loaded state must equal the saved one and carry on sampling exactly
+// as the original does.
+static void
+test_roundtrip(bool with_counts, unsigned nsweeps){
+    rng_t r(41);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,3}, {0,1,4,5,1,6}, {0,1,5,6}, {}, {2,2,4}};
+    lda::model_definition defn(5, 7);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, docs, r);
+    for(unsigned i = 0; i < nsweeps; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    state.save_snapshot(path, with_counts);
+    auto loaded = lda::state::load_snapshot(path);
+    check_same(state, *loaded);
+    MICROSCOPES_CHECK(loaded->documents() == docs, "token order lost");
+    loaded->validate_n_k_values();
+
+    rng_t r1(42), r2(42);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r1);
+        microscopes::kernels::lda_crp_gibbs(*loaded, r2);
+    }
+    check_same(state, *loaded);
+    std::remove(path.c_str());
+}
+
+// Appends the bytes of values, padded to 8 bytes as sections are.
+template <class T>
+static void
+append(string &bytes, const vector<T> &values, bool pad = true){
+    bytes.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+    if(pad) bytes.append((8 - bytes.size() % 8) % 8, '\0');
+}
+
+// Version 2 files hold the documents token by token; they load as runs.
+static void
+test_version2(){
+    rng_t r(44);
+    std::vector< std::vector<size_t>> docs {{0,1,1,1,3}, {2,2,4,4,4,1}, {0,5,5}};
+    lda::model_definition defn(3, 6);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    auto tables = state.table_assignments();
+    auto grouped = state.documents();
+    vector<uint64_t> doc_offsets(1, 0), table_offsets(1, 0);
+    vector<uint32_t> words, t_ji, k_jt;
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        words.insert(words.end(), grouped[eid].begin(), grouped[eid].end());
+        t_ji.insert(t_ji.end(), tables[eid].begin(), tables[eid].end());
+        k_jt.insert(k_jt.end(), state.dish_assignments()[eid].begin(), state.dish_assignments()[eid].end());
+        doc_offsets.push_back(words.size());
+        table_offsets.push_back(k_jt.size());
+    }
+    string bytes("MSLDASNP");
+    append(bytes, vector<uint32_t>({2, 0x01020304, 0}), false);
+    append(bytes, vector<float>({state.alpha_, state.beta_, state.gamma_}), false);
+    append(bytes, vector<uint64_t>({state.nwords(), docs.size(), words.size(), k_jt.size(), state.n_kv.nrows()}));
+    append(bytes, doc_offsets);
+    append(bytes, words);
+    append(bytes, t_ji);
+    append(bytes, table_offsets);
+    append(bytes, k_jt);
+    {
+        ofstream out(path.c_str(), ios::binary | ios::trunc);
+        out << bytes;
+    }
+    auto loaded = lda::state::load_snapshot(path);
+    check_same(state, *loaded);
+    loaded->validate_n_k_values();
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        MICROSCOPES_CHECK(loaded->nruns(eid) == state.nruns(eid), "repeats not merged into runs");
+    }
+    std::remove(path.c_str());
+}
+
+static void
+test_bad_files(){
+    rng_t r(43);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}};
+    lda::model_definition defn(2, 6);
+    lda::state state(defn, 0.5, 0.1, 1.0, 2, docs, r);
+    state.save_snapshot(path);
+    string contents;
+    {
+        ifstream in(path.c_str(), ios::binary);
+        contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    auto fails = [](const string &bytes){
+        {
+            ofstream out(path.c_str(), ios::binary | ios::trunc);
+            out << bytes;
+        }
+        try{
+            lda::state::load_snapshot(path);
+        }catch(const std::exception &){
+            return true;
+        }
+        return false;
+    };
+    MICROSCOPES_CHECK(fails(contents.substr(0, contents.size() - 8)), "loaded a truncated file");
+    MICROSCOPES_CHECK(fails(contents + string(8, '\0')), "loaded a file with trailing data");
+    string bad_magic = contents;
+    bad_magic[0] = 'X';
+    MICROSCOPES_CHECK(fails(bad_magic), "loaded a file without the magic");
+    MICROSCOPES_CHECK(fails(""), "loaded an empty file");
+    std::remove(path.c_str());
+    bool missing = false;
+    try{
+        lda::state::load_snapshot(path);
+    }catch(const std::exception &){
+        missing = true;
+    }
+    MICROSCOPES_CHECK(missing, "loaded a missing file");
+}
+
+// Stored counts that disagree with the assignments are refused; counts
+// moved between a dish's words, so that its n_kv still sums to its n_k,
+// only when loading with verify.
+static void
+test_bad_counts(){
+    rng_t r(44);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {2,2,3,5}};
+    lda::model_definition defn(docs.size(), 6);
+    lda::state state(defn, 0.5, 0.1, 1.0, 2, docs, r);
+    // Seat the words, so that the dish below has some.
+    microscopes::kernels::lda_crp_gibbs(state, r);
+    size_t k = 0, v = 0;
+    for(auto d : state.dishes()){
+        if(d != 0) k = d;
+    }
+    while(state.n_kv(k, v) == 0) ++v;
+    auto fails = [](const lda::state &bad, bool verify){
+        bad.save_snapshot(path);
+        try{
+            lda::state::load_snapshot(path, nullptr, verify);
+        }catch(const std::exception &){
+            return true;
+        }
+        return false;
+    };
+    lda::state moved = state;
+    moved.n_kv(k, v) -= 1;
+    moved.n_kv(k, (v + 1) % 6) += 1;
+    MICROSCOPES_CHECK(fails(moved, true), "loaded n_kv that does not match the tables");
+    lda::state tables = state;
+    tables.m_k[k] += 1;
+    MICROSCOPES_CHECK(fails(tables, false), "loaded m_k that does not match the tables");
+    lda::state words = state;
+    words.n_k[k] += 1;
+    MICROSCOPES_CHECK(fails(words, false), "loaded n_k that does not match the tables");
+    MICROSCOPES_CHECK(!fails(state, true), "refused consistent counts");
+
+    // Without documents only n_kv against n_k can be checked.
+    lda::state counts(6, 0.5, 0.1, 1.0);
+    const size_t d = counts.create_dish();
+    counts.m_k[d] = 1;
+    counts.n_k[d] = 3;
+    counts.n_kv(d, 0) = 2;
+    counts.n_kv(d, 4) = 1;
+    MICROSCOPES_CHECK(!fails(counts, true), "refused counts without documents");
+    counts.n_kv(d, 4) = 2;
+    MICROSCOPES_CHECK(fails(counts, false), "loaded n_kv that does not add up to n_k");
+    std::remove(path.c_str());
+}
+
+static string
+read_file(const string &p){
+    std::ifstream in(p.c_str(), std::ios::binary);
+    return string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Assignments taken from a state write the file the state wrote at that
+// point, counts included, however the state has changed since.
+static void
+test_flat_assignments(){
+    rng_t r(45);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,3}, {0,1,4,5,1,6}, {0,1,5,6}, {}, {2,2,4}};
+    lda::model_definition defn(5, 7);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    const string flat_path = path + ".flat";
+    for(bool with_counts : {true, false}){
+        state.save_snapshot(path, with_counts, "extra");
+        auto flat = state.flat_assignments();
+        for(unsigned i = 0; i < 5; ++i){
+            microscopes::kernels::lda_crp_gibbs(state, r);
+        }
+        flat.save(flat_path, with_counts, "extra");
+        MICROSCOPES_CHECK(read_file(path) == read_file(flat_path), "assignments wrote another file");
+    }
+    std::remove(path.c_str());
+    std::remove(flat_path.c_str());
+}
+
+int main(void){
+    test_roundtrip(true, 10);
+    cout << "test_roundtrip (counts) passed" << endl;
+    test_roundtrip(false, 10);
+    cout << "test_roundtrip (no counts) passed" << endl;
+    test_roundtrip(true, 0);
+    cout << "test_roundtrip (initial state) passed" << endl;
+    test_version2();
+    cout << "test_version2 passed" << endl;
+    test_bad_files();
+    cout << "test_bad_files passed" << endl;
+    test_bad_counts();
+    cout << "test_bad_counts passed" << endl;
+    test_flat_assignments();
+    cout << "test_flat_assignments passed" << endl;
+    return 0;
+}
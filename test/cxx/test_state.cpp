@@ -6,6 +6,7 @@
 #include <microscopes/common/random_fwd.hpp>
 
 #include <random>
+#include <set>
 #include <iostream>
 
 using namespace std;
@@ -229,9 +230,9 @@ sequence3(double alpha, double beta, double gamma){
     i = 1;
     v = docs[j][i];
     state.remove_table(j, i);
-    MICROSCOPES_CHECK(state.using_t[j].size() == 2, "using_t[j] is wrong size");
-    MICROSCOPES_CHECK(state.using_t[j][0] == 0, "using_t[j][0] is wrong");
-    MICROSCOPES_CHECK(state.using_t[j][1] == 1, "using_t[j][1] is wrong");
+    MICROSCOPES_CHECK(state.ntables(j) == 2, "using_t[j] is wrong size");
+    MICROSCOPES_CHECK(state.tables(j)[0] == 0, "using_t[j][0] is wrong");
+    MICROSCOPES_CHECK(state.tables(j)[1] == 1, "using_t[j][1] is wrong");
 
     f_k = calc_f_k(state, v, r);
     MICROSCOPES_CHECK(f_k.size() == 3, "f_k is wrong size in section 5");
@@ -264,24 +265,24 @@ sequence2(double alpha, double beta, double gamma){
             state.add_table(j, t_new, i);
         }
     }
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_k.get(0), beta*V),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_k(0), beta*V),
         "n_k[0] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_k.get(1), beta*V+12),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_k(1), beta*V+12),
         "n_k[1] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(0), beta + 3),
-        "n_kv[1].get(0) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(1), beta + 3),
-        "n_kv[1].get(1) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(2), beta + 1),
-        "n_kv[1].get(2) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(3), beta + 1),
-        "n_kv[1].get(3) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(4), beta + 1),
-        "n_kv[1].get(4) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(5), beta + 2),
-        "n_kv[1].get(5) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(6), beta + 1),
-        "n_kv[1].get(6) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 0), beta + 3),
+        "smoothed_n_kv(1, 0) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 1), beta + 3),
+        "smoothed_n_kv(1, 1) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 2), beta + 1),
+        "smoothed_n_kv(1, 2) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 3), beta + 1),
+        "smoothed_n_kv(1, 3) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 4), beta + 1),
+        "smoothed_n_kv(1, 4) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 5), beta + 2),
+        "smoothed_n_kv(1, 5) is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(1, 6), beta + 1),
+        "smoothed_n_kv(1, 6) is wrong");
 
     state.leave_from_dish(0, 1); // decreate m and m_k only
     MICROSCOPES_CHECK(state.ntables() == 2, "state.ntables() != 2");
@@ -323,10 +324,10 @@ sequence1(double alpha, double beta, double gamma){
     MICROSCOPES_CHECK(state.dish_assignments_[j][t_new] == 1, "incorrectly created new table");
 
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1}),
         "using_t[j] wrong after sitting at table");
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ wrong after sitting at table");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 0,
         "n_jt[j][t_new] wrong after sitting at table");
@@ -336,8 +337,8 @@ sequence1(double alpha, double beta, double gamma){
         "table_assignments()[j][i] wrng after sitting at table");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1,
         "n_jt[j][t_new] wrong after sitting at table");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
-        "n_kv[k_new].get(v) wrong after sitting at table");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(k_new, v), beta+1),
+        "smoothed_n_kv(k_new, v) wrong after sitting at table");
 
     // Section 2
     i = 1; // the existed table
@@ -362,8 +363,8 @@ sequence1(double alpha, double beta, double gamma){
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "state.table_assignments()[j][i] notset to t_new");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 2, "state.n_jt[j][t_new] incremented");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
-        "n_kv[k_new].get(v) correct");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(k_new, v), beta+1),
+        "smoothed_n_kv(k_new, v) correct");
 
     // Section 4
     i = 2;
@@ -401,17 +402,17 @@ sequence1(double alpha, double beta, double gamma){
     MICROSCOPES_CHECK(k_new == state.dish_assignments_[j][t_new], "k_new wrong in section 5");
 
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1, 2}),
+        assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1, 2}),
         "using_t[j] wrong after sitting at table in section 5");
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ wrong after sitting at table");
 
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "table_assignments() wrong in section 5");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1, "n_jt wrong in section 5");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
-        "n_kv[k_new].get(v) wrong in section 5");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(k_new, v), beta+1),
+        "smoothed_n_kv(k_new, v) wrong in section 5");
 
     // Section 6
     i = 3;
@@ -440,8 +441,8 @@ sequence1(double alpha, double beta, double gamma){
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "t_new is wrong");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 3, "n_jt[j][t_new] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta + 1),
-        "n_kv[k_new].get(v) isn't beta + 1");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(k_new, v), beta + 1),
+        "smoothed_n_kv(k_new, v) isn't beta + 1");
 
 
     j = 1;
@@ -463,16 +464,16 @@ sequence1(double alpha, double beta, double gamma){
     t_new = state.create_table(j, k_new);
     MICROSCOPES_CHECK(t_new == 1, "create_table failed to set t_new");
 
-    MICROSCOPES_CHECK(assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1}),
+    MICROSCOPES_CHECK(assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1}),
         "using_t[j] set incorrectly");
-    MICROSCOPES_CHECK(assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+    MICROSCOPES_CHECK(assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ set incorrectly");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 0, "n_jt[j][t_new] set incorrectly");
 
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == 1, "table_assignments()[j][i] set incorrectly");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1, "n_jt[j][t_new] set incorrectly");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+2), "n_kv[k_new].get(v)");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.smoothed_n_kv(k_new, v), beta+2), "smoothed_n_kv(k_new, v)");
 }
 
 static void
@@ -505,6 +506,234 @@ test8(){
     sequence2(0.01, 0.001, 0.05);
 }
 
+// perplexity() must agree with the definition through word_distribution()
+// and document_distribution(), and not depend on the number of threads.
+static void
+test9(){
+    rng_t r(77);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3,3,3}, {0,1,4,5,1}, {0,1,5,6,6}, {2,2,4,6}};
+    lda::model_definition defn(4, 7);
+    lda::state state(defn, 0.5, 0.1, 1.0, 3, docs, r);
+    for(unsigned i = 0; i < 20; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    auto phi = state.word_distribution();
+    auto theta = state.document_distribution();
+    double log_likelihood = 0;
+    size_t N = 0;
+    for(size_t eid = 0; eid < state.nentities(); eid++){
+        for(auto v : docs[eid]){
+            // theta[eid][0] is the new dish, which has no words.
+            double word_prob = 0;
+            for(size_t did = 1; did < theta[eid].size(); did++){
+                word_prob += theta[eid][did] * phi[did - 1][v];
+            }
+            log_likelihood -= log(word_prob);
+        }
+        N += state.nterms(eid);
+    }
+    double expected = exp(log_likelihood / N);
+    MICROSCOPES_CHECK(assertAlmostEqual(state.perplexity(), expected, 1e-4 * expected), "perplexity is wrong");
+    MICROSCOPES_CHECK(state.perplexity(3) == state.perplexity(), "perplexity depends on the thread count");
+}
+
+// Runs of tables against a plain vector of per-token tables.
+static void
+test10(){
+    rng_t r(101);
+    const vector<uint32_t> counts {3, 1, 6, 2};
+    lda_util::run_tables runs(counts.size(), [&](size_t q) { return counts[q]; });
+    vector<vector<uint32_t>> expected;
+    for(auto n : counts) expected.push_back(vector<uint32_t>(n, 0));
+    for(size_t step = 0; step < 5000; ++step){
+        size_t q = r() % counts.size(), pos = r() % counts[q];
+        uint32_t t = r() % 3;
+        runs.set_table(q, pos, t);
+        expected[q][pos] = t;
+        size_t nsegments = 0;
+        for(size_t q2 = 0; q2 < counts.size(); ++q2){
+            auto run = runs.run(q2);
+            // Segments are as few as the tables allow.
+            for(size_t s2 = 1; s2 < run.size(); ++s2){
+                MICROSCOPES_CHECK(run[s2].first != run[s2 - 1].first, "segments not merged");
+            }
+            for(size_t i = 0; i < counts[q2]; ++i){
+                MICROSCOPES_CHECK(runs.table(q2, i) == expected[q2][i], "wrong table");
+            }
+            nsegments += run.size();
+        }
+        MICROSCOPES_CHECK(nsegments == runs.nsegments(), "wrong segment count");
+    }
+    vector<size_t> flat, flat_expected;
+    runs.expand(flat);
+    for(auto &run : expected) flat_expected.insert(flat_expected.end(), run.begin(), run.end());
+    MICROSCOPES_CHECK(flat == flat_expected, "wrong expansion");
+
+    // Whole counts moved between tables, against per-table counts; the
+    // slots grow with the segments, not the tokens.
+    const vector<uint32_t> long_counts {1000, 1, 50};
+    lda_util::run_tables long_runs(long_counts.size(), [&](size_t q) { return long_counts[q]; });
+    MICROSCOPES_CHECK(long_runs.nslots() == long_counts.size(), "a slot per token");
+    vector<vector<uint32_t>> at(long_counts.size(), vector<uint32_t>(3, 0));
+    for(size_t q = 0; q < long_counts.size(); ++q) at[q][0] = long_counts[q];
+    for(size_t step = 0; step < 5000; ++step){
+        size_t q = r() % long_counts.size();
+        uint32_t from = r() % 3, to = r() % 3;
+        uint32_t n = at[q][from] > 0 ? r() % (at[q][from] + 1) : 0;
+        long_runs.move(q, from, to, n);
+        if(from != to){
+            at[q][from] -= n;
+            at[q][to] += n;
+        }
+        for(size_t q2 = 0; q2 < long_counts.size(); ++q2){
+            auto run = long_runs.run(q2);
+            vector<uint32_t> found(3, 0);
+            for(size_t s2 = 0; s2 < run.size(); ++s2){
+                MICROSCOPES_CHECK(s2 == 0 || run[s2].first != run[s2 - 1].first, "segments not merged");
+                MICROSCOPES_CHECK(run[s2].second > 0, "empty segment");
+                found[run[s2].first] += run[s2].second;
+            }
+            MICROSCOPES_CHECK(found == at[q2], "wrong tokens per table");
+        }
+        MICROSCOPES_CHECK(long_runs.nslots() <= 8 * long_counts.size(), "too many slots");
+    }
+}
+
+// Documents with repeated words: the state keeps every copy of a word in
+// one run, in the order given, and sweeps that reuse f_k across the
+// copies of a word match ones that do not.
+static void
+test11(){
+    vector< vector<size_t>> docs {{0,0,0,1,2,2}, {3,3,3,3,3}, {1,0,1,4,4,4,4}, {2,2,1}};
+    lda::model_definition defn(docs.size(), 5);
+    lda::corpus bag({0, 3, 4, 7, 9}, {0, 1, 2, 3, 0, 1, 4, 1, 2}, {3, 4, 6, 5, 1, 3, 7, 1, 3},
+                    {0, 0, 0, 7, 10}, {1, 0, 2, 3, 4, 5, 6, 1, 2, 0});
+    MICROSCOPES_CHECK(bag.documents() == docs && bag.nruns() == 9, "wrong runs");
+    lda::corpus grouped(docs);
+    MICROSCOPES_CHECK(grouped.words() == bag.words() && grouped.ends() == bag.ends() &&
+        grouped.order_offsets() == bag.order_offsets() && grouped.order() == bag.order(), "words not grouped");
+    MICROSCOPES_CHECK(bag.run_of(2, 3) == 2 && bag.word_at(2, 3) == 4 && bag.count(0, 0) == 3, "wrong run lookup");
+    MICROSCOPES_CHECK(bag.in_order(0) && !bag.in_order(3) && bag.token(3, 0) == 1 && bag.word_at(3, bag.token(3, 2)) == 1,
+        "wrong token order");
+    MICROSCOPES_CHECK(lda::corpus(grouped.documents()).documents() == docs, "token order lost");
+
+    rng_t r1(102), r2(102);
+    lda::state cached(defn, 0.5, 0.1, 1.0, 2, docs, r1);
+    lda::state fresh(defn, 0.5, 0.1, 1.0, 2, make_shared<const lda::corpus>(bag), r2);
+    workspace ws, ws_k;
+    for(unsigned i = 0; i < 30; ++i){
+        microscopes::kernels::lda_crp_gibbs(cached, r1, sampling_t, ws);
+        // Token by token in corpus order, as the sweep visits them, with
+        // nothing cached between tokens.
+        for(size_t eid = 0; eid < fresh.nentities(); ++eid){
+            for(size_t j = 0; j < fresh.nterms(eid); ++j){
+                workspace once;
+                size_t run = fresh.x_ji->run_of(eid, j);
+                sampling_t(fresh, eid, run, j - fresh.x_ji->begin(eid, run), r2, once);
+            }
+        }
+        sampling_k_sweep(fresh, r2, ws_k);
+        cached.validate_n_k_values();
+    }
+    MICROSCOPES_CHECK(cached.table_assignments() == fresh.table_assignments(), "cached f_k changed the chain");
+    MICROSCOPES_CHECK(cached.dish_assignments() == fresh.dish_assignments(), "cached f_k changed the chain");
+    for(size_t eid = 0; eid < cached.nentities(); ++eid){
+        for(size_t j = 0; j < cached.nterms(eid); ++j){
+            MICROSCOPES_CHECK(cached.table_assignment(eid, j) == cached.table_assignments()[eid][j],
+                "table_assignment differs from table_assignments");
+        }
+    }
+
+    // A copy of a state is never taken for the state it was copied from.
+    lda::state copy(cached);
+    MICROSCOPES_CHECK(copy.stamp() != cached.stamp(), "copy shares the stamp");
+
+    // The per-token views of an unsorted document with repeated words
+    // keep the order it was given in, so they can be passed back with it.
+    lda::nested_vector unsorted {{2, 0, 2, 1}};
+    lda::state explicit_tables(lda::model_definition(1, 3), 0.5, 0.1, 1.0,
+        {{0, 1, 2}}, {{1, 2, 1, 2}}, unsorted);
+    MICROSCOPES_CHECK(explicit_tables.documents() == unsorted, "documents reordered");
+    MICROSCOPES_CHECK(explicit_tables.table_assignments() == lda::nested_vector({{1, 2, 1, 2}}),
+        "table assignments reordered");
+    MICROSCOPES_CHECK(explicit_tables.assignments() == lda::nested_vector({{1, 2, 1, 2}}), "assignments reordered");
+    for(size_t i = 0; i < unsorted[0].size(); ++i){
+        MICROSCOPES_CHECK(explicit_tables.get_word(0, i) == unsorted[0][i], "get_word reordered");
+    }
+    lda::state rebuilt(lda::model_definition(1, 3), 0.5, 0.1, 1.0,
+        explicit_tables.dish_assignments(), explicit_tables.table_assignments(), unsorted);
+    MICROSCOPES_CHECK(rebuilt.assignments() == explicit_tables.assignments(), "round trip moved tokens");
+    for(size_t k = 1; k < 3; ++k){
+        for(size_t v = 0; v < 3; ++v){
+            MICROSCOPES_CHECK(rebuilt.dish_word_count(k, v) == explicit_tables.dish_word_count(k, v),
+                "round trip changed n_kv");
+        }
+    }
+    MICROSCOPES_CHECK(explicit_tables.dish_word_count(2, 1) == 1, "wrong n_kv");
+}
+
+
+// id_set against a reference std::set: membership, ascending order after
+// every change, smallest free id first, and ids inserted out of turn.
+static void
+test12(){
+    lda_util::id_set ids;
+    std::set<size_t> ref;
+    rng_t r(103);
+    for(unsigned i = 0; i < 2000; ++i){
+        size_t op = r() % 3;
+        if(op == 0 || ref.empty()){
+            size_t id = ids.create();
+            size_t expected = 0;
+            while(ref.count(expected)) ++expected;
+            MICROSCOPES_CHECK(id == expected, "create() is not the smallest free id");
+            ref.insert(id);
+        }
+        else if(op == 1){
+            auto it = ref.begin();
+            std::advance(it, r() % ref.size());
+            ids.erase(*it);
+            ref.erase(it);
+        }
+        else{
+            size_t id = r() % (ids.capacity() + 3);
+            if(ref.count(id)) continue;
+            ids.insert(id);
+            ref.insert(id);
+        }
+        MICROSCOPES_CHECK(ids.size() == ref.size(), "wrong size");
+        MICROSCOPES_CHECK(ids.ids() == std::vector<size_t>(ref.begin(), ref.end()), "ids are wrong or out of order");
+        for(size_t id = 0; id < ids.capacity() + 2; ++id){
+            MICROSCOPES_CHECK(ids.contains(id) == (ref.count(id) > 0), "wrong membership");
+        }
+    }
+}
+
+// histogram against a reference std::map: counts, ascending keys with no
+// zero entries, on a table with many distinct words.
+static void
+test13(){
+    lda_util::histogram<uint32_t, uint32_t> h;
+    std::map<uint32_t, uint32_t> ref;
+    rng_t r(107);
+    for(unsigned i = 0; i < 5000; ++i){
+        uint32_t key = r() % 300;
+        if(r() % 2 || !ref.count(key)){
+            uint32_t by = 1 + r() % 3;
+            h.incr(key, by);
+            ref[key] += by;
+        }
+        else{
+            uint32_t by = 1 + r() % ref[key];
+            h.decr(key, by);
+            if((ref[key] -= by) == 0) ref.erase(key);
+        }
+        MICROSCOPES_CHECK(h.get(key) == (ref.count(key) ? ref[key] : 0), "wrong count");
+    }
+    MICROSCOPES_CHECK(h.size() == ref.size(), "wrong size");
+    std::vector<std::pair<uint32_t, uint32_t>> entries(h.begin(), h.end()), expected(ref.begin(), ref.end());
+    MICROSCOPES_CHECK(entries == expected, "entries are wrong or out of order");
+}
 
 int main(void){
     test1();
@@ -519,6 +748,16 @@ int main(void){
     std::cout << "test7 passed" << std::endl;
     test8();
     std::cout << "test8 passed" << std::endl;
+    test9();
+    std::cout << "test9 passed" << std::endl;
+    test10();
+    std::cout << "test10 passed" << std::endl;
+    test11();
+    std::cout << "test11 passed" << std::endl;
+    test12();
+    std::cout << "test12 passed" << std::endl;
+    test13();
+    std::cout << "test13 passed" << std::endl;
     return 0;
 
 }
\ No newline at end of file
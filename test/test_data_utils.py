@@ -45,7 +45,7 @@ def test_docs_from_ldac_simple():
     assert utils.docs_from_ldac(stream) == docs
 
 
-@raises(AssertionError)
+@raises(ValueError)
 def test_bad_ldac_data():
     stream = StringIO()
     stream.write("2 0:1")
@@ -62,3 +62,17 @@ def test_row_major_form_conversion():
     l = [[1, 2, 3, 4], [1, 2, 3], [1, 2, 3, 4, 5, 6]]
     rmf = utils.ragged_array_to_row_major_form(l)
     assert utils.row_major_form_to_ragged_array(*rmf) == l
+
+
+def test_parse_corpus():
+    from microscopes.lda import model
+    from microscopes.lda.definition import model_definition
+    from microscopes.common.rng import rng
+    c = model.parse_corpus("2 5:2 9:1\n\n1 7:1\n")
+    assert c.documents() == [[5, 5, 9], [7]]
+    assert c.vocab() == {0: 5, 1: 7, 2: 9}
+    assert model.parse_corpus("5 5 9\n7\n", format='tokens').documents() == \
+        c.documents()
+
+    s = model.initialize(model_definition(2, 3), c, rng(1))
+    assert s.nentities() == 2 and s.nwords() == 3
@@ -1,3 +1,7 @@
+import os
+import shutil
+import tempfile
+
 from nose.plugins.attrib import attr
 
 from microscopes.lda import model, runner
@@ -15,3 +19,52 @@ def test_runner_simple():
     latent = model.initialize(defn, view, prng)
     r = runner.runner(defn, view, latent)
     r.run(prng, 1)
+
+
+def test_runner_direct():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent, kernel_config='direct')
+    r.run(prng, 5)
+    assert len(latent.word_distribution_by_topic()) == latent.ntopics()
+
+
+def test_runner_split_merge():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent)
+    assert r.split_merge_stats() is None
+    r.run(prng, 4, split_merge_every=2, split_merge_proposals=5)
+    stats = r.split_merge_stats()
+    assert stats['splits_proposed'] + stats['merges_proposed'] == 10
+    assert [it for it, _ in stats['ntopics']] == [2, 4]
+    assert 0 <= stats['split_acceptance'] <= 1
+
+
+def test_runner_checkpoint_resume():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    tmp = tempfile.mkdtemp()
+    try:
+        path = os.path.join(tmp, 'checkpoint')
+        # Without an interval, run() checkpoints once, at the end.
+        prng = rng(7)
+        latent = model.initialize(defn, data, prng)
+        runner.runner(defn, data, latent).run(prng, 3, checkpoint=path)
+        assert os.path.exists(path)
+
+        # Resuming loads into the caller's state object.
+        resumed = model.initialize(defn, data, rng(8))
+        r = runner.runner(defn, data, resumed)
+        r.run(rng(9), 3, checkpoint=path, resume=True)
+        assert resumed.table_assignments() == latent.table_assignments()
+        assert resumed.dish_assignments() == latent.dish_assignments()
+    finally:
+        shutil.rmtree(tmp)